@@ -0,0 +1,517 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "mcalc3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* default minimum time spent measuring each phase of each case, in seconds */
+#define DEFAULT_MIN_TIME 0.2
+
+/* default slowdown, in percent, above which a phase counts as a regression */
+#define DEFAULT_THRESHOLD 10.0
+
+#define MAX_NAME_LENGTH 32
+
+struct Case {
+    char name[MAX_NAME_LENGTH];
+    char *equ;
+    size_t length;
+};
+
+struct Result {
+    char name[MAX_NAME_LENGTH];
+    char phase[MAX_NAME_LENGTH];
+    double ns_per_expr;
+};
+
+struct Baseline {
+    struct Result *results;
+    size_t count;
+};
+
+/* ===== Corpus =====*/
+
+static char *copy_string(const char *str) {
+    char *copy = malloc(strlen(str) + 1);
+    if (copy != NULL)
+        strcpy(copy, str);
+    return copy;
+}
+
+/**
+ * @brief builds `terms` terms joined by alternating operators, e.g.
+ * "1 + 2 * 3 - 4 / 5".
+ */
+static char *make_long(unsigned int terms) {
+    static const char ops[] = {'+', '*', '-', '/'};
+    char *equ = malloc((size_t)terms * 16);
+    size_t length = 0;
+
+    if (equ == NULL)
+        return NULL;
+
+    length += sprintf(equ, "1");
+    for (unsigned int i = 1; i < terms; i++)
+        length += sprintf(&equ[length], " %c %u", ops[i % 4], i % 97 + 1);
+
+    return equ;
+}
+
+/**
+ * @brief builds an expression with `depth` levels of parenthesis, e.g.
+ * "(1 + (2 * (3 - 4)))".
+ */
+static char *make_nested(unsigned int depth) {
+    static const char ops[] = {'+', '*', '-'};
+    char *equ = malloc((size_t)depth * 12 + 8);
+    size_t length = 0;
+
+    if (equ == NULL)
+        return NULL;
+
+    for (unsigned int i = 0; i < depth; i++)
+        length += sprintf(&equ[length], "(%u %c ", i % 9 + 1, ops[i % 3]);
+
+    length += sprintf(&equ[length], "1");
+    memset(&equ[length], ')', depth);
+    equ[length + depth] = '\0';
+
+    return equ;
+}
+
+/**
+ * @brief builds a sum of `count` long decimal literals.
+ */
+static char *make_numbers(unsigned int count) {
+    char *equ = malloc((size_t)count * 24);
+    size_t length = 0;
+    unsigned long long seed = 88172645463325252ULL;
+
+    if (equ == NULL)
+        return NULL;
+
+    for (unsigned int i = 0; i < count; i++) {
+        /* xorshift, so the corpus is the same on every run */
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        length += sprintf(&equ[length], "%s%llu.%06llu", i ? " + " : "",
+                          seed % 100000000ULL, (seed >> 32) % 1000000ULL);
+    }
+
+    return equ;
+}
+
+/**
+ * @brief builds `count` function calls and constants joined by operators, e.g.
+ * "sin(1 * pi) + cos(2 / e)".
+ */
+static char *make_functions(unsigned int count) {
+    static const char *functions[] = {"sin", "cos", "tan", "log", "ln"};
+    static const char ops[] = {'+', '*', '-', '/'};
+    char *equ = malloc((size_t)count * 24);
+    size_t length = 0;
+
+    if (equ == NULL)
+        return NULL;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (i > 0)
+            length += sprintf(&equ[length], " %c ", ops[i % 4]);
+        length += sprintf(&equ[length], "%s(%u %c %s)", functions[i % 5],
+                          i % 9 + 1, ops[i % 4], (i % 2) ? "pi" : "e");
+    }
+
+    return equ;
+}
+
+/**
+ * @brief builds `count` terms over eight variables joined by operators, e.g.
+ * "x * 1.5 + y / 2.5 - z * 3.5". The result depends on the variables, so the
+ * optimizer cannot fold it away.
+ */
+static char *make_variables(unsigned int count) {
+    static const char names[] = {'x', 'y', 'z', 'u', 'v', 'w', 'p', 'q'};
+    static const char ops[] = {'+', '*', '-', '/'};
+    char *equ = malloc((size_t)count * 16);
+    size_t length = 0;
+
+    if (equ == NULL)
+        return NULL;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (i > 0)
+            length += sprintf(&equ[length], " %c ", ops[i % 4]);
+        length += sprintf(&equ[length], "%c %c %u.5", names[i % 8],
+                          ops[(i + 1) % 4], i % 9 + 1);
+    }
+
+    return equ;
+}
+
+/**
+ * @brief builds a polynomial of degree `degree` in Horner form, e.g.
+ * "((x * 0.5 + 1) * x - 2) * x + 3".
+ */
+static char *make_polynomial(unsigned int degree) {
+    char *equ = malloc((size_t)degree * 16 + 16);
+    size_t length = 0;
+
+    if (equ == NULL)
+        return NULL;
+
+    memset(equ, '(', degree - 1);
+    length = degree - 1;
+    length += sprintf(&equ[length], "x * 0.5");
+    for (unsigned int i = 1; i < degree; i++)
+        length += sprintf(&equ[length], " %c %u) * x", (i % 2) ? '+' : '-',
+                          i % 9 + 1);
+    sprintf(&equ[length], " + %u", degree % 9 + 1);
+
+    return equ;
+}
+
+static int add_case(struct Case *cases, size_t *count, const char *name,
+                    char *equ) {
+    if (equ == NULL)
+        return -1;
+
+    struct Case *bench_case = &cases[(*count)++];
+    snprintf(bench_case->name, MAX_NAME_LENGTH, "%s", name);
+    bench_case->equ = equ;
+    bench_case->length = strlen(equ);
+
+    return 0;
+}
+
+static size_t build_corpus(struct Case *cases) {
+    size_t count = 0;
+    int failed = 0;
+
+    failed |= add_case(cases, &count, "short", copy_string("2 + 3 * 4"));
+    failed |= add_case(cases, &count, "medium",
+                       copy_string("(12.5 * 3 - 4 / 2) ^ 2 + 7 * (8 - 3) / "
+                                   "(1 + 2 ^ 3) - 0.25 * (6 - 1)"));
+    failed |= add_case(cases, &count, "long", make_long(2000));
+    failed |= add_case(cases, &count, "nested", make_nested(500));
+    failed |= add_case(cases, &count, "numbers", make_numbers(500));
+    failed |= add_case(cases, &count, "functions", make_functions(500));
+    failed |= add_case(cases, &count, "variables", make_variables(500));
+    failed |= add_case(cases, &count, "polynomial", make_polynomial(200));
+
+    return failed ? 0 : count;
+}
+
+/* ===== Measurement =====*/
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The phases measured for each case. Each runs one expression once and
+   returns something derived from the result, so the work is not optimized
+   away. */
+
+/* a compiled case and the values of its variables */
+struct Compiled {
+    MC3_Program *prog;
+    const double *vars;
+};
+
+static double phase_tokenize(const struct Case *bench_case, void *state) {
+    (void)state;
+    return bench_tokenize(bench_case->equ, bench_case->length, NULL);
+}
+
+static double phase_parse(const struct Case *bench_case, void *state) {
+    (void)state;
+    MC3_Program *prog =
+        MC3_compile_n(bench_case->equ, bench_case->length, NULL);
+    double check = (prog != NULL);
+    MC3_free_program(prog);
+    return check;
+}
+
+static double phase_evaluate(const struct Case *bench_case, void *state) {
+    (void)state;
+    return MC3_evaluate_n(bench_case->equ, bench_case->length, NULL);
+}
+
+static double phase_context(const struct Case *bench_case, void *state) {
+    return MC3_context_evaluate(state, bench_case->equ, bench_case->length,
+                                NULL);
+}
+
+static double phase_cached(const struct Case *bench_case, void *state) {
+    return MC3_context_evaluate(state, bench_case->equ, bench_case->length,
+                                NULL);
+}
+
+static double phase_run(const struct Case *bench_case, void *state) {
+    (void)bench_case;
+    const struct Compiled *compiled = state;
+    return MC3_run(compiled->prog, compiled->vars, NULL);
+}
+
+static double phase_jit(const struct Case *bench_case, void *state) {
+    (void)bench_case;
+    const struct Compiled *compiled = state;
+    return MC3_run(compiled->prog, compiled->vars, NULL);
+}
+
+static double phase_format(const struct Case *bench_case, void *state) {
+    (void)bench_case;
+    const MC3_Error ok = {MC3_NO_ERROR, 0};
+    char row[MC3_RESULT_BUFFER_SIZE];
+
+    return MC3_format_result(MC3_FORMAT_PLAIN, *(double *)state, &ok, row);
+}
+
+struct Phase {
+    const char *name;
+    double (*run)(const struct Case *bench_case, void *state);
+    /* whether the phase can give values to variables, the others are skipped
+       for cases which have any */
+    int binds_vars;
+};
+
+static const struct Phase PHASES[] = {
+    {"tokenize", phase_tokenize, 1},
+    {"parse", phase_parse, 1},
+    {"evaluate", phase_evaluate, 0},
+    {"context_evaluate", phase_context, 0},
+    {"cached_evaluate", phase_cached, 0},
+    {"run", phase_run, 1},
+    {"jit_run", phase_jit, 1},
+    {"format", phase_format, 1},
+};
+
+/**
+ * @brief runs `phase` on `bench_case` in growing batches until at least
+ * `min_time` seconds were spent in one batch.
+ *
+ * @return the time per expression, in nanoseconds.
+ */
+static double measure(const struct Phase *phase, const struct Case *bench_case,
+                      void *state, double min_time) {
+    volatile double sink = 0;
+    unsigned long iterations = 1;
+
+    /* warm up caches and the context arena */
+    sink += phase->run(bench_case, state);
+
+    for (;;) {
+        const double start = now_ns();
+
+        for (unsigned long i = 0; i < iterations; i++)
+            sink += phase->run(bench_case, state);
+
+        const double elapsed = now_ns() - start;
+
+        if (elapsed >= min_time * 1e9)
+            return elapsed / iterations;
+
+        iterations *= 2;
+    }
+}
+
+/* ===== Baseline =====*/
+
+/**
+ * @brief reads the results of a previous run, as written by main.
+ *
+ * @return 0, or -1 if the file could not be read.
+ */
+static int load_baseline(const char *path, struct Baseline *baseline) {
+    FILE *file = fopen(path, "r");
+    char line[512];
+    size_t capacity = 0;
+
+    if (file == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), file)) {
+        struct Result result;
+
+        if (sscanf(line,
+                   " {\"case\": \"%31[^\"]\", \"phase\": \"%31[^\"]\", "
+                   "\"bytes\": %*u, \"ns_per_expr\": %lf",
+                   result.name, result.phase, &result.ns_per_expr) != 3)
+            continue;
+
+        if (baseline->count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            struct Result *results =
+                realloc(baseline->results, capacity * sizeof(struct Result));
+
+            if (results == NULL) {
+                fclose(file);
+                return -1;
+            }
+            baseline->results = results;
+        }
+
+        baseline->results[baseline->count++] = result;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static const struct Result *find_baseline(const struct Baseline *baseline,
+                                          const char *name,
+                                          const char *phase) {
+    for (size_t i = 0; i < baseline->count; i++) {
+        if (strcmp(baseline->results[i].name, name) == 0 &&
+            strcmp(baseline->results[i].phase, phase) == 0)
+            return &baseline->results[i];
+    }
+
+    return NULL;
+}
+
+/* ===== Main Function =====*/
+
+static void print_usage(void) {
+    fprintf(stderr,
+            "usage: bench [--min-time SECONDS] [--baseline FILE] "
+            "[--threshold PERCENT]\n"
+            "Writes one JSON result per case and phase to stdout. With "
+            "--baseline, each\n"
+            "result is compared against FILE (a previous output) and the exit "
+            "status is 1\n"
+            "if any phase is more than PERCENT slower.\n");
+}
+
+int main(int argc, char *argv[]) {
+    double min_time = DEFAULT_MIN_TIME;
+    double threshold = DEFAULT_THRESHOLD;
+    struct Baseline baseline = {NULL, 0};
+    const char *baseline_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (baseline_path && load_baseline(baseline_path, &baseline) != 0) {
+        fprintf(stderr, "bench: cannot read baseline %s\n", baseline_path);
+        return EXIT_FAILURE;
+    }
+
+    struct Case cases[16];
+    const size_t case_count = build_corpus(cases);
+    MC3_Context *ctx = MC3_context_new();
+    MC3_Context *cached_ctx = MC3_context_new();
+    MC3_Cache *cache = MC3_cache_new(case_count, 1);
+
+    if (case_count == 0 || ctx == NULL || cached_ctx == NULL || cache == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    MC3_context_set_cache(cached_ctx, cache);
+
+    int regressed = 0;
+    const size_t phase_count = sizeof(PHASES) / sizeof(PHASES[0]);
+
+    printf("{\"benchmarks\": [\n");
+
+    for (size_t i = 0; i < case_count; i++) {
+        MC3_Program *prog = MC3_compile_n(cases[i].equ, cases[i].length, NULL);
+        /* falls back to the interpreter where there is no JIT */
+        MC3_Program *jit_prog =
+            MC3_compile_n(cases[i].equ, cases[i].length, NULL);
+        const unsigned int var_count = MC3_var_count(prog);
+        double *vars = malloc((var_count + 1) * sizeof(double));
+
+        if (vars == NULL) {
+            fprintf(stderr, "bench: out of memory\n");
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned int v = 0; v < var_count; v++)
+            vars[v] = 0.75 + 0.125 * v;
+
+        MC3_jit_compile(jit_prog);
+        struct Compiled run = {prog, vars};
+        struct Compiled jit_run = {jit_prog, vars};
+        double result = MC3_run(prog, vars, NULL);
+
+        for (size_t p = 0; p < phase_count; p++) {
+            const struct Phase *phase = &PHASES[p];
+            void *state = NULL;
+
+            if (var_count > 0 && !phase->binds_vars)
+                continue;
+
+            if (phase->run == phase_context)
+                state = ctx;
+            else if (phase->run == phase_cached)
+                state = cached_ctx;
+            else if (phase->run == phase_run)
+                state = &run;
+            else if (phase->run == phase_jit)
+                state = &jit_run;
+            else if (phase->run == phase_format)
+                state = &result;
+
+            const double ns = measure(phase, &cases[i], state, min_time);
+            const int last = (i + 1 == case_count) && (p + 1 == phase_count);
+
+            printf("  {\"case\": \"%s\", \"phase\": \"%s\", \"bytes\": %zu, "
+                   "\"ns_per_expr\": %.1f, \"exprs_per_sec\": %.0f",
+                   cases[i].name, phase->name, cases[i].length, ns, 1e9 / ns);
+
+            const struct Result *base =
+                find_baseline(&baseline, cases[i].name, phase->name);
+
+            if (base != NULL) {
+                const double change =
+                    (ns - base->ns_per_expr) / base->ns_per_expr * 100.0;
+                const int is_regression = change > threshold;
+
+                printf(", \"baseline_ns_per_expr\": %.1f, "
+                       "\"change_pct\": %.1f, \"regression\": %s",
+                       base->ns_per_expr, change,
+                       is_regression ? "true" : "false");
+
+                if (is_regression) {
+                    fprintf(stderr, "bench: %s/%s is %.1f%% slower\n",
+                            cases[i].name, phase->name, change);
+                    regressed = 1;
+                }
+            }
+
+            printf("}%s\n", last ? "" : ",");
+            fflush(stdout);
+        }
+
+        MC3_free_program(prog);
+        MC3_free_program(jit_prog);
+        free(vars);
+        free(cases[i].equ);
+    }
+
+    printf("]}\n");
+
+    MC3_context_free(ctx);
+    MC3_context_free(cached_ctx);
+    MC3_cache_free(cache);
+    free(baseline.results);
+
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,15 +1,563 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "mcalc3.h"
+#include "parallel.h"
+#include "repl.h"
+#include "server.h"
+#include "sheet.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* size of the buffer expressions are read into. A line longer than this is
+   reported as an error instead of growing the buffer, so memory stays bounded
+   however long the input is. */
+#define IN_BUFFER_SIZE (16 << 20)
+
+/* size of the buffer results are collected in before being written */
+#define OUT_BUFFER_SIZE (1 << 16)
+
+/* number of independently locked parts of the --cache cache */
+#define CACHE_SHARDS 16
+
+/* size of the cache --serve uses when --cache is not given */
+#define SERVE_CACHE_SIZE 4096
+
+struct OutBuffer {
+    int fd;
+    /* memory reused by every evaluation of the stream */
+    MC3_Context *ctx;
+    MC3_Format format;
+    size_t length;
+    char data[OUT_BUFFER_SIZE];
+};
+
+/**
+ * @brief writes everything collected in `out` with as few `write` calls as the
+ * kernel allows.
+ */
+static int flush_output(struct OutBuffer *out) {
+    size_t written = 0;
+
+    while (written < out->length) {
+        ssize_t count =
+            write(out->fd, &out->data[written], out->length - written);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        written += count;
+    }
+
+    out->length = 0;
+    return 0;
+}
+
+/**
+ * @brief evaluates one expression and appends its result (or error) as a line
+ * of output.
+ */
+static int write_result(struct OutBuffer *out, const char *equ,
+                        size_t length) {
+    if (OUT_BUFFER_SIZE - out->length < MC3_RESULT_BUFFER_SIZE &&
+        flush_output(out) != 0)
+        return -1;
+
+    MC3_Error error;
+    double result = MC3_context_evaluate(out->ctx, equ, length, &error);
+
+    out->length += MC3_format_result(out->format, result, &error,
+                                     &out->data[out->length]);
+    return 0;
+}
+
+/**
+ * @brief evaluates `line`, which is `length` bytes long without its newline.
+ */
+static int evaluate_line(struct OutBuffer *out, const char *line,
+                         size_t length) {
+    if (length > 0 && line[length - 1] == '\r')
+        length--;
+
+    if (length == 0) {
+        if (OUT_BUFFER_SIZE - out->length < MC3_RESULT_BUFFER_SIZE &&
+            flush_output(out) != 0)
+            return -1;
+        out->length += MC3_format_result(out->format, 0.0, NULL,
+                                         &out->data[out->length]);
+        return 0;
+    }
+
+    return write_result(out, line, length);
+}
+
+/**
+ * @brief evaluates newline-delimited expressions from `fd` until end of input,
+ * writing one line of output per line of input.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if reading or writing failed.
+ */
+static int evaluate_stream(int fd, MC3_Cache *cache, MC3_Format format) {
+    static char input[IN_BUFFER_SIZE];
+    static struct OutBuffer out;
+    size_t length = 0;
+    /* set while skipping the rest of a line which did not fit in `input` */
+    int discarding = 0;
+
+    out.fd = STDOUT_FILENO;
+    out.length = 0;
+    out.format = format;
+    out.ctx = MC3_context_new();
+
+    if (out.ctx == NULL) {
+        fprintf(stderr, "mcalc3: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    MC3_context_set_cache(out.ctx, cache);
+
+    for (;;) {
+        ssize_t count = read(fd, &input[length], IN_BUFFER_SIZE - length);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("mcalc3: read");
+            MC3_context_free(out.ctx);
+            return EXIT_FAILURE;
+        }
+
+        if (count == 0) {
+            /* a last line without a trailing newline */
+            if (length > 0 && !discarding &&
+                evaluate_line(&out, input, length) != 0)
+                break;
+
+            MC3_context_free(out.ctx);
+            return (flush_output(&out) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        const size_t end = length + count;
+        size_t start = 0;
+        char *newline;
+
+        while ((newline = memchr(&input[length], '\n', end - length))) {
+            const size_t line_end = newline - input;
+
+            if (discarding) {
+                discarding = 0;
+            } else if (evaluate_line(&out, &input[start], line_end - start) !=
+                       0) {
+                goto write_failed;
+            }
+
+            start = line_end + 1;
+            length = start;
+        }
+
+        memmove(input, &input[start], end - start);
+        length = end - start;
+
+        if (length == IN_BUFFER_SIZE) {
+            /* the line does not fit, report it once and drop the rest */
+            if (!discarding) {
+                const MC3_Error error = {MC3_TOKENS_LIMIT_REACHED,
+                                         IN_BUFFER_SIZE};
+
+                if (OUT_BUFFER_SIZE - out.length < MC3_RESULT_BUFFER_SIZE &&
+                    flush_output(&out) != 0)
+                    goto write_failed;
+                out.length += MC3_format_result(format, 0.0, &error,
+                                                &out.data[out.length]);
+            }
+            discarding = 1;
+            length = 0;
+        }
+    }
+
+write_failed:
+    perror("mcalc3: write");
+    MC3_context_free(out.ctx);
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief opens `path` and streams its lines through evaluate_stream.
+ */
+static int evaluate_file(const char *path, MC3_Cache *cache,
+                         MC3_Format format) {
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "mcalc3: cannot open %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int status = evaluate_stream(fd, cache, format);
+    close(fd);
+
+    return status;
+}
+
+/**
+ * @brief writes the rows of a MC3_Stats histogram which are not empty.
+ */
+static void print_histogram(const char *name,
+                            const unsigned long long *buckets) {
+    fprintf(stderr, "%s:\n", name);
+
+    for (int i = 0; i < MC3_STATS_BUCKETS; i++) {
+        if (buckets[i] == 0)
+            continue;
+
+        if (i < 2) {
+            fprintf(stderr, "  %9d  %llu\n", i, buckets[i]);
+        } else {
+            char range[32];
+            snprintf(range, sizeof(range), "%llu-%llu", 1ull << (i - 1),
+                     (1ull << i) - 1);
+            fprintf(stderr, "  %9s  %llu\n", range, buckets[i]);
+        }
+    }
+}
+
+/**
+ * @brief writes the counters gathered by the library to stderr.
+ */
+static void print_stats(void) {
+    static const char *const phases[MC3_PHASE_COUNT] = {"tokenize", "parse",
+                                                        "evaluate"};
+    const MC3_Stats stats = MC3_get_stats();
+
+    /* keep the report after the results when both go to a terminal */
+    fflush(stdout);
+
+    if (!stats.enabled) {
+        fprintf(stderr, "mcalc3: built without MC3_STATS, no counters\n");
+        return;
+    }
+
+    fprintf(stderr, "%-10s %14s %18s %12s\n", "phase", "calls", "cycles",
+            "cycles/call");
+    for (int i = 0; i < MC3_PHASE_COUNT; i++) {
+        fprintf(stderr, "%-10s %14llu %18llu %12.1f\n", phases[i],
+                stats.calls[i], stats.cycles[i],
+                stats.calls[i] ? (double)stats.cycles[i] / stats.calls[i]
+                               : 0.0);
+    }
+
+    print_histogram("tokens per expression", stats.token_counts);
+    print_histogram("nesting depth", stats.nesting_depths);
+
+    fprintf(stderr, "errors:\n");
+    for (int i = 0; i < MC3_ERROR_CODES; i++) {
+        if (i != MC3_NO_ERROR && stats.errors[i] != 0)
+            fprintf(stderr, "  %llu  %s\n", stats.errors[i],
+                    getErrorString(i));
+    }
+}
+
+/**
+ * @brief prints `equ` as a C function called `name`.
+ */
+static int emit_c(const char *name, const char *equ) {
+    bool valid = isalpha((unsigned char)name[0]) || name[0] == '_';
+
+    for (size_t i = 1; valid && name[i] != '\0'; i++)
+        valid = isalnum((unsigned char)name[i]) || name[i] == '_';
+
+    if (!valid) {
+        fprintf(stderr, "mcalc3: %s is not a C identifier\n", name);
+        return EXIT_FAILURE;
+    }
+
+    MC3_ErrorCode error;
+    MC3_Program *prog = MC3_compile(equ, &error);
+
+    if (prog == NULL) {
+        fprintf(stderr, "%s: %s\n", equ, getErrorString(error));
+        return EXIT_FAILURE;
+    }
+
+    /* a valid expression cannot contain the end of a comment */
+    printf("/* %s */\n", equ);
+    MC3_emit_c(prog, name, stdout);
+    MC3_free_program(prog);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief prints `matrix`, the value of `equ`, as a literal: `equ = [1, 2; 3,
+ * 4]`. A matrix of one element is printed as a number.
+ */
+static void print_matrix(const char *equ, const MC3_Matrix *matrix) {
+    char text[MC3_DOUBLE_BUFFER_SIZE];
+    const size_t size = (size_t)matrix->rows * matrix->columns;
+
+    printf("%s = ", equ);
+
+    if (size == 1) {
+        MC3_format_double(matrix->elements[0], text);
+        printf("%s\n", text);
+        return;
+    }
 
+    putchar('[');
+    for (size_t i = 0; i < size; i++) {
+        if (i > 0)
+            fputs((i % matrix->columns == 0) ? "; " : ", ", stdout);
+
+        MC3_format_double(matrix->elements[i], text);
+        fputs(text, stdout);
+    }
+    puts("]");
+}
 
 int main(const int argc, const char* argv[]) {
     MC3_ErrorCode error = MC3_NO_ERROR;
-    
+    /* number of worker threads used by -f and --sheet, 0 to evaluate on this
+       thread. --serve uses one per processor if 0. */
+    unsigned int threads = 0;
+    /* print the optimized program of each expression instead of its value */
+    int dump_optimized = 0;
+    /* evaluate arguments with exact decimals instead of doubles */
+    int exact = 0;
+    /* evaluate arguments with matrices as values */
+    int matrices = 0;
+    /* compiled programs shared by --stdin and -f, NULL to compile every line */
+    MC3_Cache *cache = NULL;
+    /* print the library counters to stderr once every argument is done */
+    int print_counters = 0;
+    /* how results of --stdin, -f and arguments are written */
+    MC3_Format format = MC3_FORMAT_PLAIN;
+
+    if (argc == 1)
+        return run_repl();
+
     for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--parallel=", 11) == 0) {
+            char *end;
+            long value = strtol(&argv[i][11], &end, 10);
+
+            if (*end != '\0' || value < 1 || value > 1024) {
+                fprintf(stderr, "mcalc3: invalid thread count %s\n",
+                        &argv[i][11]);
+                return EXIT_FAILURE;
+            }
+
+            threads = value;
+            continue;
+        }
+
+        if (strncmp(argv[i], "--cache=", 8) == 0) {
+            char *end;
+            long value = strtol(&argv[i][8], &end, 10);
+
+            if (*end != '\0' || value < 1) {
+                fprintf(stderr, "mcalc3: invalid cache size %s\n",
+                        &argv[i][8]);
+                return EXIT_FAILURE;
+            }
+
+            MC3_cache_free(cache);
+            cache = MC3_cache_new(value, CACHE_SHARDS);
+            if (cache == NULL) {
+                fprintf(stderr, "mcalc3: out of memory\n");
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        if (strncmp(argv[i], "--format=", 9) == 0) {
+            static const char *const formats[] = {"plain", "csv", "json",
+                                                  "binary"};
+            int found = -1;
+
+            for (int j = 0; j < 4; j++) {
+                if (strcmp(&argv[i][9], formats[j]) == 0)
+                    found = j;
+            }
+
+            if (found < 0) {
+                fprintf(stderr, "mcalc3: unknown format %s\n", &argv[i][9]);
+                return EXIT_FAILURE;
+            }
+
+            format = (MC3_Format)found;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--dump-optimized") == 0) {
+            dump_optimized = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--exact") == 0) {
+            exact = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--matrix") == 0) {
+            matrices = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--stats") == 0) {
+            print_counters = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--stdin") == 0) {
+            fflush(stdout);
+            if (evaluate_stream(STDIN_FILENO, cache, format) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "mcalc3: --serve requires a socket path\n");
+                return EXIT_FAILURE;
+            }
+
+            if (cache == NULL)
+                cache = MC3_cache_new(SERVE_CACHE_SIZE, CACHE_SHARDS);
+
+            fflush(stdout);
+            i++;
+            if (serve(argv[i], threads, cache) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--client") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "mcalc3: --client requires a socket path\n");
+                return EXIT_FAILURE;
+            }
+
+            fflush(stdout);
+            i++;
+            if (run_client(argv[i]) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--sheet") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "mcalc3: --sheet requires a file name\n");
+                return EXIT_FAILURE;
+            }
+
+            fflush(stdout);
+            i++;
+            if (evaluate_sheet(argv[i], threads ? threads : 1) !=
+                EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--emit-c") == 0) {
+            if (i + 2 >= argc) {
+                fprintf(stderr,
+                        "mcalc3: --emit-c requires a name and an expression\n");
+                return EXIT_FAILURE;
+            }
+
+            if (emit_c(argv[i + 1], argv[i + 2]) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            i += 2;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-f") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "mcalc3: -f requires a file name\n");
+                return EXIT_FAILURE;
+            }
+
+            fflush(stdout);
+            i++;
+            int status = threads ? evaluate_parallel(argv[i], threads, cache,
+                                                     format)
+                                 : evaluate_file(argv[i], cache, format);
+            if (status != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            continue;
+        }
+
+        if (dump_optimized) {
+            MC3_Program *prog = MC3_compile(argv[i], &error);
+
+            if (prog == NULL) {
+                fprintf(stderr, "%s: %s\n", argv[i], getErrorString(error));
+                continue;
+            }
+
+            printf("%s:\n", argv[i]);
+            MC3_dump_program(prog, stdout);
+            MC3_free_program(prog);
+            continue;
+        }
+
+        if (exact) {
+            MC3_Error exact_error;
+            char *text =
+                MC3_evaluate_exact(argv[i], strlen(argv[i]), &exact_error);
+
+            if (text == NULL) {
+                fprintf(stderr, "%s: %s (at %zu)\n", argv[i],
+                        getErrorString(exact_error.code), exact_error.offset);
+                continue;
+            }
+
+            printf("%s = %s\n", argv[i], text);
+            free(text);
+            continue;
+        }
+
+        if (matrices) {
+            MC3_Error matrix_error;
+            MC3_Matrix matrix;
+
+            if (MC3_evaluate_matrix(argv[i], strlen(argv[i]), NULL, &matrix,
+                                    &matrix_error) != MC3_NO_ERROR) {
+                fprintf(stderr, "%s: %s (at %zu)\n", argv[i],
+                        getErrorString(matrix_error.code),
+                        matrix_error.offset);
+                continue;
+            }
+
+            print_matrix(argv[i], &matrix);
+            free(matrix.elements);
+            continue;
+        }
+
         double result = MC3_evaluate(argv[i], &error);
 
-        if (!error_occured(&error)) {
-            printf("%s = %lf\n", argv[i], result);
+        if (format != MC3_FORMAT_PLAIN) {
+            char row[MC3_RESULT_BUFFER_SIZE];
+            const MC3_Error full_error = {error, 0};
+
+            fwrite(row, 1, MC3_format_result(format, result, &full_error, row),
+                   stdout);
+        } else if (!error_occured(&error)) {
+            char text[MC3_DOUBLE_BUFFER_SIZE];
+
+            MC3_format_double(result, text);
+            printf("%s = %s\n", argv[i], text);
         }
     }
+
+    if (print_counters)
+        print_stats();
+
+    MC3_cache_free(cache);
 }
@@ -1,13 +1,28 @@
+/* MAP_ANONYMOUS, used by the JIT */
+#define _DEFAULT_SOURCE
+
 #include "mcalc3.h"
 #include "mlogging.h"
+#include "mpowers.h"
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define MAX_TOKENS 100
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 /* ===== String Functions =====*/
 
@@ -32,40 +47,78 @@ enum TokenType {
     OP_MULT,
     OP_DIV,
     OP_EXP,
+    /* matrix product, `a @ b` */
+    OP_MATMUL,
     /* grouping */
     PAR_LEFT,
     PAR_RIGHT,
+    /* matrix literals, `[1, 2; 3, 4]` */
+    BRACKET_LEFT,
+    BRACKET_RIGHT,
+    /* separates the arguments of sum, prod and dot, and the elements of a
+       row of a matrix literal */
+    SEP_COMMA,
+    /* separates the rows of a matrix literal */
+    SEP_SEMICOLON,
     /* types */
     TYPE_INTEGER,
     TYPE_DECIMAL,
+    TYPE_IDENTIFIER,
+    TYPE_FUNCTION,
+    TYPE_CONSTANT,
     TYPE_EMPTY,
 };
 
+/* Names which are not variables. The order matches the KEYWORDS table. */
+enum Keyword {
+    /* functions */
+    KW_SIN,
+    KW_COS,
+    KW_TAN,
+    KW_LOG,
+    KW_LN,
+    /* sums and products over a range, `sum(i, from, to, body)` */
+    KW_SUM,
+    KW_PROD,
+    /* dot product of two matrices, `dot(a, b)` */
+    KW_DOT,
+    /* constants */
+    KW_PI,
+    KW_E,
+    KW_NONE,
+};
+
 struct Token {
     /* Stores the type of the token, TYPE_EMPTY means the token hasn't been
        intialized. */
     enum TokenType type;
 
+    /* byte offset of the first character of the token in the expression */
+    size_t offset;
+
     /* Stores the value contained in the token, varies based on type. Using an
        integer and floating point data type allows for storing larger range of
        numbers */
     union {
         long long ivalue;
         double fvalue;
+        /* TYPE_IDENTIFIER: the name, pointing into the tokenized string */
+        struct {
+            const char *name;
+            size_t name_len;
+        };
+        /* TYPE_FUNCTION and TYPE_CONSTANT: which one */
+        enum Keyword keyword;
     };
 };
 
 struct TokensList {
-    /* array of tokens */
-    struct Token tokens[MAX_TOKENS];
-    /* maximum number of tokens which can be stored */
+    /* array of tokens, grown as needed */
+    struct Token *tokens;
+    /* number of tokens which can be stored before growing */
     unsigned int capacity;
     /* current index of tokens */
     unsigned int tkns_pos;
-    /* indexes of operators in tokens */
-    unsigned int operators[MAX_TOKENS];
-    /* current index of operators[] */
-    unsigned int op_pos;
 };
 
 /* ===== Token Functions =====*/
@@ -82,14 +135,30 @@ const char *type_to_str(enum TokenType type) {
         return "OP_DIV";
     case OP_EXP:
         return "OP_EXP";
+    case OP_MATMUL:
+        return "OP_MATMUL";
     case PAR_LEFT:
         return "PAR_LEFT";
     case PAR_RIGHT:
         return "PAR_RIGHT";
+    case BRACKET_LEFT:
+        return "BRACKET_LEFT";
+    case BRACKET_RIGHT:
+        return "BRACKET_RIGHT";
+    case SEP_COMMA:
+        return "SEP_COMMA";
+    case SEP_SEMICOLON:
+        return "SEP_SEMICOLON";
     case TYPE_INTEGER:
         return "TYPE_INTEGER";
     case TYPE_DECIMAL:
         return "TYPE_DECIMAL";
+    case TYPE_IDENTIFIER:
+        return "TYPE_IDENTIFIER";
+    case TYPE_FUNCTION:
+        return "TYPE_FUNCTION";
+    case TYPE_CONSTANT:
+        return "TYPE_CONSTANT";
     case TYPE_EMPTY:
         return "TYPE_EMPTY";
     default:
@@ -109,10 +178,20 @@ enum TokenType char_to_type(char ch) {
         return OP_DIV;
     case '^':
         return OP_EXP;
+    case '@':
+        return OP_MATMUL;
     case '(':
         return PAR_LEFT;
     case ')':
         return PAR_RIGHT;
+    case '[':
+        return BRACKET_LEFT;
+    case ']':
+        return BRACKET_RIGHT;
+    case ',':
+        return SEP_COMMA;
+    case ';':
+        return SEP_SEMICOLON;
     default:
         return TYPE_EMPTY;
     }
@@ -125,40 +204,116 @@ bool is_operator(char ch) {
     case '*':
     case '/':
     case '^':
+    case '@':
         return true;
     default:
         return false;
     }
 }
 
-bool is_grouping(char ch) { return (ch == '(') || (ch == ')'); }
+bool is_grouping(char ch) {
+    return (ch == '(') || (ch == ')') || (ch == '[') || (ch == ']');
+}
 
-bool is_constant(const char *str, const int index) {
-    char *funcs[] = {"pi", "e"};
-    int len = sizeof(funcs) / sizeof(char *);
+bool is_separator(char ch) { return (ch == ',') || (ch == ';'); }
 
-    for (int i = 0; i < len; i++) {
-        if (string_at(funcs[i], &str[index]))
-            return true;
-    }
+/* ctype functions take the value of an unsigned char, and a byte above 127
+   in a plain char would be negative */
+bool is_identifier_start(char ch) {
+    return isalpha((unsigned char)ch) || (ch == '_');
+}
 
-    return false;
+bool is_identifier_char(char ch) {
+    return isalnum((unsigned char)ch) || (ch == '_');
 }
 
-bool is_func(const char *str, const int index) {
-    char *funcs[] = {"sin", "cos", "tan", "log", "ln"};
-    int len = sizeof(funcs) / sizeof(char *);
+struct KeywordInfo {
+    const char *name;
+    size_t length;
+    enum TokenType type;
+    /* value of a constant */
+    double value;
+};
 
-    for (int i = 0; i < len; i++) {
-        if (string_at(funcs[i], &str[index]))
-            return true;
+/* Every function and constant, indexed by enum Keyword. A new keyword needs an
+   entry here and a case in find_keyword. */
+static const struct KeywordInfo KEYWORDS[] = {
+    [KW_SIN] = {"sin", 3, TYPE_FUNCTION, 0.0},
+    [KW_COS] = {"cos", 3, TYPE_FUNCTION, 0.0},
+    [KW_TAN] = {"tan", 3, TYPE_FUNCTION, 0.0},
+    [KW_LOG] = {"log", 3, TYPE_FUNCTION, 0.0},
+    [KW_LN] = {"ln", 2, TYPE_FUNCTION, 0.0},
+    [KW_SUM] = {"sum", 3, TYPE_FUNCTION, 0.0},
+    [KW_PROD] = {"prod", 4, TYPE_FUNCTION, 0.0},
+    [KW_DOT] = {"dot", 3, TYPE_FUNCTION, 0.0},
+    [KW_PI] = {"pi", 2, TYPE_CONSTANT, 3.14159265358979323846},
+    [KW_E] = {"e", 1, TYPE_CONSTANT, 2.71828182845904523536},
+};
+
+static enum Keyword match_keyword(const char *name, size_t length,
+                                  enum Keyword candidate) {
+    const struct KeywordInfo *info = &KEYWORDS[candidate];
+
+    if (info->length == length && memcmp(info->name, name, length) == 0)
+        return candidate;
+
+    return KW_NONE;
+}
+
+/**
+ * @brief recognizes the identifier of `length` characters at `name`. The first
+ * character and the length select the only keyword it can be, which is then
+ * compared, so the cost does not depend on the rest of the expression or on
+ * the number of keywords.
+ *
+ * @return the keyword, or KW_NONE for a variable.
+ */
+enum Keyword find_keyword(const char *name, size_t length) {
+    switch (name[0]) {
+    case 'c':
+        return match_keyword(name, length, KW_COS);
+    case 'd':
+        return match_keyword(name, length, KW_DOT);
+    case 'e':
+        return match_keyword(name, length, KW_E);
+    case 'l':
+        return match_keyword(name, length, (length == 2) ? KW_LN : KW_LOG);
+    case 'p':
+        return match_keyword(name, length, (length == 4) ? KW_PROD : KW_PI);
+    case 's':
+        return match_keyword(name, length,
+                             (length > 1 && name[1] == 'u') ? KW_SUM : KW_SIN);
+    case 't':
+        return match_keyword(name, length, KW_TAN);
+    default:
+        return KW_NONE;
     }
+}
 
-    return false;
+/**
+ * @brief finds the keyword the identifier starting at str[index] names.
+ */
+static enum Keyword keyword_at(const char *str, const int index) {
+    size_t length = 0;
+
+    while (is_identifier_char(str[index + length]))
+        length++;
+
+    return (length > 0) ? find_keyword(&str[index], length) : KW_NONE;
+}
+
+bool is_constant(const char *str, const int index) {
+    const enum Keyword keyword = keyword_at(str, index);
+    return (keyword != KW_NONE) && (KEYWORDS[keyword].type == TYPE_CONSTANT);
+}
+
+bool is_func(const char *str, const int index) {
+    const enum Keyword keyword = keyword_at(str, index);
+    return (keyword != KW_NONE) && (KEYWORDS[keyword].type == TYPE_FUNCTION);
 }
 
 bool is_op_type(enum TokenType type) {
-    return ((type >= OP_ADD) && (type <= OP_EXP));
+    return ((type >= OP_ADD) && (type <= OP_MATMUL));
 }
 
 bool tokens_equal(struct Token a, struct Token b) {
@@ -189,244 +344,516 @@ void set_token(struct Token *dest, enum TokenType type, double value) {
 /* ===== Tokenization Functions =====*/
 
 struct TokensList new_list(void) {
-    struct TokensList list = {
-        .capacity = MAX_TOKENS, .tkns_pos = 0, .op_pos = 0};
+    struct TokensList list = {.tokens = NULL, .capacity = 0, .tkns_pos = 0};
+    return list;
+}
 
-    for (int i = 0; i < MAX_TOKENS; i++) {
-        list.tokens[i].type = TYPE_EMPTY;
-        list.operators[i] = 0;
-    }
+/**
+ * @brief empties `list`, keeping its storage for the next tokenize call.
+ */
+void clear_list(struct TokensList *list) { list->tkns_pos = 0; }
 
-    return list;
+void free_list(struct TokensList *list) {
+    free(list->tokens);
+    *list = new_list();
 }
 
-void clear_list(struct TokensList *list) {
-    list->tkns_pos = 0;
-    list->op_pos = 0;
-    for (unsigned int i = 0; i < list->capacity; i++) {
-        list->tokens[i].type = TYPE_EMPTY;
-        list->tokens[i].ivalue = 0;
-        list->tokens[i].fvalue = 0;
-        list->operators[i] = 0;
-    }
+/**
+ * @brief makes room for `count` tokens in `list`.
+ *
+ * @return false if the list could not grow.
+ */
+bool reserve_tokens(struct TokensList *list, unsigned int count) {
+    if (count <= list->capacity)
+        return true;
+
+    unsigned int capacity = list->capacity ? list->capacity : 16;
+    while (capacity < count)
+        capacity *= 2;
+
+    struct Token *tokens =
+        realloc(list->tokens, (size_t)capacity * sizeof(struct Token));
+    if (tokens == NULL)
+        return false;
+
+    list->tokens = tokens;
+    list->capacity = capacity;
+    return true;
 }
 
-void add_operator(struct TokensList *list, const char *equ, int *iterator) {
-    if (list->tkns_pos < (list->capacity - 1)) {
-        const enum TokenType TYPE = char_to_type(equ[*iterator]);
-        set_token(&list->tokens[list->tkns_pos], TYPE, 0);
-        list->operators[list->op_pos] = list->tkns_pos;
+struct Lexer {
+    /* string being tokenized, not necessarily terminated */
+    const char *equ;
+    size_t length;
+    /* index of the next character to read */
+    size_t pos;
+};
 
-        list->tkns_pos++;
-        (*iterator)++;
-        list->op_pos++;
-    }
+struct Lexer new_lexer(const char *equ, size_t length) {
+    struct Lexer lexer = {.equ = equ, .length = length, .pos = 0};
+    return lexer;
+}
+
+/* most decimal digits accumulated into the 64-bit mantissa of a literal */
+#define MAX_MANTISSA_DIGITS 19
+
+/* exponents are clamped to this magnitude, far past where every literal
+   overflows to infinity or underflows to zero */
+#define MAX_LITERAL_EXPONENT 100000
+
+/* powers of ten which are exact as doubles */
+static const double EXACT_POWERS_OF_TEN[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* A decimal literal split into mantissa * 10^exponent. */
+struct Literal {
+    uint64_t mantissa;
+    int exponent;
+    /* number of digits in `mantissa`, not counting leading zeros */
+    int digits;
+    /* set if nonzero digits did not fit in `mantissa` */
+    bool truncated;
+    /* set if the literal had a fraction or an exponent */
+    bool is_decimal;
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #define HAVE_SWAR_DIGITS 1
+
+/**
+ * @brief checks whether the eight characters packed into `chunk` are all
+ * digits, with a few operations on the whole word instead of one per byte.
+ */
+static bool is_eight_digits(uint64_t chunk) {
+    return (((chunk & 0xf0f0f0f0f0f0f0f0ULL) |
+             (((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >>
+              4)) == 0x3333333333333333ULL);
+}
+
+/**
+ * @brief converts eight digits packed into `chunk`, first digit in the lowest
+ * byte, by combining neighbouring bytes, then pairs and quads of them.
+ */
+static uint32_t parse_eight_digits(uint64_t chunk) {
+    const uint64_t mask = 0x000000ff000000ffULL;
+    const uint64_t mul1 = 100 + (1000000ULL << 32);
+    const uint64_t mul2 = 1 + (10000ULL << 32);
+
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10) + (chunk >> 8);
+    chunk = (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+
+    return (uint32_t)chunk;
 }
+#endif
+
+/**
+ * @brief reads a run of digits into `literal`. Each digit lowers the exponent
+ * if it belongs to the fraction, and digits which no longer fit raise it if
+ * they belong to the integer part.
+ */
+static void read_digits(struct Lexer *lexer, struct Literal *literal,
+                        bool fraction) {
+    const char *equ = lexer->equ;
 
-void add_number(struct TokensList *list, const char *equ, int *iterator) {
-    bool is_decimal = false;
-    const int START_INDEX = *iterator;
+    /* leading zeros do not count towards the digits the mantissa can hold */
+    if (literal->mantissa == 0) {
+        while (lexer->pos < lexer->length && equ[lexer->pos] == '0') {
+            literal->exponent -= fraction;
+            lexer->pos++;
+        }
+    }
+
+#if defined(HAVE_SWAR_DIGITS)
+    while (lexer->pos + 8 <= lexer->length &&
+           literal->digits + 8 <= MAX_MANTISSA_DIGITS) {
+        uint64_t chunk;
+        memcpy(&chunk, &equ[lexer->pos], sizeof(chunk));
+
+        if (!is_eight_digits(chunk))
+            break;
 
-    while (isdigit(equ[*iterator]) || equ[*iterator] == '.') {
-        if (equ[*iterator] == '.')
-            is_decimal = true;
-        (*iterator)++;
+        literal->mantissa =
+            literal->mantissa * 100000000 + parse_eight_digits(chunk);
+        literal->digits += 8;
+        literal->exponent -= fraction ? 8 : 0;
+        lexer->pos += 8;
     }
+#endif
 
-    if (is_decimal) {
-        double value = strtod(&equ[START_INDEX], NULL);
-        set_token(&list->tokens[list->tkns_pos], TYPE_DECIMAL, value);
-        list->tkns_pos++;
-    } else {
-        int value = strtoll(&equ[START_INDEX], NULL, 10);
-        set_token(&list->tokens[list->tkns_pos], TYPE_INTEGER, value);
-        list->tkns_pos++;
+    while (lexer->pos < lexer->length &&
+           isdigit((unsigned char)equ[lexer->pos])) {
+        const unsigned int digit = equ[lexer->pos] - '0';
+
+        if (literal->digits < MAX_MANTISSA_DIGITS) {
+            literal->mantissa = literal->mantissa * 10 + digit;
+            literal->digits += (literal->mantissa != 0);
+            literal->exponent -= fraction;
+        } else {
+            literal->truncated |= (digit != 0);
+            literal->exponent += !fraction;
+        }
+
+        lexer->pos++;
     }
 }
 
-struct Token get_token_at(struct TokensList *list, unsigned int index) {
-    if (index >= list->capacity) {
-        MLOG_error("Trying to access invalid index of TokensList");
-        exit(EXIT_FAILURE);
+/**
+ * @brief reads an exponent such as `e-9` into `literal`. An `e` which is not
+ * followed by digits is left for the next token.
+ */
+static void read_exponent(struct Lexer *lexer, struct Literal *literal) {
+    const char *equ = lexer->equ;
+    size_t pos = lexer->pos;
+
+    if (pos >= lexer->length || (equ[pos] != 'e' && equ[pos] != 'E'))
+        return;
+    pos++;
+
+    const bool negative = (pos < lexer->length && equ[pos] == '-');
+    if (pos < lexer->length && (equ[pos] == '-' || equ[pos] == '+'))
+        pos++;
+
+    if (pos >= lexer->length || !isdigit((unsigned char)equ[pos]))
+        return;
+
+    int exponent = 0;
+    while (pos < lexer->length && isdigit((unsigned char)equ[pos])) {
+        if (exponent < MAX_LITERAL_EXPONENT)
+            exponent = exponent * 10 + (equ[pos] - '0');
+        pos++;
     }
 
-    return list->tokens[index];
+    literal->exponent += negative ? -exponent : exponent;
+    literal->is_decimal = true;
+    lexer->pos = pos;
 }
 
-enum TokenType get_type_at(struct TokensList *list, unsigned int index) {
-    if (index >= list->capacity) {
-        MLOG_error("Trying to access invalid index of TokensList");
-        exit(EXIT_FAILURE);
-    }
+/* high 64 bits of the 128-bit product of `a` and `b`, the low ones in `low` */
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 uint128_t;
+
+static uint64_t mul_high(uint64_t a, uint64_t b, uint64_t *low) {
+    const uint128_t product = (uint128_t)a * b;
+
+    *low = (uint64_t)product;
+    return (uint64_t)(product >> 64);
+}
+#else
+static uint64_t mul_high(uint64_t a, uint64_t b, uint64_t *low) {
+    const uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+    const uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+    const uint64_t lo_lo = a_lo * b_lo;
+    const uint64_t hi_lo = a_hi * b_lo;
+    const uint64_t lo_hi = a_lo * b_hi;
+    const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
 
-    return list->tokens[index].type;
+    *low = (cross << 32) | (lo_lo & 0xffffffff);
+    return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
 }
+#endif
 
 /**
- * @brief Takes string `equ` and tokenizes it into Tokens, writing to `list`.
+ * @brief converts mantissa * 10^exponent to the nearest double with the
+ * Eisel-Lemire algorithm: the mantissa is multiplied by a 128-bit
+ * approximation of the power of ten, which is enough to round correctly
+ * unless the product lies too close to halfway between two doubles.
  *
- * @param equ
- * @param list
- * @return MC3_ErrorCode
+ * @return false if the result could not be decided, or is subnormal or
+ * infinite.
  */
-void tokenize(const char *equ, struct TokensList *list, MC3_ErrorCode *err) {
-    MC3_ErrorCode err_code = MC3_NO_ERROR;
-    const int EQU_LENGTH = strlen(equ);
-
-    int i = 0;
-    while (i < EQU_LENGTH) {
-        if (is_operator(equ[i]) || is_grouping(equ[i])) {
-            /* parenthesis are also considered operators in this context */
-            add_operator(list, equ, &i);
-        } else if (isdigit(equ[i])) {
-            add_number(list, equ, &i);
-        } else if (equ[i] == ' ') {
-            i++;
-        } else {
-            err_code = MC3_INVALID_CHARACTER_FOUND;
-        }
+static bool eisel_lemire(uint64_t mantissa, int exponent, double *value) {
+    if (exponent < POWERS_OF_TEN_MIN_EXP || exponent > POWERS_OF_TEN_MAX_EXP)
+        return false;
+
+    const uint64_t *power = POWERS_OF_TEN[exponent - POWERS_OF_TEN_MIN_EXP];
+    const int zeros = __builtin_clzll(mantissa);
+    uint64_t low;
+
+    mantissa <<= zeros;
+    /* floor(log2(10) * exponent), plus the bias and the bits of the product */
+    uint64_t binary_exponent =
+        (uint64_t)(((217706 * exponent) >> 16) + 64 + 1023 - zeros);
+    uint64_t high = mul_high(mantissa, power[1], &low);
+
+    /* the truncated bits could carry into the result, so widen the product */
+    if ((high & 0x1ff) == 0x1ff && low + mantissa < mantissa) {
+        uint64_t extra_low;
+        const uint64_t extra = mul_high(mantissa, power[0], &extra_low);
+        uint64_t merged_high = high;
+        const uint64_t merged_low = low + extra;
+
+        if (merged_low < low)
+            merged_high++;
+
+        if ((merged_high & 0x1ff) == 0x1ff && merged_low + 1 == 0 &&
+            extra_low + mantissa < mantissa)
+            return false;
+
+        high = merged_high;
+        low = merged_low;
     }
 
-    if (err != NULL)
-        *err = err_code;
-}
+    const uint64_t msb = high >> 63;
+    uint64_t bits = high >> (msb + 9);
+    binary_exponent -= 1 ^ msb;
 
-/* ===== Parsing Functions =====*/
+    /* exactly halfway, which needs the digits the mantissa dropped */
+    if (low == 0 && (high & 0x1ff) == 0 && (bits & 3) == 1)
+        return false;
 
-struct Parser {
-    struct TokensList *token_list;
-    unsigned int index;
-};
+    bits += bits & 1;
+    bits >>= 1;
+    if (bits >> 53) {
+        bits >>= 1;
+        binary_exponent++;
+    }
 
-double parse_exp(struct Parser *parser);
+    if (binary_exponent - 1 >= 0x7ff - 1)
+        return false;
+
+    bits = (binary_exponent << 52) | (bits & 0x000fffffffffffffULL);
+    memcpy(value, &bits, sizeof(*value));
+    return true;
+}
 
 /**
- * @brief Parses num/par and evaluates any adjacent multiplication/divison.
+ * @brief converts the `len` characters of the literal at `str` with `strtod`,
+ * for the rare literals the fast paths cannot round. The literal is rewritten
+ * without its decimal point first, so the result does not depend on the
+ * locale.
  */
-double parse_multdiv(struct Parser *parser);
+double literal_to_double(const char *str, size_t len) {
+    char stack_copy[64];
+    /* room for the digits and an exponent of up to 24 characters */
+    char *copy =
+        (len + 32 <= sizeof(stack_copy)) ? stack_copy : malloc(len + 32);
+    size_t length = 0;
+    long exponent = 0;
+    bool fraction = false;
+
+    if (copy == NULL)
+        return NAN;
+
+    for (size_t i = 0; i < len; i++) {
+        if (isdigit((unsigned char)str[i])) {
+            copy[length++] = str[i];
+            exponent -= fraction;
+        } else if (str[i] == '.') {
+            fraction = true;
+        } else {
+            /* the exponent, already checked by read_exponent */
+            const bool negative = (str[++i] == '-');
+            long value = 0;
+
+            if (str[i] == '-' || str[i] == '+')
+                i++;
+            for (; i < len; i++) {
+                if (value < MAX_LITERAL_EXPONENT)
+                    value = value * 10 + (str[i] - '0');
+            }
+
+            exponent += negative ? -value : value;
+            break;
+        }
+    }
+
+    sprintf(&copy[length], "e%ld", exponent);
+    double value = strtod(copy, NULL);
+
+    if (copy != stack_copy)
+        free(copy);
+
+    return value;
+}
 
 /**
- * @brief Parses num/par and evaluates any adjacent addition/subtraction.
+ * @brief converts `literal`, exactly when the mantissa and the power of ten
+ * are both exact doubles, otherwise with eisel_lemire.
  */
-double parse_addsub(struct Parser *parser);
+static double literal_value(const struct Literal *literal, const char *str,
+                            size_t len) {
+    const uint64_t mantissa = literal->mantissa;
+    const int exponent = literal->exponent;
+    double value = 0.0;
+
+    if (mantissa == 0)
+        return 0.0;
+
+    if (!literal->truncated && mantissa <= (1ULL << 53) && exponent >= -22 &&
+        exponent <= 22) {
+        return (exponent >= 0) ? mantissa * EXACT_POWERS_OF_TEN[exponent]
+                               : mantissa / EXACT_POWERS_OF_TEN[-exponent];
+    }
+
+    if (eisel_lemire(mantissa, exponent, &value)) {
+        double above;
+
+        /* the dropped digits put the literal between mantissa and
+           mantissa + 1, which is only decided if both round the same */
+        if (!literal->truncated ||
+            (eisel_lemire(mantissa + 1, exponent, &above) && above == value))
+            return value;
+    }
+
+    return literal_to_double(str, len);
+}
 
 /**
- * @brief Parses num/par. Returns the value of the expression
+ * @brief reads a literal such as `42`, `0.5` or `1e-9` in one pass. Integers
+ * which fit in 64 bits are kept exactly, everything else is converted to the
+ * nearest double.
  */
-double parse_numpar(struct Parser *parser);
+void read_number(struct Lexer *lexer, struct Token *token) {
+    const char *equ = lexer->equ;
+    const size_t START_INDEX = lexer->pos;
+    struct Literal literal = {0};
 
-struct Parser new_parser(struct TokensList *list) {
-    struct Parser parser = {
-        .token_list = list,
-        .index = 0,
-    };
+    read_digits(lexer, &literal, false);
 
-    return parser;
-}
+    if (lexer->pos < lexer->length && equ[lexer->pos] == '.') {
+        lexer->pos++;
+        literal.is_decimal = true;
+        read_digits(lexer, &literal, true);
+    }
 
-struct Token get_current(struct Parser *parser) {
-    return parser->token_list->tokens[parser->index];
-}
+    read_exponent(lexer, &literal);
 
-void consume(struct Parser *parser, enum TokenType type) {
-    if (get_current(parser).type == type) {
-        // MLOG_logf("Consumed token of type: %s", type_to_str(type));
-        parser->index++;
-    } else {
-        MLOG_errorf("Expected %s but found %s | Is equal: %d & %d",
-                    type_to_str(get_current(parser).type), type_to_str(type),
-                    get_current(parser).type, type);
-        exit(EXIT_FAILURE);
+    if (!literal.is_decimal && !literal.truncated &&
+        literal.exponent == 0 && literal.mantissa <= INT64_MAX) {
+        token->type = TYPE_INTEGER;
+        token->ivalue = (long long)literal.mantissa;
+        return;
     }
+
+    token->type = TYPE_DECIMAL;
+    token->fvalue =
+        literal_value(&literal, &equ[START_INDEX], lexer->pos - START_INDEX);
 }
 
-double parse_exp(struct Parser *parser) {
-    double value = parse_numpar(parser);
-    struct Token current = get_current(parser);
+void read_identifier(struct Lexer *lexer, struct Token *token) {
+    const char *equ = lexer->equ;
+    const size_t START_INDEX = lexer->pos;
+
+    /* the first character was checked by the caller, and may be a `$` */
+    lexer->pos++;
+    while (lexer->pos < lexer->length && is_identifier_char(equ[lexer->pos]))
+        lexer->pos++;
+
+    const size_t length = lexer->pos - START_INDEX;
+    const enum Keyword keyword = find_keyword(&equ[START_INDEX], length);
 
-    while (current.type == OP_EXP) {
-        consume(parser, OP_EXP);
-        value = pow(value, parse_numpar(parser));
-        current = get_current(parser);
+    if (keyword != KW_NONE) {
+        token->type = KEYWORDS[keyword].type;
+        token->keyword = keyword;
+        return;
     }
 
-    return value;
+    token->type = TYPE_IDENTIFIER;
+    token->name = &equ[START_INDEX];
+    token->name_len = length;
 }
 
-double parse_multdiv(struct Parser *parser) {
-    double value = parse_exp(parser);
-    struct Token current = get_current(parser);
+/**
+ * @brief reads the token starting at the current position of `lexer` into
+ * `token`. At the end of the string the token is TYPE_EMPTY.
+ *
+ * @return MC3_NO_ERROR, or MC3_INVALID_CHARACTER_FOUND.
+ */
+MC3_ErrorCode next_token(struct Lexer *lexer, struct Token *token) {
+    const char *equ = lexer->equ;
+
+    while (lexer->pos < lexer->length && equ[lexer->pos] == ' ')
+        lexer->pos++;
 
-    while (current.type == OP_MULT || current.type == OP_DIV) {
-        if (current.type == OP_MULT) {
-            consume(parser, OP_MULT);
-            value *= parse_numpar(parser);
-        } else {
-            consume(parser, OP_DIV);
-            value /= parse_numpar(parser);
-        }
+    token->offset = lexer->pos;
 
-        current = get_current(parser);
+    if (lexer->pos == lexer->length) {
+        token->type = TYPE_EMPTY;
+        return MC3_NO_ERROR;
     }
 
-    return value;
-}
+    const char ch = equ[lexer->pos];
 
-double parse_addsub(struct Parser *parser) {
-    double value = parse_multdiv(parser);
-    struct Token current = get_current(parser);
+    if (is_operator(ch) || is_grouping(ch) || is_separator(ch)) {
+        /* parenthesis are also considered operators in this context */
+        set_token(token, char_to_type(ch), 0);
+        lexer->pos++;
+    } else if (isdigit((unsigned char)ch)) {
+        read_number(lexer, token);
+    } else if (is_identifier_start(ch) ||
+               (ch == '$' && lexer->pos + 1 < lexer->length &&
+                isdigit((unsigned char)equ[lexer->pos + 1]))) {
+        /* `$1` names the first result of a session */
+        read_identifier(lexer, token);
+    } else {
+        return MC3_INVALID_CHARACTER_FOUND;
+    }
 
-    while (current.type == OP_ADD || current.type == OP_SUB) {
-        if (current.type == OP_ADD) {
-            consume(parser, OP_ADD);
-            value += parse_numpar(parser);
-        } else {
-            consume(parser, OP_SUB);
-            value -= parse_numpar(parser);
-        }
+    return MC3_NO_ERROR;
+}
 
-        current = get_current(parser);
+/**
+ * @brief returns the token at `index`, or a TYPE_EMPTY token past the end of
+ * the list.
+ */
+struct Token get_token_at(struct TokensList *list, unsigned int index) {
+    if (index >= list->tkns_pos) {
+        struct Token empty = {.type = TYPE_EMPTY};
+        return empty;
     }
 
-    return value;
+    return list->tokens[index];
 }
 
-double parse_numpar(struct Parser *parser) {
-    double value;
-    struct Token current = get_current(parser);
+enum TokenType get_type_at(struct TokensList *list, unsigned int index) {
+    return get_token_at(list, index).type;
+}
 
-    if (current.type == TYPE_INTEGER || current.type == TYPE_DECIMAL) {
-        if (current.type == TYPE_INTEGER) {
-            value = (double)current.ivalue;
-            consume(parser, TYPE_INTEGER);
-            return value;
-        } else if (current.type == TYPE_DECIMAL) {
-            value = current.fvalue;
-            consume(parser, TYPE_DECIMAL);
-            return value;
+/**
+ * @brief Takes the first `length` characters of `equ` and tokenizes them into
+ * Tokens, appending to `list`. `equ` does not need to be terminated. The list
+ * grows as needed and is always followed by a TYPE_EMPTY token.
+ *
+ * @param equ
+ * @param length
+ * @param list
+ * @return MC3_ErrorCode
+ */
+void tokenize_n(const char *equ, size_t length, struct TokensList *list,
+                MC3_ErrorCode *err) {
+    MC3_ErrorCode err_code = MC3_NO_ERROR;
+    struct Lexer lexer = new_lexer(equ, length);
+
+    for (;;) {
+        if (!reserve_tokens(list, list->tkns_pos + 1)) {
+            err_code = MC3_OUT_OF_MEMORY;
+            break;
         }
-    } else if (current.type == PAR_LEFT) {
-        consume(parser, PAR_LEFT);
-        value = parse_addsub(parser);
-        consume(parser, PAR_RIGHT);
-        return value;
-    } else {
-        MLOG_error("Expected factor (num or par)");
-        exit(1);
+
+        struct Token *token = &list->tokens[list->tkns_pos];
+        err_code = next_token(&lexer, token);
+
+        if (err_code != MC3_NO_ERROR || token->type == TYPE_EMPTY)
+            break;
+
+        list->tkns_pos++;
     }
 
-    return -1;
+    if (list->tkns_pos < list->capacity)
+        list->tokens[list->tkns_pos].type = TYPE_EMPTY;
+
+    if (err != NULL)
+        *err = err_code;
 }
 
 /**
- * @brief generates a parse tree from list of tokens.
- *
- * @returns A reference to the root of the parse tree.
+ * @brief Takes string `equ` and tokenizes it into Tokens, writing to `list`.
  */
-double parse(struct TokensList *list) {
-    struct Parser parser = new_parser(list);
-    double result = parse_addsub(&parser);
-    return result;
+void tokenize(const char *equ, struct TokensList *list, MC3_ErrorCode *err) {
+    tokenize_n(equ, strlen(equ), list, err);
 }
 
 /* ===== Error Handling Functions =====*/
@@ -439,93 +866,10523 @@ const char *get_error_str(const MC3_ErrorCode err) {
         return "Tokens limit Reached. Expression too long.";
     case MC3_INVALID_CHARACTER_FOUND:
         return "Invalid character was found.";
+    case MC3_OUT_OF_MEMORY:
+        return "Out of memory.";
+    case MC3_UNBOUND_VARIABLE:
+        return "Expression uses variables but no values were given.";
+    case MC3_UNEXPECTED_TOKEN:
+        return "Unexpected token. Expected a number, variable or operator.";
+    case MC3_UNBALANCED_PARENTHESES:
+        return "Unbalanced parentheses.";
+    case MC3_CIRCULAR_REFERENCE:
+        return "Circular reference between cells.";
+    case MC3_DIVISION_BY_ZERO:
+        return "Division by zero.";
+    case MC3_INEXACT_RESULT:
+        return "Result has no exact decimal value.";
+    case MC3_DIMENSION_MISMATCH:
+        return "Matrices of incompatible sizes.";
     default:
         return "Invalid Error Code";
     }
 }
 
+const char *getErrorString(const MC3_ErrorCode err) {
+    return get_error_str(err);
+}
+
 void write_error(MC3_ErrorCode *err_obj, MC3_ErrorCode code) {
     if (err_obj != NULL)
         *err_obj = code;
 }
 
-// /* ===== Main Function =====*/
+static void write_context_error(MC3_Error *err, MC3_ErrorCode code,
+                                size_t offset) {
+    if (err != NULL) {
+        err->code = code;
+        err->offset = offset;
+    }
+}
 
-// /**
-//  * @brief evaluates a mathematical expression from a string, returning the
-//  * result as a double. Calculator supports all basic arithmetic operators:
-//  * +, -, *, /, and ^. Also supports basic scientific functions such as ln,
-//  * sin and constants such as e and pi. The calculator follows  standard
-//  PEMDAS
-//  * order of operations.
-//  *
-//  * @param equ
-//  * @param err if parameter is NULL, then the error will not be set.
-//  Otherwise,
-//  * the value of any error that occurs is written to `err`.
-//  * @return double
-//  */
-double MC3_evaluate(const char *equ, MC3_ErrorCode *err) {
-    struct TokensList tokens_list = new_list();
-    MC3_ErrorCode error_code = MC3_NO_ERROR;
+/* ===== Statistics Functions =====*/
 
-    tokenize(equ, &tokens_list, &error_code);
-    if (error_code != MC3_NO_ERROR) {
-        write_error(err, error_code);
-        return 0.0;
-    }
+/*
+ * With MC3_STATS defined, every thread counts into its own block of counters,
+ * so counting needs no locking and no shared cache lines. Blocks are only
+ * written by their thread and read by MC3_get_stats, and are folded into
+ * `stats_retired` when their thread exits. Without MC3_STATS every STATS(...)
+ * statement is compiled out.
+ */
 
-    double result = parse(&tokens_list);
+#if defined(MC3_STATS)
+    #define STATS(...) __VA_ARGS__
 
-    return result;
+struct StatsBlock {
+    struct StatsBlock *next;
+    atomic_ullong calls[MC3_PHASE_COUNT];
+    atomic_ullong cycles[MC3_PHASE_COUNT];
+    atomic_ullong token_counts[MC3_STATS_BUCKETS];
+    atomic_ullong nesting_depths[MC3_STATS_BUCKETS];
+    atomic_ullong errors[MC3_ERROR_CODES];
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* blocks of the running threads, guarded by stats_lock */
+static struct StatsBlock *stats_blocks = NULL;
+/* totals of the threads which exited, guarded by stats_lock */
+static MC3_Stats stats_retired;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static _Thread_local struct StatsBlock *stats_block = NULL;
+
+/* adds `count` to a counter only the calling thread writes, which needs no
+   atomic read-modify-write */
+static void stats_bump(atomic_ullong *counter, unsigned long long count) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + count,
+        memory_order_relaxed);
 }
 
-/* ==== Tests ==== */
+/* adds the counters of `block` to `stats` */
+static void stats_sum(MC3_Stats *stats, struct StatsBlock *block) {
+    for (int i = 0; i < MC3_PHASE_COUNT; i++) {
+        stats->calls[i] += atomic_load(&block->calls[i]);
+        stats->cycles[i] += atomic_load(&block->cycles[i]);
+    }
+    for (int i = 0; i < MC3_STATS_BUCKETS; i++) {
+        stats->token_counts[i] += atomic_load(&block->token_counts[i]);
+        stats->nesting_depths[i] += atomic_load(&block->nesting_depths[i]);
+    }
+    for (int i = 0; i < MC3_ERROR_CODES; i++)
+        stats->errors[i] += atomic_load(&block->errors[i]);
+}
 
-void print_token(struct Token *token) {
-    if (token->type == TYPE_INTEGER) {
-        printf("INTEGER(%lld)", token->ivalue);
-    } else if (token->type == TYPE_DECIMAL) {
-        printf("DECIMAL(%lf)", token->fvalue);
-    } else {
-        printf("%s", type_to_str(token->type));
+static void stats_clear(struct StatsBlock *block) {
+    for (int i = 0; i < MC3_PHASE_COUNT; i++) {
+        atomic_store(&block->calls[i], 0);
+        atomic_store(&block->cycles[i], 0);
+    }
+    for (int i = 0; i < MC3_STATS_BUCKETS; i++) {
+        atomic_store(&block->token_counts[i], 0);
+        atomic_store(&block->nesting_depths[i], 0);
     }
+    for (int i = 0; i < MC3_ERROR_CODES; i++)
+        atomic_store(&block->errors[i], 0);
 }
 
-void test_tokenization(void) {
-    struct TokensList list = new_list();
+static void retire_stats_block(void *arg) {
+    struct StatsBlock *block = arg;
 
-    MLOG_log("Testing Suite: Tokenization");
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(&stats_retired, block);
+    for (struct StatsBlock **link = &stats_blocks; *link;
+         link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
 
-    clear_list(&list);
-    tokenize("2 + 4", &list, NULL);
-    MLOG_test("2 + 4",
+    free(block);
+}
+
+static void create_stats_key(void) {
+    pthread_key_create(&stats_key, retire_stats_block);
+}
+
+/**
+ * @brief the counters of the calling thread, created on first use.
+ *
+ * @return the block, or NULL if it could not be allocated.
+ */
+static struct StatsBlock *get_stats_block(void) {
+    if (stats_block != NULL)
+        return stats_block;
+
+    pthread_once(&stats_once, create_stats_key);
+
+    struct StatsBlock *block = calloc(1, sizeof(struct StatsBlock));
+    if (block == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    block->next = stats_blocks;
+    stats_blocks = block;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, block);
+    stats_block = block;
+    return block;
+}
+
+/* cycle counter on x86-64, nanoseconds elsewhere */
+static uint64_t stats_now(void) {
+    #if defined(__x86_64__) && defined(__GNUC__)
+    return __builtin_ia32_rdtsc();
+    #else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    #endif
+}
+
+/* histogram bucket of `value`: 0, 1, 2-3, 4-7, ... */
+static int stats_bucket(unsigned int value) {
+    int bucket = 0;
+
+    while (value > 0 && bucket < MC3_STATS_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static void stats_phase(MC3_Phase phase, uint64_t cycles, unsigned int calls) {
+    struct StatsBlock *block = get_stats_block();
+
+    if (block != NULL) {
+        stats_bump(&block->calls[phase], calls);
+        stats_bump(&block->cycles[phase], cycles);
+    }
+}
+
+static void stats_expression(unsigned int tokens, unsigned int depth) {
+    struct StatsBlock *block = get_stats_block();
+
+    if (block != NULL) {
+        stats_bump(&block->token_counts[stats_bucket(tokens)], 1);
+        stats_bump(&block->nesting_depths[stats_bucket(depth)], 1);
+    }
+}
+
+static void stats_error(MC3_ErrorCode code) {
+    struct StatsBlock *block = get_stats_block();
+
+    if (block != NULL && code != MC3_NO_ERROR)
+        stats_bump(&block->errors[code], 1);
+}
+#else
+    #define STATS(...)
+#endif
+
+/**
+ * @brief Adds up the counters of every thread since the start of the process
+ * or the last MC3_reset_stats. Threads may keep counting meanwhile, so the
+ * totals are a snapshot. `enabled` is 0, and every counter too, if the
+ * library was built without MC3_STATS.
+ */
+MC3_Stats MC3_get_stats(void) {
+    MC3_Stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+#if defined(MC3_STATS)
+    pthread_mutex_lock(&stats_lock);
+    stats = stats_retired;
+    stats.enabled = 1;
+
+    for (struct StatsBlock *block = stats_blocks; block; block = block->next)
+        stats_sum(&stats, block);
+    pthread_mutex_unlock(&stats_lock);
+#endif
+
+    return stats;
+}
+
+/**
+ * @brief sets every counter back to zero. Counts made by other threads while
+ * resetting may be lost.
+ */
+void MC3_reset_stats(void) {
+#if defined(MC3_STATS)
+    pthread_mutex_lock(&stats_lock);
+    memset(&stats_retired, 0, sizeof(stats_retired));
+
+    for (struct StatsBlock *block = stats_blocks; block; block = block->next)
+        stats_clear(block);
+    pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+/* ===== Arena Functions =====*/
+
+/* size of the first block of an arena */
+#define ARENA_FIRST_BLOCK 4096
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    /* number of bytes in data */
+    size_t size;
+    /* number of bytes of data handed out */
+    size_t used;
+    max_align_t data[];
+};
+
+/* Hands out memory from large blocks and releases all of it at once, so
+   temporaries of a compilation or evaluation cost a pointer bump instead of a
+   malloc each. */
+struct Arena {
+    /* block allocations are currently made from, followed by older blocks */
+    struct ArenaBlock *head;
+};
+
+struct Arena new_arena(void) {
+    struct Arena arena = {.head = NULL};
+    return arena;
+}
+
+void free_arena(struct Arena *arena) {
+    struct ArenaBlock *block = arena->head;
+
+    while (block != NULL) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->head = NULL;
+}
+
+/**
+ * @brief releases everything allocated from `arena`. Memory is kept for the
+ * next use; if several blocks were needed they are merged into one large
+ * enough for all of them.
+ */
+void reset_arena(struct Arena *arena) {
+    if (arena->head == NULL)
+        return;
+
+    if (arena->head->next == NULL) {
+        arena->head->used = 0;
+        return;
+    }
+
+    size_t total = 0;
+    for (struct ArenaBlock *block = arena->head; block; block = block->next)
+        total += block->size;
+
+    free_arena(arena);
+
+    struct ArenaBlock *block = malloc(sizeof(struct ArenaBlock) + total);
+    if (block != NULL) {
+        block->next = NULL;
+        block->size = total;
+        block->used = 0;
+    }
+    arena->head = block;
+}
+
+/**
+ * @return `size` bytes aligned for any type, or NULL if out of memory.
+ */
+void *arena_alloc(struct Arena *arena, size_t size) {
+    const size_t align = sizeof(max_align_t);
+    size = (size + align - 1) / align * align;
+
+    struct ArenaBlock *block = arena->head;
+
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = block ? block->size * 2 : ARENA_FIRST_BLOCK;
+        while (block_size < size)
+            block_size *= 2;
+
+        block = malloc(sizeof(struct ArenaBlock) + block_size);
+        if (block == NULL)
+            return NULL;
+
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+
+    void *memory = (char *)block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+/**
+ * @brief grows the array `items`, allocated from `arena`, so one more element
+ * of `size` bytes fits after the first `count`. The old array is left in the
+ * arena until it is reset.
+ *
+ * @return the array, which may have moved, or NULL if it could not grow.
+ */
+void *arena_grow(struct Arena *arena, void *items, unsigned int *capacity,
+                 unsigned int count, size_t size) {
+    if (count < *capacity)
+        return items;
+
+    unsigned int new_capacity = *capacity ? *capacity * 2 : 16;
+    void *new_items = arena_alloc(arena, (size_t)new_capacity * size);
+
+    if (new_items != NULL) {
+        if (count > 0)
+            memcpy(new_items, items, (size_t)count * size);
+        *capacity = new_capacity;
+    }
+
+    return new_items;
+}
+
+/* ===== Program Data Types =====*/
+
+enum OpCode {
+    OPC_CONST,
+    OPC_VAR,
+    /* index of an enclosing sum or product, only found in their bodies */
+    OPC_INDEX,
+    OPC_ADD,
+    OPC_SUB,
+    OPC_MULT,
+    OPC_DIV,
+    OPC_EXP,
+    /* functions of one operand */
+    OPC_SIN,
+    OPC_COS,
+    OPC_TAN,
+    OPC_LOG,
+    OPC_LN,
+    /* sums and products over a range */
+    OPC_SUM,
+    OPC_PROD,
+    /* matrix product, dot product and matrix literal, only found in
+       expressions parsed for MC3_evaluate_matrix */
+    OPC_MATMUL,
+    OPC_DOT,
+    OPC_MATRIX,
+};
+
+struct Instr {
+    /* Stores the operation. Every instruction writes the register with the
+       same index as the instruction itself, so a program is a flat list of
+       single assignments. */
+    enum OpCode op;
+
+    /* Indexes of the registers holding the operands, unused by OPC_CONST.
+       Operands always refer to earlier instructions. OPC_VAR stores the index
+       of the variable in `lhs` instead, and OPC_INDEX the number of ranges
+       around the one whose index it loads. Functions of one operand store it
+       in both, so every pass can treat them like binary operators. OPC_SUM
+       and OPC_PROD hold the first and last index of their range, and
+       OPC_MATRIX the number of rows and columns of its literal. */
+    unsigned int lhs;
+    unsigned int rhs;
+
+    /* literal value loaded by OPC_CONST, the index of the range of OPC_SUM
+       and OPC_PROD in `ranges`, or the index of the first element of
+       OPC_MATRIX in the elements of its parser */
+    double value;
+};
+
+struct MC3_Program {
+    /* array of instructions, in evaluation order */
+    struct Instr *code;
+    /* current number of instructions */
+    unsigned int length;
+    /* maximum number of instructions before `code` has to grow */
+    unsigned int capacity;
+    /* register holding the value of the whole expression */
+    unsigned int result;
+    /* names of the variables, in order of first appearance */
+    char **var_names;
+    /* number of variables in var_names */
+    unsigned int var_count;
+    /* bodies of the sums and products, innermost ones before the ones they are
+       in */
+    struct Range *ranges;
+    unsigned int range_count;
+    /* number of instructions other than constants the optimizer found
+       already emitted, and shared instead of emitting them again */
+    unsigned int deduplicated;
+    /* references held by callers and caches, the program is released when the
+       last one is dropped. Unused for programs built in an arena. */
+    atomic_uint refs;
+    /* native code of the program, if it was translated by MC3_jit_compile */
+    _Atomic(struct JitCode *) jit;
+};
+
+/* highest degree of a polynomial body summed in closed form */
+#define MAX_CLOSED_FORM_DEGREE 5
+
+/* A body summed or multiplied over a range, `sum(i, from, to, body)`. */
+struct Range {
+    /* The body, a program of its own sharing the variables and the ranges of
+       the program it belongs to. Bodies read the variables, followed by the
+       index of every range they are in, outermost first. */
+    struct MC3_Program body;
+    /* OPC_SUM or OPC_PROD */
+    enum OpCode op;
+    /* number of ranges around this one, and the slot of its index after the
+       variables */
+    unsigned int depth;
+    /* Degree of the body as a polynomial in the index, or -1. Such sums, and
+       products of a body not using the index, are computed from the registers
+       of the body in `coefficients` evaluated once, lowest degree first,
+       NO_COEFFICIENT standing for zero. */
+    int degree;
+    unsigned int coefficients[MAX_CLOSED_FORM_DEGREE + 1];
+};
+
+#define NO_COEFFICIENT UINT_MAX
+
+/**
+ * @brief checks whether instructions of `op` read the registers in `lhs` and
+ * `rhs`.
+ */
+static bool has_operands(enum OpCode op) {
+    return op != OPC_CONST && op != OPC_VAR && op != OPC_INDEX &&
+           op != OPC_MATRIX;
+}
+
+/**
+ * @brief checks whether `prog` evaluates a sum or product, rather than only
+ * having had them folded into constants.
+ */
+static bool uses_ranges(const struct MC3_Program *prog) {
+    for (unsigned int i = 0; i < prog->length; i++) {
+        if (prog->code[i].op == OPC_SUM || prog->code[i].op == OPC_PROD)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief points the bodies of the ranges of `prog` at its variables and
+ * ranges.
+ */
+static void link_ranges(struct MC3_Program *prog) {
+    for (unsigned int i = 0; i < prog->range_count; i++) {
+        struct MC3_Program *body = &prog->ranges[i].body;
+
+        body->var_names = prog->var_names;
+        body->var_count = prog->var_count;
+        body->ranges = prog->ranges;
+        body->range_count = prog->range_count;
+    }
+}
+
+/* number of registers MC3_run keeps on the stack before falling back to the
+   heap */
+#define RUN_STACK_REGS 128
+
+/* number of rows MC3_eval_batch evaluates per instruction before moving on to
+   the next one, sized so the live registers of a block stay in cache */
+#define BATCH_BLOCK_ROWS 256
+
+/* ===== Parsing Functions =====*/
+
+/*
+ * Expressions are parsed in a single pass over the string, without building a
+ * token list first. Operators wait on an explicit stack until an operator of
+ * lower or equal precedence (or a closing parenthesis) arrives, and are then
+ * lowered into the program. Only unfinished operators and their operands are
+ * kept, so memory is bounded by the nesting depth of the expression and deep
+ * nesting cannot overflow the C stack.
+ */
+
+/* An operator waiting on the stack of the parser. For an open parenthesis,
+   `function` is the function applied once it closes, or KW_NONE. */
+struct PendingOperator {
+    enum TokenType type;
+    enum Keyword function;
+    /* byte offset of the operator, or of the function name */
+    size_t offset;
+    /* number of operands below those read after the operator, so an open
+       parenthesis or bracket can tell how many values it holds */
+    unsigned int first_operand;
+    /* for an open bracket, the rows read so far and the length of the first,
+       once it has ended */
+    unsigned int rows;
+    unsigned int columns;
+};
+
+/* A sum or product whose closing parenthesis has not been read yet. */
+struct RangeFrame {
+    /* name of the index */
+    const char *name;
+    size_t name_len;
+    /* commas read so far, the body starts after the third */
+    unsigned int commas;
+    /* byte offset of the third comma */
+    size_t body_offset;
+    /* number of bodies around this range */
+    unsigned int depth;
+    /* program the body is lowered into */
+    struct MC3_Program body;
+};
+
+/* A variable read in the body of a range, at byte `offset`. */
+struct VarRead {
+    unsigned int var;
+    size_t offset;
+};
+
+/* The text of the body of a range, from its comma to its closing parenthesis,
+   in bytes. */
+struct BodySpan {
+    size_t first;
+    size_t last;
+};
+
+struct Parser {
+    struct Lexer lexer;
+    /* tokens of the string, ending with TYPE_EMPTY, to parse instead of
+       lexing it again, or NULL */
+    const struct Token *tokens;
+    /* reported at the end of `tokens`, if the string could not be tokenized
+       to the end */
+    MC3_ErrorCode tokens_error;
+    /* program the parse is lowered into */
+    struct MC3_Program *program;
+    /* where the program and the stacks below are allocated */
+    struct Arena *arena;
+    MC3_ErrorCode error;
+    /* byte offset of the token `error` was found at */
+    size_t error_offset;
+    /* byte offset of the first variable, if the program has any */
+    size_t var_offset;
+
+    /* function named by the last token, waiting for its open parenthesis,
+       and the offset of its name */
+    enum Keyword function;
+    size_t function_offset;
+
+    /* byte offset of the token each instruction of the program comes from,
+       kept only if `keep_offsets` is set */
+    bool keep_offsets;
+    size_t *offsets;
+    unsigned int offset_capacity;
+    /* instructions of bodies have no offsets, so with `keep_offsets` the span
+       of every range, indexed like the ranges, and every variable read in a
+       body are kept instead */
+    struct BodySpan *body_spans;
+    unsigned int body_span_capacity;
+    struct VarRead *var_reads;
+    unsigned int var_read_count;
+    unsigned int var_read_capacity;
+
+    /* operators waiting for their right operand, and open parenthesis */
+    struct PendingOperator *operators;
+    unsigned int op_pos;
+    unsigned int op_capacity;
+
+    /* registers holding the operands of the waiting operators */
+    unsigned int *operands;
+    unsigned int operand_pos;
+    unsigned int operand_capacity;
+
+    /* sums and products being read, innermost last */
+    struct RangeFrame *frames;
+    unsigned int frame_pos;
+    unsigned int frame_capacity;
+
+    /* Set to lower matrix literals, `@` and `dot` into matrix operations.
+       Otherwise numbers are matrices of one element: `@` and `dot` multiply,
+       and a literal must hold a single number. */
+    bool matrices;
+    /* registers of the elements of every matrix literal, row after row, kept
+       only if `matrices` is set */
+    unsigned int *elements;
+    unsigned int element_count;
+    unsigned int element_capacity;
+};
+
+struct Parser new_parser(const char *equ, size_t length,
+                         struct MC3_Program *program, struct Arena *arena) {
+    struct Parser parser = {
+        .lexer = new_lexer(equ, length),
+        .program = program,
+        .arena = arena,
+        .error = MC3_NO_ERROR,
+        .function = KW_NONE,
+    };
+
+    return parser;
+}
+
+/**
+ * @brief records the first error of the parse, found at byte `offset`.
+ */
+void parser_error(struct Parser *parser, MC3_ErrorCode code, size_t offset) {
+    if (parser->error != MC3_NO_ERROR)
+        return;
+
+    parser->error = code;
+    parser->error_offset = offset;
+
+    MLOG_debugf("cannot parse \"%.*s\": %s (at %zu)",
+                (int)parser->lexer.length, parser->lexer.equ,
+                get_error_str(code), offset);
+}
+
+void push_operator(struct Parser *parser, enum TokenType type,
+                   enum Keyword function, size_t offset) {
+    struct PendingOperator *operators =
+        arena_grow(parser->arena, parser->operators, &parser->op_capacity,
+                   parser->op_pos, sizeof(struct PendingOperator));
+    if (operators == NULL) {
+        parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+        return;
+    }
+
+    parser->operators = operators;
+    parser->operators[parser->op_pos++] = (struct PendingOperator){
+        .type = type,
+        .function = function,
+        .offset = offset,
+        .first_operand = parser->operand_pos,
+    };
+}
+
+void push_operand(struct Parser *parser, unsigned int reg) {
+    unsigned int *operands =
+        arena_grow(parser->arena, parser->operands, &parser->operand_capacity,
+                   parser->operand_pos, sizeof(unsigned int));
+    if (operands == NULL) {
+        parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+        return;
+    }
+
+    parser->operands = operands;
+    parser->operands[parser->operand_pos++] = reg;
+}
+
+/**
+ * @brief program the instructions read next belong to: the body of the
+ * innermost range whose body is being read, or the program itself.
+ */
+static struct MC3_Program *emit_target(struct Parser *parser) {
+    for (unsigned int i = parser->frame_pos; i-- > 0;) {
+        if (parser->frames[i].commas == 3)
+            return &parser->frames[i].body;
+    }
+
+    return parser->program;
+}
+
+/**
+ * @brief checks whether the instructions read next are evaluated as
+ * matrices, which the bodies of sums and products never are.
+ */
+static bool reads_matrices(struct Parser *parser) {
+    return parser->matrices && emit_target(parser) == parser->program;
+}
+
+/**
+ * @brief appends an instruction to the program being built by `parser`, for
+ * the token at byte `offset`.
+ *
+ * @return the register written by the new instruction.
+ */
+unsigned int emit(struct Parser *parser, enum OpCode op, unsigned int lhs,
+                  unsigned int rhs, double value, size_t offset) {
+    struct MC3_Program *program = emit_target(parser);
+    struct Instr *code =
+        arena_grow(parser->arena, program->code, &program->capacity,
+                   program->length, sizeof(struct Instr));
+
+    if (code == NULL) {
+        parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+        return 0;
+    }
+    program->code = code;
+
+    /* instructions of bodies are not evaluated exactly, so they need none */
+    if (parser->keep_offsets && program == parser->program) {
+        size_t *offsets =
+            arena_grow(parser->arena, parser->offsets, &parser->offset_capacity,
+                       program->length, sizeof(size_t));
+        if (offsets == NULL) {
+            parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+            return 0;
+        }
+        parser->offsets = offsets;
+        offsets[program->length] = offset;
+    }
+
+    struct Instr *instr = &program->code[program->length];
+    instr->op = op;
+    instr->lhs = lhs;
+    instr->rhs = rhs;
+    instr->value = value;
+
+    return program->length++;
+}
+
+/**
+ * @brief finds the index of the variable `name` in the program being built by
+ * `parser`, adding it if it is not there yet.
+ */
+unsigned int intern_variable(struct Parser *parser, const char *name,
+                             size_t name_len) {
+    struct MC3_Program *program = parser->program;
+
+    for (unsigned int i = 0; i < program->var_count; i++) {
+        if (strlen(program->var_names[i]) == name_len &&
+            memcmp(program->var_names[i], name, name_len) == 0)
+            return i;
+    }
+
+    unsigned int capacity = program->var_count;
+    char **var_names =
+        arena_grow(parser->arena, program->var_names, &capacity,
+                   program->var_count, sizeof(char *));
+    char *copy = arena_alloc(parser->arena, name_len + 1);
+
+    if (var_names == NULL || copy == NULL) {
+        parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+        return 0;
+    }
+    program->var_names = var_names;
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+
+    var_names[program->var_count] = copy;
+    return program->var_count++;
+}
+
+/**
+ * @brief binding strength of a binary operator. Every operator is left
+ * associative, including `^`.
+ */
+int precedence(enum TokenType type) {
+    switch (type) {
+    case OP_ADD:
+    case OP_SUB:
+        return 1;
+    case OP_MULT:
+    case OP_DIV:
+        return 2;
+    case OP_MATMUL:
+        return 2;
+    case OP_EXP:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+enum OpCode type_to_opcode(enum TokenType type) {
+    switch (type) {
+    case OP_ADD:
+        return OPC_ADD;
+    case OP_SUB:
+        return OPC_SUB;
+    case OP_MULT:
+        return OPC_MULT;
+    case OP_DIV:
+        return OPC_DIV;
+    case OP_MATMUL:
+        return OPC_MATMUL;
+    default:
+        return OPC_EXP;
+    }
+}
+
+/**
+ * @brief lowers waiting operators into the program for as long as the top of
+ * the stack binds at least as strongly as `min_precedence`. Open parenthesis
+ * and brackets stop the reduction.
+ */
+void reduce(struct Parser *parser, int min_precedence) {
+    while (parser->op_pos > 0) {
+        const struct PendingOperator top =
+            parser->operators[parser->op_pos - 1];
+
+        if (top.type == PAR_LEFT || top.type == BRACKET_LEFT ||
+            precedence(top.type) < min_precedence)
+            return;
+
+        enum OpCode op = type_to_opcode(top.type);
+        if (op == OPC_MATMUL && !reads_matrices(parser))
+            op = OPC_MULT;
+
+        parser->op_pos--;
+        const unsigned int rhs = parser->operands[--parser->operand_pos];
+        const unsigned int lhs = parser->operands[--parser->operand_pos];
+        push_operand(parser, emit(parser, op, lhs, rhs, 0, top.offset));
+    }
+}
+
+enum OpCode keyword_to_opcode(enum Keyword function) {
+    switch (function) {
+    case KW_SIN:
+        return OPC_SIN;
+    case KW_COS:
+        return OPC_COS;
+    case KW_TAN:
+        return OPC_TAN;
+    case KW_LOG:
+        return OPC_LOG;
+    default:
+        return OPC_LN;
+    }
+}
+
+/**
+ * @brief starts reading a sum or product, after its open parenthesis.
+ */
+static void push_frame(struct Parser *parser) {
+    struct RangeFrame *frames =
+        arena_grow(parser->arena, parser->frames, &parser->frame_capacity,
+                   parser->frame_pos, sizeof(struct RangeFrame));
+    if (frames == NULL) {
+        parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+        return;
+    }
+
+    unsigned int depth = 0;
+    for (unsigned int i = 0; i < parser->frame_pos; i++)
+        depth += (frames[i].commas == 3);
+
+    parser->frames = frames;
+    parser->frames[parser->frame_pos++] = (struct RangeFrame){.depth = depth};
+}
+
+/**
+ * @brief finds the innermost range whose body is being read and whose index
+ * is called `name`.
+ *
+ * @return its frame, or -1 if `name` is not an index.
+ */
+static int find_index(const struct Parser *parser, const char *name,
+                      size_t name_len) {
+    for (unsigned int i = parser->frame_pos; i-- > 0;) {
+        const struct RangeFrame *frame = &parser->frames[i];
+
+        if (frame->commas == 3 && frame->name_len == name_len &&
+            memcmp(frame->name, name, name_len) == 0)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief ends the sum or product opened by `open` at its closing parenthesis,
+ * at byte `offset`: adds its body to the ranges of the program and pushes
+ * the instruction evaluating it.
+ */
+static void close_range(struct Parser *parser,
+                        const struct PendingOperator *open, size_t offset) {
+    struct RangeFrame frame = parser->frames[--parser->frame_pos];
+
+    if (frame.commas != 3) {
+        parser_error(parser, MC3_UNEXPECTED_TOKEN, offset);
+        return;
+    }
+    frame.body.result = parser->operands[--parser->operand_pos];
+
+    struct MC3_Program *program = parser->program;
+    unsigned int capacity = program->range_count;
+    struct Range *ranges =
+        arena_grow(parser->arena, program->ranges, &capacity,
+                   program->range_count, sizeof(struct Range));
+    if (ranges == NULL) {
+        parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+        return;
+    }
+    if (parser->keep_offsets) {
+        struct BodySpan *spans = arena_grow(
+            parser->arena, parser->body_spans, &parser->body_span_capacity,
+            program->range_count, sizeof(struct BodySpan));
+        if (spans == NULL) {
+            parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+            return;
+        }
+        parser->body_spans = spans;
+        spans[program->range_count] =
+            (struct BodySpan){frame.body_offset, offset};
+    }
+
+    const unsigned int index = program->range_count++;
+    program->ranges = ranges;
+    const enum OpCode op = (open->function == KW_SUM) ? OPC_SUM : OPC_PROD;
+    ranges[index] = (struct Range){
+        .body = frame.body,
+        .op = op,
+        .depth = frame.depth,
+        .degree = -1,
+    };
+
+    const unsigned int to = parser->operands[--parser->operand_pos];
+    const unsigned int from = parser->operands[--parser->operand_pos];
+    push_operand(parser, emit(parser, op, from, to, index, open->offset));
+}
+
+/**
+ * @brief ends the current row of the matrix literal opened by `open`, at the
+ * semicolon or bracket at byte `offset`. Every row must be as long as the
+ * first.
+ */
+static void end_row(struct Parser *parser, struct PendingOperator *open,
+                    size_t offset) {
+    const unsigned int elements = parser->operand_pos - open->first_operand;
+
+    if (open->rows == 0) {
+        open->columns = elements;
+    } else if (elements != (open->rows + 1) * open->columns) {
+        parser_error(parser, MC3_DIMENSION_MISMATCH, offset);
+        return;
+    }
+
+    open->rows++;
+}
+
+/**
+ * @brief ends the matrix literal opened by `open`, replacing its elements on
+ * the operand stack by the matrix.
+ */
+static void close_matrix(struct Parser *parser,
+                         const struct PendingOperator *open) {
+    const unsigned int count = open->rows * open->columns;
+
+    /* a number is a matrix of one element */
+    if (!reads_matrices(parser)) {
+        if (count != 1)
+            parser_error(parser, MC3_DIMENSION_MISMATCH, open->offset);
+        return;
+    }
+
+    const unsigned int first = parser->element_count;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int *elements = arena_grow(
+            parser->arena, parser->elements, &parser->element_capacity,
+            parser->element_count, sizeof(unsigned int));
+        if (elements == NULL) {
+            parser_error(parser, MC3_OUT_OF_MEMORY, parser->lexer.pos);
+            return;
+        }
+
+        parser->elements = elements;
+        elements[parser->element_count++] =
+            parser->operands[open->first_operand + i];
+    }
+
+    parser->operand_pos = open->first_operand;
+    push_operand(parser, emit(parser, OPC_MATRIX, open->rows, open->columns,
+                              first, open->offset));
+}
+
+/**
+ * @brief reads an operand: a number, a variable, a constant, a function name,
+ * an open parenthesis or an open bracket.
+ *
+ * @return true if a value was pushed, false after an open parenthesis or a
+ * function name, which means another operand is expected.
+ */
+bool parse_operand(struct Parser *parser, struct Token *current) {
+    /* a function name must be followed by its parenthesized argument */
+    if (parser->function != KW_NONE && current->type != PAR_LEFT) {
+        parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+        return false;
+    }
+
+    /* `sum(` and `prod(` are followed by the name of the index */
+    if (parser->frame_pos > 0 &&
+        parser->frames[parser->frame_pos - 1].commas == 0) {
+        struct RangeFrame *frame = &parser->frames[parser->frame_pos - 1];
+
+        if (current->type != TYPE_IDENTIFIER) {
+            parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+            return false;
+        }
+
+        frame->name = current->name;
+        frame->name_len = current->name_len;
+        return true;
+    }
+
+    switch (current->type) {
+    case TYPE_INTEGER:
+        push_operand(parser, emit(parser, OPC_CONST, 0, 0,
+                                  (double)current->ivalue, current->offset));
+        return true;
+    case TYPE_DECIMAL:
+        push_operand(parser, emit(parser, OPC_CONST, 0, 0, current->fvalue,
+                                  current->offset));
+        return true;
+    case TYPE_IDENTIFIER: {
+        const int frame = find_index(parser, current->name, current->name_len);
+        if (frame >= 0) {
+            push_operand(parser, emit(parser, OPC_INDEX,
+                                      parser->frames[frame].depth, 0, 0,
+                                      current->offset));
+            return true;
+        }
+
+        if (parser->program->var_count == 0)
+            parser->var_offset = current->offset;
+
+        unsigned int var =
+            intern_variable(parser, current->name, current->name_len);
+
+        if (parser->keep_offsets && emit_target(parser) != parser->program) {
+            struct VarRead *reads = arena_grow(
+                parser->arena, parser->var_reads, &parser->var_read_capacity,
+                parser->var_read_count, sizeof(struct VarRead));
+            if (reads == NULL) {
+                parser_error(parser, MC3_OUT_OF_MEMORY, current->offset);
+                return false;
+            }
+            parser->var_reads = reads;
+            reads[parser->var_read_count++] =
+                (struct VarRead){var, current->offset};
+        }
+        push_operand(parser, emit(parser, OPC_VAR, var, 0, 0,
+                                  current->offset));
+        return true;
+    }
+    case TYPE_CONSTANT:
+        push_operand(parser, emit(parser, OPC_CONST, 0, 0,
+                                  KEYWORDS[current->keyword].value,
+                                  current->offset));
+        return true;
+    case TYPE_FUNCTION:
+        parser->function = current->keyword;
+        parser->function_offset = current->offset;
+        return false;
+    case PAR_LEFT:
+        push_operator(parser, PAR_LEFT, parser->function,
+                      (parser->function != KW_NONE) ? parser->function_offset
+                                                    : current->offset);
+        if (parser->function == KW_SUM || parser->function == KW_PROD)
+            push_frame(parser);
+        parser->function = KW_NONE;
+        return false;
+    case BRACKET_LEFT:
+        push_operator(parser, BRACKET_LEFT, KW_NONE, current->offset);
+        return false;
+    case PAR_RIGHT:
+        /* when the innermost group is a parenthesis, as in `()` or
+           `(2 + )`, it is the operand which is missing */
+        for (unsigned int i = parser->op_pos; i-- > 0;) {
+            if (parser->operators[i].type == BRACKET_LEFT)
+                break;
+            if (parser->operators[i].type == PAR_LEFT) {
+                parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+                return false;
+            }
+        }
+        parser_error(parser, MC3_UNBALANCED_PARENTHESES, current->offset);
+        return false;
+    default:
+        /* an operator or the end of the expression where a factor (num, var
+           or par) was expected */
+        parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+        return false;
+    }
+}
+
+/**
+ * @brief reads what follows an operand: an operator, a closing parenthesis or
+ * bracket, a separator or the end of the expression.
+ *
+ * @return true if the expression is complete.
+ */
+bool parse_operator(struct Parser *parser, struct Token *current) {
+    /* the name of an index is followed by a comma */
+    if (parser->frame_pos > 0 &&
+        parser->frames[parser->frame_pos - 1].commas == 0 &&
+        current->type != SEP_COMMA) {
+        parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+        return false;
+    }
+
+    switch (current->type) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MULT:
+    case OP_DIV:
+    case OP_EXP:
+    case OP_MATMUL:
+        reduce(parser, precedence(current->type));
+        push_operator(parser, current->type, KW_NONE, current->offset);
+        return false;
+    case PAR_RIGHT:
+        reduce(parser, 0);
+        if (parser->op_pos == 0 ||
+            parser->operators[parser->op_pos - 1].type != PAR_LEFT) {
+            parser_error(parser, MC3_UNBALANCED_PARENTHESES, current->offset);
+            return false;
+        }
+
+        /* the parenthesis of a function call applies the function */
+        const struct PendingOperator open = parser->operators[--parser->op_pos];
+        if (open.function == KW_SUM || open.function == KW_PROD) {
+            close_range(parser, &open, current->offset);
+        } else if (open.function == KW_DOT) {
+            if (parser->operand_pos - open.first_operand != 2) {
+                parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+                return false;
+            }
+
+            const enum OpCode op = reads_matrices(parser) ? OPC_DOT : OPC_MULT;
+            const unsigned int rhs = parser->operands[--parser->operand_pos];
+            const unsigned int lhs = parser->operands[--parser->operand_pos];
+            push_operand(parser, emit(parser, op, lhs, rhs, 0, open.offset));
+        } else if (open.function != KW_NONE) {
+            const enum OpCode op = keyword_to_opcode(open.function);
+            const unsigned int arg = parser->operands[--parser->operand_pos];
+            push_operand(parser, emit(parser, op, arg, arg, 0, open.offset));
+        }
+        return false;
+    case BRACKET_RIGHT: {
+        reduce(parser, 0);
+        if (parser->op_pos == 0 ||
+            parser->operators[parser->op_pos - 1].type != BRACKET_LEFT) {
+            parser_error(parser, MC3_UNBALANCED_PARENTHESES, current->offset);
+            return false;
+        }
+
+        struct PendingOperator open = parser->operators[--parser->op_pos];
+        end_row(parser, &open, current->offset);
+        if (parser->error == MC3_NO_ERROR)
+            close_matrix(parser, &open);
+        return false;
+    }
+    case SEP_COMMA: {
+        reduce(parser, 0);
+
+        /* commas separate the elements of a row, the two arguments of dot,
+           and the arguments of sum and prod */
+        const struct PendingOperator *open =
+            (parser->op_pos > 0) ? &parser->operators[parser->op_pos - 1]
+                                 : NULL;
+        const enum Keyword function = open ? open->function : KW_NONE;
+
+        if (open != NULL && open->type == BRACKET_LEFT)
+            return false;
+        if (function == KW_DOT &&
+            parser->operand_pos - open->first_operand == 1)
+            return false;
+        if ((function != KW_SUM && function != KW_PROD) ||
+            parser->frames[parser->frame_pos - 1].commas == 3) {
+            parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+            return false;
+        }
+
+        parser->frames[parser->frame_pos - 1].commas++;
+        parser->frames[parser->frame_pos - 1].body_offset = current->offset;
+        return false;
+    }
+    case SEP_SEMICOLON:
+        reduce(parser, 0);
+
+        /* semicolons only separate the rows of a matrix literal */
+        if (parser->op_pos == 0 ||
+            parser->operators[parser->op_pos - 1].type != BRACKET_LEFT) {
+            parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+            return false;
+        }
+
+        end_row(parser, &parser->operators[parser->op_pos - 1],
+                current->offset);
+        return false;
+    case TYPE_EMPTY:
+        reduce(parser, 0);
+        if (parser->op_pos != 0)
+            parser_error(parser, MC3_UNBALANCED_PARENTHESES, current->offset);
+        return true;
+    default:
+        /* two operands in a row, such as `2 3` or `2x` */
+        parser_error(parser, MC3_UNEXPECTED_TOKEN, current->offset);
+        return false;
+    }
+}
+
+/**
+ * @brief tokenizes and parses the string given to `parser` in one pass,
+ * lowering it into the program.
+ *
+ * @returns MC3_NO_ERROR, or the first error found.
+ */
+MC3_ErrorCode parse(struct Parser *parser) {
+    struct Token current;
+    bool expect_operand = true;
+    STATS(const uint64_t start = stats_now();
+          unsigned int tokens = 0, depth = 0, max_depth = 0;)
+
+    for (;;) {
+        MC3_ErrorCode lex_error = MC3_NO_ERROR;
+
+        if (parser->tokens == NULL) {
+            lex_error = next_token(&parser->lexer, &current);
+        } else if ((current = *parser->tokens).type == TYPE_EMPTY) {
+            lex_error = parser->tokens_error;
+        } else {
+            parser->tokens++;
+        }
+
+        if (lex_error != MC3_NO_ERROR) {
+            parser_error(parser, lex_error, current.offset);
+            break;
+        }
+
+        STATS(tokens += (current.type != TYPE_EMPTY);
+              depth += (current.type == PAR_LEFT);
+              depth -= (current.type == PAR_RIGHT && depth > 0);
+              max_depth = (depth > max_depth) ? depth : max_depth;)
+
+        if (expect_operand) {
+            expect_operand = !parse_operand(parser, &current);
+        } else if (parse_operator(parser, &current)) {
+            break;
+        } else {
+            /* after an operator another operand is expected, after a closing
+               parenthesis or bracket another operator */
+            expect_operand = (current.type != PAR_RIGHT &&
+                              current.type != BRACKET_RIGHT);
+        }
+
+        if (parser->error != MC3_NO_ERROR)
+            break;
+    }
+
+    if (parser->error == MC3_NO_ERROR) {
+        parser->program->result = parser->operands[0];
+        link_ranges(parser->program);
+    }
+
+    /* lexing is interleaved with parsing, and timing it apart would read the
+       clock twice per token, so it counts as parsing */
+    STATS(stats_phase(MC3_PHASE_PARSE, stats_now() - start, 1);
+          stats_expression(tokens, max_depth);)
+    return parser->error;
+}
+
+/* ===== Range Functions =====*/
+
+/*
+ * A sum or product runs its body once per index, from the first index up to
+ * the last in steps of one. Terms are added in chunks of RANGE_CHUNK_TERMS
+ * with compensated summation, and the chunks are then added pairwise in a
+ * fixed order, so the result depends only on the range and not on how many
+ * threads shared the chunks. Sums of a polynomial in the index, and products
+ * of a body which does not depend on it, skip the loop altogether.
+ */
+
+/* most terms a range may have, so every index is exactly an integer step from
+   the first */
+#define MAX_RANGE_TERMS 0x1p53
+
+/* terms added one after the other before chunks are added pairwise */
+#define RANGE_CHUNK_TERMS 16384
+
+/* fewest terms split across threads */
+#define RANGE_PARALLEL_TERMS (8 * RANGE_CHUNK_TERMS)
+
+/* chunks whose partial results are kept on the stack */
+#define RANGE_STACK_CHUNKS 16
+
+/* threads the chunks of a range evaluated on this thread may be shared by,
+   counting this one: 0 for every thread of the range pool, 1 to stay on this
+   thread. See MC3_set_range_threads. */
+static _Thread_local unsigned int range_threads = 0;
+
+/* set while a thread adds the chunks of a range, whose nested ranges then
+   stay on that thread */
+static _Thread_local bool in_range = false;
+
+static double run_code(const MC3_Program *prog, const double *vars,
+                       double *regs);
+
+/**
+ * @brief number of terms of a range from `from` to `to`: zero if `to` is below
+ * `from`, NaN if either is NaN or there are too many to count.
+ */
+static double range_terms(double from, double to) {
+    if (isnan(from) || isnan(to) || isinf(from))
+        return NAN;
+    if (to < from)
+        return 0.0;
+
+    const double terms = floor(to - from) + 1.0;
+    return (terms <= MAX_RANGE_TERMS) ? terms : NAN;
+}
+
+/**
+ * @brief sum of the polynomial with the given coefficients, lowest degree
+ * first, over the indexes from `from` to `to`, or for a product the constant
+ * `coefficients[0]` raised to the number of indexes.
+ */
+static double closed_form(enum OpCode op, int degree,
+                          const double *coefficients, double from, double to) {
+    const double terms = range_terms(from, to);
+
+    if (isnan(terms))
+        return NAN;
+    if (terms == 0.0)
+        return (op == OPC_PROD) ? 1.0 : 0.0;
+    if (op == OPC_PROD)
+        return pow(coefficients[0], terms);
+
+    /* shifted so the polynomial is in k = index - from, summed over k from 0
+       to m by the sums of the powers of k */
+    double shifted[MAX_CLOSED_FORM_DEGREE + 1];
+    memcpy(shifted, coefficients, (degree + 1) * sizeof(double));
+
+    for (int i = 0; i < degree; i++) {
+        for (int j = degree - 1; j >= i; j--)
+            shifted[j] += from * shifted[j + 1];
+    }
+
+    const double m = terms - 1.0;
+    const double s1 = m * (m + 1.0) / 2.0;
+    const double s2 = s1 * (2.0 * m + 1.0) / 3.0;
+    const double powers[MAX_CLOSED_FORM_DEGREE + 1] = {
+        terms,
+        s1,
+        s2,
+        s1 * s1,
+        s2 * (3.0 * m * m + 3.0 * m - 1.0) / 5.0,
+        s1 * s1 * (2.0 * m * m + 2.0 * m - 1.0) / 3.0,
+    };
+
+    double sum = 0.0;
+    for (int j = degree; j >= 0; j--)
+        sum += shifted[j] * powers[j];
+
+    return sum;
+}
+
+/**
+ * @brief adds the partial sum `hi + lo` of a chunk, or of several, to the one
+ * before it.
+ */
+static void add_partial(double *hi, double *lo, double next_hi,
+                        double next_lo) {
+    const double sum = *hi + next_hi;
+
+    if (!isfinite(sum)) {
+        *hi = sum;
+        *lo = 0.0;
+        return;
+    }
+
+    const double rounded = sum - *hi;
+    const double error = (*hi - (sum - rounded)) + (next_hi - rounded);
+    const double tail = error + *lo + next_lo;
+
+    *hi = sum + tail;
+    *lo = tail - (*hi - sum);
+}
+
+/* A range whose terms are being added, shared by the threads adding it. */
+struct RangeTask {
+    const struct Range *range;
+    enum OpCode op;
+    double from;
+    double terms;
+    /* values of the variables and indexes the body reads, the index of the
+       range going in `slot` */
+    const double *outer;
+    unsigned int slot;
+    uint64_t chunk_count;
+    /* next chunk no thread has taken yet */
+    atomic_uint_fast64_t next_chunk;
+    /* sum and error of every chunk, or product and zero */
+    double *partial;
+};
+
+/**
+ * @brief adds the terms of chunks of `task` until none are left. A thread
+ * which cannot allocate its registers takes no chunk.
+ */
+static void *range_worker_main(void *arg) {
+    struct RangeTask *task = arg;
+    const MC3_Program *body = &task->range->body;
+    double *values = malloc((task->slot + 1 + body->length) * sizeof(double));
+
+    if (values == NULL)
+        return NULL;
+
+    double *regs = &values[task->slot + 1];
+    const bool was_in_range = in_range;
+    in_range = true;
+
+    if (task->slot > 0)
+        memcpy(values, task->outer, task->slot * sizeof(double));
+
+    uint64_t chunk;
+    while ((chunk = atomic_fetch_add(&task->next_chunk, 1)) <
+           task->chunk_count) {
+        const uint64_t first = chunk * RANGE_CHUNK_TERMS;
+        uint64_t last = first + RANGE_CHUNK_TERMS;
+        double sum = (task->op == OPC_PROD) ? 1.0 : 0.0;
+        double error = 0.0;
+
+        if (last > (uint64_t)task->terms)
+            last = (uint64_t)task->terms;
+
+        for (uint64_t k = first; k < last; k++) {
+            values[task->slot] = task->from + (double)k;
+            const double term = run_code(body, values, regs);
+
+            if (task->op == OPC_PROD) {
+                sum *= term;
+                continue;
+            }
+
+            const double next = sum + term;
+            error += (fabs(sum) >= fabs(term)) ? (sum - next) + term
+                                               : (term - next) + sum;
+            sum = next;
+        }
+
+        task->partial[2 * chunk] = sum;
+        task->partial[2 * chunk + 1] = isfinite(sum) ? error : 0.0;
+    }
+
+    in_range = was_in_range;
+    free(values);
+    return NULL;
+}
+
+/**
+ * @brief combines the partial results of the chunks of `task` pairwise, in an
+ * order fixed by the number of chunks alone.
+ */
+static double merge_chunks(const struct RangeTask *task) {
+    /* partial results of 2^level chunks each, like the bits of a counter */
+    double hi[64];
+    double lo[64];
+    unsigned int level[64];
+    unsigned int count = 0;
+
+    for (uint64_t chunk = 0; chunk < task->chunk_count; chunk++) {
+        hi[count] = task->partial[2 * chunk];
+        lo[count] = task->partial[2 * chunk + 1];
+        level[count++] = 0;
+
+        while (count > 1 && level[count - 2] == level[count - 1]) {
+            count--;
+            if (task->op == OPC_PROD)
+                hi[count - 1] *= hi[count];
+            else
+                add_partial(&hi[count - 1], &lo[count - 1], hi[count],
+                            lo[count]);
+            level[count - 1]++;
+        }
+    }
+
+    while (count > 1) {
+        count--;
+        if (task->op == OPC_PROD)
+            hi[count - 1] *= hi[count];
+        else
+            add_partial(&hi[count - 1], &lo[count - 1], hi[count], lo[count]);
+    }
+
+    return (task->op == OPC_PROD || !isfinite(hi[0])) ? hi[0] : hi[0] + lo[0];
+}
+
+/* Threads shared by the ranges of every thread, one per processor besides
+   the thread evaluating a range, or as many as MC3_set_range_threads asked
+   for. They are started the first time a range needs them and kept until the
+   process exits. They help with one range at a
+   time; a range evaluated while they are busy is added by its own thread,
+   which gives the same result. */
+static struct {
+    pthread_mutex_t lock;
+    /* signalled when a range is handed out */
+    pthread_cond_t work_ready;
+    /* signalled when the last thread leaves a range */
+    pthread_cond_t idle;
+    /* threads started */
+    unsigned int threads;
+    /* range being shared, or NULL */
+    struct RangeTask *task;
+    /* threads which took `task`, and the most which may */
+    unsigned int helpers;
+    unsigned int max_helpers;
+    /* threads still adding chunks of `task` */
+    unsigned int active;
+    /* incremented for every range handed out */
+    unsigned long round;
+} range_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static void *range_pool_main(void *arg) {
+    unsigned long seen_round = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&range_pool.lock);
+    for (;;) {
+        while (range_pool.round == seen_round)
+            pthread_cond_wait(&range_pool.work_ready, &range_pool.lock);
+        seen_round = range_pool.round;
+
+        /* the range may already be done, or have enough threads */
+        struct RangeTask *task = range_pool.task;
+        if (task == NULL || range_pool.helpers == range_pool.max_helpers)
+            continue;
+        range_pool.helpers++;
+        range_pool.active++;
+        pthread_mutex_unlock(&range_pool.lock);
+
+        range_worker_main(task);
+
+        pthread_mutex_lock(&range_pool.lock);
+        if (--range_pool.active == 0)
+            pthread_cond_broadcast(&range_pool.idle);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief starts threads of the range pool until it has `count`.
+ *
+ * @return the number of threads of the pool, fewer than `count` if a thread
+ * could not be started.
+ */
+static unsigned int grow_range_pool(unsigned int count) {
+    pthread_attr_t attr;
+
+    pthread_mutex_lock(&range_pool.lock);
+    if (range_pool.threads < count && pthread_attr_init(&attr) == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        /* ranges use the threads which did start */
+        while (range_pool.threads < count) {
+            pthread_t id;
+            if (pthread_create(&id, &attr, range_pool_main, NULL) != 0)
+                break;
+            range_pool.threads++;
+        }
+
+        pthread_attr_destroy(&attr);
+    }
+    count = range_pool.threads;
+    pthread_mutex_unlock(&range_pool.lock);
+
+    return count;
+}
+
+/**
+ * @brief number of pool threads which may help with a range of `chunks`
+ * chunks and `terms` terms, besides the thread evaluating it.
+ */
+static unsigned int range_helper_count(uint64_t chunks, double terms) {
+    if (in_range || range_threads == 1 || terms < RANGE_PARALLEL_TERMS)
+        return 0;
+
+    long threads = range_threads;
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 2)
+        return 0;
+
+    const uint64_t helpers = grow_range_pool(threads - 1);
+    return (helpers < chunks) ? (unsigned int)helpers
+                              : (unsigned int)(chunks - 1);
+}
+
+/**
+ * @brief Sets how many threads the chunks of a large sum or product
+ * evaluated on the calling thread may be shared by, counting the calling
+ * thread: 0 for one per processor, which is the default, and 1 to evaluate
+ * them on the calling thread alone. The other threads come from a pool the
+ * library keeps, so no thread is started per evaluation. Threads which
+ * already evaluate expressions in parallel, like the workers of a sheet, keep
+ * ranges to themselves with 1.
+ */
+void MC3_set_range_threads(unsigned int threads) { range_threads = threads; }
+
+/**
+ * @brief evaluates the OPC_SUM or OPC_PROD instruction `instr` of `prog`,
+ * whose range goes from `from` to `to`, for the variables and indexes in
+ * `vars`. An empty sum is 0 and an empty product 1.
+ *
+ * @return the value, or NaN if a bound is NaN or out of memory.
+ */
+static double evaluate_range(const MC3_Program *prog, const struct Instr *instr,
+                             double from, double to, const double *vars) {
+    const struct Range *range = &prog->ranges[(unsigned int)instr->value];
+    const double terms = range_terms(from, to);
+
+    if (isnan(terms))
+        return NAN;
+    if (terms == 0.0)
+        return (instr->op == OPC_PROD) ? 1.0 : 0.0;
+
+    struct RangeTask task = {
+        .range = range,
+        .op = instr->op,
+        .from = from,
+        .terms = terms,
+        .outer = vars,
+        .slot = prog->var_count + range->depth,
+        .chunk_count = ((uint64_t)terms + RANGE_CHUNK_TERMS - 1) /
+                       RANGE_CHUNK_TERMS,
+    };
+
+    if (range->degree >= 0) {
+        /* the coefficients do not depend on the index, one run gives them */
+        const MC3_Program *body = &range->body;
+        double *values =
+            malloc((task.slot + 1 + body->length) * sizeof(double));
+        double coefficients[MAX_CLOSED_FORM_DEGREE + 1];
+
+        if (values == NULL)
+            return NAN;
+
+        if (task.slot > 0)
+            memcpy(values, vars, task.slot * sizeof(double));
+        values[task.slot] = from;
+        run_code(body, values, &values[task.slot + 1]);
+
+        for (int p = 0; p <= range->degree; p++) {
+            const unsigned int reg = range->coefficients[p];
+            coefficients[p] =
+                (reg == NO_COEFFICIENT) ? 0.0 : values[task.slot + 1 + reg];
+        }
+
+        free(values);
+        return closed_form(instr->op, range->degree, coefficients, from, to);
+    }
+
+    double stack_partial[2 * RANGE_STACK_CHUNKS];
+    task.partial = stack_partial;
+    if (task.chunk_count > RANGE_STACK_CHUNKS) {
+        task.partial = malloc(2 * task.chunk_count * sizeof(double));
+        if (task.partial == NULL)
+            return NAN;
+    }
+
+    const unsigned int helpers = range_helper_count(task.chunk_count, terms);
+    bool shared = false;
+
+    atomic_init(&task.next_chunk, 0);
+
+    if (helpers > 0) {
+        pthread_mutex_lock(&range_pool.lock);
+        shared = range_pool.task == NULL && range_pool.active == 0;
+        if (shared) {
+            range_pool.task = &task;
+            range_pool.helpers = 0;
+            range_pool.max_helpers = helpers;
+            range_pool.round++;
+            pthread_cond_broadcast(&range_pool.work_ready);
+        }
+        pthread_mutex_unlock(&range_pool.lock);
+    }
+
+    /* this thread takes chunks too, all of them if the pool is busy */
+    range_worker_main(&task);
+
+    if (shared) {
+        pthread_mutex_lock(&range_pool.lock);
+        range_pool.task = NULL;
+        while (range_pool.active > 0)
+            pthread_cond_wait(&range_pool.idle, &range_pool.lock);
+        pthread_mutex_unlock(&range_pool.lock);
+    }
+
+    /* every chunk was taken, by a thread which then added it */
+    const double result = (atomic_load(&task.next_chunk) >= task.chunk_count)
+                              ? merge_chunks(&task)
+                              : NAN;
+
+    if (task.partial != stack_partial)
+        free(task.partial);
+    return result;
+}
+
+/* ===== Optimization Functions =====*/
+
+/* largest integer exponent `^` is rewritten into multiplications for. x * x
+   is correctly rounded, but every further multiplication rounds again, and
+   x ^ 13 as a chain is already 8 ulp away from pow. */
+#define MAX_UNROLLED_EXPONENT 2
+
+/* marks an empty slot of the node table of an optimizer */
+#define NO_NODE UINT_MAX
+
+/* Rewrites a parsed program into an equivalent, cheaper one. The rewritten
+   instructions are appended to `code`, and `map` gives the register of the
+   rewritten program that holds the value of each original register. */
+struct Optimizer {
+    struct Arena *arena;
+    /* ranges of the program */
+    const struct Range *ranges;
+    struct Instr *code;
+    unsigned int length;
+    unsigned int capacity;
+    unsigned int *map;
+    /* Registers of `code`, an open addressing table keyed by their
+       instruction. An instruction identical to one already emitted reuses its
+       register, so repeated subexpressions are computed once. */
+    unsigned int *nodes;
+    /* number of slots in `nodes`, a power of two */
+    unsigned int node_slots;
+    /* number of instructions other than constants which reused a register */
+    unsigned int deduplicated;
+    bool out_of_memory;
+};
+
+static bool same_instr(const struct Instr *a, const struct Instr *b) {
+    /* constants are compared by their bits, so 0 and -0 stay apart */
+    return a->op == b->op && a->lhs == b->lhs && a->rhs == b->rhs &&
+           memcmp(&a->value, &b->value, sizeof(double)) == 0;
+}
+
+static uint64_t mix_hash(uint64_t hash, uint64_t value) {
+    /* the finalizer of splitmix64 */
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * @return the slot of `nodes` holding the register of `instr`, or the empty
+ * slot it belongs in.
+ */
+static unsigned int *find_node(const struct Optimizer *opt,
+                               const struct Instr *instr) {
+    const unsigned int mask = opt->node_slots - 1;
+    uint64_t bits;
+
+    memcpy(&bits, &instr->value, sizeof(bits));
+    const uint64_t hash =
+        mix_hash(mix_hash(instr->op, (uint64_t)instr->lhs << 32 | instr->rhs),
+                 bits);
+
+    for (unsigned int slot = hash & mask;; slot = (slot + 1) & mask) {
+        const unsigned int reg = opt->nodes[slot];
+
+        if (reg == NO_NODE || same_instr(&opt->code[reg], instr))
+            return &opt->nodes[slot];
+    }
+}
+
+/**
+ * @brief grows `nodes` so it stays at most half full with one more
+ * instruction, entering the instructions already in `code`.
+ */
+static bool reserve_nodes(struct Optimizer *opt) {
+    if ((opt->length + 1) * 2 <= opt->node_slots)
+        return true;
+
+    unsigned int slots = opt->node_slots ? opt->node_slots : 64;
+    while (slots < (opt->length + 1) * 2)
+        slots *= 2;
+
+    unsigned int *nodes = arena_alloc(opt->arena, slots * sizeof(unsigned int));
+    if (nodes == NULL)
+        return false;
+
+    memset(nodes, 0xff, slots * sizeof(unsigned int));
+    opt->nodes = nodes;
+    opt->node_slots = slots;
+
+    for (unsigned int i = 0; i < opt->length; i++) {
+        unsigned int *slot = find_node(opt, &opt->code[i]);
+        if (*slot == NO_NODE)
+            *slot = i;
+    }
+
+    return true;
+}
+
+/**
+ * @brief emits an instruction, or finds the register of an identical one
+ * emitted before.
+ *
+ * @return the register holding its value.
+ */
+static unsigned int opt_emit(struct Optimizer *opt, enum OpCode op,
+                             unsigned int lhs, unsigned int rhs, double value) {
+    const struct Instr instr = {
+        .op = op, .lhs = lhs, .rhs = rhs, .value = value};
+
+    if (!reserve_nodes(opt)) {
+        opt->out_of_memory = true;
+        return 0;
+    }
+
+    unsigned int *slot = find_node(opt, &instr);
+    if (*slot != NO_NODE) {
+        opt->deduplicated += (op != OPC_CONST);
+        return *slot;
+    }
+
+    struct Instr *code = arena_grow(opt->arena, opt->code, &opt->capacity,
+                                    opt->length, sizeof(struct Instr));
+
+    if (code == NULL) {
+        opt->out_of_memory = true;
+        return 0;
+    }
+    opt->code = code;
+    opt->code[opt->length] = instr;
+
+    *slot = opt->length;
+    return opt->length++;
+}
+
+static bool opt_is_const(const struct Optimizer *opt, unsigned int reg) {
+    return opt->code[reg].op == OPC_CONST;
+}
+
+/**
+ * @brief applies an operator exactly as run_program does, so folded
+ * constants are bit-identical to evaluated ones. Functions ignore `rhs`.
+ */
+static double apply_operator(enum OpCode op, double lhs, double rhs) {
+    switch (op) {
+    case OPC_ADD:
+        return lhs + rhs;
+    case OPC_SUB:
+        return lhs - rhs;
+    case OPC_MULT:
+        return lhs * rhs;
+    case OPC_DIV:
+        return lhs / rhs;
+    case OPC_SIN:
+        return sin(lhs);
+    case OPC_COS:
+        return cos(lhs);
+    case OPC_TAN:
+        return tan(lhs);
+    case OPC_LOG:
+        return log10(lhs);
+    case OPC_LN:
+        return log(lhs);
+    default:
+        return pow(lhs, rhs);
+    }
+}
+
+/**
+ * @brief emits `base ^ exponent` as multiplications, squaring `base` for
+ * every bit of the exponent.
+ *
+ * @return the register holding the power.
+ */
+static unsigned int emit_power(struct Optimizer *opt, unsigned int base,
+                               long exponent) {
+    const bool reciprocal = exponent < 0;
+    unsigned long bits = reciprocal ? -exponent : exponent;
+    unsigned int result = 0;
+    bool have_result = false;
+
+    if (bits == 0)
+        return opt_emit(opt, OPC_CONST, 0, 0, 1.0);
+
+    while (bits) {
+        if (bits & 1) {
+            result = have_result ? opt_emit(opt, OPC_MULT, result, base, 0)
+                                 : base;
+            have_result = true;
+        }
+
+        bits >>= 1;
+        if (bits)
+            base = opt_emit(opt, OPC_MULT, base, base, 0);
+    }
+
+    if (reciprocal) {
+        unsigned int one = opt_emit(opt, OPC_CONST, 0, 0, 1.0);
+        result = opt_emit(opt, OPC_DIV, one, result, 0);
+    }
+
+    return result;
+}
+
+/**
+ * @brief checks whether `value` is a power of two whose reciprocal is also a
+ * normal number, so multiplying by the reciprocal rounds exactly like
+ * dividing by `value`.
+ */
+static bool has_exact_reciprocal(double value) {
+    int exponent;
+    const double mantissa = frexp(value, &exponent);
+
+    return (fabs(mantissa) == 0.5) && isnormal(value) && isnormal(1.0 / value);
+}
+
+/**
+ * @brief lowers a sum or product, folding it into a constant if its bounds
+ * are constant and it has a closed form with constant coefficients.
+ *
+ * @return the register holding its value.
+ */
+static unsigned int optimize_range(struct Optimizer *opt,
+                                   const struct Instr *instr, unsigned int from,
+                                   unsigned int to) {
+    const struct Range *range = &opt->ranges[(unsigned int)instr->value];
+    double coefficients[MAX_CLOSED_FORM_DEGREE + 1];
+    bool constant = range->degree >= 0 && opt_is_const(opt, from) &&
+                    opt_is_const(opt, to);
+
+    for (int p = 0; constant && p <= range->degree; p++) {
+        const unsigned int reg = range->coefficients[p];
+
+        if (reg == NO_COEFFICIENT)
+            coefficients[p] = 0.0;
+        else if (range->body.code[reg].op == OPC_CONST)
+            coefficients[p] = range->body.code[reg].value;
+        else
+            constant = false;
+    }
+
+    if (constant) {
+        const double value =
+            closed_form(range->op, range->degree, coefficients,
+                        opt->code[from].value, opt->code[to].value);
+        return opt_emit(opt, OPC_CONST, 0, 0, value);
+    }
+
+    return opt_emit(opt, instr->op, from, to, instr->value);
+}
+
+/**
+ * @brief lowers one instruction of the original program into the optimized
+ * program, given the already mapped registers of its operands.
+ *
+ * @return the register holding its value.
+ */
+static unsigned int optimize_instr(struct Optimizer *opt,
+                                   const struct Instr *instr, unsigned int lhs,
+                                   unsigned int rhs) {
+    switch (instr->op) {
+    case OPC_CONST:
+    case OPC_VAR:
+    case OPC_INDEX:
+        return opt_emit(opt, instr->op, instr->lhs, 0, instr->value);
+    case OPC_SUM:
+    case OPC_PROD:
+        return optimize_range(opt, instr, lhs, rhs);
+    default:
+        break;
+    }
+
+    if (opt_is_const(opt, lhs) && opt_is_const(opt, rhs)) {
+        const double value = apply_operator(instr->op, opt->code[lhs].value,
+                                            opt->code[rhs].value);
+        return opt_emit(opt, OPC_CONST, 0, 0, value);
+    }
+
+    if (instr->op == OPC_EXP && opt_is_const(opt, rhs)) {
+        const double exponent = opt->code[rhs].value;
+
+        if (exponent == floor(exponent) && exponent >= 0 &&
+            exponent <= MAX_UNROLLED_EXPONENT)
+            return emit_power(opt, lhs, (long)exponent);
+    }
+
+    if (instr->op == OPC_DIV && opt_is_const(opt, rhs) &&
+        has_exact_reciprocal(opt->code[rhs].value)) {
+        unsigned int reciprocal =
+            opt_emit(opt, OPC_CONST, 0, 0, 1.0 / opt->code[rhs].value);
+        return opt_emit(opt, OPC_MULT, lhs, reciprocal, 0);
+    }
+
+    return opt_emit(opt, instr->op, lhs, rhs, 0);
+}
+
+/**
+ * @brief drops the instructions of `prog` the result does not depend on,
+ * renumbering the rest.
+ */
+static bool remove_dead_code(struct MC3_Program *prog, struct Arena *arena) {
+    bool *live = arena_alloc(arena, prog->length * sizeof(bool));
+    unsigned int *renumber =
+        arena_alloc(arena, prog->length * sizeof(unsigned int));
+
+    if (live == NULL || renumber == NULL)
+        return false;
+
+    memset(live, 0, prog->length * sizeof(bool));
+    live[prog->result] = true;
+
+    for (unsigned int i = prog->length; i-- > 0;) {
+        const struct Instr *instr = &prog->code[i];
+
+        if (live[i] && has_operands(instr->op)) {
+            live[instr->lhs] = true;
+            live[instr->rhs] = true;
+        }
+    }
+
+    unsigned int length = 0;
+    for (unsigned int i = 0; i < prog->length; i++) {
+        if (!live[i])
+            continue;
+
+        struct Instr instr = prog->code[i];
+        if (has_operands(instr.op)) {
+            instr.lhs = renumber[instr.lhs];
+            instr.rhs = renumber[instr.rhs];
+        }
+
+        renumber[i] = length;
+        prog->code[length++] = instr;
+    }
+
+    prog->result = renumber[prog->result];
+    prog->length = length;
+    return true;
+}
+
+/**
+ * @brief optimizes the instructions of `prog` alone, the ranges it uses
+ * having been optimized already.
+ */
+static MC3_ErrorCode optimize_code(struct MC3_Program *prog,
+                                   struct Arena *arena) {
+    struct Optimizer opt = {
+        .arena = arena,
+        .ranges = prog->ranges,
+        .map = arena_alloc(arena, prog->length * sizeof(unsigned int)),
+    };
+
+    if (opt.map == NULL)
+        return MC3_OUT_OF_MEMORY;
+
+    for (unsigned int i = 0; i < prog->length && !opt.out_of_memory; i++) {
+        const struct Instr *instr = &prog->code[i];
+        const bool operands = has_operands(instr->op);
+
+        opt.map[i] = optimize_instr(&opt, instr,
+                                    operands ? opt.map[instr->lhs] : 0,
+                                    operands ? opt.map[instr->rhs] : 0);
+    }
+
+    if (opt.out_of_memory)
+        return MC3_OUT_OF_MEMORY;
+
+    prog->code = opt.code;
+    prog->length = opt.length;
+    prog->capacity = opt.capacity;
+    prog->result = opt.map[prog->result];
+    prog->deduplicated += opt.deduplicated;
+
+    return remove_dead_code(prog, arena) ? MC3_NO_ERROR : MC3_OUT_OF_MEMORY;
+}
+
+/* The body of a range as a polynomial in its index, each coefficient held in
+   a register of the body or NO_COEFFICIENT for zero. */
+struct Polynomial {
+    /* -1 if the register is not a polynomial of low enough degree */
+    int degree;
+    /* set if the register does not depend on the index at all, and is then
+       its own coefficient of degree 0 */
+    bool invariant;
+    unsigned int coefficients[MAX_CLOSED_FORM_DEGREE + 1];
+};
+
+/**
+ * @brief checks whether the body of `range`, or of a range inside it, reads
+ * the index of the range at `depth`.
+ */
+static bool reads_index(const struct Range *ranges, const struct Range *range,
+                        unsigned int depth) {
+    const MC3_Program *body = &range->body;
+
+    for (unsigned int i = 0; i < body->length; i++) {
+        const struct Instr *instr = &body->code[i];
+
+        if (instr->op == OPC_INDEX && instr->lhs == depth)
+            return true;
+        if ((instr->op == OPC_SUM || instr->op == OPC_PROD) &&
+            reads_index(ranges, &ranges[(unsigned int)instr->value], depth))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief emits `lhs op rhs` for coefficients, where NO_COEFFICIENT is zero,
+ * folding constants and multiplications by one.
+ */
+static unsigned int emit_coefficient(struct Optimizer *opt, enum OpCode op,
+                                     unsigned int lhs, unsigned int rhs) {
+    const bool is_zero[2] = {lhs == NO_COEFFICIENT, rhs == NO_COEFFICIENT};
+
+    switch (op) {
+    case OPC_ADD:
+        if (is_zero[0] || is_zero[1])
+            return is_zero[0] ? rhs : lhs;
+        break;
+    case OPC_SUB:
+        if (is_zero[1])
+            return lhs;
+        if (is_zero[0])
+            lhs = opt_emit(opt, OPC_CONST, 0, 0, 0.0);
+        break;
+    default:
+        /* multiplication, or division by a register which is not zero */
+        if (is_zero[0] || is_zero[1])
+            return NO_COEFFICIENT;
+        if (op == OPC_MULT && opt_is_const(opt, lhs) &&
+            opt->code[lhs].value == 1.0)
+            return rhs;
+        if (opt_is_const(opt, rhs) && opt->code[rhs].value == 1.0)
+            return lhs;
+        break;
+    }
+
+    if (opt_is_const(opt, lhs) && opt_is_const(opt, rhs)) {
+        const double value = apply_operator(op, opt->code[lhs].value,
+                                            opt->code[rhs].value);
+        return opt_emit(opt, OPC_CONST, 0, 0, value);
+    }
+
+    return opt_emit(opt, op, lhs, rhs, 0);
+}
+
+/**
+ * @brief emits the coefficients of the product of `lhs` and `rhs`, whose
+ * degrees add up to at most MAX_CLOSED_FORM_DEGREE.
+ */
+static struct Polynomial multiply_polynomials(struct Optimizer *opt,
+                                              const struct Polynomial *lhs,
+                                              const struct Polynomial *rhs) {
+    struct Polynomial poly = {.degree = lhs->degree + rhs->degree};
+
+    for (int p = 0; p <= MAX_CLOSED_FORM_DEGREE; p++)
+        poly.coefficients[p] = NO_COEFFICIENT;
+
+    for (int p = 0; p <= lhs->degree; p++) {
+        for (int q = 0; q <= rhs->degree; q++) {
+            const unsigned int product = emit_coefficient(
+                opt, OPC_MULT, lhs->coefficients[p], rhs->coefficients[q]);
+            poly.coefficients[p + q] = emit_coefficient(
+                opt, OPC_ADD, poly.coefficients[p + q], product);
+        }
+    }
+
+    return poly;
+}
+
+/**
+ * @brief finds the polynomial of the instruction `instr` of the body, from
+ * the polynomials of its operands. `one` is the register holding 1 once one
+ * is needed, or NO_COEFFICIENT.
+ */
+static struct Polynomial polynomial_of(struct Optimizer *opt,
+                                       const struct Range *range,
+                                       const struct Instr *instr,
+                                       const struct Polynomial *lhs,
+                                       const struct Polynomial *rhs,
+                                       unsigned int *one) {
+    struct Polynomial poly = {.degree = -1};
+
+    for (int p = 0; p <= MAX_CLOSED_FORM_DEGREE; p++)
+        poly.coefficients[p] = NO_COEFFICIENT;
+
+    switch (instr->op) {
+    case OPC_CONST:
+    case OPC_VAR:
+        poly.invariant = true;
+        return poly;
+    case OPC_INDEX:
+        if (instr->lhs == range->depth) {
+            if (*one == NO_COEFFICIENT)
+                *one = opt_emit(opt, OPC_CONST, 0, 0, 1.0);
+            poly.degree = 1;
+            poly.coefficients[1] = *one;
+        } else {
+            poly.invariant = true;
+        }
+        return poly;
+    case OPC_SUM:
+    case OPC_PROD:
+        poly.invariant =
+            lhs->invariant && rhs->invariant &&
+            !reads_index(opt->ranges, &opt->ranges[(unsigned int)instr->value],
+                         range->depth);
+        return poly;
+    default:
+        break;
+    }
+
+    if (lhs->invariant && rhs->invariant) {
+        poly.invariant = true;
+        return poly;
+    }
+
+    if (lhs->degree < 0 || rhs->degree < 0)
+        return poly;
+
+    switch (instr->op) {
+    case OPC_ADD:
+    case OPC_SUB:
+        poly.degree = (lhs->degree > rhs->degree) ? lhs->degree : rhs->degree;
+        for (int p = 0; p <= poly.degree; p++)
+            poly.coefficients[p] =
+                emit_coefficient(opt, instr->op, lhs->coefficients[p],
+                                 rhs->coefficients[p]);
+        return poly;
+    case OPC_MULT:
+        if (lhs->degree + rhs->degree > MAX_CLOSED_FORM_DEGREE)
+            return poly;
+        return multiply_polynomials(opt, lhs, rhs);
+    case OPC_EXP: {
+        /* powers other than x ^ 2 are left to pow by the optimizer, so
+           i ^ 3 is only expanded here */
+        if (!opt_is_const(opt, instr->rhs))
+            return poly;
+        const double exponent = opt->code[instr->rhs].value;
+        if (exponent != floor(exponent) || exponent < 1 ||
+            lhs->degree * exponent > MAX_CLOSED_FORM_DEGREE)
+            return poly;
+
+        poly = *lhs;
+        for (int p = 1; p < (int)exponent; p++)
+            poly = multiply_polynomials(opt, &poly, lhs);
+        return poly;
+    }
+    case OPC_DIV:
+        if (!rhs->invariant)
+            return poly;
+
+        poly.degree = lhs->degree;
+        for (int p = 0; p <= poly.degree; p++)
+            poly.coefficients[p] = emit_coefficient(
+                opt, OPC_DIV, lhs->coefficients[p], rhs->coefficients[0]);
+        return poly;
+    default:
+        return poly;
+    }
+}
+
+/**
+ * @brief sets up `range` to be computed in closed form if its body, already
+ * optimized, is a polynomial in the index of low enough degree. The registers
+ * computing the coefficients are appended to the body.
+ *
+ * @return MC3_NO_ERROR, or MC3_OUT_OF_MEMORY.
+ */
+static MC3_ErrorCode find_closed_form(struct Range *range,
+                                      const struct Range *ranges,
+                                      struct Arena *arena) {
+    struct MC3_Program *body = &range->body;
+    const unsigned int length = body->length;
+    struct Polynomial *polys =
+        arena_alloc(arena, length * sizeof(struct Polynomial));
+    struct Optimizer opt = {
+        .arena = arena,
+        .ranges = ranges,
+        .code = body->code,
+        .length = body->length,
+        .capacity = body->capacity,
+    };
+    unsigned int one = NO_COEFFICIENT;
+
+    if (polys == NULL)
+        return MC3_OUT_OF_MEMORY;
+
+    for (unsigned int i = 0; i < length && !opt.out_of_memory; i++) {
+        const struct Instr instr = opt.code[i];
+        const bool operands = has_operands(instr.op);
+
+        polys[i] = polynomial_of(&opt, range, &instr,
+                                 operands ? &polys[instr.lhs] : NULL,
+                                 operands ? &polys[instr.rhs] : NULL, &one);
+
+        if (polys[i].invariant) {
+            polys[i].degree = 0;
+            polys[i].coefficients[0] = i;
+        }
+    }
+
+    if (opt.out_of_memory)
+        return MC3_OUT_OF_MEMORY;
+
+    const struct Polynomial *result = &polys[body->result];
+    if (result->degree < 0 || (range->op == OPC_PROD && result->degree > 0))
+        return MC3_NO_ERROR;
+
+    body->code = opt.code;
+    body->length = opt.length;
+    body->capacity = opt.capacity;
+    body->deduplicated += opt.deduplicated;
+    range->degree = result->degree;
+    memcpy(range->coefficients, result->coefficients,
+           sizeof(range->coefficients));
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief optimizes the bodies of the sums and products of `prog`, leaving its
+ * own instructions as they are.
+ *
+ * @return MC3_NO_ERROR, or MC3_OUT_OF_MEMORY.
+ */
+static MC3_ErrorCode optimize_ranges(struct MC3_Program *prog,
+                                     struct Arena *arena) {
+    /* inner ranges come first, so they are folded into the bodies using
+       them */
+    for (unsigned int i = 0; i < prog->range_count; i++) {
+        MC3_ErrorCode error = optimize_code(&prog->ranges[i].body, arena);
+        if (error == MC3_NO_ERROR)
+            error = find_closed_form(&prog->ranges[i], prog->ranges, arena);
+        if (error != MC3_NO_ERROR)
+            return error;
+    }
+
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief folds constant subtrees, rewrites x ^ 2 into x * x and divisions by
+ * powers of two into multiplications, and emits identical instructions only
+ * once, so a subexpression repeated in the expression is computed once.
+ * Instructions that are no longer needed are removed last. Every rewrite gives
+ * bit-identical results except x ^ 2: x * x is correctly rounded (within 0.5
+ * ulp), and pow may round it differently in the last bit. Other powers are left
+ * to pow. The bodies of sums and products are optimized first, and those which
+ * are polynomials in their index are set up to be summed in closed form, which
+ * rounds differently from adding the terms.
+ *
+ * @return MC3_NO_ERROR, or MC3_OUT_OF_MEMORY.
+ */
+MC3_ErrorCode optimize(struct MC3_Program *prog, struct Arena *arena) {
+    const MC3_ErrorCode error = optimize_ranges(prog, arena);
+    return (error == MC3_NO_ERROR) ? optimize_code(prog, arena) : error;
+}
+
+static const char *opcode_to_str(enum OpCode op) {
+    switch (op) {
+    case OPC_CONST:
+        return "const";
+    case OPC_VAR:
+        return "var";
+    case OPC_ADD:
+        return "add";
+    case OPC_SUB:
+        return "sub";
+    case OPC_MULT:
+        return "mult";
+    case OPC_DIV:
+        return "div";
+    case OPC_EXP:
+        return "exp";
+    case OPC_SIN:
+        return "sin";
+    case OPC_COS:
+        return "cos";
+    case OPC_TAN:
+        return "tan";
+    case OPC_LOG:
+        return "log";
+    case OPC_LN:
+        return "ln";
+    case OPC_INDEX:
+        return "index";
+    case OPC_SUM:
+        return "sum";
+    case OPC_PROD:
+        return "prod";
+    default:
+        return "?";
+    }
+}
+
+static void dump_code(const MC3_Program *prog, const char *indent,
+                      FILE *file) {
+    for (unsigned int i = 0; i < prog->length; i++) {
+        const struct Instr *instr = &prog->code[i];
+
+        fprintf(file, "%sr%u = %s", indent, i, opcode_to_str(instr->op));
+
+        if (instr->op == OPC_CONST) {
+            fprintf(file, " %.17g\n", instr->value);
+        } else if (instr->op == OPC_VAR) {
+            fprintf(file, " %s\n", prog->var_names[instr->lhs]);
+        } else if (instr->op == OPC_INDEX) {
+            fprintf(file, " %u\n", instr->lhs);
+        } else if (instr->op == OPC_SUM || instr->op == OPC_PROD) {
+            fprintf(file, " r%u r%u range %u\n", instr->lhs, instr->rhs,
+                    (unsigned int)instr->value);
+        } else if (instr->op >= OPC_SIN) {
+            fprintf(file, " r%u\n", instr->lhs);
+        } else {
+            fprintf(file, " r%u r%u\n", instr->lhs, instr->rhs);
+        }
+    }
+
+    fprintf(file, "%sresult r%u\n", indent, prog->result);
+}
+
+/**
+ * @brief counts the subexpressions of `prog`, its sums and products included,
+ * which were compiled into a register computed earlier instead of
+ * instructions of their own. Repeated constants are shared too, but not
+ * counted.
+ */
+unsigned int MC3_dedup_count(const MC3_Program *prog) {
+    unsigned int count = prog->deduplicated;
+
+    for (unsigned int i = 0; i < prog->range_count; i++)
+        count += prog->ranges[i].body.deduplicated;
+
+    return count;
+}
+
+/**
+ * @brief writes a listing of `prog`, one instruction per line, to `file`,
+ * followed by the number of deduplicated subexpressions if there are any.
+ * The bodies of its sums and products follow, each with the registers
+ * holding its coefficients if it is computed in closed form.
+ */
+void MC3_dump_program(const MC3_Program *prog, FILE *file) {
+    const unsigned int deduplicated = MC3_dedup_count(prog);
+
+    dump_code(prog, "", file);
+    if (deduplicated > 0)
+        fprintf(file, "deduplicated %u\n", deduplicated);
+
+    for (unsigned int i = 0; i < prog->range_count; i++) {
+        const struct Range *range = &prog->ranges[i];
+
+        fprintf(file, "range %u, index %u:\n", i, range->depth);
+        dump_code(&range->body, "    ", file);
+
+        if (range->degree < 0)
+            continue;
+
+        fputs("    coefficients", file);
+        for (int p = 0; p <= range->degree; p++) {
+            if (range->coefficients[p] == NO_COEFFICIENT)
+                fputs(" 0", file);
+            else
+                fprintf(file, " r%u", range->coefficients[p]);
+        }
+        fputc('\n', file);
+    }
+}
+
+/**
+ * @brief writes a C constant for `value`, in hexadecimal so it reads back as
+ * exactly the same double.
+ */
+static void emit_c_constant(double value, FILE *file) {
+    if (isnan(value)) {
+        fputs("NAN", file);
+    } else if (isinf(value)) {
+        fputs((value < 0) ? "-HUGE_VAL" : "HUGE_VAL", file);
+    } else {
+        fprintf(file, "%a", value);
+    }
+}
+
+/* The loops of sums and products, and their closed forms, written out in C
+   once per file. They follow evaluate_range and closed_form operation for
+   operation, chunks being added one after the other. */
+static const char *const EMITTED_RANGE_HELPERS[] = {
+    "#ifndef MC3_RANGE_HELPERS\n",
+    "#define MC3_RANGE_HELPERS\n\n",
+    "static double mc3_range_terms(double from, double to) {\n",
+    "    if (isnan(from) || isnan(to) || isinf(from))\n",
+    "        return NAN;\n",
+    "    if (to < from)\n",
+    "        return 0.0;\n",
+    "    const double terms = floor(to - from) + 1.0;\n",
+    "    return (terms <= 0x1p53) ? terms : NAN;\n",
+    "}\n\n",
+    "static double mc3_closed_form(const double *c, int degree, int product,\n",
+    "                              double from, double to) {\n",
+    "    const double terms = mc3_range_terms(from, to);\n",
+    "    if (isnan(terms))\n",
+    "        return NAN;\n",
+    "    if (terms == 0.0)\n",
+    "        return product ? 1.0 : 0.0;\n",
+    "    if (product)\n",
+    "        return pow(c[0], terms);\n",
+    "    double shifted[6];\n",
+    "    for (int p = 0; p <= degree; p++)\n",
+    "        shifted[p] = c[p];\n",
+    "    for (int i = 0; i < degree; i++)\n",
+    "        for (int j = degree - 1; j >= i; j--)\n",
+    "            shifted[j] += from * shifted[j + 1];\n",
+    "    const double m = terms - 1.0;\n",
+    "    const double s1 = m * (m + 1.0) / 2.0;\n",
+    "    const double s2 = s1 * (2.0 * m + 1.0) / 3.0;\n",
+    "    const double powers[6] = {\n",
+    "        terms, s1, s2, s1 * s1,\n",
+    "        s2 * (3.0 * m * m + 3.0 * m - 1.0) / 5.0,\n",
+    "        s1 * s1 * (2.0 * m * m + 2.0 * m - 1.0) / 3.0};\n",
+    "    double sum = 0.0;\n",
+    "    for (int j = degree; j >= 0; j--)\n",
+    "        sum += shifted[j] * powers[j];\n",
+    "    return sum;\n",
+    "}\n\n",
+    "static void mc3_add_partial(double *hi, double *lo, double next_hi,\n",
+    "                            double next_lo) {\n",
+    "    const double sum = *hi + next_hi;\n",
+    "    if (!isfinite(sum)) {\n",
+    "        *hi = sum;\n",
+    "        *lo = 0.0;\n",
+    "        return;\n",
+    "    }\n",
+    "    const double rounded = sum - *hi;\n",
+    "    const double error = (*hi - (sum - rounded)) + (next_hi - rounded);\n",
+    "    const double tail = error + *lo + next_lo;\n",
+    "    *hi = sum + tail;\n",
+    "    *lo = tail - (*hi - sum);\n",
+    "}\n\n",
+    "static double mc3_range_loop(double (*term)(const double *),\n",
+    "                             double *values, unsigned int slot,\n",
+    "                             double from, double to, int product) {\n",
+    "    const double terms = mc3_range_terms(from, to);\n",
+    "    double hi[64], lo[64];\n",
+    "    unsigned int level[64], count = 0;\n",
+    "    if (isnan(terms))\n",
+    "        return NAN;\n",
+    "    if (terms == 0.0)\n",
+    "        return product ? 1.0 : 0.0;\n",
+    "    for (unsigned long long first = 0; first < terms; first += 16384) {\n",
+    "        unsigned long long last = first + 16384;\n",
+    "        double sum = product ? 1.0 : 0.0, error = 0.0;\n",
+    "        if (last > (unsigned long long)terms)\n",
+    "            last = (unsigned long long)terms;\n",
+    "        for (unsigned long long k = first; k < last; k++) {\n",
+    "            values[slot] = from + (double)k;\n",
+    "            const double t = term(values);\n",
+    "            if (product) {\n",
+    "                sum *= t;\n",
+    "                continue;\n",
+    "            }\n",
+    "            const double next = sum + t;\n",
+    "            error += (fabs(sum) >= fabs(t)) ? (sum - next) + t\n",
+    "                                            : (t - next) + sum;\n",
+    "            sum = next;\n",
+    "        }\n",
+    "        hi[count] = sum;\n",
+    "        lo[count] = isfinite(sum) ? error : 0.0;\n",
+    "        level[count++] = 0;\n",
+    "        while (count > 1 && level[count - 2] == level[count - 1]) {\n",
+    "            count--;\n",
+    "            if (product)\n",
+    "                hi[count - 1] *= hi[count];\n",
+    "            else\n",
+    "                mc3_add_partial(&hi[count - 1], &lo[count - 1],\n",
+    "                                hi[count], lo[count]);\n",
+    "            level[count - 1]++;\n",
+    "        }\n",
+    "    }\n",
+    "    while (count > 1) {\n",
+    "        count--;\n",
+    "        if (product)\n",
+    "            hi[count - 1] *= hi[count];\n",
+    "        else\n",
+    "            mc3_add_partial(&hi[count - 1], &lo[count - 1], hi[count],\n",
+    "                            lo[count]);\n",
+    "    }\n",
+    "    return (product || !isfinite(hi[0])) ? hi[0] : hi[0] + lo[0];\n",
+    "}\n\n",
+    "#endif\n\n",
+};
+
+/**
+ * @brief writes the instructions of `prog` as C statements, reading the
+ * variables from the array `vars` and calling the functions of the ranges of
+ * the program `name`.
+ */
+static void emit_c_code(const MC3_Program *prog, const char *vars,
+                        const char *name, FILE *file) {
+    static const char *const operators[] = {
+        [OPC_ADD] = "+", [OPC_SUB] = "-", [OPC_MULT] = "*", [OPC_DIV] = "/"};
+    static const char *const functions[] = {[OPC_SIN] = "sin",
+                                            [OPC_COS] = "cos",
+                                            [OPC_TAN] = "tan",
+                                            [OPC_LOG] = "log10",
+                                            [OPC_LN] = "log"};
+
+    for (unsigned int i = 0; i < prog->length; i++) {
+        const struct Instr *instr = &prog->code[i];
+
+        fprintf(file, "    const double r%u = ", i);
+
+        if (instr->op == OPC_CONST) {
+            emit_c_constant(instr->value, file);
+        } else if (instr->op == OPC_VAR) {
+            fprintf(file, "%s[%u]", vars, instr->lhs);
+        } else if (instr->op == OPC_INDEX) {
+            fprintf(file, "%s[%u]", vars, prog->var_count + instr->lhs);
+        } else if (instr->op == OPC_SUM || instr->op == OPC_PROD) {
+            fprintf(file, "%s_range%u(%s, r%u, r%u)", name,
+                    (unsigned int)instr->value, vars, instr->lhs, instr->rhs);
+        } else if (instr->op == OPC_EXP) {
+            fprintf(file, "pow(r%u, r%u)", instr->lhs, instr->rhs);
+        } else if (instr->op >= OPC_SIN) {
+            fprintf(file, "%s(r%u)", functions[instr->op], instr->lhs);
+        } else {
+            fprintf(file, "r%u %s r%u", instr->lhs, operators[instr->op],
+                    instr->rhs);
+        }
+
+        fputs(";\n", file);
+    }
+}
+
+/**
+ * @brief writes range `index` of `prog` as the C function `name_range<index>`,
+ * taking the variables and indexes around the range and its bounds. Bodies
+ * added term by term get a function of their own, `name_term<index>`.
+ */
+static void emit_c_range(const MC3_Program *prog, unsigned int index,
+                         const char *name, FILE *file) {
+    const struct Range *range = &prog->ranges[index];
+    const unsigned int slot = prog->var_count + range->depth;
+    const int product = (range->op == OPC_PROD);
+
+    if (range->degree < 0) {
+        fprintf(file, "static double %s_term%u(const double *values) {\n",
+                name, index);
+        emit_c_code(&range->body, "values", name, file);
+        fprintf(file, "    return r%u;\n}\n\n", range->body.result);
+    }
+
+    fprintf(file,
+            "static double %s_range%u(const double *outer, double from, "
+            "double to) {\n"
+            "    double values[%u];\n",
+            name, index, slot + 1);
+    if (slot > 0)
+        fprintf(file,
+                "    for (int i = 0; i < %u; i++)\n"
+                "        values[i] = outer[i];\n",
+                slot);
+    else
+        fputs("    (void)outer;\n", file);
+
+    if (range->degree < 0) {
+        fprintf(file,
+                "    return mc3_range_loop(%s_term%u, values, %u, from, to, "
+                "%d);\n}\n\n",
+                name, index, slot, product);
+        return;
+    }
+
+    fprintf(file, "    values[%u] = from;\n", slot);
+    emit_c_code(&range->body, "values", name, file);
+
+    fputs("    const double c[] = {", file);
+    for (int p = 0; p <= range->degree; p++) {
+        if (range->coefficients[p] == NO_COEFFICIENT)
+            fprintf(file, "%s0.0", p ? ", " : "");
+        else
+            fprintf(file, "%sr%u", p ? ", " : "", range->coefficients[p]);
+    }
+    fprintf(file,
+            "};\n"
+            "    return mc3_closed_form(c, %d, %d, from, to);\n}\n\n",
+            range->degree, product);
+}
+
+/**
+ * @brief writes `prog` to `file` as the C function `double name(const double*
+ * vars)`, which takes the values of the variables like MC3_run and returns
+ * exactly what MC3_run would, and so what MC3_evaluate gives for the same
+ * expression, since both lower it the same way. The function is straight-line
+ * code, one statement per instruction, calling the same libm functions as the
+ * interpreter, so it must not be built with -ffast-math or contracted into
+ * fused multiply-adds for the results to match. Sums and products become
+ * static functions of their own, named after `name`, which must be a valid C
+ * identifier.
+ */
+void MC3_emit_c(const MC3_Program *prog, const char *name, FILE *file) {
+    fputs("#include <math.h>\n\n", file);
+
+    if (uses_ranges(prog)) {
+        const size_t lines = sizeof(EMITTED_RANGE_HELPERS) /
+                             sizeof(EMITTED_RANGE_HELPERS[0]);
+
+        for (size_t i = 0; i < lines; i++)
+            fputs(EMITTED_RANGE_HELPERS[i], file);
+        for (unsigned int i = 0; i < prog->range_count; i++)
+            emit_c_range(prog, i, name, file);
+    }
+
+    for (unsigned int i = 0; i < prog->var_count; i++)
+        fprintf(file, "%s vars[%u] = %s%s\n", i ? "  " : "/*", i,
+                prog->var_names[i], (i + 1 == prog->var_count) ? " */" : "");
+
+    fprintf(file, "double %s(const double *vars) {\n", name);
+    if (prog->var_count == 0)
+        fputs("    (void)vars;\n", file);
+
+    emit_c_code(prog, "vars", name, file);
+    fprintf(file, "    return r%u;\n}\n", prog->result);
+}
+
+/* ===== JIT Functions =====*/
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(MC3_NO_JIT)
+    #include <sys/mman.h>
+    #define HAVE_JIT 1
+#endif
+
+/* Native code generated for a program, at the start of its own mapping. The
+   constants the code loads follow it in the same mapping. */
+struct JitCode {
+    /* size of the whole mapping */
+    size_t size;
+    unsigned char code[];
+};
+
+#if defined(HAVE_JIT)
+
+/* largest program translated, so every frame and variable offset fits in a
+   32-bit displacement */
+    #define JIT_MAX_LENGTH (1u << 24)
+
+/* upper bound of the bytes emitted for one instruction, and for the prologue
+   and epilogue together */
+    #define JIT_INSTR_SIZE 40
+    #define JIT_FRAME_SIZE 64
+
+/* A displacement to patch with the address of a constant once the constants
+   have been placed after the code. */
+struct JitFixup {
+    /* offset of the 32-bit displacement in the code */
+    size_t at;
+    /* constant it refers to */
+    unsigned int constant;
+};
+
+struct JitCompiler {
+    const MC3_Program *prog;
+    unsigned char *code;
+    size_t length;
+    /* stack slot of every computed register, constant pool index of every
+       constant */
+    unsigned int *place;
+    struct JitFixup *fixups;
+    unsigned int fixup_count;
+};
+
+static void jit_byte(struct JitCompiler *jit, unsigned int byte) {
+    jit->code[jit->length++] = (unsigned char)byte;
+}
+
+static void jit_u32(struct JitCompiler *jit, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        jit_byte(jit, (value >> (8 * i)) & 0xff);
+}
+
+/**
+ * @brief emits the ModRM byte and displacement addressing register `operand`
+ * of the program, with `reg` as the xmm register of the instruction.
+ * Constants are read from the pool after the code, variables from the array
+ * pointed to by rbx and computed registers from the frame below rbp.
+ */
+static void jit_operand(struct JitCompiler *jit, unsigned int reg,
+                        unsigned int operand) {
+    const struct Instr *instr = &jit->prog->code[operand];
+
+    switch (instr->op) {
+    case OPC_CONST:
+        jit_byte(jit, 0x05 | reg << 3);
+        jit->fixups[jit->fixup_count].at = jit->length;
+        jit->fixups[jit->fixup_count++].constant = jit->place[operand];
+        jit_u32(jit, 0);
+        break;
+    case OPC_VAR:
+        jit_byte(jit, 0x83 | reg << 3);
+        jit_u32(jit, 8 * instr->lhs);
+        break;
+    default:
+        jit_byte(jit, 0x85 | reg << 3);
+        jit_u32(jit, -(uint32_t)(16 + 8 * jit->place[operand]));
+    }
+}
+
+/**
+ * @brief emits the scalar double instruction `opcode` (movsd, addsd, ...)
+ * between xmm register `reg` and register `operand` of the program.
+ */
+static void jit_sse(struct JitCompiler *jit, unsigned int opcode,
+                    unsigned int reg, unsigned int operand) {
+    jit_byte(jit, 0xf2);
+    jit_byte(jit, 0x0f);
+    jit_byte(jit, opcode);
+    jit_operand(jit, reg, operand);
+}
+
+static void jit_store(struct JitCompiler *jit, unsigned int index) {
+    jit_byte(jit, 0xf2);
+    jit_byte(jit, 0x0f);
+    jit_byte(jit, 0x11);
+    jit_byte(jit, 0x85);
+    jit_u32(jit, -(uint32_t)(16 + 8 * jit->place[index]));
+}
+
+/**
+ * @brief emits a call to the C function at `address`, which takes its
+ * arguments in xmm0 and xmm1 and returns in xmm0.
+ */
+static void jit_call(struct JitCompiler *jit, uint64_t address) {
+    /* mov rax, address; call rax */
+    jit_byte(jit, 0x48);
+    jit_byte(jit, 0xb8);
+    jit_u32(jit, address & 0xffffffff);
+    jit_u32(jit, address >> 32);
+    jit_byte(jit, 0xff);
+    jit_byte(jit, 0xd0);
+}
+
+/**
+ * @brief address of the libm function run_program calls for `op`.
+ */
+static uint64_t libm_address(enum OpCode op) {
+    double (*unary)(double) = sin;
+    double (*binary)(double, double) = pow;
+    uint64_t address;
+
+    switch (op) {
+    case OPC_EXP:
+        memcpy(&address, &binary, sizeof(address));
+        return address;
+    case OPC_COS:
+        unary = cos;
+        break;
+    case OPC_TAN:
+        unary = tan;
+        break;
+    case OPC_LOG:
+        unary = log10;
+        break;
+    case OPC_LN:
+        unary = log;
+        break;
+    default:
+        break;
+    }
+
+    memcpy(&address, &unary, sizeof(address));
+    return address;
+}
+
+static unsigned int sse_opcode(enum OpCode op) {
+    switch (op) {
+    case OPC_ADD:
+        return 0x58;
+    case OPC_SUB:
+        return 0x5c;
+    case OPC_MULT:
+        return 0x59;
+    default:
+        return 0x5e;
+    }
+}
+
+/**
+ * @brief translates every instruction of `jit->prog` into `jit->code`.
+ * Results are kept in xmm0 and spilled to their stack slot, and `^` and the
+ * functions call the same libm functions as run_program, so the native code
+ * computes exactly what the interpreter does.
+ */
+static void jit_translate(struct JitCompiler *jit, unsigned int slots) {
+    const MC3_Program *prog = jit->prog;
+    /* register whose value is in xmm0, or UINT_MAX */
+    unsigned int in_xmm0 = (unsigned int)-1;
+
+    /* push rbp; mov rbp, rsp; push rbx; mov rbx, rdi; sub rsp, frame */
+    static const unsigned char prologue[] = {0x55, 0x48, 0x89, 0xe5, 0x53,
+                                             0x48, 0x89, 0xfb, 0x48, 0x81,
+                                             0xec};
+    for (size_t i = 0; i < sizeof(prologue); i++)
+        jit_byte(jit, prologue[i]);
+    /* keeps rsp 16-byte aligned for calls */
+    jit_u32(jit, ((slots * 8 + 15) & ~15u) + 8);
+
+    for (unsigned int i = 0; i < prog->length; i++) {
+        const struct Instr *instr = &prog->code[i];
+
+        if (instr->op == OPC_CONST || instr->op == OPC_VAR)
+            continue;
+
+        if (in_xmm0 != instr->lhs)
+            jit_sse(jit, 0x10, 0, instr->lhs);
+
+        if (instr->op == OPC_EXP) {
+            jit_sse(jit, 0x10, 1, instr->rhs);
+            jit_call(jit, libm_address(instr->op));
+        } else if (instr->op >= OPC_SIN) {
+            jit_call(jit, libm_address(instr->op));
+        } else {
+            jit_sse(jit, sse_opcode(instr->op), 0, instr->rhs);
+        }
+
+        jit_store(jit, i);
+        in_xmm0 = i;
+    }
+
+    if (in_xmm0 != prog->result)
+        jit_sse(jit, 0x10, 0, prog->result);
+
+    /* mov rbx, [rbp - 8]; leave; ret */
+    static const unsigned char epilogue[] = {0x48, 0x8b, 0x5d, 0xf8,
+                                             0xc9, 0xc3};
+    for (size_t i = 0; i < sizeof(epilogue); i++)
+        jit_byte(jit, epilogue[i]);
+}
+
+/**
+ * @brief copies the translated code and its constants into a new mapping,
+ * which is made executable and no longer writable.
+ *
+ * @return the mapping, or NULL if it could not be created.
+ */
+static struct JitCode *jit_map(const struct JitCompiler *jit,
+                               unsigned int constants) {
+    const size_t code_offset = offsetof(struct JitCode, code);
+    const size_t pool_offset = (code_offset + jit->length + 7) & ~(size_t)7;
+    const size_t size = pool_offset + constants * sizeof(double);
+
+    struct JitCode *native = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (native == MAP_FAILED)
+        return NULL;
+
+    native->size = size;
+    memcpy(native->code, jit->code, jit->length);
+
+    unsigned char *memory = (unsigned char *)native;
+    for (unsigned int i = 0; i < jit->prog->length; i++) {
+        if (jit->prog->code[i].op == OPC_CONST)
+            memcpy(memory + pool_offset + jit->place[i] * sizeof(double),
+                   &jit->prog->code[i].value, sizeof(double));
+    }
+
+    /* rip-relative displacements count from the end of the displacement */
+    for (unsigned int i = 0; i < jit->fixup_count; i++) {
+        const struct JitFixup *fixup = &jit->fixups[i];
+        const size_t target = pool_offset + fixup->constant * sizeof(double);
+        const uint32_t displacement =
+            (uint32_t)(target - (code_offset + fixup->at + 4));
+
+        for (int byte = 0; byte < 4; byte++)
+            native->code[fixup->at + byte] = displacement >> (8 * byte);
+    }
+
+    if (mprotect(native, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(native, size);
+        return NULL;
+    }
+
+    return native;
+}
+
+static struct JitCode *jit_compile(const MC3_Program *prog) {
+    struct JitCompiler jit = {.prog = prog};
+    unsigned int slots = 0;
+    unsigned int constants = 0;
+    struct JitCode *native = NULL;
+
+    /* the loops of sums and products are left to the interpreter */
+    if (prog->length > JIT_MAX_LENGTH || uses_ranges(prog))
+        return NULL;
+
+    jit.code = malloc(JIT_FRAME_SIZE + (size_t)prog->length * JIT_INSTR_SIZE);
+    jit.place = malloc(prog->length * sizeof(unsigned int));
+    jit.fixups = malloc((2 * (size_t)prog->length + 1) *
+                        sizeof(struct JitFixup));
+
+    if (jit.code != NULL && jit.place != NULL && jit.fixups != NULL) {
+        for (unsigned int i = 0; i < prog->length; i++) {
+            if (prog->code[i].op == OPC_CONST)
+                jit.place[i] = constants++;
+            else if (prog->code[i].op != OPC_VAR)
+                jit.place[i] = slots++;
+        }
+
+        jit_translate(&jit, slots);
+        native = jit_map(&jit, constants);
+    }
+
+    free(jit.code);
+    free(jit.place);
+    free(jit.fixups);
+    return native;
+}
+
+#endif
+
+static MC3_JitFunction jit_function(const MC3_Program *prog) {
+    MC3_JitFunction function = NULL;
+    struct JitCode *native =
+        atomic_load_explicit(&prog->jit, memory_order_acquire);
+
+    if (native != NULL) {
+        /* ISO C has no cast from object to function pointers */
+        void *code = native->code;
+        memcpy(&function, &code, sizeof(function));
+    }
+
+    return function;
+}
+
+static void free_jit(MC3_Program *prog) {
+#if defined(HAVE_JIT)
+    struct JitCode *native = atomic_load(&prog->jit);
+
+    if (native != NULL)
+        munmap(native, native->size);
+#else
+    (void)prog;
+#endif
+}
+
+/**
+ * @brief Translates `prog` into native x86-64 code, which MC3_run uses from
+ * then on. The code computes exactly what the interpreter does. Translating a
+ * program more than once returns the same function.
+ *
+ * @return the native function, taking the variables like MC3_run, or NULL if
+ * there is no JIT on this platform (or the library was built with
+ * MC3_NO_JIT), the program evaluates a sum or product, or executable memory
+ * could not be mapped. MC3_run keeps interpreting the program in that case.
+ */
+MC3_JitFunction MC3_jit_compile(MC3_Program *prog) {
+#if defined(HAVE_JIT)
+    if (jit_function(prog) != NULL)
+        return jit_function(prog);
+
+    struct JitCode *native = jit_compile(prog);
+    struct JitCode *expected = NULL;
+
+    if (native == NULL)
+        return NULL;
+
+    /* a program from a cache may be translated by several threads at once */
+    if (!atomic_compare_exchange_strong(&prog->jit, &expected, native))
+        munmap(native, native->size);
+
+    return jit_function(prog);
+#else
+    (void)prog;
+    return NULL;
+#endif
+}
+
+/* ===== Program Functions =====*/
+
+static size_t align_size(size_t size) {
+    const size_t align = sizeof(max_align_t);
+    return (size + align - 1) / align * align;
+}
+
+/**
+ * @brief copies a program built in an arena into a single heap allocation, so
+ * it outlives the arena and is released with one free.
+ *
+ * @return the copy, or NULL if out of memory.
+ */
+MC3_Program *copy_program(const struct MC3_Program *src) {
+    const size_t code_offset = align_size(sizeof(struct MC3_Program));
+    const size_t ranges_offset =
+        code_offset + align_size(src->length * sizeof(struct Instr));
+    size_t bodies_offset =
+        ranges_offset + align_size(src->range_count * sizeof(struct Range));
+    size_t names_offset = bodies_offset;
+
+    for (unsigned int i = 0; i < src->range_count; i++)
+        names_offset += align_size(src->ranges[i].body.length *
+                                   sizeof(struct Instr));
+
+    size_t chars_offset =
+        names_offset + align_size(src->var_count * sizeof(char *));
+    size_t size = chars_offset;
+
+    for (unsigned int i = 0; i < src->var_count; i++)
+        size += strlen(src->var_names[i]) + 1;
+
+    char *memory = malloc(size);
+    if (memory == NULL)
+        return NULL;
+
+    MC3_Program *prog = (MC3_Program *)memory;
+    *prog = *src;
+    atomic_init(&prog->refs, 1);
+    atomic_init(&prog->jit, NULL);
+    prog->code = (struct Instr *)(memory + code_offset);
+    prog->capacity = src->length;
+    prog->ranges = (struct Range *)(memory + ranges_offset);
+    prog->var_names = (char **)(memory + names_offset);
+    memcpy(prog->code, src->code, src->length * sizeof(struct Instr));
+
+    for (unsigned int i = 0; i < src->range_count; i++) {
+        const struct MC3_Program *body = &src->ranges[i].body;
+
+        prog->ranges[i] = src->ranges[i];
+        prog->ranges[i].body.code = (struct Instr *)(memory + bodies_offset);
+        prog->ranges[i].body.capacity = body->length;
+        memcpy(prog->ranges[i].body.code, body->code,
+               body->length * sizeof(struct Instr));
+        bodies_offset += align_size(body->length * sizeof(struct Instr));
+    }
+
+    for (unsigned int i = 0; i < src->var_count; i++) {
+        const size_t name_size = strlen(src->var_names[i]) + 1;
+        prog->var_names[i] = memory + chars_offset;
+        memcpy(prog->var_names[i], src->var_names[i], name_size);
+        chars_offset += name_size;
+    }
+
+    link_ranges(prog);
+    return prog;
+}
+
+/**
+ * @brief drops one reference to `prog`, releasing it when it was the last.
+ * Programs handed out by a cache are shared, and must be released with this
+ * function like any other.
+ */
+void MC3_free_program(MC3_Program *prog) {
+    if (prog == NULL)
+        return;
+
+    /* the program and everything it points to is a single allocation */
+    if (atomic_fetch_sub_explicit(&prog->refs, 1, memory_order_acq_rel) == 1) {
+        free_jit(prog);
+        free(prog);
+    }
+}
+
+static MC3_Program *retain_program(MC3_Program *prog) {
+    atomic_fetch_add_explicit(&prog->refs, 1, memory_order_relaxed);
+    return prog;
+}
+
+unsigned int MC3_var_count(const MC3_Program *prog) { return prog->var_count; }
+
+const char *MC3_var_name(const MC3_Program *prog, unsigned int index) {
+    return (index < prog->var_count) ? prog->var_names[index] : NULL;
+}
+
+int MC3_var_index(const MC3_Program *prog, const char *name) {
+    for (unsigned int i = 0; i < prog->var_count; i++) {
+        if (strcmp(prog->var_names[i], name) == 0)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief parses and optimizes the string of `parser` into its program. Every
+ * way of evaluating a number goes through here, so whether the program came
+ * from a cache or not, it computes the same bits.
+ *
+ * @return MC3_NO_ERROR, or the error with its offset in `parser`.
+ */
+static MC3_ErrorCode lower_program(struct Parser *parser) {
+    if (parse(parser) != MC3_NO_ERROR)
+        return parser->error;
+
+    STATS(const uint64_t start = stats_now();)
+    const MC3_ErrorCode error = optimize(parser->program, parser->arena);
+    STATS(stats_phase(MC3_PHASE_PARSE, stats_now() - start, 0);)
+
+    if (error != MC3_NO_ERROR)
+        parser->error_offset = parser->lexer.length;
+    return error;
+}
+
+/**
+ * @brief compiles and optimizes `equ` into a program on the heap.
+ *
+ * @return the program, or NULL with the error and its offset in `err`.
+ */
+static MC3_Program *compile_program(const char *equ, size_t length,
+                                    MC3_Error *err) {
+    struct Arena arena = new_arena();
+    struct MC3_Program scratch = {0};
+    struct Parser parser = new_parser(equ, length, &scratch, &arena);
+    MC3_Program *prog = NULL;
+
+    err->code = lower_program(&parser);
+    err->offset = parser.error_offset;
+
+    if (err->code == MC3_NO_ERROR) {
+        prog = copy_program(&scratch);
+        if (prog == NULL)
+            err->code = MC3_OUT_OF_MEMORY;
+    }
+
+    STATS(stats_error(err->code);)
+    free_arena(&arena);
+    return prog;
+}
+
+/**
+ * @brief Tokenizes and parses the first `length` characters of `equ` once,
+ * lowering them into an optimized program which can be evaluated any number of
+ * times with MC3_run. `equ` does not need to be terminated.
+ *
+ * @param equ
+ * @param length
+ * @param err if parameter is NULL, then the error will not be set.
+ * @return the program, or NULL if an error occured. Release it with
+ * MC3_free_program.
+ */
+MC3_Program *MC3_compile_n(const char *equ, size_t length,
+                           MC3_ErrorCode *err) {
+    MC3_Error error;
+    MC3_Program *prog = compile_program(equ, length, &error);
+
+    write_error(err, error.code);
+    return prog;
+}
+
+/**
+ * @brief Same as MC3_compile_n, for a terminated string.
+ */
+MC3_Program *MC3_compile(const char *equ, MC3_ErrorCode *err) {
+    return MC3_compile_n(equ, strlen(equ), err);
+}
+
+/**
+ * @brief evaluates every instruction of `prog` into `regs`, which must hold at
+ * least `prog->length` values. Bodies of ranges find the indexes of their
+ * ranges after the variables in `vars`.
+ */
+static double run_code(const MC3_Program *prog, const double *vars,
+                       double *regs) {
+    const struct Instr *code = prog->code;
+    const unsigned int length = prog->length;
+
+    for (unsigned int i = 0; i < length; i++) {
+        const struct Instr *instr = &code[i];
+
+        switch (instr->op) {
+        case OPC_CONST:
+            regs[i] = instr->value;
+            break;
+        case OPC_VAR:
+            regs[i] = vars[instr->lhs];
+            break;
+        case OPC_INDEX:
+            regs[i] = vars[prog->var_count + instr->lhs];
+            break;
+        case OPC_ADD:
+            regs[i] = regs[instr->lhs] + regs[instr->rhs];
+            break;
+        case OPC_SUB:
+            regs[i] = regs[instr->lhs] - regs[instr->rhs];
+            break;
+        case OPC_MULT:
+            regs[i] = regs[instr->lhs] * regs[instr->rhs];
+            break;
+        case OPC_DIV:
+            regs[i] = regs[instr->lhs] / regs[instr->rhs];
+            break;
+        case OPC_EXP:
+            regs[i] = pow(regs[instr->lhs], regs[instr->rhs]);
+            break;
+        case OPC_SUM:
+        case OPC_PROD:
+            regs[i] = evaluate_range(prog, instr, regs[instr->lhs],
+                                     regs[instr->rhs], vars);
+            break;
+        default:
+            regs[i] = apply_operator(instr->op, regs[instr->lhs], 0.0);
+            break;
+        }
+    }
+
+    return regs[prog->result];
+}
+
+static double run_program(const MC3_Program *prog, const double *vars,
+                          double *regs) {
+    STATS(const uint64_t start = stats_now();)
+    const double result = run_code(prog, vars, regs);
+
+    STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start, 1);)
+    return result;
+}
+
+/**
+ * @brief evaluates a program built by MC3_compile. The program is not
+ * modified, so it can be run concurrently from several threads.
+ *
+ * @param prog
+ * @param vars values of the variables, indexed like MC3_var_name. May be NULL
+ * if the program has no variables.
+ * @param err if parameter is NULL, then the error will not be set.
+ * @return double
+ */
+double MC3_run(const MC3_Program *prog, const double *vars,
+               MC3_ErrorCode *err) {
+    double stack_regs[RUN_STACK_REGS];
+    double *regs = stack_regs;
+
+    if (vars == NULL && prog->var_count > 0) {
+        STATS(stats_error(MC3_UNBOUND_VARIABLE);)
+        write_error(err, MC3_UNBOUND_VARIABLE);
+        return 0.0;
+    }
+
+    MC3_JitFunction native = jit_function(prog);
+    if (native != NULL) {
+        STATS(const uint64_t start = stats_now();)
+        const double result = native(vars);
+        STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start, 1);)
+
+        write_error(err, MC3_NO_ERROR);
+        return result;
+    }
+
+    if (prog->length > RUN_STACK_REGS) {
+        regs = malloc(prog->length * sizeof(double));
+        if (regs == NULL) {
+            STATS(stats_error(MC3_OUT_OF_MEMORY);)
+            write_error(err, MC3_OUT_OF_MEMORY);
+            return 0.0;
+        }
+    }
+
+    double result = run_program(prog, vars, regs);
+
+    if (regs != stack_regs)
+        free(regs);
+
+    write_error(err, MC3_NO_ERROR);
+    return result;
+}
+
+/* ===== Cache Functions =====*/
+
+/* A compiled program kept by a cache, together with the normalized text it was
+   compiled from. */
+struct CacheEntry {
+    /* next entry in the same hash bucket */
+    struct CacheEntry *chain;
+    /* neighbours in the shard's recency list, newer and older */
+    struct CacheEntry *newer;
+    struct CacheEntry *older;
+    unsigned long long hash;
+    MC3_Program *prog;
+    size_t key_length;
+    char key[];
+};
+
+/* An independent part of a cache, holding the expressions whose hash selects
+   it. Each shard has its own lock so threads rarely wait for each other. */
+struct CacheShard {
+    pthread_mutex_t lock;
+    struct CacheEntry **buckets;
+    /* number of buckets, a power of two */
+    size_t bucket_count;
+    /* recency list, entries are evicted from the oldest end */
+    struct CacheEntry *newest;
+    struct CacheEntry *oldest;
+    size_t size;
+    size_t capacity;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+};
+
+struct MC3_Cache {
+    struct CacheShard *shards;
+    unsigned int shard_count;
+};
+
+/* normalized expressions up to this length are built on the stack */
+#define CACHE_KEY_STACK_SIZE 256
+
+static bool is_word_char(char ch) {
+    return !is_operator(ch) && !is_grouping(ch) && !is_separator(ch);
+}
+
+static bool is_exponent_marker(char ch) { return (ch == 'e') || (ch == 'E'); }
+
+/**
+ * @brief whether `ch` following the `key_length` characters of `key` without
+ * a space would read as part of the same token, such as two words, or the
+ * sign and digits after the exponent marker of a number.
+ */
+static bool runs_together(const char *key, size_t key_length, char ch) {
+    const char last = key[key_length - 1];
+
+    if (is_word_char(last) && is_word_char(ch))
+        return true;
+    if (is_exponent_marker(last) && (ch == '+' || ch == '-'))
+        return true;
+    return (last == '+' || last == '-') && key_length > 1 &&
+           is_exponent_marker(key[key_length - 2]) &&
+           isdigit((unsigned char)ch);
+}
+
+/**
+ * @brief writes the tokens of `equ` to `key` without the spaces between them,
+ * except a single one between tokens which would otherwise run together, so
+ * expressions which only differ in spacing share an entry. From an invalid
+ * character on, the rest of `equ` is copied as is. `key` must have room for
+ * `length` characters.
+ *
+ * @return the length of the key.
+ */
+static size_t normalize_expression(const char *equ, size_t length,
+                                   char *key) {
+    struct Lexer lexer = new_lexer(equ, length);
+    struct Token token;
+    size_t key_length = 0;
+    size_t end = 0;
+
+    for (;;) {
+        if (next_token(&lexer, &token) != MC3_NO_ERROR) {
+            memcpy(&key[key_length], &equ[token.offset],
+                   length - token.offset);
+            return key_length + length - token.offset;
+        }
+
+        if (token.type == TYPE_EMPTY)
+            return key_length;
+
+        if (token.offset > end && key_length > 0 &&
+            runs_together(key, key_length, equ[token.offset]))
+            key[key_length++] = ' ';
+
+        memcpy(&key[key_length], &equ[token.offset], lexer.pos - token.offset);
+        key_length += lexer.pos - token.offset;
+        end = lexer.pos;
+    }
+}
+
+/* 64-bit FNV-1a */
+static unsigned long long hash_key(const char *key, size_t length) {
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Creates a cache holding up to `capacity` compiled expressions, split
+ * into `shards` independently locked parts (at least one). Once full, the
+ * least recently used expression of a shard is dropped to make room.
+ *
+ * @return the cache, or NULL if out of memory.
+ */
+MC3_Cache *MC3_cache_new(size_t capacity, unsigned int shards) {
+    if (shards == 0)
+        shards = 1;
+    if (capacity < shards)
+        capacity = shards;
+
+    MC3_Cache *cache = malloc(sizeof(MC3_Cache));
+    if (cache == NULL)
+        return NULL;
+
+    cache->shard_count = shards;
+    cache->shards = calloc(shards, sizeof(struct CacheShard));
+    if (cache->shards == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    const size_t shard_capacity = (capacity + shards - 1) / shards;
+    size_t bucket_count = 1;
+    while (bucket_count < shard_capacity)
+        bucket_count *= 2;
+
+    for (unsigned int i = 0; i < shards; i++) {
+        struct CacheShard *shard = &cache->shards[i];
+
+        shard->buckets = calloc(bucket_count, sizeof(struct CacheEntry *));
+        if (shard->buckets == NULL) {
+            cache->shard_count = i;
+            MC3_cache_free(cache);
+            return NULL;
+        }
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->bucket_count = bucket_count;
+        shard->capacity = shard_capacity;
+    }
+
+    return cache;
+}
+
+void MC3_cache_free(MC3_Cache *cache) {
+    if (cache == NULL)
+        return;
+
+    for (unsigned int i = 0; i < cache->shard_count; i++) {
+        struct CacheShard *shard = &cache->shards[i];
+        struct CacheEntry *entry = shard->newest;
+
+        while (entry != NULL) {
+            struct CacheEntry *older = entry->older;
+            MC3_free_program(entry->prog);
+            free(entry);
+            entry = older;
+        }
+
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+
+    free(cache->shards);
+    free(cache);
+}
+
+static void unlink_recency(struct CacheShard *shard, struct CacheEntry *entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        shard->newest = entry->older;
+
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        shard->oldest = entry->newer;
+}
+
+static void push_newest(struct CacheShard *shard, struct CacheEntry *entry) {
+    entry->newer = NULL;
+    entry->older = shard->newest;
+
+    if (shard->newest != NULL)
+        shard->newest->newer = entry;
+    else
+        shard->oldest = entry;
+
+    shard->newest = entry;
+}
+
+static struct CacheEntry **find_entry(struct CacheShard *shard,
+                                      unsigned long long hash, const char *key,
+                                      size_t key_length) {
+    struct CacheEntry **link =
+        &shard->buckets[hash & (shard->bucket_count - 1)];
+
+    while (*link != NULL) {
+        struct CacheEntry *entry = *link;
+
+        if (entry->hash == hash && entry->key_length == key_length &&
+            memcmp(entry->key, key, key_length) == 0)
+            return link;
+
+        link = &entry->chain;
+    }
+
+    return link;
+}
+
+static void evict_oldest(struct CacheShard *shard) {
+    struct CacheEntry *entry = shard->oldest;
+    struct CacheEntry **link = find_entry(shard, entry->hash, entry->key,
+                                          entry->key_length);
+
+    *link = entry->chain;
+    unlink_recency(shard, entry);
+    MC3_free_program(entry->prog);
+    free(entry);
+
+    shard->size--;
+    shard->evictions++;
+}
+
+/**
+ * @brief looks `key` up in `shard`, marking it as most recently used.
+ *
+ * @return a new reference to the cached program, or NULL.
+ */
+static MC3_Program *shard_lookup(struct CacheShard *shard,
+                                 unsigned long long hash, const char *key,
+                                 size_t key_length) {
+    struct CacheEntry *entry = *find_entry(shard, hash, key, key_length);
+
+    if (entry == NULL)
+        return NULL;
+
+    if (shard->newest != entry) {
+        unlink_recency(shard, entry);
+        push_newest(shard, entry);
+    }
+
+    return retain_program(entry->prog);
+}
+
+/**
+ * @brief adds `prog` to `shard` under `key`, unless another thread compiled
+ * the same expression first, in which case `prog` is dropped for its program.
+ *
+ * @return a new reference to the program now cached under `key`.
+ */
+static MC3_Program *shard_insert(struct CacheShard *shard,
+                                 unsigned long long hash, const char *key,
+                                 size_t key_length, MC3_Program *prog) {
+    MC3_Program *cached = shard_lookup(shard, hash, key, key_length);
+
+    if (cached != NULL) {
+        MC3_free_program(prog);
+        return cached;
+    }
+
+    struct CacheEntry *entry = malloc(sizeof(struct CacheEntry) + key_length);
+
+    /* the program is still usable, it just is not kept */
+    if (entry == NULL)
+        return prog;
+
+    if (shard->size == shard->capacity)
+        evict_oldest(shard);
+
+    struct CacheEntry **link = find_entry(shard, hash, key, key_length);
+
+    entry->chain = NULL;
+    entry->hash = hash;
+    entry->prog = retain_program(prog);
+    entry->key_length = key_length;
+    memcpy(entry->key, key, key_length);
+
+    *link = entry;
+    push_newest(shard, entry);
+    shard->size++;
+
+    return prog;
+}
+
+/**
+ * @brief Same as MC3_compile_n, but the program is taken from `cache` when an
+ * expression differing from `equ` only in spacing was compiled before, so
+ * tokenizing and parsing are skipped. A cache can be shared by any number of
+ * threads.
+ *
+ * @return a program which must be released with MC3_free_program, or NULL if
+ * `equ` does not compile, with the error and its offset in `err`. Errors are
+ * not cached.
+ */
+MC3_Program *MC3_cache_compile(MC3_Cache *cache, const char *equ,
+                               size_t length, MC3_Error *err) {
+    char stack_key[CACHE_KEY_STACK_SIZE];
+    char *key = stack_key;
+
+    if (length > CACHE_KEY_STACK_SIZE) {
+        key = malloc(length);
+        if (key == NULL) {
+            write_context_error(err, MC3_OUT_OF_MEMORY, 0);
+            return NULL;
+        }
+    }
+
+    const size_t key_length = normalize_expression(equ, length, key);
+    const unsigned long long hash = hash_key(key, key_length);
+    struct CacheShard *shard =
+        &cache->shards[(hash >> 32) % cache->shard_count];
+
+    pthread_mutex_lock(&shard->lock);
+    MC3_Program *prog = shard_lookup(shard, hash, key, key_length);
+    if (prog != NULL)
+        shard->hits++;
+    else
+        shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (prog != NULL) {
+        write_context_error(err, MC3_NO_ERROR, 0);
+    } else {
+        /* compiled without the lock held, so other expressions of the shard
+           are not held up */
+        MC3_Error error;
+        prog = compile_program(equ, length, &error);
+        write_context_error(err, error.code, error.offset);
+
+        if (prog != NULL) {
+            pthread_mutex_lock(&shard->lock);
+            prog = shard_insert(shard, hash, key, key_length, prog);
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+
+    if (key != stack_key)
+        free(key);
+
+    return prog;
+}
+
+/**
+ * @brief adds up the counters of every shard of `cache`. Other threads may
+ * use the cache meanwhile, so the totals are only a snapshot.
+ */
+MC3_CacheStats MC3_cache_stats(MC3_Cache *cache) {
+    MC3_CacheStats stats = {0, 0, 0, 0};
+
+    for (unsigned int i = 0; i < cache->shard_count; i++) {
+        struct CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats.hits += shard->hits;
+        stats.misses += shard->misses;
+        stats.evictions += shard->evictions;
+        stats.size += shard->size;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return stats;
+}
+
+/* ===== Context Functions =====*/
+
+struct MC3_Context {
+    /* holds the program and registers of the current evaluation */
+    struct Arena arena;
+    /* programs shared with other contexts, or NULL to compile every time */
+    MC3_Cache *cache;
+};
+
+MC3_Context *MC3_context_new(void) {
+    MC3_Context *ctx = malloc(sizeof(MC3_Context));
+
+    if (ctx != NULL) {
+        ctx->arena = new_arena();
+        ctx->cache = NULL;
+    }
+
+    return ctx;
+}
+
+void MC3_context_free(MC3_Context *ctx) {
+    if (ctx == NULL)
+        return;
+
+    free_arena(&ctx->arena);
+    free(ctx);
+}
+
+/**
+ * @brief compiles and evaluates `equ` using `arena` for every temporary.
+ */
+static double evaluate_in_arena(struct Arena *arena, const char *equ,
+                                size_t length, MC3_Error *err) {
+    struct MC3_Program prog = {0};
+    struct Parser parser = new_parser(equ, length, &prog, arena);
+    const MC3_ErrorCode error = lower_program(&parser);
+
+    if (error != MC3_NO_ERROR) {
+        STATS(stats_error(error);)
+        write_context_error(err, error, parser.error_offset);
+        return 0.0;
+    }
+
+    if (prog.var_count > 0) {
+        STATS(stats_error(MC3_UNBOUND_VARIABLE);)
+        write_context_error(err, MC3_UNBOUND_VARIABLE, parser.var_offset);
+        return 0.0;
+    }
+
+    double *regs = arena_alloc(arena, prog.length * sizeof(double));
+    if (regs == NULL) {
+        STATS(stats_error(MC3_OUT_OF_MEMORY);)
+        write_context_error(err, MC3_OUT_OF_MEMORY, length);
+        return 0.0;
+    }
+
+    write_context_error(err, MC3_NO_ERROR, 0);
+    return run_program(&prog, NULL, regs);
+}
+
+/**
+ * @brief Same as MC3_evaluate_n, but every temporary is taken from memory
+ * owned by `ctx` and kept for the next call, so evaluating does not allocate
+ * once the context has grown to fit the expressions it is given. A context
+ * must only be used by one thread at a time.
+ *
+ * @param ctx
+ * @param equ
+ * @param length
+ * @param err if parameter is NULL, then the error will not be set. Otherwise
+ * the error code, and the byte offset in `equ` it was found at, are written.
+ * @return double
+ */
+double MC3_context_evaluate(MC3_Context *ctx, const char *equ, size_t length,
+                            MC3_Error *err) {
+    reset_arena(&ctx->arena);
+
+    if (ctx->cache == NULL)
+        return evaluate_in_arena(&ctx->arena, equ, length, err);
+
+    MC3_Program *prog = MC3_cache_compile(ctx->cache, equ, length, err);
+    if (prog == NULL)
+        return 0.0;
+
+    /* parsed again, only to report where the first variable is */
+    if (prog->var_count > 0) {
+        MC3_free_program(prog);
+        return evaluate_in_arena(&ctx->arena, equ, length, err);
+    }
+
+    double result = 0.0;
+    double *regs = arena_alloc(&ctx->arena, prog->length * sizeof(double));
+
+    if (regs != NULL)
+        result = run_program(prog, NULL, regs);
+    else
+        write_context_error(err, MC3_OUT_OF_MEMORY, length);
+
+    MC3_free_program(prog);
+    return result;
+}
+
+/**
+ * @brief makes `ctx` take its programs from `cache`, or compile every
+ * expression again if `cache` is NULL. The cache must outlive the context.
+ */
+void MC3_context_set_cache(MC3_Context *ctx, MC3_Cache *cache) {
+    ctx->cache = cache;
+}
+
+/* ===== Session Functions =====*/
+
+/*
+ * A session keeps the tokens of the text it was last given, its parse, and the
+ * values of the subexpressions it evaluated. When the text changes, only the
+ * tokens between the common prefix and the common suffix of the old and new
+ * text are lexed again; lexing stops as soon as it reaches a token which
+ * starts at the same place in the common suffix as an old one, and the old
+ * tokens from there on are kept.
+ *
+ * If the new tokens only change the values of operands, such as a number
+ * being edited, the parse keeps its shape: the operands are patched in place
+ * and only the operators above them are marked to be evaluated again. Any
+ * other edit parses the tokens again. Either way the parse is evaluated from
+ * the root down, stopping at every subexpression whose value is known, so an
+ * edit only evaluates the operators between the edit and the root.
+ *
+ * Values of operators are also remembered across updates, in a table found by
+ * a hash of the subexpression but keyed by the operator and the values of its
+ * operands, and for sums and products by their bodies too. A remembered value
+ * is only used when all of them match, so two subexpressions with the same
+ * hash never share a value.
+ */
+
+/* number of characters past the end of a token the lexer may read before it
+   knows where the token ends, for the `e+5` of `1e+5` */
+#define LEXER_LOOKAHEAD 3
+
+/* smallest number of slots of the memo of a session */
+#define MEMO_MIN_SLOTS 1024
+
+/* parent of the result, and operand of tokens which are not operands */
+#define NO_INSTR UINT_MAX
+
+/* evaluation state of an instruction of a session */
+enum {
+    /* changed since it was last evaluated, or never evaluated */
+    INSTR_STALE,
+    /* waiting for its operands */
+    INSTR_PENDING,
+    INSTR_KNOWN,
+};
+
+/* The value of an operator applied to the values of its operands. A slot
+   found by hash is only used if everything else matches too. */
+struct MemoSlot {
+    /* hash of the subexpression, 0 for an empty slot */
+    uint64_t hash;
+    enum OpCode op;
+    double lhs;
+    double rhs;
+    /* for sums and products, the body with the values of the variables it
+       reads, as written by range_key, and its number of words */
+    uint64_t *body;
+    size_t body_words;
+    double value;
+};
+
+struct MC3_Session {
+    /* text of the last update, not terminated */
+    char *text;
+    size_t length;
+    size_t text_capacity;
+
+    /* tokens of `text`, followed by a TYPE_EMPTY token at the end of the text
+       or at the character which could not be tokenized */
+    struct Token *tokens;
+    /* byte offset just past the end of each token */
+    size_t *ends;
+    unsigned int token_count;
+    unsigned int token_capacity;
+    /* MC3_NO_ERROR, or why the text could not be tokenized to the end */
+    MC3_ErrorCode lex_error;
+
+    /* tokens the last update lexed in place of old ones, and whether they
+       only changed the values of operands */
+    unsigned int edit_first;
+    unsigned int edit_count;
+    bool same_shape;
+
+    /* parse of `tokens`, with its variables bound, if it succeeded */
+    struct MC3_Program program;
+    bool has_program;
+    /* holds `program` and the arrays below until the tokens are parsed
+       again */
+    struct Arena program_arena;
+    /* values of the variables */
+    double *vars;
+    /* for every instruction: the instruction using it, or NO_INSTR for the
+       result, the hash of its subexpression, its value and its state */
+    unsigned int *parents;
+    uint64_t *hashes;
+    double *values;
+    unsigned char *states;
+    /* instructions waiting for their operands during an evaluation */
+    unsigned int *stack;
+    /* for every token, the instruction loading it if it is an operand */
+    unsigned int *operands;
+
+    /* values of subexpressions, an open addressing table keyed by hash */
+    struct MemoSlot *memo;
+    size_t memo_slots;
+    size_t memo_used;
+    /* holds the bodies of the slots of `memo` until it is emptied */
+    struct Arena memo_arena;
+
+    /* holds the temporaries of the last update */
+    struct Arena arena;
+
+    /* value of the last update, if it succeeded */
+    double value;
+    bool has_value;
+
+    /* committed results, `$1` is results[0] */
+    double *results;
+    unsigned int result_count;
+    unsigned int result_capacity;
+
+    MC3_SessionStats stats;
+};
+
+MC3_Session *MC3_session_new(void) {
+    MC3_Session *session = calloc(1, sizeof(MC3_Session));
+
+    if (session != NULL) {
+        session->arena = new_arena();
+        session->program_arena = new_arena();
+        session->memo_arena = new_arena();
+        session->lex_error = MC3_NO_ERROR;
+    }
+
+    return session;
+}
+
+void MC3_session_free(MC3_Session *session) {
+    if (session == NULL)
+        return;
+
+    free(session->text);
+    free(session->tokens);
+    free(session->ends);
+    free(session->memo);
+    free(session->results);
+    free_arena(&session->program_arena);
+    free_arena(&session->memo_arena);
+    free_arena(&session->arena);
+    free(session);
+}
+
+/**
+ * @brief makes the names of the identifiers among the tokens from `first` to
+ * `last` point into `text`.
+ */
+static void rebase_names(struct Token *tokens, unsigned int first,
+                         unsigned int last, const char *text) {
+    for (unsigned int i = first; i < last; i++) {
+        if (tokens[i].type == TYPE_IDENTIFIER)
+            tokens[i].name = &text[tokens[i].offset];
+    }
+}
+
+/**
+ * @brief grows the text and token arrays of `session` to hold `length`
+ * characters and `count` tokens, keeping their contents.
+ */
+static bool reserve_session(MC3_Session *session, size_t length,
+                            unsigned int count) {
+    if (length > session->text_capacity || session->text == NULL) {
+        size_t capacity = session->text_capacity ? session->text_capacity : 64;
+        while (capacity < length)
+            capacity *= 2;
+
+        /* a new buffer, so the names of the tokens can be moved over */
+        char *text = malloc(capacity);
+        if (text == NULL)
+            return false;
+
+        if (session->length > 0)
+            memcpy(text, session->text, session->length);
+        free(session->text);
+        session->text = text;
+        session->text_capacity = capacity;
+        rebase_names(session->tokens, 0, session->token_count, text);
+    }
+
+    if (count > session->token_capacity) {
+        unsigned int capacity =
+            session->token_capacity ? session->token_capacity : 64;
+        while (capacity < count)
+            capacity *= 2;
+
+        struct Token *tokens =
+            realloc(session->tokens, capacity * sizeof(struct Token));
+        if (tokens == NULL)
+            return false;
+        session->tokens = tokens;
+
+        size_t *ends = realloc(session->ends, capacity * sizeof(size_t));
+        if (ends == NULL)
+            return false;
+        session->ends = ends;
+        session->token_capacity = capacity;
+    }
+
+    return true;
+}
+
+static bool is_operand_token(enum TokenType type) {
+    return type == TYPE_INTEGER || type == TYPE_DECIMAL ||
+           type == TYPE_CONSTANT || type == TYPE_IDENTIFIER;
+}
+
+/**
+ * @brief checks whether `new` can replace `old` without changing the shape of
+ * the parse: both are numbers or constants, or both are the same token apart
+ * from their offset.
+ */
+static bool same_shape(const struct Token *old, const struct Token *new) {
+    if (old->type != TYPE_IDENTIFIER && is_operand_token(old->type))
+        return new->type != TYPE_IDENTIFIER && is_operand_token(new->type);
+
+    if (old->type != new->type)
+        return false;
+
+    if (old->type == TYPE_IDENTIFIER)
+        return old->name_len == new->name_len &&
+               memcmp(old->name, new->name, old->name_len) == 0;
+
+    return old->type != TYPE_FUNCTION || old->keyword == new->keyword;
+}
+
+/**
+ * @return the number of characters `a` and `b` start with in common, comparing
+ * a word at a time.
+ */
+static size_t common_prefix(const char *a, const char *b, size_t length) {
+    size_t count = 0;
+
+    for (; count + 8 <= length; count += 8) {
+        uint64_t x, y;
+        memcpy(&x, &a[count], sizeof(x));
+        memcpy(&y, &b[count], sizeof(y));
+
+        if (x != y)
+            break;
+    }
+
+    while (count < length && a[count] == b[count])
+        count++;
+
+    return count;
+}
+
+/**
+ * @return the number of characters the strings ending at `a_end` and `b_end`
+ * end with in common, looking at most `length` characters back.
+ */
+static size_t common_suffix(const char *a_end, const char *b_end,
+                            size_t length) {
+    size_t count = 0;
+
+    for (; count + 8 <= length; count += 8) {
+        uint64_t x, y;
+        memcpy(&x, a_end - count - 8, sizeof(x));
+        memcpy(&y, b_end - count - 8, sizeof(y));
+
+        if (x != y)
+            break;
+    }
+
+    while (count < length && *(a_end - count - 1) == *(b_end - count - 1))
+        count++;
+
+    return count;
+}
+
+/**
+ * @brief replaces the text of `session` by `equ`, lexing only the tokens the
+ * edit touched. Tokens lexed from `equ` are kept in the arena until they are
+ * copied in.
+ *
+ * @return false if out of memory, in which case the session is unchanged.
+ */
+static bool relex(MC3_Session *session, const char *equ, size_t length) {
+    const char *old = session->text;
+    const size_t old_length = session->length;
+    const size_t shorter = (length < old_length) ? length : old_length;
+    const unsigned int count = session->token_count;
+    STATS(const uint64_t start = stats_now();)
+
+    const size_t prefix = common_prefix(old, equ, shorter);
+    const size_t suffix =
+        shorter ? common_suffix(old + old_length, equ + length,
+                                shorter - prefix)
+                : 0;
+
+    /* the first token which read an edited character, the characters the
+       lexer looked at past a token being part of it */
+    unsigned int first = 0;
+    unsigned int last = count;
+    while (first < last) {
+        const unsigned int middle = first + (last - first) / 2;
+
+        if (session->ends[middle] + LEXER_LOOKAHEAD > prefix)
+            last = middle;
+        else
+            first = middle + 1;
+    }
+
+    struct Lexer lexer = new_lexer(equ, length);
+    lexer.pos = (first > 0) ? session->ends[first - 1] : 0;
+
+    struct Token *lexed = NULL;
+    size_t *lexed_ends = NULL;
+    unsigned int lexed_count = 0;
+    unsigned int lexed_capacity = 0;
+    /* old token the rest of the text is lexed the same from, if resynced */
+    unsigned int kept = first;
+    bool resynced = false;
+    MC3_ErrorCode error;
+
+    for (;;) {
+        if (lexed_count == lexed_capacity) {
+            unsigned int ends_capacity = lexed_capacity;
+
+            lexed = arena_grow(&session->arena, lexed, &lexed_capacity,
+                               lexed_count, sizeof(struct Token));
+            lexed_ends = arena_grow(&session->arena, lexed_ends,
+                                    &ends_capacity, lexed_count,
+                                    sizeof(size_t));
+            if (lexed == NULL || lexed_ends == NULL)
+                return false;
+        }
+
+        struct Token *token = &lexed[lexed_count];
+        error = next_token(&lexer, token);
+
+        if (error != MC3_NO_ERROR || token->type == TYPE_EMPTY)
+            break;
+
+        if (token->offset >= length - suffix) {
+            /* the same characters follow in the old text, so if an old token
+               started at the same place, every token from there on is the
+               same too */
+            const size_t old_offset = token->offset + old_length - length;
+
+            while (kept < count && session->tokens[kept].offset < old_offset)
+                kept++;
+
+            if (kept < count && session->tokens[kept].offset == old_offset) {
+                resynced = true;
+                break;
+            }
+        }
+
+        lexed_ends[lexed_count++] = lexer.pos;
+    }
+
+    /* the old tokens the lexed ones replace */
+    const unsigned int replaced = (resynced ? kept : count) - first;
+    bool shape = (replaced == lexed_count) &&
+                 (resynced || error == session->lex_error);
+
+    for (unsigned int i = 0; i < lexed_count && shape; i++)
+        shape = same_shape(&session->tokens[first + i], &lexed[i]);
+
+    const unsigned int moved = resynced ? count - kept : 0;
+    const unsigned int new_count = first + lexed_count + moved;
+
+    if (!reserve_session(session, length, new_count + 1))
+        return false;
+
+    /* only the characters between the common prefix and suffix change */
+    if (length != old_length)
+        memmove(&session->text[length - suffix],
+                &session->text[old_length - suffix], suffix);
+    memcpy(&session->text[prefix], &equ[prefix], length - suffix - prefix);
+
+    if (resynced && (first + lexed_count != kept || length != old_length)) {
+        /* the kept tokens and the TYPE_EMPTY token after them */
+        const unsigned int to = first + lexed_count;
+
+        memmove(&session->tokens[to], &session->tokens[kept],
+                (moved + 1) * sizeof(struct Token));
+        memmove(&session->ends[to], &session->ends[kept],
+                (moved + 1) * sizeof(size_t));
+
+        for (unsigned int i = to; i <= new_count; i++) {
+            session->tokens[i].offset += length - old_length;
+            session->ends[i] += length - old_length;
+        }
+        rebase_names(session->tokens, to, new_count, session->text);
+    } else if (!resynced) {
+        /* a token which could not be lexed ends the tokens like the end of
+           the text does */
+        session->tokens[new_count].type = TYPE_EMPTY;
+        session->tokens[new_count].offset = lexed[lexed_count].offset;
+        session->ends[new_count] = lexed[lexed_count].offset;
+        session->lex_error = error;
+    }
+
+    memcpy(&session->tokens[first], lexed, lexed_count * sizeof(struct Token));
+    memcpy(&session->ends[first], lexed_ends, lexed_count * sizeof(size_t));
+    rebase_names(session->tokens, first, first + lexed_count, session->text);
+
+    session->length = length;
+    session->token_count = new_count;
+    session->edit_first = first;
+    session->edit_count = lexed_count;
+    session->same_shape = shape;
+    session->stats.tokens = new_count;
+    session->stats.relexed = lexed_count + resynced;
+
+    STATS(stats_phase(MC3_PHASE_TOKENIZE, stats_now() - start, 1);)
+    return true;
+}
+
+/**
+ * @brief hashes the body of `range`, an instruction at a time, with the
+ * values of the variables it reads.
+ */
+static uint64_t hash_range(const MC3_Session *session,
+                           const struct Range *range) {
+    const MC3_Program *body = &range->body;
+    uint64_t hash = mix_hash(range->op, body->result);
+
+    for (unsigned int i = 0; i < body->length; i++) {
+        const struct Instr *instr = &body->code[i];
+        const double leaf = (instr->op == OPC_VAR) ? session->vars[instr->lhs]
+                                                   : instr->value;
+        uint64_t bits;
+
+        memcpy(&bits, &leaf, sizeof(bits));
+        hash = mix_hash(hash, instr->op);
+        hash = mix_hash(hash, (uint64_t)instr->lhs << 32 | instr->rhs);
+
+        /* the index of a range in the table changes with its position */
+        if (instr->op == OPC_SUM || instr->op == OPC_PROD)
+            bits = hash_range(session, &body->ranges[(unsigned int)leaf]);
+        hash = mix_hash(hash, bits);
+    }
+
+    return hash;
+}
+
+/**
+ * @brief hashes instruction `index` of the program of `session` from the
+ * hashes of its operands.
+ */
+static void hash_instr(MC3_Session *session, unsigned int index) {
+    const struct Instr *instr = &session->program.code[index];
+    uint64_t hash;
+    double leaf;
+
+    if (instr->op == OPC_CONST || instr->op == OPC_VAR) {
+        leaf = (instr->op == OPC_CONST) ? instr->value
+                                        : session->vars[instr->lhs];
+        memcpy(&hash, &leaf, sizeof(hash));
+        hash = mix_hash(instr->op, hash);
+    } else {
+        hash = mix_hash(mix_hash(instr->op, session->hashes[instr->lhs]),
+                        session->hashes[instr->rhs]);
+    }
+
+    if (instr->op == OPC_SUM || instr->op == OPC_PROD) {
+        const unsigned int range = (unsigned int)instr->value;
+        hash = mix_hash(hash, hash_range(session,
+                                         &session->program.ranges[range]));
+    }
+
+    /* 0 marks empty memo slots */
+    session->hashes[index] = hash + (hash == 0);
+}
+
+/**
+ * @brief makes room in the memo of `session` for `count` more values. A full
+ * memo is emptied rather than grown past four slots per instruction of the
+ * current expression, which bounds it to the size of what is being edited.
+ */
+static bool reserve_memo(MC3_Session *session, unsigned int count) {
+    if ((session->memo_used + count) * 4 <= session->memo_slots * 3)
+        return true;
+
+    size_t slots = MEMO_MIN_SLOTS;
+    while (slots < (size_t)session->program.length * 4 || slots < count * 2)
+        slots *= 2;
+
+    if (slots > session->memo_slots) {
+        struct MemoSlot *memo = calloc(slots, sizeof(struct MemoSlot));
+        if (memo == NULL)
+            return false;
+
+        free(session->memo);
+        session->memo = memo;
+        session->memo_slots = slots;
+    } else {
+        memset(session->memo, 0,
+               session->memo_slots * sizeof(struct MemoSlot));
+    }
+
+    session->memo_used = 0;
+    reset_arena(&session->memo_arena);
+    return true;
+}
+
+/**
+ * @brief writes the body of `range` to `key` like hash_range hashes it, three
+ * words per instruction, with the bodies of the ranges inside it in place of
+ * their indexes. `key` may be NULL to only count the words.
+ *
+ * @return the number of words.
+ */
+static size_t range_key(const MC3_Session *session, const struct Range *range,
+                        uint64_t *key) {
+    const MC3_Program *body = &range->body;
+    size_t words = 1;
+
+    if (key != NULL)
+        key[0] = (uint64_t)range->op << 32 | body->result;
+
+    for (unsigned int i = 0; i < body->length; i++) {
+        const struct Instr *instr = &body->code[i];
+        const double leaf = (instr->op == OPC_VAR) ? session->vars[instr->lhs]
+                                                   : instr->value;
+
+        if (key != NULL) {
+            key[words] = instr->op;
+            key[words + 1] = (uint64_t)instr->lhs << 32 | instr->rhs;
+        }
+        words += 2;
+
+        if (instr->op == OPC_SUM || instr->op == OPC_PROD) {
+            words += range_key(session, &body->ranges[(unsigned int)leaf],
+                               (key != NULL) ? &key[words] : NULL);
+        } else {
+            if (key != NULL)
+                memcpy(&key[words], &leaf, sizeof(uint64_t));
+            words++;
+        }
+    }
+
+    return words;
+}
+
+/**
+ * @brief finds the slot of the memo of `session` holding `op` applied to
+ * `lhs` and `rhs`, and for a sum or product to the body `body`, or the empty
+ * slot it would go into.
+ */
+static struct MemoSlot *find_memo(const MC3_Session *session, uint64_t hash,
+                                  enum OpCode op, double lhs, double rhs,
+                                  const uint64_t *body, size_t body_words) {
+    const size_t mask = session->memo_slots - 1;
+    size_t index = hash & mask;
+
+    for (;; index = (index + 1) & mask) {
+        const struct MemoSlot *slot = &session->memo[index];
+
+        if (slot->hash == 0)
+            break;
+        if (slot->hash == hash && slot->op == op &&
+            memcmp(&slot->lhs, &lhs, sizeof(double)) == 0 &&
+            memcmp(&slot->rhs, &rhs, sizeof(double)) == 0 &&
+            slot->body_words == body_words &&
+            (body_words == 0 ||
+             memcmp(slot->body, body, body_words * sizeof(uint64_t)) == 0))
+            break;
+    }
+
+    return &session->memo[index];
+}
+
+/**
+ * @brief the value of the result `name` stands for: `ans` for the last one,
+ * `$n` for the nth.
+ */
+static bool session_variable(const MC3_Session *session, const char *name,
+                             size_t length, double *value) {
+    unsigned long number = 0;
+
+    if (length == 3 && memcmp(name, "ans", 3) == 0) {
+        number = session->result_count;
+    } else if (length > 1 && name[0] == '$') {
+        for (size_t i = 1; i < length && number <= session->result_count; i++) {
+            if (!isdigit((unsigned char)name[i]))
+                return false;
+            number = number * 10 + (name[i] - '0');
+        }
+    }
+
+    if (number == 0 || number > session->result_count)
+        return false;
+
+    *value = session->results[number - 1];
+    return true;
+}
+
+/**
+ * @brief looks up the value of every variable of the program of `session`.
+ *
+ * @return MC3_NO_ERROR, or MC3_UNBOUND_VARIABLE with the offset of the first
+ * variable which does not name a result written to `offset`.
+ */
+static MC3_ErrorCode bind_session_variables(MC3_Session *session,
+                                            size_t *offset) {
+    const struct MC3_Program *prog = &session->program;
+
+    for (unsigned int i = 0; i < prog->var_count; i++) {
+        const char *name = prog->var_names[i];
+
+        if (session_variable(session, name, strlen(name), &session->vars[i]))
+            continue;
+
+        /* the offset of the variable is only known to its token */
+        for (unsigned int j = 0; j < session->token_count; j++) {
+            const struct Token *token = &session->tokens[j];
+
+            if (token->type == TYPE_IDENTIFIER &&
+                token->name_len == strlen(name) &&
+                memcmp(token->name, name, token->name_len) == 0) {
+                *offset = token->offset;
+                break;
+            }
+        }
+        return MC3_UNBOUND_VARIABLE;
+    }
+
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief parses the tokens of `session` again, and prepares the parse to be
+ * evaluated with nothing known about it.
+ *
+ * @return MC3_NO_ERROR, or the error with its offset written to `offset`.
+ */
+static MC3_ErrorCode parse_session(MC3_Session *session, size_t *offset) {
+    struct MC3_Program *prog = &session->program;
+    struct Arena *arena = &session->program_arena;
+
+    reset_arena(arena);
+    memset(prog, 0, sizeof(*prog));
+
+    struct Parser parser = new_parser(session->text, session->length, prog,
+                                      arena);
+    parser.tokens = session->tokens;
+    parser.tokens_error = session->lex_error;
+
+    if (parse(&parser) != MC3_NO_ERROR) {
+        *offset = parser.error_offset;
+        return parser.error;
+    }
+
+    /* sums and products are summed like MC3_evaluate sums them */
+    if (optimize_ranges(prog, arena) != MC3_NO_ERROR) {
+        *offset = session->length;
+        return MC3_OUT_OF_MEMORY;
+    }
+
+    const unsigned int length = prog->length;
+    session->vars = arena_alloc(arena, (prog->var_count + 1) * sizeof(double));
+    session->parents = arena_alloc(arena, length * sizeof(unsigned int));
+    session->hashes = arena_alloc(arena, length * sizeof(uint64_t));
+    session->values = arena_alloc(arena, length * sizeof(double));
+    session->states = arena_alloc(arena, length);
+    session->stack = arena_alloc(arena, length * sizeof(unsigned int));
+    session->operands =
+        arena_alloc(arena, (session->token_count + 1) * sizeof(unsigned int));
+
+    if (session->vars == NULL || session->parents == NULL ||
+        session->hashes == NULL || session->values == NULL ||
+        session->states == NULL || session->stack == NULL ||
+        session->operands == NULL) {
+        *offset = session->length;
+        return MC3_OUT_OF_MEMORY;
+    }
+
+    const MC3_ErrorCode error = bind_session_variables(session, offset);
+    if (error != MC3_NO_ERROR)
+        return error;
+
+    /* operands are loaded in the order their tokens appear, except those in
+       the bodies of sums and products, which are parsed again instead */
+    unsigned int operand = 0;
+    for (unsigned int i = 0; i < session->token_count; i++) {
+        session->operands[i] = NO_INSTR;
+
+        if (!is_operand_token(session->tokens[i].type) ||
+            prog->range_count > 0)
+            continue;
+
+        while (prog->code[operand].op != OPC_CONST &&
+               prog->code[operand].op != OPC_VAR)
+            operand++;
+        session->operands[i] = operand++;
+    }
+
+    session->stats.operators = 0;
+    for (unsigned int i = 0; i < length; i++) {
+        const struct Instr *instr = &prog->code[i];
+
+        session->parents[i] = NO_INSTR;
+        if (has_operands(instr->op)) {
+            session->parents[instr->lhs] = i;
+            session->parents[instr->rhs] = i;
+            session->stats.operators++;
+        }
+        hash_instr(session, i);
+    }
+    memset(session->states, INSTR_STALE, length);
+
+    session->has_program = true;
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief loads the operands the last edit changed into the parse of
+ * `session`, and marks them and every operator above them stale.
+ *
+ * @return the number of instructions marked.
+ */
+static unsigned int patch_session(MC3_Session *session) {
+    const unsigned int last = session->edit_first + session->edit_count;
+    unsigned int marked = 0;
+
+    for (unsigned int i = session->edit_first; i < last; i++) {
+        const struct Token *token = &session->tokens[i];
+        unsigned int index = session->operands[i];
+
+        if (index == NO_INSTR || token->type == TYPE_IDENTIFIER)
+            continue;
+
+        struct Instr *instr = &session->program.code[index];
+        const double value =
+            (token->type == TYPE_INTEGER)   ? (double)token->ivalue
+            : (token->type == TYPE_DECIMAL) ? token->fvalue
+                                            : KEYWORDS[token->keyword].value;
+
+        if (memcmp(&instr->value, &value, sizeof(double)) == 0)
+            continue;
+
+        instr->value = value;
+        for (; index != NO_INSTR; index = session->parents[index]) {
+            hash_instr(session, index);
+            session->states[index] = INSTR_STALE;
+            marked++;
+        }
+    }
+
+    return marked;
+}
+
+/**
+ * @brief evaluates the parse of `session` from its result down, stopping at
+ * every instruction whose value is known or remembered.
+ */
+static double evaluate_session(MC3_Session *session) {
+    const struct Instr *code = session->program.code;
+    unsigned char *states = session->states;
+    double *values = session->values;
+    unsigned int *stack = session->stack;
+    unsigned int evaluated = 0;
+    unsigned int top = 0;
+    STATS(const uint64_t start = stats_now();)
+
+    stack[top++] = session->program.result;
+
+    while (top > 0) {
+        const unsigned int reg = stack[top - 1];
+        const struct Instr *instr = &code[reg];
+
+        if (states[reg] == INSTR_KNOWN) {
+            top--;
+        } else if (instr->op == OPC_CONST || instr->op == OPC_VAR) {
+            values[reg] = (instr->op == OPC_CONST) ? instr->value
+                                                   : session->vars[instr->lhs];
+            states[reg] = INSTR_KNOWN;
+            top--;
+        } else if (states[reg] == INSTR_STALE) {
+            states[reg] = INSTR_PENDING;
+            stack[top++] = instr->lhs;
+            if (instr->rhs != instr->lhs)
+                stack[top++] = instr->rhs;
+        } else {
+            const bool range = instr->op == OPC_SUM || instr->op == OPC_PROD;
+            const double lhs = values[instr->lhs];
+            const double rhs = values[instr->rhs];
+            uint64_t *body = NULL;
+            size_t body_words = 0;
+
+            /* without room for its body, a range is evaluated and not
+               remembered */
+            if (range) {
+                const struct Range *r =
+                    &session->program.ranges[(unsigned int)instr->value];
+                body_words = range_key(session, r, NULL);
+                body = arena_alloc(&session->arena,
+                                   body_words * sizeof(uint64_t));
+                if (body != NULL)
+                    range_key(session, r, body);
+            }
+
+            struct MemoSlot *slot =
+                (range && body == NULL)
+                    ? NULL
+                    : find_memo(session, session->hashes[reg], instr->op, lhs,
+                                rhs, body, body_words);
+            states[reg] = INSTR_KNOWN;
+            top--;
+
+            if (slot != NULL && slot->hash != 0) {
+                values[reg] = slot->value;
+                continue;
+            }
+
+            values[reg] = range ? evaluate_range(&session->program, instr, lhs,
+                                                 rhs, session->vars)
+                                : apply_operator(instr->op, lhs, rhs);
+            evaluated++;
+
+            /* the body outlives this update in the memo */
+            if (range && slot != NULL) {
+                uint64_t *kept = arena_alloc(&session->memo_arena,
+                                             body_words * sizeof(uint64_t));
+                if (kept != NULL)
+                    memcpy(kept, body, body_words * sizeof(uint64_t));
+                slot = (kept != NULL) ? slot : NULL;
+                body = kept;
+            }
+
+            if (slot != NULL) {
+                *slot = (struct MemoSlot){
+                    .hash = session->hashes[reg],
+                    .op = instr->op,
+                    .lhs = lhs,
+                    .rhs = rhs,
+                    .body = body,
+                    .body_words = body_words,
+                    .value = values[reg],
+                };
+                session->memo_used++;
+            }
+        }
+    }
+
+    session->stats.evaluated = evaluated;
+
+    STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start, 1);)
+    return values[session->program.result];
+}
+
+/**
+ * @brief makes `equ` the text of `session` and evaluates it. Only the tokens
+ * the change from the previous text touched are lexed again, and only the
+ * subexpressions which were not evaluated before are evaluated. `ans` stands
+ * for the last committed result and `$1`, `$2`, ... for the results in the
+ * order they were committed.
+ *
+ * @param err if parameter is NULL, then the error will not be set. Otherwise
+ * the error code, and the byte offset in `equ` it was found at, are written.
+ * @return the value, or 0 if an error occured.
+ */
+double MC3_session_update(MC3_Session *session, const char *equ,
+                          size_t length, MC3_Error *err) {
+    session->has_value = false;
+    session->stats.evaluated = 0;
+    reset_arena(&session->arena);
+
+    if (!relex(session, equ, length)) {
+        session->has_program = false;
+        write_context_error(err, MC3_OUT_OF_MEMORY, length);
+        return 0.0;
+    }
+
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    size_t offset = length;
+    unsigned int marked;
+
+    if (session->has_program && session->same_shape &&
+        session->program.range_count == 0) {
+        marked = patch_session(session);
+    } else {
+        session->has_program = false;
+        session->stats.operators = 0;
+        error = parse_session(session, &offset);
+        marked = session->program.length;
+    }
+
+    if (error == MC3_NO_ERROR && !reserve_memo(session, marked))
+        error = MC3_OUT_OF_MEMORY;
+
+    if (error != MC3_NO_ERROR) {
+        STATS(stats_error(error);)
+        session->has_program = false;
+        write_context_error(err, error, offset);
+        return 0.0;
+    }
+
+    session->value = evaluate_session(session);
+    session->has_value = true;
+    write_context_error(err, MC3_NO_ERROR, 0);
+    return session->value;
+}
+
+/**
+ * @brief appends the value of the last update to the results of `session`.
+ *
+ * @return the number of the result, n for `$n`, or 0 if the last update
+ * failed or memory ran out.
+ */
+unsigned int MC3_session_commit(MC3_Session *session) {
+    if (!session->has_value)
+        return 0;
+
+    if (session->result_count == session->result_capacity) {
+        unsigned int capacity =
+            session->result_capacity ? session->result_capacity * 2 : 16;
+        double *results =
+            realloc(session->results, capacity * sizeof(double));
+
+        if (results == NULL)
+            return 0;
+
+        session->results = results;
+        session->result_capacity = capacity;
+    }
+
+    session->results[session->result_count++] = session->value;
+    session->has_value = false;
+    /* `ans` has a new value, the variables are bound again by a new parse */
+    session->has_program = false;
+    return session->result_count;
+}
+
+unsigned int MC3_session_result_count(const MC3_Session *session) {
+    return session->result_count;
+}
+
+/**
+ * @return result number `number` of `session`, counting from 1, or NaN if
+ * there is no such result.
+ */
+double MC3_session_result(const MC3_Session *session, unsigned int number) {
+    if (number == 0 || number > session->result_count)
+        return NAN;
+
+    return session->results[number - 1];
+}
+
+MC3_SessionStats MC3_session_stats(const MC3_Session *session) {
+    return session->stats;
+}
+
+/* ===== Sheet Functions =====*/
+
+/*
+ * The cells of a sheet refer to each other through the variables of their
+ * programs, which makes a graph with an edge from every cell to the cells
+ * using it. Cycles are refused when a cell is set, so the graph is a DAG.
+ * Setting a cell marks it and everything downstream of it dirty, and
+ * MC3_sheet_recalc evaluates only the dirty cells: each one waits for its
+ * dirty precedents, and cells whose precedents are done are evaluated on a
+ * pool of threads. Every thread takes cells from the back of its own deque,
+ * pushes the dependents it makes ready there, and steals from the front of
+ * the others' deques when it runs out.
+ */
+
+/* cell index marking an empty slot of the name table */
+#define NO_CELL UINT_MAX
+
+/* below this many dirty cells a recalculation runs on the calling thread,
+   handing cells between threads would cost more than evaluating them */
+#define SHEET_PARALLEL_CELLS 1024
+
+/* number of variables a cell is evaluated with on the stack before falling
+   back to the heap */
+#define SHEET_STACK_VARS 32
+
+struct SheetCell {
+    char *name;
+    /* the expression, or NULL for a value set directly or a cell which is only
+       referred to */
+    MC3_Program *prog;
+    /* cells the variables of `prog` refer to, indexed like MC3_var_name */
+    unsigned int *precedents;
+    /* cells whose expressions refer to this one */
+    unsigned int *dependents;
+    unsigned int dependent_count;
+    unsigned int dependent_capacity;
+    /* set once the cell has an expression or a value */
+    bool defined;
+    bool dirty;
+    /* marks of the last cycle check */
+    unsigned int visit;
+    /* dirty precedents still to be evaluated by the running recalculation */
+    atomic_uint pending;
+    double value;
+    MC3_ErrorCode error;
+};
+
+/* cells ready to be evaluated by one thread of a recalculation */
+struct SheetDeque {
+    pthread_mutex_t lock;
+    unsigned int *cells;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+};
+
+struct SheetWorker {
+    MC3_Sheet *sheet;
+    unsigned int id;
+};
+
+struct MC3_Sheet {
+    struct SheetCell *cells;
+    unsigned int count;
+    unsigned int capacity;
+
+    /* open addressing table of cell indexes, keyed by name */
+    unsigned int *slots;
+    size_t slot_count;
+
+    /* cells marked dirty since the last recalculation */
+    unsigned int *dirty;
+    unsigned int dirty_count;
+    unsigned int dirty_capacity;
+
+    /* last mark handed out by a cycle check */
+    unsigned int visit;
+
+    /* threads of the pool, counting the one calling MC3_sheet_recalc, which
+       takes deque 0 */
+    unsigned int threads;
+    pthread_t *ids;
+    struct SheetWorker *workers;
+    struct SheetDeque *deques;
+
+    pthread_mutex_t lock;
+    /* signalled when a recalculation is handed out or the pool stops */
+    pthread_cond_t work_ready;
+    /* signalled when the last thread leaves a recalculation */
+    pthread_cond_t idle;
+    /* incremented for every recalculation handed out */
+    unsigned long round;
+    /* pool threads working on a recalculation */
+    unsigned int active;
+    bool stop;
+    /* dirty cells of the running recalculation not evaluated yet */
+    atomic_uint remaining;
+};
+
+static void *sheet_worker_main(void *arg);
+
+static void stop_sheet_pool(MC3_Sheet *sheet, unsigned int started) {
+    pthread_mutex_lock(&sheet->lock);
+    sheet->stop = true;
+    pthread_cond_broadcast(&sheet->work_ready);
+    pthread_mutex_unlock(&sheet->lock);
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(sheet->ids[i + 1], NULL);
+}
+
+/**
+ * @brief Creates an empty sheet, recalculated on `threads` threads (0 for one
+ * per processor, 1 to evaluate on the calling thread only).
+ *
+ * @return the sheet, or NULL if out of memory.
+ */
+MC3_Sheet *MC3_sheet_new(unsigned int threads) {
+    if (threads == 0) {
+        const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (processors > 0) ? processors : 1;
+    }
+
+    MC3_Sheet *sheet = calloc(1, sizeof(MC3_Sheet));
+    if (sheet == NULL)
+        return NULL;
+
+    sheet->threads = threads;
+    sheet->ids = calloc(threads, sizeof(pthread_t));
+    sheet->workers = calloc(threads, sizeof(struct SheetWorker));
+    sheet->deques = calloc(threads, sizeof(struct SheetDeque));
+
+    if (sheet->ids == NULL || sheet->workers == NULL ||
+        sheet->deques == NULL) {
+        free(sheet->ids);
+        free(sheet->workers);
+        free(sheet->deques);
+        free(sheet);
+        return NULL;
+    }
+
+    pthread_mutex_init(&sheet->lock, NULL);
+    pthread_cond_init(&sheet->work_ready, NULL);
+    pthread_cond_init(&sheet->idle, NULL);
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_mutex_init(&sheet->deques[i].lock, NULL);
+        sheet->workers[i].sheet = sheet;
+        sheet->workers[i].id = i;
+    }
+
+    for (unsigned int i = 1; i < threads; i++) {
+        if (pthread_create(&sheet->ids[i], NULL, sheet_worker_main,
+                           &sheet->workers[i]) != 0) {
+            /* recalculations use the threads which did start */
+            for (unsigned int j = i; j < threads; j++)
+                pthread_mutex_destroy(&sheet->deques[j].lock);
+            sheet->threads = i;
+            break;
+        }
+    }
+
+    return sheet;
+}
+
+void MC3_sheet_free(MC3_Sheet *sheet) {
+    if (sheet == NULL)
+        return;
+
+    stop_sheet_pool(sheet, sheet->threads - 1);
+
+    for (unsigned int i = 0; i < sheet->count; i++) {
+        struct SheetCell *cell = &sheet->cells[i];
+
+        free(cell->name);
+        MC3_free_program(cell->prog);
+        free(cell->precedents);
+        free(cell->dependents);
+    }
+
+    for (unsigned int i = 0; i < sheet->threads; i++) {
+        pthread_mutex_destroy(&sheet->deques[i].lock);
+        free(sheet->deques[i].cells);
+    }
+    pthread_mutex_destroy(&sheet->lock);
+    pthread_cond_destroy(&sheet->work_ready);
+    pthread_cond_destroy(&sheet->idle);
+
+    free(sheet->cells);
+    free(sheet->slots);
+    free(sheet->dirty);
+    free(sheet->ids);
+    free(sheet->workers);
+    free(sheet->deques);
+    free(sheet);
+}
+
+/**
+ * @return the slot of the name table holding the cell `name`, or the empty
+ * slot it would go in.
+ */
+static unsigned int *find_cell_slot(const MC3_Sheet *sheet, const char *name,
+                                    size_t length) {
+    const size_t mask = sheet->slot_count - 1;
+    size_t index = hash_key(name, length) & mask;
+
+    for (;; index = (index + 1) & mask) {
+        const unsigned int cell = sheet->slots[index];
+
+        if (cell == NO_CELL || (strlen(sheet->cells[cell].name) == length &&
+                                memcmp(sheet->cells[cell].name, name,
+                                       length) == 0))
+            return &sheet->slots[index];
+    }
+}
+
+static unsigned int find_cell(const MC3_Sheet *sheet, const char *name,
+                              size_t length) {
+    if (sheet->slot_count == 0)
+        return NO_CELL;
+
+    return *find_cell_slot(sheet, name, length);
+}
+
+/**
+ * @brief doubles the name table of `sheet`, or creates it.
+ */
+static bool grow_cell_slots(MC3_Sheet *sheet) {
+    const size_t count = sheet->slot_count ? sheet->slot_count * 2 : 64;
+    unsigned int *slots = malloc(count * sizeof(unsigned int));
+
+    if (slots == NULL)
+        return false;
+
+    free(sheet->slots);
+    sheet->slots = slots;
+    sheet->slot_count = count;
+    memset(slots, 0xff, count * sizeof(unsigned int));
+
+    for (unsigned int i = 0; i < sheet->count; i++) {
+        const char *name = sheet->cells[i].name;
+        *find_cell_slot(sheet, name, strlen(name)) = i;
+    }
+
+    return true;
+}
+
+/**
+ * @brief finds the cell `name`, adding an undefined one if there is none.
+ *
+ * @return the index of the cell, or NO_CELL if out of memory.
+ */
+static unsigned int intern_cell(MC3_Sheet *sheet, const char *name,
+                                size_t length) {
+    unsigned int index = find_cell(sheet, name, length);
+    if (index != NO_CELL)
+        return index;
+
+    if ((sheet->count + 1) * 2 > sheet->slot_count && !grow_cell_slots(sheet))
+        return NO_CELL;
+
+    if (sheet->count == sheet->capacity) {
+        const unsigned int capacity =
+            sheet->capacity ? sheet->capacity * 2 : 64;
+        struct SheetCell *cells =
+            realloc(sheet->cells, capacity * sizeof(struct SheetCell));
+
+        if (cells == NULL)
+            return NO_CELL;
+        sheet->cells = cells;
+        sheet->capacity = capacity;
+    }
+
+    char *copy = malloc(length + 1);
+    if (copy == NULL)
+        return NO_CELL;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
+    struct SheetCell *cell = &sheet->cells[sheet->count];
+    memset(cell, 0, sizeof(*cell));
+    cell->name = copy;
+    cell->value = 0.0;
+    cell->error = MC3_UNBOUND_VARIABLE;
+
+    *find_cell_slot(sheet, name, length) = sheet->count;
+    return sheet->count++;
+}
+
+/**
+ * @brief checks that `name` is a single identifier, which expressions can
+ * refer to.
+ */
+static bool is_cell_name(const char *name) {
+    const size_t length = strlen(name);
+    struct Lexer lexer = new_lexer(name, length);
+    struct Token token;
+
+    return next_token(&lexer, &token) == MC3_NO_ERROR &&
+           token.type == TYPE_IDENTIFIER && token.offset == 0 &&
+           lexer.pos == length;
+}
+
+/**
+ * @brief marks cell `index` and every cell downstream of it dirty. Cells
+ * already dirty have their downstream marked already.
+ */
+static bool mark_dirty(MC3_Sheet *sheet, unsigned int index) {
+    if (sheet->cells[index].dirty)
+        return true;
+
+    unsigned int next = sheet->dirty_count;
+    sheet->cells[index].dirty = true;
+    sheet->dirty_count++;
+
+    /* the dirty list doubles as the work list, so it has room for every cell,
+       and so does the first deque, which a serial recalculation runs from */
+    if (sheet->dirty_capacity < sheet->count) {
+        const size_t size = sheet->capacity * sizeof(unsigned int);
+        unsigned int *dirty = realloc(sheet->dirty, size);
+        if (dirty != NULL)
+            sheet->dirty = dirty;
+
+        unsigned int *ready =
+            dirty ? realloc(sheet->deques[0].cells, size) : NULL;
+        if (ready == NULL) {
+            sheet->cells[index].dirty = false;
+            sheet->dirty_count--;
+            return false;
+        }
+        sheet->deques[0].cells = ready;
+        sheet->deques[0].capacity = sheet->capacity;
+        sheet->dirty_capacity = sheet->capacity;
+    }
+    sheet->dirty[next] = index;
+
+    for (; next < sheet->dirty_count; next++) {
+        const struct SheetCell *cell = &sheet->cells[sheet->dirty[next]];
+
+        for (unsigned int i = 0; i < cell->dependent_count; i++) {
+            struct SheetCell *dependent = &sheet->cells[cell->dependents[i]];
+
+            if (!dependent->dirty) {
+                dependent->dirty = true;
+                sheet->dirty[sheet->dirty_count++] = cell->dependents[i];
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief checks whether cell `from` is downstream of cell `to`, or is `to`.
+ * Uses `stack`, which must have room for every cell.
+ */
+static bool is_downstream(MC3_Sheet *sheet, unsigned int from,
+                          unsigned int to, unsigned int *stack) {
+    const unsigned int visit = ++sheet->visit;
+    unsigned int top = 0;
+
+    stack[top++] = to;
+    sheet->cells[to].visit = visit;
+
+    while (top > 0) {
+        const struct SheetCell *cell = &sheet->cells[stack[--top]];
+
+        if (cell == &sheet->cells[from])
+            return true;
+
+        for (unsigned int i = 0; i < cell->dependent_count; i++) {
+            struct SheetCell *dependent = &sheet->cells[cell->dependents[i]];
+
+            if (dependent->visit != visit) {
+                dependent->visit = visit;
+                stack[top++] = cell->dependents[i];
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief the byte offset of the first reference to `name` in `equ`.
+ */
+static size_t reference_offset(const char *equ, size_t length,
+                               const char *name) {
+    struct Lexer lexer = new_lexer(equ, length);
+    struct Token token;
+
+    while (next_token(&lexer, &token) == MC3_NO_ERROR &&
+           token.type != TYPE_EMPTY) {
+        if (token.type == TYPE_IDENTIFIER &&
+            token.name_len == strlen(name) &&
+            memcmp(token.name, name, token.name_len) == 0)
+            return token.offset;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief drops cell `index` from the dependents of its precedents, and its
+ * expression.
+ */
+static void unlink_cell(MC3_Sheet *sheet, unsigned int index) {
+    struct SheetCell *cell = &sheet->cells[index];
+
+    if (cell->prog == NULL)
+        return;
+
+    for (unsigned int i = 0; i < MC3_var_count(cell->prog); i++) {
+        struct SheetCell *precedent = &sheet->cells[cell->precedents[i]];
+
+        for (unsigned int j = 0; j < precedent->dependent_count; j++) {
+            if (precedent->dependents[j] == index) {
+                precedent->dependents[j] =
+                    precedent->dependents[--precedent->dependent_count];
+                break;
+            }
+        }
+    }
+
+    MC3_free_program(cell->prog);
+    free(cell->precedents);
+    cell->prog = NULL;
+    cell->precedents = NULL;
+}
+
+static bool add_dependent(struct SheetCell *cell, unsigned int dependent) {
+    if (cell->dependent_count == cell->dependent_capacity) {
+        const unsigned int capacity =
+            cell->dependent_capacity ? cell->dependent_capacity * 2 : 4;
+        unsigned int *dependents =
+            realloc(cell->dependents, capacity * sizeof(unsigned int));
+
+        if (dependents == NULL)
+            return false;
+        cell->dependents = dependents;
+        cell->dependent_capacity = capacity;
+    }
+
+    cell->dependents[cell->dependent_count++] = dependent;
+    return true;
+}
+
+/**
+ * @brief Sets cell `name` to the first `length` characters of `equ`. Its
+ * variables refer to other cells by name, which do not need to exist yet.
+ * The cell and every cell downstream of it are evaluated by the next
+ * MC3_sheet_recalc.
+ *
+ * @param err if parameter is NULL, then the error will not be set. Otherwise
+ * the error code, and the byte offset in `equ` it was found at, are written.
+ * @return MC3_NO_ERROR, MC3_UNEXPECTED_TOKEN if `name` is not an identifier,
+ * MC3_CIRCULAR_REFERENCE if the cell would depend on itself, or an error of
+ * the expression. The cell is unchanged on error.
+ */
+MC3_ErrorCode MC3_sheet_set(MC3_Sheet *sheet, const char *name,
+                            const char *equ, size_t length, MC3_Error *err) {
+    MC3_Error error = {MC3_NO_ERROR, 0};
+    MC3_Program *prog = NULL;
+    unsigned int *precedents = NULL;
+    unsigned int *stack = NULL;
+    unsigned int index = NO_CELL;
+
+    if (!is_cell_name(name)) {
+        error.code = MC3_UNEXPECTED_TOKEN;
+        goto done;
+    }
+
+    prog = compile_program(equ, length, &error);
+    if (prog == NULL)
+        goto done;
+
+    const unsigned int vars = MC3_var_count(prog);
+    index = intern_cell(sheet, name, strlen(name));
+    precedents = malloc((vars + 1) * sizeof(unsigned int));
+
+    if (index == NO_CELL || precedents == NULL) {
+        error.code = MC3_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    for (unsigned int i = 0; i < vars; i++) {
+        const char *var = MC3_var_name(prog, i);
+
+        precedents[i] = intern_cell(sheet, var, strlen(var));
+        if (precedents[i] == NO_CELL) {
+            error.code = MC3_OUT_OF_MEMORY;
+            goto done;
+        }
+    }
+
+    stack = malloc(sheet->count * sizeof(unsigned int));
+    if (stack == NULL) {
+        error.code = MC3_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    for (unsigned int i = 0; i < vars; i++) {
+        if (is_downstream(sheet, precedents[i], index, stack)) {
+            error.code = MC3_CIRCULAR_REFERENCE;
+            error.offset =
+                reference_offset(equ, length, MC3_var_name(prog, i));
+            goto done;
+        }
+    }
+
+    /* room for the new edges first, so the cell cannot be left half linked */
+    for (unsigned int i = 0; i < vars; i++) {
+        struct SheetCell *precedent = &sheet->cells[precedents[i]];
+
+        if (!add_dependent(precedent, index)) {
+            error.code = MC3_OUT_OF_MEMORY;
+            break;
+        }
+        precedent->dependent_count--;
+    }
+
+    if (error.code != MC3_NO_ERROR || !mark_dirty(sheet, index)) {
+        error.code = MC3_OUT_OF_MEMORY;
+        goto done;
+    }
+
+    unlink_cell(sheet, index);
+    for (unsigned int i = 0; i < vars; i++)
+        sheet->cells[precedents[i]].dependents
+            [sheet->cells[precedents[i]].dependent_count++] = index;
+
+    sheet->cells[index].prog = prog;
+    sheet->cells[index].precedents = precedents;
+    sheet->cells[index].defined = true;
+    prog = NULL;
+    precedents = NULL;
+
+done:
+    MC3_free_program(prog);
+    free(precedents);
+    free(stack);
+    write_context_error(err, error.code, error.offset);
+    return error.code;
+}
+
+/**
+ * @brief Sets cell `name` to `value`, replacing its expression if it had one.
+ * The cell and every cell downstream of it are evaluated by the next
+ * MC3_sheet_recalc.
+ *
+ * @return MC3_NO_ERROR, MC3_UNEXPECTED_TOKEN if `name` is not an identifier,
+ * or MC3_OUT_OF_MEMORY.
+ */
+MC3_ErrorCode MC3_sheet_set_value(MC3_Sheet *sheet, const char *name,
+                                  double value) {
+    if (!is_cell_name(name))
+        return MC3_UNEXPECTED_TOKEN;
+
+    const unsigned int index = intern_cell(sheet, name, strlen(name));
+    if (index == NO_CELL || !mark_dirty(sheet, index))
+        return MC3_OUT_OF_MEMORY;
+
+    struct SheetCell *cell = &sheet->cells[index];
+    unlink_cell(sheet, index);
+    cell->defined = true;
+    cell->value = value;
+    cell->error = MC3_NO_ERROR;
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief evaluates one cell, whose precedents are all up to date. A cell
+ * referring to a cell in error takes on that error.
+ */
+static void evaluate_cell(const MC3_Sheet *sheet, struct SheetCell *cell) {
+    if (!cell->defined) {
+        cell->error = MC3_UNBOUND_VARIABLE;
+        cell->value = 0.0;
+        return;
+    }
+
+    if (cell->prog == NULL)
+        return;
+
+    const unsigned int count = MC3_var_count(cell->prog);
+    double stack_vars[SHEET_STACK_VARS];
+    double *vars = stack_vars;
+
+    if (count > SHEET_STACK_VARS) {
+        vars = malloc(count * sizeof(double));
+        if (vars == NULL) {
+            cell->error = MC3_OUT_OF_MEMORY;
+            cell->value = 0.0;
+            return;
+        }
+    }
+
+    cell->error = MC3_NO_ERROR;
+    for (unsigned int i = 0; i < count; i++) {
+        const struct SheetCell *precedent = &sheet->cells[cell->precedents[i]];
+
+        if (precedent->error != MC3_NO_ERROR) {
+            cell->error = precedent->error;
+            break;
+        }
+        vars[i] = precedent->value;
+    }
+
+    cell->value = (cell->error == MC3_NO_ERROR)
+                      ? MC3_run(cell->prog, vars, &cell->error)
+                      : 0.0;
+
+    if (vars != stack_vars)
+        free(vars);
+}
+
+/**
+ * @brief evaluates the dirty cells on the calling thread, in an order where
+ * every cell follows its dirty precedents. Their `pending` counts must be set.
+ */
+static void recalc_serial(MC3_Sheet *sheet) {
+    unsigned int *ready = sheet->deques[0].cells;
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < sheet->dirty_count; i++) {
+        if (atomic_load_explicit(&sheet->cells[sheet->dirty[i]].pending,
+                                 memory_order_relaxed) == 0)
+            ready[count++] = sheet->dirty[i];
+    }
+
+    while (count > 0) {
+        struct SheetCell *cell = &sheet->cells[ready[--count]];
+        evaluate_cell(sheet, cell);
+
+        for (unsigned int i = 0; i < cell->dependent_count; i++) {
+            const unsigned int index = cell->dependents[i];
+
+            if (atomic_fetch_sub_explicit(&sheet->cells[index].pending, 1,
+                                          memory_order_relaxed) == 1)
+                ready[count++] = index;
+        }
+    }
+}
+
+/**
+ * @brief takes a ready cell for thread `id`: the last one it pushed if it has
+ * one, otherwise the oldest one of another thread.
+ *
+ * @return the cell, or NO_CELL if none is ready at the moment.
+ */
+static unsigned int take_cell(MC3_Sheet *sheet, unsigned int id) {
+    struct SheetDeque *own = &sheet->deques[id];
+    unsigned int cell = NO_CELL;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+        cell = own->cells[--own->tail];
+    pthread_mutex_unlock(&own->lock);
+
+    for (unsigned int i = 1; cell == NO_CELL && i < sheet->threads; i++) {
+        struct SheetDeque *victim = &sheet->deques[(id + i) % sheet->threads];
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail)
+            cell = victim->cells[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return cell;
+}
+
+static void push_cell(struct SheetDeque *deque, unsigned int cell) {
+    pthread_mutex_lock(&deque->lock);
+    deque->cells[deque->tail++] = cell;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * @brief evaluates ready cells on thread `id` until every dirty cell is done.
+ * A thread finding no ready cell waits for the others to finish the cells
+ * the rest depend on.
+ */
+static void run_cells(MC3_Sheet *sheet, unsigned int id) {
+    while (atomic_load(&sheet->remaining) > 0) {
+        const unsigned int index = take_cell(sheet, id);
+
+        if (index == NO_CELL) {
+            sched_yield();
+            continue;
+        }
+
+        struct SheetCell *cell = &sheet->cells[index];
+        evaluate_cell(sheet, cell);
+
+        /* the thread taking the last pending precedent of a dependent sees
+           the values of all of them */
+        for (unsigned int i = 0; i < cell->dependent_count; i++) {
+            const unsigned int dependent = cell->dependents[i];
+
+            if (atomic_fetch_sub(&sheet->cells[dependent].pending, 1) == 1)
+                push_cell(&sheet->deques[id], dependent);
+        }
+
+        atomic_fetch_sub(&sheet->remaining, 1);
+    }
+}
+
+static void *sheet_worker_main(void *arg) {
+    struct SheetWorker *worker = arg;
+    MC3_Sheet *sheet = worker->sheet;
+    unsigned long seen_round = 0;
+
+    /* the cells are already evaluated in parallel */
+    range_threads = 1;
+
+    for (;;) {
+        pthread_mutex_lock(&sheet->lock);
+        while (!sheet->stop && sheet->round == seen_round)
+            pthread_cond_wait(&sheet->work_ready, &sheet->lock);
+
+        if (sheet->stop) {
+            pthread_mutex_unlock(&sheet->lock);
+            return NULL;
+        }
+        seen_round = sheet->round;
+        pthread_mutex_unlock(&sheet->lock);
+
+        run_cells(sheet, worker->id);
+
+        pthread_mutex_lock(&sheet->lock);
+        if (--sheet->active == 0)
+            pthread_cond_signal(&sheet->idle);
+        pthread_mutex_unlock(&sheet->lock);
+    }
+}
+
+/**
+ * @brief gives every deque room for all the dirty cells, which is the most
+ * one thread can push in a recalculation.
+ */
+static bool reserve_deques(MC3_Sheet *sheet) {
+    for (unsigned int i = 1; i < sheet->threads; i++) {
+        struct SheetDeque *deque = &sheet->deques[i];
+
+        if (deque->capacity < sheet->dirty_count) {
+            unsigned int *cells =
+                realloc(deque->cells, sheet->dirty_capacity *
+                                          sizeof(unsigned int));
+            if (cells == NULL)
+                return false;
+            deque->cells = cells;
+            deque->capacity = sheet->dirty_capacity;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief evaluates the dirty cells on every thread of the pool. Their
+ * `pending` counts must be set.
+ */
+static void recalc_parallel(MC3_Sheet *sheet) {
+    unsigned int next = 0;
+
+    for (unsigned int i = 0; i < sheet->threads; i++) {
+        sheet->deques[i].head = 0;
+        sheet->deques[i].tail = 0;
+    }
+
+    /* the cells ready from the start are dealt out to all the threads */
+    for (unsigned int i = 0; i < sheet->dirty_count; i++) {
+        const unsigned int index = sheet->dirty[i];
+
+        if (atomic_load(&sheet->cells[index].pending) == 0) {
+            struct SheetDeque *deque = &sheet->deques[next];
+            deque->cells[deque->tail++] = index;
+            next = (next + 1) % sheet->threads;
+        }
+    }
+    atomic_store(&sheet->remaining, sheet->dirty_count);
+
+    pthread_mutex_lock(&sheet->lock);
+    sheet->round++;
+    sheet->active = sheet->threads - 1;
+    pthread_cond_broadcast(&sheet->work_ready);
+    pthread_mutex_unlock(&sheet->lock);
+
+    const unsigned int caller_range_threads = range_threads;
+    range_threads = 1;
+    run_cells(sheet, 0);
+    range_threads = caller_range_threads;
+
+    pthread_mutex_lock(&sheet->lock);
+    while (sheet->active > 0)
+        pthread_cond_wait(&sheet->idle, &sheet->lock);
+    pthread_mutex_unlock(&sheet->lock);
+}
+
+/**
+ * @brief Evaluates every cell set since the last recalculation and every cell
+ * downstream of one, each after the cells it refers to. Cells which do not
+ * depend on each other are evaluated in parallel.
+ *
+ * @return the number of cells evaluated.
+ */
+unsigned int MC3_sheet_recalc(MC3_Sheet *sheet) {
+    const unsigned int count = sheet->dirty_count;
+
+    for (unsigned int i = 0; i < count; i++) {
+        struct SheetCell *cell = &sheet->cells[sheet->dirty[i]];
+        unsigned int pending = 0;
+
+        if (cell->prog != NULL) {
+            for (unsigned int j = 0; j < MC3_var_count(cell->prog); j++)
+                pending += sheet->cells[cell->precedents[j]].dirty;
+        }
+        atomic_store_explicit(&cell->pending, pending, memory_order_relaxed);
+    }
+
+    if (sheet->threads > 1 && count >= SHEET_PARALLEL_CELLS &&
+        reserve_deques(sheet)) {
+        recalc_parallel(sheet);
+    } else {
+        recalc_serial(sheet);
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+        sheet->cells[sheet->dirty[i]].dirty = false;
+    sheet->dirty_count = 0;
+
+    return count;
+}
+
+/**
+ * @brief Gets the value of cell `name` as of the last MC3_sheet_recalc.
+ *
+ * @param err if parameter is NULL, then the error will not be set. Otherwise
+ * the error of the cell is written: MC3_UNBOUND_VARIABLE for a cell which was
+ * never set, or which refers to one, and the error of a cell it refers to for
+ * a cell referring to a cell in error, with offset 0. Errors of the
+ * expression itself are reported by MC3_sheet_set instead.
+ * @return the value, or 0.0 on error.
+ */
+double MC3_sheet_get(const MC3_Sheet *sheet, const char *name,
+                     MC3_Error *err) {
+    const unsigned int index = find_cell(sheet, name, strlen(name));
+
+    if (index == NO_CELL) {
+        write_context_error(err, MC3_UNBOUND_VARIABLE, 0);
+        return 0.0;
+    }
+
+    write_context_error(err, sheet->cells[index].error, 0);
+    return sheet->cells[index].value;
+}
+
+/* ===== Exact Arithmetic Functions =====*/
+
+/*
+ * MC3_evaluate_exact evaluates without rounding. Values are decimals: a signed
+ * integer mantissa and the number of its digits after the point. Mantissas
+ * are kept in limbs of nine decimal digits, least significant first, so text
+ * converts to and from them in linear time and scaling by a power of ten only
+ * shifts limbs and multiplies by a small number.
+ *
+ * Multiplication picks its algorithm by the length of the shorter operand:
+ * schoolbook, then Karatsuba, then Toom-3, and beyond that a number theoretic
+ * transform modulo three primes whose results are joined with the Chinese
+ * remainder theorem. Division is exact or an error, so it only needs to divide
+ * by the part of the divisor which is not made of twos and fives: by long
+ * division, or recursively with the multiplications above for long operands.
+ */
+
+#define LIMB_BASE 1000000000u
+#define LIMB_DIGITS 9
+
+/* shortest operand, in limbs, multiplied by Karatsuba, Toom-3 and transform.
+   Each algorithm only pays off once its overhead is spread over enough limbs.
+ */
+#define KARATSUBA_LIMBS 32
+#define TOOM3_LIMBS 160
+#define NTT_LIMBS 1500
+
+/* shortest divisor and quotient, in limbs, divided recursively */
+#define DIVIDE_RECURSIVE_LIMBS 64
+
+/* longest product, in limbs, the transform handles. The primes have roots of
+   unity of order 2^23, and a convolution of this length stays below their
+   product. Longer products are split by Toom-3 first. */
+#define NTT_MAX_LENGTH (1u << 23)
+
+/* longest mantissa an exact evaluation builds, about 600 million digits */
+#define EXACT_MAX_LIMBS ((size_t)1 << 26)
+
+/* largest powers of two and five which divide a limb without overflow */
+#define LIMB_POWER_OF_TWO (1u << 29)
+#define LIMB_POWER_OF_FIVE 244140625u
+
+static const uint32_t LIMB_POWERS_OF_TEN[LIMB_DIGITS] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+/**
+ * @return the length of the `length` limbs at `a` without their leading zero
+ * limbs.
+ */
+static size_t limbs_trim(const uint32_t *a, size_t length) {
+    while (length > 0 && a[length - 1] == 0)
+        length--;
+
+    return length;
+}
+
+/**
+ * @brief compares two trimmed numbers.
+ */
+static int limbs_compare(const uint32_t *a, size_t an, const uint32_t *b,
+                         size_t bn) {
+    if (an != bn)
+        return (an < bn) ? -1 : 1;
+
+    for (size_t i = an; i-- > 0;) {
+        if (a[i] != b[i])
+            return (a[i] < b[i]) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief adds the `bn` limbs at `b` to the `rn` limbs at `r`, bn <= rn.
+ *
+ * @return the carry out of the last limb of `r`.
+ */
+static uint32_t limbs_add(uint32_t *r, size_t rn, const uint32_t *b,
+                          size_t bn) {
+    uint32_t carry = 0;
+    size_t i = 0;
+
+    for (; i < bn; i++) {
+        const uint32_t sum = r[i] + b[i] + carry;
+        carry = (sum >= LIMB_BASE);
+        r[i] = carry ? sum - LIMB_BASE : sum;
+    }
+
+    for (; carry && i < rn; i++) {
+        carry = (r[i] == LIMB_BASE - 1);
+        r[i] = carry ? 0 : r[i] + 1;
+    }
+
+    return carry;
+}
+
+/**
+ * @brief subtracts the `bn` limbs at `b` from the `rn` limbs at `r`, which
+ * must not be smaller.
+ */
+static void limbs_sub(uint32_t *r, size_t rn, const uint32_t *b, size_t bn) {
+    uint32_t borrow = 0;
+    size_t i = 0;
+
+    for (; i < bn; i++) {
+        const uint32_t sub = b[i] + borrow;
+        borrow = (r[i] < sub);
+        r[i] = borrow ? r[i] + LIMB_BASE - sub : r[i] - sub;
+    }
+
+    for (; borrow && i < rn; i++) {
+        borrow = (r[i] == 0);
+        r[i] = borrow ? LIMB_BASE - 1 : r[i] - 1;
+    }
+}
+
+/**
+ * @brief multiplies the `length` limbs at `a` by `factor`, below LIMB_BASE,
+ * into `r`, which may be `a`.
+ *
+ * @return the limb carried out.
+ */
+static uint32_t limbs_mul_small(uint32_t *r, const uint32_t *a, size_t length,
+                                uint32_t factor) {
+    uint64_t carry = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        const uint64_t product = (uint64_t)a[i] * factor + carry;
+        r[i] = product % LIMB_BASE;
+        carry = product / LIMB_BASE;
+    }
+
+    return (uint32_t)carry;
+}
+
+/**
+ * @brief divides the `length` limbs at `a` by `divisor` into `r`, which may be
+ * `a`.
+ *
+ * @return the remainder.
+ */
+static uint32_t limbs_div_small(uint32_t *r, const uint32_t *a, size_t length,
+                                uint32_t divisor) {
+    uint64_t remainder = 0;
+
+    for (size_t i = length; i-- > 0;) {
+        const uint64_t current = remainder * LIMB_BASE + a[i];
+        r[i] = current / divisor;
+        remainder = current % divisor;
+    }
+
+    return (uint32_t)remainder;
+}
+
+static uint32_t limbs_mod_small(const uint32_t *a, size_t length,
+                                uint32_t divisor) {
+    uint64_t remainder = 0;
+
+    for (size_t i = length; i-- > 0;)
+        remainder = (remainder * LIMB_BASE + a[i]) % divisor;
+
+    return (uint32_t)remainder;
+}
+
+static bool limbs_mul(uint32_t *r, const uint32_t *a, size_t an,
+                      const uint32_t *b, size_t bn);
+
+/**
+ * @brief multiplies digit by digit, for short operands. Writes an + bn limbs.
+ */
+static void mul_schoolbook(uint32_t *r, const uint32_t *a, size_t an,
+                           const uint32_t *b, size_t bn) {
+    memset(r, 0, (an + bn) * sizeof(uint32_t));
+
+    for (size_t i = 0; i < bn; i++) {
+        const uint64_t factor = b[i];
+        uint64_t carry = 0;
+
+        if (factor == 0)
+            continue;
+
+        /* a product of two limbs plus two more stays below 2^64 */
+        for (size_t j = 0; j < an; j++) {
+            const uint64_t product = r[i + j] + a[j] * factor + carry;
+            r[i + j] = product % LIMB_BASE;
+            carry = product / LIMB_BASE;
+        }
+        r[i + an] = (uint32_t)carry;
+    }
+}
+
+/**
+ * @brief multiplies an operand at least twice as long as the other one piece
+ * by piece, each piece as long as the shorter operand.
+ */
+static bool mul_unbalanced(uint32_t *r, const uint32_t *a, size_t an,
+                           const uint32_t *b, size_t bn) {
+    uint32_t *product = malloc(2 * bn * sizeof(uint32_t));
+    if (product == NULL)
+        return false;
+
+    memset(r, 0, (an + bn) * sizeof(uint32_t));
+
+    for (size_t at = 0; at < an; at += bn) {
+        const size_t length = (an - at < bn) ? an - at : bn;
+
+        if (!limbs_mul(product, &a[at], length, b, bn)) {
+            free(product);
+            return false;
+        }
+        limbs_add(&r[at], an + bn - at, product, length + bn);
+    }
+
+    free(product);
+    return true;
+}
+
+/**
+ * @brief splits both operands in two halves of k limbs, a = a1 B^k + a0, and
+ * multiplies with three half length products instead of four:
+ * a0 b0, a1 b1 and (a0 + a1)(b0 + b1), from which the middle term is the
+ * other two subtracted. Needs bn <= an < 2 bn.
+ */
+static bool mul_karatsuba(uint32_t *r, const uint32_t *a, size_t an,
+                          const uint32_t *b, size_t bn) {
+    const size_t k = (an + 1) / 2;
+    const size_t b0n = (bn < k) ? bn : k;
+    const size_t length = an + bn;
+
+    /* a0 + a1 and b0 + b1 with a limb for the carry, and their product */
+    uint32_t *sa = malloc((4 * k + 4) * sizeof(uint32_t));
+    if (sa == NULL)
+        return false;
+    uint32_t *sb = &sa[k + 1];
+    uint32_t *middle = &sb[k + 1];
+
+    memcpy(sa, a, k * sizeof(uint32_t));
+    sa[k] = limbs_add(sa, k, &a[k], an - k);
+
+    memset(sb, 0, (k + 1) * sizeof(uint32_t));
+    memcpy(sb, b, b0n * sizeof(uint32_t));
+    sb[k] = limbs_add(sb, k, &b[b0n], bn - b0n);
+
+    /* a0 b0 fills the low 2k limbs, a1 b1 the rest */
+    memset(r, 0, 2 * k * sizeof(uint32_t));
+    bool done = limbs_mul(r, a, k, b, b0n) &&
+                limbs_mul(&r[2 * k], &a[k], an - k, &b[b0n], bn - b0n) &&
+                limbs_mul(middle, sa, k + 1, sb, k + 1);
+
+    if (done) {
+        limbs_sub(middle, 2 * k + 2, r, 2 * k);
+        limbs_sub(middle, 2 * k + 2, &r[2 * k], length - 2 * k);
+        limbs_add(&r[k], length - k, middle, limbs_trim(middle, 2 * k + 2));
+    }
+
+    free(sa);
+    return done;
+}
+
+/**
+ * @brief evaluates x0 + x1 t + x2 t^2 at t = 1, -1 and 2 into `one`, `minus`
+ * (its magnitude, the sign in `negative`) and `two`, each `width` limbs.
+ */
+static void toom3_evaluate(uint32_t *one, uint32_t *minus, bool *negative,
+                           uint32_t *two, size_t width, const uint32_t *x0,
+                           size_t n0, const uint32_t *x1, size_t n1,
+                           const uint32_t *x2, size_t n2) {
+    memset(one, 0, width * sizeof(uint32_t));
+    memcpy(one, x0, n0 * sizeof(uint32_t));
+    limbs_add(one, width, x2, n2);
+
+    /* x0 + x2 - x1 */
+    const size_t even = limbs_trim(one, width);
+    const size_t odd = limbs_trim(x1, n1);
+    *negative = limbs_compare(one, even, x1, odd) < 0;
+
+    memset(minus, 0, width * sizeof(uint32_t));
+    if (*negative) {
+        memcpy(minus, x1, odd * sizeof(uint32_t));
+        limbs_sub(minus, width, one, even);
+    } else {
+        memcpy(minus, one, even * sizeof(uint32_t));
+        limbs_sub(minus, width, x1, odd);
+    }
+    limbs_add(one, width, x1, n1);
+
+    /* ((x2 2) + x1) 2 + x0 */
+    memset(two, 0, width * sizeof(uint32_t));
+    memcpy(two, x2, n2 * sizeof(uint32_t));
+    limbs_mul_small(two, two, width, 2);
+    limbs_add(two, width, x1, n1);
+    limbs_mul_small(two, two, width, 2);
+    limbs_add(two, width, x0, n0);
+}
+
+/**
+ * @brief splits both operands in three parts of k limbs and multiplies with
+ * five third length products: the two outer parts, and the operands as
+ * polynomials evaluated at 1, -1 and 2. The five coefficients of the product
+ * are interpolated from these with exact divisions by 2 and 3. Needs
+ * bn <= an < 2 bn.
+ */
+static bool mul_toom3(uint32_t *r, const uint32_t *a, size_t an,
+                      const uint32_t *b, size_t bn) {
+    const size_t k = (an + 2) / 3;
+    const size_t length = an + bn;
+    /* values at 1, -1 and 2 are below 7 B^k, products below 49 B^2k */
+    const size_t width = k + 1;
+    const size_t wide = 2 * width;
+
+    const size_t b0n = (bn < k) ? bn : k;
+    const size_t b1n = (bn < 2 * k) ? bn - b0n : k;
+    const size_t b2n = bn - b0n - b1n;
+
+    uint32_t *buffer = malloc((6 * width + 6 * wide) * sizeof(uint32_t));
+    if (buffer == NULL)
+        return false;
+
+    uint32_t *a_one = buffer, *a_minus = &a_one[width];
+    uint32_t *a_two = &a_minus[width], *b_one = &a_two[width];
+    uint32_t *b_minus = &b_one[width], *b_two = &b_minus[width];
+    uint32_t *c0 = &b_two[width], *c4 = &c0[wide], *r_one = &c4[wide];
+    uint32_t *r_minus = &r_one[wide], *r_two = &r_minus[wide];
+    uint32_t *odd = &r_two[wide];
+    bool a_negative, b_negative;
+
+    toom3_evaluate(a_one, a_minus, &a_negative, a_two, width, a, k, &a[k], k,
+                   &a[2 * k], an - 2 * k);
+    toom3_evaluate(b_one, b_minus, &b_negative, b_two, width, b, b0n,
+                   &b[b0n], b1n, &b[b0n + b1n], b2n);
+
+    memset(c0, 0, 2 * wide * sizeof(uint32_t));
+    bool done = limbs_mul(c0, a, k, b, b0n) &&
+                limbs_mul(c4, &a[2 * k], an - 2 * k, &b[b0n + b1n], b2n) &&
+                limbs_mul(r_one, a_one, width, b_one, width) &&
+                limbs_mul(r_minus, a_minus, width, b_minus, width) &&
+                limbs_mul(r_two, a_two, width, b_two, width);
+
+    if (!done) {
+        free(buffer);
+        return false;
+    }
+
+    /* r(1) + r(-1) = 2 (c0 + c2 + c4), r(1) - r(-1) = 2 (c1 + c3) */
+    memcpy(odd, r_one, wide * sizeof(uint32_t));
+    if (a_negative != b_negative) {
+        limbs_add(odd, wide, r_minus, wide);
+        limbs_sub(r_one, wide, r_minus, wide);
+    } else {
+        limbs_sub(odd, wide, r_minus, wide);
+        limbs_add(r_one, wide, r_minus, wide);
+    }
+
+    /* c2, into r_one */
+    uint32_t *c2 = r_one;
+    limbs_div_small(c2, c2, wide, 2);
+    limbs_sub(c2, wide, c0, wide);
+    limbs_sub(c2, wide, c4, wide);
+
+    /* c1 + c3, into odd */
+    limbs_div_small(odd, odd, wide, 2);
+
+    /* (r(2) - c0 - 4 c2 - 16 c4) / 2 = c1 + 4 c3, into r_two */
+    limbs_sub(r_two, wide, c0, wide);
+    limbs_mul_small(r_minus, c2, wide, 4);
+    limbs_sub(r_two, wide, r_minus, wide);
+    limbs_mul_small(r_minus, c4, wide, 16);
+    limbs_sub(r_two, wide, r_minus, wide);
+    limbs_div_small(r_two, r_two, wide, 2);
+
+    /* c3 = ((c1 + 4 c3) - (c1 + c3)) / 3, then c1 */
+    uint32_t *c3 = r_two;
+    uint32_t *c1 = odd;
+    limbs_sub(c3, wide, odd, wide);
+    limbs_div_small(c3, c3, wide, 3);
+    limbs_sub(c1, wide, c3, wide);
+
+    const uint32_t *coefficients[5] = {c0, c1, c2, c3, c4};
+    memset(r, 0, length * sizeof(uint32_t));
+    for (size_t i = 0; i < 5; i++) {
+        const size_t at = i * k;
+        const size_t n = limbs_trim(coefficients[i], wide);
+
+        if (n > 0)
+            limbs_add(&r[at], length - at, coefficients[i], n);
+    }
+
+    free(buffer);
+    return true;
+}
+
+/* A prime p = c 2^k + 1 for number theoretic transforms, with the constants
+   of Montgomery multiplication modulo p for R = 2^32. */
+struct NttPrime {
+    uint32_t modulus;
+    /* -1 / p mod R */
+    uint32_t negative_inverse;
+    /* R^2 mod p */
+    uint32_t r_squared;
+    /* a primitive root modulo p */
+    uint32_t root;
+};
+
+static const struct NttPrime NTT_PRIMES[3] = {
+    {998244353, 0x3b7fffff, 932051910, 3},
+    {167772161, 0x09ffffff, 40265974, 3},
+    {469762049, 0x1bffffff, 460175152, 3},
+};
+
+/* constants of the Chinese remainder theorem for the primes above: 1 / p0
+   mod p1, 1 / (p0 p1) mod p2, and p0 p1 in two limbs */
+#define NTT_INVERSE_01 47450712u
+#define NTT_INVERSE_012 115990628u
+#define NTT_PRODUCT_01_HIGH 167477612u
+#define NTT_PRODUCT_01_LOW 308856833u
+
+/**
+ * @return value / R mod p, for a value below p R.
+ */
+static uint32_t montgomery_reduce(uint64_t value, const struct NttPrime *p) {
+    const uint32_t m = (uint32_t)value * p->negative_inverse;
+    const uint32_t reduced = (value + (uint64_t)m * p->modulus) >> 32;
+
+    return (reduced >= p->modulus) ? reduced - p->modulus : reduced;
+}
+
+static uint32_t montgomery_mul(uint32_t a, uint32_t b,
+                               const struct NttPrime *p) {
+    return montgomery_reduce((uint64_t)a * b, p);
+}
+
+/**
+ * @return `base` to the power `exponent`, both in Montgomery form.
+ */
+static uint32_t montgomery_pow(uint32_t base, uint64_t exponent,
+                               const struct NttPrime *p) {
+    uint32_t result = montgomery_reduce(p->r_squared, p);
+
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1)
+            result = montgomery_mul(result, base, p);
+        base = montgomery_mul(base, base, p);
+    }
+
+    return result;
+}
+
+/**
+ * @brief transforms the `n` values at `a` in place, in Montgomery form.
+ * `roots` holds the first n / 2 powers of a root of unity of order n.
+ */
+static void ntt(uint32_t *a, size_t n, const uint32_t *roots,
+                const struct NttPrime *p) {
+    const uint32_t modulus = p->modulus;
+
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j |= bit;
+
+        if (i < j) {
+            const uint32_t swap = a[i];
+            a[i] = a[j];
+            a[j] = swap;
+        }
+    }
+
+    for (size_t half = 1; half < n; half <<= 1) {
+        const size_t step = n / (2 * half);
+
+        for (size_t i = 0; i < n; i += 2 * half) {
+            for (size_t j = 0; j < half; j++) {
+                const uint32_t u = a[i + j];
+                const uint32_t v =
+                    montgomery_mul(a[i + j + half], roots[j * step], p);
+
+                a[i + j] = (u + v >= modulus) ? u + v - modulus : u + v;
+                a[i + j + half] = (u >= v) ? u - v : u + modulus - v;
+            }
+        }
+    }
+}
+
+/**
+ * @brief computes the cyclic convolution of `a` and `b` modulo prime `p` into
+ * `result`, `n` values, plain rather than in Montgomery form. `fb` is scratch
+ * space of n values, unused when squaring.
+ */
+static void ntt_convolve(uint32_t *result, uint32_t *fb, uint32_t *roots,
+                         size_t n, const uint32_t *a, size_t an,
+                         const uint32_t *b, size_t bn,
+                         const struct NttPrime *p) {
+    const bool square = (a == b && an == bn);
+    const uint32_t one = montgomery_reduce(p->r_squared, p);
+    const uint32_t root = montgomery_pow(
+        montgomery_mul(p->root, p->r_squared, p), (p->modulus - 1) / n, p);
+
+    roots[0] = one;
+    for (size_t i = 1; i < n / 2; i++)
+        roots[i] = montgomery_mul(roots[i - 1], root, p);
+
+    /* limbs are below 2^30, so multiplying by R^2 reduces them in one go */
+    for (size_t i = 0; i < n; i++)
+        result[i] = (i < an) ? montgomery_mul(a[i], p->r_squared, p) : 0;
+    ntt(result, n, roots, p);
+
+    if (square) {
+        for (size_t i = 0; i < n; i++)
+            result[i] = montgomery_mul(result[i], result[i], p);
+    } else {
+        for (size_t i = 0; i < n; i++)
+            fb[i] = (i < bn) ? montgomery_mul(b[i], p->r_squared, p) : 0;
+        ntt(fb, n, roots, p);
+
+        for (size_t i = 0; i < n; i++)
+            result[i] = montgomery_mul(result[i], fb[i], p);
+    }
+
+    /* the inverse transform is the forward one with the outputs reversed */
+    ntt(result, n, roots, p);
+    for (size_t i = 1, j = n - 1; i < j; i++, j--) {
+        const uint32_t swap = result[i];
+        result[i] = result[j];
+        result[j] = swap;
+    }
+
+    /* dividing by n leaves Montgomery form at the same time: 1 / n is plain */
+    const uint32_t inverse_n = p->modulus - (p->modulus - 1) / n;
+    for (size_t i = 0; i < n; i++)
+        result[i] = montgomery_mul(result[i], inverse_n, p);
+}
+
+/**
+ * @brief multiplies by convolving the limbs modulo three primes. Every
+ * coefficient of the convolution is below the product of the primes, so the
+ * three residues determine it, and it is rebuilt with the Chinese remainder
+ * theorem in Garner's form: x = x0 + p0 t1 + p0 p1 t2.
+ */
+static bool mul_ntt(uint32_t *r, const uint32_t *a, size_t an,
+                    const uint32_t *b, size_t bn) {
+    size_t n = 1;
+    while (n < an + bn)
+        n <<= 1;
+
+    uint32_t *residues = malloc(5 * n * sizeof(uint32_t));
+    if (residues == NULL)
+        return false;
+    uint32_t *fb = &residues[3 * n];
+    uint32_t *roots = &residues[4 * n];
+
+    for (int i = 0; i < 3; i++)
+        ntt_convolve(&residues[i * n], fb, roots, n, a, an, b, bn,
+                     &NTT_PRIMES[i]);
+
+    const uint64_t p0 = NTT_PRIMES[0].modulus;
+    const uint64_t p1 = NTT_PRIMES[1].modulus;
+    const uint64_t p2 = NTT_PRIMES[2].modulus;
+    uint64_t carry = 0;
+
+    for (size_t i = 0; i < an + bn; i++) {
+        const uint64_t x0 = residues[i];
+        const uint64_t x1 = residues[n + i];
+        const uint64_t x2 = residues[2 * n + i];
+
+        const uint64_t t1 = (x1 + p1 - x0 % p1) % p1 * NTT_INVERSE_01 % p1;
+        const uint64_t known = (x0 + p0 * t1) % p2;
+        const uint64_t t2 = (x2 + p2 - known) % p2 * NTT_INVERSE_012 % p2;
+
+        /* x = low + high B, both below 2^60 */
+        const uint64_t low = x0 + p0 * t1 + NTT_PRODUCT_01_LOW * t2 + carry;
+        r[i] = low % LIMB_BASE;
+        carry = low / LIMB_BASE + NTT_PRODUCT_01_HIGH * t2;
+    }
+
+    free(residues);
+    return true;
+}
+
+/**
+ * @brief multiplies the `an` limbs at `a` by the `bn` limbs at `b` into `r`,
+ * which must not overlap them, with the algorithm suiting their lengths.
+ * Writes an + bn limbs.
+ *
+ * @return false if out of memory.
+ */
+static bool limbs_mul(uint32_t *r, const uint32_t *a, size_t an,
+                      const uint32_t *b, size_t bn) {
+    const size_t length = an + bn;
+    bool done = true;
+
+    an = limbs_trim(a, an);
+    bn = limbs_trim(b, bn);
+    if (an < bn) {
+        const uint32_t *swap = a;
+        a = b;
+        b = swap;
+        an ^= bn;
+        bn ^= an;
+        an ^= bn;
+    }
+
+    if (bn == 0) {
+        memset(r, 0, length * sizeof(uint32_t));
+        return true;
+    }
+
+    if (bn < KARATSUBA_LIMBS) {
+        mul_schoolbook(r, a, an, b, bn);
+    } else if (bn >= NTT_LIMBS && an + bn <= NTT_MAX_LENGTH) {
+        done = mul_ntt(r, a, an, b, bn);
+    } else if (an >= 2 * bn) {
+        done = mul_unbalanced(r, a, an, b, bn);
+    } else if (bn < TOOM3_LIMBS) {
+        done = mul_karatsuba(r, a, an, b, bn);
+    } else {
+        done = mul_toom3(r, a, an, b, bn);
+    }
+
+    memset(&r[an + bn], 0, (length - an - bn) * sizeof(uint32_t));
+    return done;
+}
+
+/**
+ * @brief divides the `un` limbs at `u` by the `n` limbs at `v`, n >= 2, by
+ * Knuth's algorithm D: the top limb of the divisor must be at least half the
+ * base, which makes the quotient limb estimated from the top two limbs at most
+ * two too large, and u < B^(un - n) v. Writes un - n limbs of quotient, and
+ * leaves the remainder in the low n limbs of `u`.
+ */
+static void divide_schoolbook(uint32_t *quotient, uint32_t *u, size_t un,
+                              const uint32_t *v, size_t n) {
+    const uint64_t top = v[n - 1];
+    const uint64_t next = v[n - 2];
+
+    for (size_t j = un - n; j-- > 0;) {
+        const uint64_t head = (uint64_t)u[j + n] * LIMB_BASE + u[j + n - 1];
+        uint64_t guess = head / top;
+        uint64_t rest = head % top;
+
+        while (guess >= LIMB_BASE ||
+               guess * next > rest * LIMB_BASE + u[j + n - 2]) {
+            guess--;
+            rest += top;
+            if (rest >= LIMB_BASE)
+                break;
+        }
+
+        /* u[j..j+n] -= guess v */
+        uint64_t carry = 0;
+        int64_t borrow = 0;
+        for (size_t i = 0; i < n; i++) {
+            const uint64_t product = guess * v[i] + carry;
+            carry = product / LIMB_BASE;
+
+            int64_t limb = (int64_t)u[i + j] - (int64_t)(product % LIMB_BASE) +
+                           borrow;
+            borrow = (limb < 0) ? -1 : 0;
+            u[i + j] = (uint32_t)((limb < 0) ? limb + LIMB_BASE : limb);
+        }
+        int64_t last = (int64_t)u[j + n] - (int64_t)carry + borrow;
+
+        /* the guess was one too large: add v back */
+        if (last < 0) {
+            guess--;
+            last += limbs_add(&u[j], n, v, n);
+        }
+        u[j + n] = (uint32_t)last;
+        quotient[j] = (uint32_t)guess;
+    }
+}
+
+/**
+ * @brief subtracts `high` times the low `k` limbs of `b` from the `xn` limbs
+ * at `x`, where `high` is a quotient of `qn` limbs found from the high limbs
+ * of `b` only. While that leaves `x` negative, `high` was too large: it is
+ * decremented and `b` added back. `product` needs room for qn + k limbs.
+ *
+ * @return false if out of memory.
+ */
+static bool correct_quotient(uint32_t *high, size_t qn, uint32_t *x,
+                             size_t xn, const uint32_t *b, size_t n, size_t k,
+                             uint32_t *product) {
+    static const uint32_t one = 1;
+
+    if (!limbs_mul(product, high, qn, b, k))
+        return false;
+
+    const size_t pn = limbs_trim(product, qn + k);
+
+    while (limbs_compare(x, limbs_trim(x, xn), product, pn) < 0) {
+        limbs_sub(high, qn, &one, 1);
+        limbs_add(x, xn, b, n);
+    }
+    limbs_sub(x, xn, product, pn);
+
+    return true;
+}
+
+/**
+ * @brief divides the n + m limbs at `a` by the `n` limbs at `b`, m <= n, with
+ * the top limb of `b` at least half the base, by recursive division (Brent
+ * and Zimmermann, Modern Computer Arithmetic, algorithm 1.8). The upper half
+ * of the quotient is found by dividing the top of `a` by the top n - k limbs
+ * of `b`, k = m / 2, and corrected for the low k limbs of `b` with one
+ * multiplication; the lower half likewise from what is left. Divisions thus
+ * cost a few multiplications. Writes m + 1 limbs of quotient, and leaves the
+ * remainder in the low n limbs of `a`.
+ *
+ * @return false if out of memory.
+ */
+static bool divide_recursive(uint32_t *quotient, uint32_t *a,
+                             const uint32_t *b, size_t n, size_t m) {
+    uint32_t top = 0;
+
+    /* so that a < B^m b, as the halves below need */
+    while (limbs_compare(&a[m], limbs_trim(&a[m], n), b, n) >= 0) {
+        limbs_sub(&a[m], n, b, n);
+        top++;
+    }
+
+    if (m < DIVIDE_RECURSIVE_LIMBS) {
+        divide_schoolbook(quotient, a, n + m, b, n);
+        quotient[m] = top;
+        return true;
+    }
+
+    const size_t k = m / 2;
+    uint32_t *product = malloc((m + k + 2) * sizeof(uint32_t));
+    if (product == NULL)
+        return false;
+    uint32_t *low = &product[m + 1];
+
+    const bool done =
+        divide_recursive(&quotient[k], &a[2 * k], &b[k], n - k, m - k) &&
+        correct_quotient(&quotient[k], m - k + 1, &a[k], n + m - k, b, n, k,
+                         product) &&
+        divide_recursive(low, &a[k], &b[k], n - k, k) &&
+        correct_quotient(low, k + 1, a, n + m, b, n, k, product);
+
+    if (done) {
+        memcpy(quotient, low, k * sizeof(uint32_t));
+        limbs_add(&quotient[k], m - k + 1, &low[k], 1);
+        quotient[m] += top;
+    }
+
+    free(product);
+    return done;
+}
+
+/**
+ * @brief divides the `an` limbs at `a` by the `bn` limbs at `b`, bn >= 2. Both
+ * are scaled so the top limb of the divisor is at least half the base. Short
+ * quotients or divisors take Knuth's algorithm D, longer ones recursive
+ * division, n limbs of quotient at a time for a divisor of n limbs. Writes
+ * an - bn + 1 limbs of quotient.
+ *
+ * @return 0 if the division leaves no remainder, 1 if it does, -1 if out of
+ * memory.
+ */
+static int limbs_divide(uint32_t *quotient, const uint32_t *a, size_t an,
+                        const uint32_t *b, size_t bn) {
+    uint32_t *u = malloc((an + 2 + 2 * bn) * sizeof(uint32_t));
+    if (u == NULL)
+        return -1;
+    uint32_t *v = &u[an + 1];
+    uint32_t *part = &v[bn];
+
+    const uint32_t scale = LIMB_BASE / (b[bn - 1] + 1);
+    u[an] = limbs_mul_small(u, a, an, scale);
+    limbs_mul_small(v, b, bn, scale);
+
+    if (bn < DIVIDE_RECURSIVE_LIMBS || an - bn + 1 < DIVIDE_RECURSIVE_LIMBS) {
+        divide_schoolbook(quotient, u, an + 1, v, bn);
+    } else {
+        /* each part divides the remainder so far, followed by the next limbs
+           of the dividend */
+        for (size_t end = an - bn + 1; end > 0;) {
+            const size_t m = (end < bn) ? end : bn;
+
+            if (!divide_recursive(part, &u[end - m], v, bn, m)) {
+                free(u);
+                return -1;
+            }
+            memcpy(&quotient[end - m], part, m * sizeof(uint32_t));
+            end -= m;
+        }
+    }
+
+    const int inexact = (limbs_trim(u, bn) != 0);
+    free(u);
+    return inexact;
+}
+
+/* An exact value: mantissa 10^-scale. */
+struct Decimal {
+    /* limbs of the magnitude of the mantissa, least significant first,
+       without leading zero limbs. Zero has none. */
+    uint32_t *limbs;
+    size_t length;
+    bool negative;
+    /* digits after the decimal point */
+    size_t scale;
+};
+
+static void free_decimal(struct Decimal *d) {
+    free(d->limbs);
+    memset(d, 0, sizeof(*d));
+}
+
+/**
+ * @brief makes room for a mantissa of `length` limbs, zeroed, replacing the
+ * one `d` had.
+ */
+static MC3_ErrorCode alloc_decimal(struct Decimal *d, size_t length) {
+    free(d->limbs);
+    d->limbs = NULL;
+    d->length = 0;
+
+    if (length > EXACT_MAX_LIMBS)
+        return MC3_OUT_OF_MEMORY;
+
+    d->limbs = calloc(length ? length : 1, sizeof(uint32_t));
+    if (d->limbs == NULL)
+        return MC3_OUT_OF_MEMORY;
+
+    d->length = length;
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief drops the leading zero limbs of the mantissa of `d`, and the trailing
+ * zero digits after the point, so equal values have equal representations.
+ */
+static void normalize_decimal(struct Decimal *d) {
+    d->length = limbs_trim(d->limbs, d->length);
+
+    if (d->length == 0) {
+        d->negative = false;
+        d->scale = 0;
+        return;
+    }
+
+    size_t zero_limbs = 0;
+    while (d->limbs[zero_limbs] == 0)
+        zero_limbs++;
+
+    size_t zeros = zero_limbs * LIMB_DIGITS;
+    for (uint32_t limb = d->limbs[zero_limbs]; limb % 10 == 0; limb /= 10)
+        zeros++;
+
+    if (zeros > d->scale)
+        zeros = d->scale;
+
+    const size_t shift = zeros / LIMB_DIGITS;
+    if (shift > 0) {
+        d->length -= shift;
+        memmove(d->limbs, &d->limbs[shift], d->length * sizeof(uint32_t));
+    }
+
+    limbs_div_small(d->limbs, d->limbs, d->length,
+                    LIMB_POWERS_OF_TEN[zeros % LIMB_DIGITS]);
+    d->length = limbs_trim(d->limbs, d->length);
+    d->scale -= zeros;
+}
+
+/**
+ * @brief copies `a` into `r` with `scale` digits after the point, at least as
+ * many as `a` has, and one spare limb.
+ */
+static MC3_ErrorCode copy_scaled(struct Decimal *r, const struct Decimal *a,
+                                 size_t scale) {
+    const size_t digits = scale - a->scale;
+    const size_t shift = digits / LIMB_DIGITS;
+
+    if (shift > EXACT_MAX_LIMBS ||
+        alloc_decimal(r, a->length + shift + 2) != MC3_NO_ERROR)
+        return MC3_OUT_OF_MEMORY;
+
+    memcpy(&r->limbs[shift], a->limbs, a->length * sizeof(uint32_t));
+    r->limbs[shift + a->length] =
+        limbs_mul_small(&r->limbs[shift], &r->limbs[shift], a->length,
+                        LIMB_POWERS_OF_TEN[digits % LIMB_DIGITS]);
+    r->length = limbs_trim(r->limbs, r->length);
+    r->negative = a->negative;
+    r->scale = scale;
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief writes a + b, or a - b if `subtract` is set, to `r`.
+ */
+static MC3_ErrorCode add_decimals(struct Decimal *r, const struct Decimal *a,
+                                  const struct Decimal *b, bool subtract) {
+    const size_t scale = (a->scale > b->scale) ? a->scale : b->scale;
+    struct Decimal x = {0};
+    struct Decimal y = {0};
+
+    if (copy_scaled(&x, a, scale) != MC3_NO_ERROR ||
+        copy_scaled(&y, b, scale) != MC3_NO_ERROR) {
+        free_decimal(&x);
+        free_decimal(&y);
+        return MC3_OUT_OF_MEMORY;
+    }
+    y.negative ^= subtract;
+
+    /* the sum goes to the longer one, which has a spare limb */
+    if (limbs_compare(x.limbs, x.length, y.limbs, y.length) < 0) {
+        const struct Decimal swap = x;
+        x = y;
+        y = swap;
+    }
+
+    if (x.negative == y.negative) {
+        x.limbs[x.length] = limbs_add(x.limbs, x.length, y.limbs, y.length);
+        x.length++;
+    } else {
+        limbs_sub(x.limbs, x.length, y.limbs, y.length);
+    }
+
+    free_decimal(&y);
+    free_decimal(r);
+    *r = x;
+    normalize_decimal(r);
+    return MC3_NO_ERROR;
+}
+
+static MC3_ErrorCode multiply_decimals(struct Decimal *r,
+                                       const struct Decimal *a,
+                                       const struct Decimal *b) {
+    struct Decimal product = {0};
+
+    if (alloc_decimal(&product, a->length + b->length) != MC3_NO_ERROR ||
+        !limbs_mul(product.limbs, a->limbs, a->length, b->limbs, b->length)) {
+        free_decimal(&product);
+        return MC3_OUT_OF_MEMORY;
+    }
+
+    product.negative = a->negative != b->negative;
+    product.scale = a->scale + b->scale;
+    free_decimal(r);
+    *r = product;
+    normalize_decimal(r);
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief divides the mantissa of `d` by `factor` for as long as it divides
+ * evenly, `power` at a time first, which is `factor` to the `exponent`.
+ *
+ * @return the number of times `factor` was divided out.
+ */
+static size_t remove_factor(struct Decimal *d, uint32_t factor, uint32_t power,
+                            unsigned int exponent) {
+    size_t count = 0;
+
+    while (d->length > 0 && limbs_mod_small(d->limbs, d->length, power) == 0) {
+        limbs_div_small(d->limbs, d->limbs, d->length, power);
+        d->length = limbs_trim(d->limbs, d->length);
+        count += exponent;
+    }
+
+    while (d->length > 0 && limbs_mod_small(d->limbs, d->length, factor) == 0) {
+        limbs_div_small(d->limbs, d->limbs, d->length, factor);
+        d->length = limbs_trim(d->limbs, d->length);
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief multiplies the mantissa of `d`, which has room, by `factor` to the
+ * `count`, `power` (`factor` to the `exponent`) at a time.
+ */
+static void apply_factor(struct Decimal *d, uint32_t factor, uint32_t power,
+                         unsigned int exponent, size_t count) {
+    for (; count > 0; count -= (count >= exponent) ? exponent : 1) {
+        const uint32_t step = (count >= exponent) ? power : factor;
+        const uint32_t carry =
+            limbs_mul_small(d->limbs, d->limbs, d->length, step);
+
+        if (carry != 0)
+            d->limbs[d->length++] = carry;
+    }
+}
+
+/**
+ * @brief writes a / b to `r`. A quotient has a finite decimal expansion only
+ * if the divisor, without its factors of two and five, divides the dividend.
+ * What is left of the divisor after the division is 2^p 5^q, and dividing by
+ * it is multiplying by 2^(m - p) 5^(m - q) and moving the point m digits,
+ * for m = max(p, q).
+ */
+static MC3_ErrorCode divide_decimals(struct Decimal *r,
+                                     const struct Decimal *a,
+                                     const struct Decimal *b) {
+    if (b->length == 0)
+        return MC3_DIVISION_BY_ZERO;
+
+    struct Decimal divisor = {0};
+    struct Decimal quotient = {0};
+    MC3_ErrorCode error = MC3_OUT_OF_MEMORY;
+
+    if (alloc_decimal(&divisor, b->length) != MC3_NO_ERROR)
+        goto done;
+    memcpy(divisor.limbs, b->limbs, b->length * sizeof(uint32_t));
+
+    const size_t twos = remove_factor(&divisor, 2, LIMB_POWER_OF_TWO, 29);
+    const size_t fives = remove_factor(&divisor, 5, LIMB_POWER_OF_FIVE, 12);
+    const size_t m = (twos > fives) ? twos : fives;
+
+    /* 2^(m - p) 5^(m - q) has fewer than m digits */
+    if (alloc_decimal(&quotient, a->length + m / LIMB_DIGITS + 2) !=
+        MC3_NO_ERROR)
+        goto done;
+
+    if (divisor.length == 1) {
+        if (limbs_div_small(quotient.limbs, a->limbs, a->length,
+                            divisor.limbs[0]) != 0) {
+            error = MC3_INEXACT_RESULT;
+            goto done;
+        }
+    } else if (a->length >= divisor.length) {
+        const int inexact = limbs_divide(quotient.limbs, a->limbs, a->length,
+                                         divisor.limbs, divisor.length);
+        if (inexact != 0) {
+            error = (inexact < 0) ? MC3_OUT_OF_MEMORY : MC3_INEXACT_RESULT;
+            goto done;
+        }
+    } else if (a->length > 0) {
+        error = MC3_INEXACT_RESULT;
+        goto done;
+    }
+
+    quotient.length = limbs_trim(quotient.limbs, a->length);
+    apply_factor(&quotient, 2, LIMB_POWER_OF_TWO, 29, m - twos);
+    apply_factor(&quotient, 5, LIMB_POWER_OF_FIVE, 12, m - fives);
+    quotient.negative = a->negative != b->negative;
+
+    /* the point moves m digits left, and by the scales of a and b */
+    if (a->scale + m >= b->scale) {
+        quotient.scale = a->scale + m - b->scale;
+    } else {
+        struct Decimal whole = {0};
+        quotient.scale = 0;
+
+        if (copy_scaled(&whole, &quotient, b->scale - a->scale - m) !=
+            MC3_NO_ERROR) {
+            free_decimal(&whole);
+            goto done;
+        }
+        whole.scale = 0;
+        free_decimal(&quotient);
+        quotient = whole;
+    }
+
+    free_decimal(r);
+    *r = quotient;
+    quotient.limbs = NULL;
+    normalize_decimal(r);
+    error = MC3_NO_ERROR;
+
+done:
+    free_decimal(&divisor);
+    free_decimal(&quotient);
+    return error;
+}
+
+/**
+ * @brief writes a ^ b to `r`, for an integer b, by squaring: the bits of the
+ * exponent are taken from the top, squaring for each one and multiplying by
+ * a for the set ones.
+ */
+static MC3_ErrorCode raise_decimal(struct Decimal *r, const struct Decimal *a,
+                                   const struct Decimal *b) {
+    if (b->scale > 0)
+        return MC3_INEXACT_RESULT;
+
+    if (a->length == 0) {
+        if (b->negative)
+            return MC3_DIVISION_BY_ZERO;
+
+        /* 0 ^ 0 is 1, as for pow */
+        if (alloc_decimal(r, 1) != MC3_NO_ERROR)
+            return MC3_OUT_OF_MEMORY;
+        r->limbs[0] = (b->length == 0);
+        r->negative = false;
+        r->scale = 0;
+        normalize_decimal(r);
+        return MC3_NO_ERROR;
+    }
+
+    /* 1 and -1 to any power */
+    if (a->length == 1 && a->limbs[0] == 1 && a->scale == 0) {
+        if (alloc_decimal(r, 1) != MC3_NO_ERROR)
+            return MC3_OUT_OF_MEMORY;
+        r->limbs[0] = 1;
+        r->negative = a->negative && b->length > 0 && (b->limbs[0] & 1);
+        r->scale = 0;
+        return MC3_NO_ERROR;
+    }
+
+    /* every other power has about exponent (log10 |mantissa| + scale)
+       digits, which must fit */
+    const uint64_t exponent = (b->length == 0)   ? 0
+                              : (b->length == 1) ? b->limbs[0]
+                                                 : UINT64_MAX;
+    const double digits = (double)(a->length - 1) * LIMB_DIGITS +
+                          log10(a->limbs[a->length - 1]) + a->scale;
+    if ((double)exponent * digits > (double)EXACT_MAX_LIMBS * LIMB_DIGITS)
+        return MC3_OUT_OF_MEMORY;
+
+    struct Decimal power = {0};
+    if (alloc_decimal(&power, 1) != MC3_NO_ERROR)
+        return MC3_OUT_OF_MEMORY;
+    power.limbs[0] = 1;
+
+    int bit = 63;
+    while (bit >= 0 && !((exponent >> bit) & 1))
+        bit--;
+
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    for (; bit >= 0 && error == MC3_NO_ERROR; bit--) {
+        error = multiply_decimals(&power, &power, &power);
+        if (error == MC3_NO_ERROR && ((exponent >> bit) & 1))
+            error = multiply_decimals(&power, &power, a);
+    }
+
+    if (error == MC3_NO_ERROR && b->negative) {
+        struct Decimal one = {0};
+
+        error = alloc_decimal(&one, 1);
+        if (error == MC3_NO_ERROR) {
+            one.limbs[0] = 1;
+            error = divide_decimals(&power, &one, &power);
+        }
+        free_decimal(&one);
+    }
+
+    if (error != MC3_NO_ERROR) {
+        free_decimal(&power);
+        return error;
+    }
+
+    free_decimal(r);
+    *r = power;
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief reads the literal at the start of the `length` characters at `str`,
+ * with the syntax read_number accepts, into `d`.
+ */
+static MC3_ErrorCode read_decimal(const char *str, size_t length,
+                                  struct Decimal *d) {
+    size_t end = 0;
+
+    while (end < length && isdigit((unsigned char)str[end]))
+        end++;
+    const size_t point = end;
+
+    if (end < length && str[end] == '.') {
+        end++;
+        while (end < length && isdigit((unsigned char)str[end]))
+            end++;
+    }
+    const bool has_point = (end > point);
+    const size_t fraction = has_point ? end - point - 1 : 0;
+    const size_t digits = end - has_point;
+
+    /* an `e` not followed by digits is not part of the literal */
+    size_t exponent = 0;
+    bool negative_exponent = false;
+    size_t pos = end;
+
+    if (pos < length && (str[pos] == 'e' || str[pos] == 'E')) {
+        pos++;
+        negative_exponent = (pos < length && str[pos] == '-');
+        if (pos < length && (str[pos] == '-' || str[pos] == '+'))
+            pos++;
+
+        while (pos < length && isdigit((unsigned char)str[pos])) {
+            /* past this the value could not be held anyway */
+            if (exponent <= EXACT_MAX_LIMBS * LIMB_DIGITS)
+                exponent = exponent * 10 + (str[pos] - '0');
+            pos++;
+        }
+    }
+
+    if (exponent > EXACT_MAX_LIMBS * LIMB_DIGITS ||
+        alloc_decimal(d, digits / LIMB_DIGITS + 1) != MC3_NO_ERROR)
+        return MC3_OUT_OF_MEMORY;
+
+    /* limbs are filled from the last digit */
+    size_t limb = 0;
+    uint32_t power = 1;
+    for (size_t i = end; i-- > 0;) {
+        if (str[i] == '.')
+            continue;
+
+        d->limbs[limb] += (str[i] - '0') * power;
+        power *= 10;
+        if (power == LIMB_BASE) {
+            power = 1;
+            limb++;
+        }
+    }
+
+    d->negative = false;
+    d->scale = fraction;
+
+    if (negative_exponent) {
+        d->scale += exponent;
+    } else if (exponent <= fraction) {
+        d->scale -= exponent;
+    } else {
+        struct Decimal scaled = {0};
+
+        d->scale = 0;
+        if (copy_scaled(&scaled, d, exponent - fraction) != MC3_NO_ERROR) {
+            free_decimal(&scaled);
+            return MC3_OUT_OF_MEMORY;
+        }
+        scaled.scale = 0;
+        free_decimal(d);
+        *d = scaled;
+    }
+
+    normalize_decimal(d);
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @return the decimal text of `d`, terminated, or NULL if out of memory.
+ */
+static char *format_decimal(const struct Decimal *d) {
+    if (d->length == 0)
+        return strdup("0");
+
+    size_t digits = (d->length - 1) * LIMB_DIGITS;
+    for (uint32_t top = d->limbs[d->length - 1]; top > 0; top /= 10)
+        digits++;
+
+    /* -, the integer part or 0, the point, zeros after it, the digits */
+    const size_t whole = (digits > d->scale) ? digits - d->scale : 0;
+    const size_t zeros = (digits < d->scale) ? d->scale - digits : 0;
+    const size_t length = d->negative + (whole ? 0 : 1) + (d->scale > 0) +
+                          zeros + digits;
+
+    char *text = malloc(length + 1);
+    if (text == NULL)
+        return NULL;
+
+    char *out = text;
+    if (d->negative)
+        *out++ = '-';
+    if (whole == 0) {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', zeros);
+        out += zeros;
+    }
+
+    /* digits are written from the last one, the point among them */
+    char *last = &text[length];
+    size_t written = 0;
+    *last = '\0';
+
+    for (size_t i = 0; i < d->length; i++) {
+        uint32_t limb = d->limbs[i];
+
+        for (int j = 0; j < LIMB_DIGITS && written < digits; j++) {
+            if (written == d->scale && whole > 0 && d->scale > 0)
+                *--last = '.';
+            *--last = '0' + limb % 10;
+            limb /= 10;
+            written++;
+        }
+    }
+
+    return text;
+}
+
+/**
+ * @brief Evaluates the first `length` characters of `equ` exactly, with
+ * arbitrary precision decimals instead of doubles. Sums, differences,
+ * products and integer powers are always exact; quotients and negative powers
+ * are exact when they have a finite decimal expansion and an error
+ * otherwise. Functions, `sum`, `prod`, `pi`, `e` and variables are not
+ * available.
+ *
+ * @param err if parameter is NULL, then the error will not be set. Otherwise
+ * the error code, and the byte offset of the token it was found at, are
+ * written: MC3_INEXACT_RESULT for a quotient or function without an exact
+ * value, `sum` or `prod`, MC3_DIVISION_BY_ZERO, MC3_UNBOUND_VARIABLE for a
+ * variable, or MC3_OUT_OF_MEMORY for a result over about 600 million digits.
+ * @return the decimal text of the result, such as `-12.5`, without an
+ * exponent or trailing zeros after the point. Release it with free. NULL on
+ * error.
+ */
+char *MC3_evaluate_exact(const char *equ, size_t length, MC3_Error *err) {
+    struct Arena arena = new_arena();
+    struct MC3_Program prog = {0};
+    struct Parser parser = new_parser(equ, length, &prog, &arena);
+    struct Decimal *values = NULL;
+    MC3_Error error = {MC3_NO_ERROR, 0};
+    char *text = NULL;
+
+    parser.keep_offsets = true;
+    error.code = parse(&parser);
+    error.offset = parser.error_offset;
+
+    if (error.code == MC3_NO_ERROR) {
+        values = calloc(prog.length, sizeof(struct Decimal));
+        if (values == NULL)
+            error.code = MC3_OUT_OF_MEMORY;
+    }
+
+    STATS(const uint64_t start = stats_now();)
+    for (unsigned int i = 0; i < prog.length && error.code == MC3_NO_ERROR;
+         i++) {
+        const struct Instr *instr = &prog.code[i];
+        struct Decimal *lhs = &values[instr->lhs];
+        struct Decimal *rhs = &values[instr->rhs];
+        const size_t offset = parser.offsets[i];
+
+        switch (instr->op) {
+        case OPC_CONST:
+            /* `pi` and `e` have no exact value */
+            error.code = isdigit((unsigned char)equ[offset])
+                             ? read_decimal(&equ[offset], length - offset,
+                                            &values[i])
+                             : MC3_INEXACT_RESULT;
+            break;
+        case OPC_VAR:
+            error.code = MC3_UNBOUND_VARIABLE;
+            break;
+        case OPC_ADD:
+        case OPC_SUB:
+            error.code =
+                add_decimals(&values[i], lhs, rhs, instr->op == OPC_SUB);
+            break;
+        case OPC_MULT:
+            error.code = multiply_decimals(&values[i], lhs, rhs);
+            break;
+        case OPC_DIV:
+            error.code = divide_decimals(&values[i], lhs, rhs);
+            break;
+        case OPC_EXP:
+            error.code = raise_decimal(&values[i], lhs, rhs);
+            break;
+        default:
+            error.code = MC3_INEXACT_RESULT;
+            break;
+        }
+
+        /* every register is read by one instruction, so operands are done */
+        if (instr->op != OPC_CONST && instr->op != OPC_VAR) {
+            free_decimal(lhs);
+            free_decimal(rhs);
+        }
+        if (error.code != MC3_NO_ERROR)
+            error.offset = offset;
+    }
+    STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start, 1);)
+
+    if (error.code == MC3_NO_ERROR) {
+        text = format_decimal(&values[prog.result]);
+        if (text == NULL)
+            error.code = MC3_OUT_OF_MEMORY;
+    }
+
+    if (values != NULL) {
+        for (unsigned int i = 0; i < prog.length; i++)
+            free(values[i].limbs);
+        free(values);
+    }
+
+    STATS(stats_error(error.code);)
+    write_context_error(err, error.code, error.offset);
+    free_arena(&arena);
+    return text;
+}
+
+/* ===== Batch Evaluation Functions =====*/
+
+/* A kernel applies one binary operator to `n` rows of two operand columns. */
+typedef void (*BatchKernel)(double *restrict dst, const double *lhs,
+                            const double *rhs, size_t n);
+
+static void batch_add(double *restrict dst, const double *lhs,
+                      const double *rhs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = lhs[i] + rhs[i];
+}
+
+static void batch_sub(double *restrict dst, const double *lhs,
+                      const double *rhs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = lhs[i] - rhs[i];
+}
+
+static void batch_mult(double *restrict dst, const double *lhs,
+                       const double *rhs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = lhs[i] * rhs[i];
+}
+
+static void batch_div(double *restrict dst, const double *lhs,
+                      const double *rhs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = lhs[i] / rhs[i];
+}
+
+/* there is no vector pow instruction, so every kernel set shares this one */
+static void batch_exp(double *restrict dst, const double *lhs,
+                      const double *rhs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = pow(lhs[i], rhs[i]);
+}
+
+/* Defines `name` as a kernel calling `function` on every row of `lhs`, which
+   functions share with `rhs`. */
+#define DEFINE_FUNCTION_KERNEL(name, function)                                 \
+    static void name(double *restrict dst, const double *lhs,                 \
+                     const double *rhs, size_t n) {                           \
+        (void)rhs;                                                            \
+        for (size_t i = 0; i < n; i++)                                        \
+            dst[i] = function(lhs[i]);                                        \
+    }
+
+DEFINE_FUNCTION_KERNEL(batch_sin, sin)
+DEFINE_FUNCTION_KERNEL(batch_cos, cos)
+DEFINE_FUNCTION_KERNEL(batch_tan, tan)
+DEFINE_FUNCTION_KERNEL(batch_log, log10)
+DEFINE_FUNCTION_KERNEL(batch_ln, log)
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+
+    /* Defines `name` as a kernel running two lanes per instruction with SSE2
+       and finishing the odd row with the scalar operator. */
+    #define DEFINE_SSE2_KERNEL(name, vec_op, op)                               \
+        static void name(double *restrict dst, const double *lhs,             \
+                         const double *rhs, size_t n) {                       \
+            size_t i = 0;                                                     \
+            for (; i + 2 <= n; i += 2) {                                      \
+                __m128d a = _mm_loadu_pd(&lhs[i]);                            \
+                __m128d b = _mm_loadu_pd(&rhs[i]);                            \
+                _mm_storeu_pd(&dst[i], vec_op(a, b));                         \
+            }                                                                 \
+            for (; i < n; i++)                                                \
+                dst[i] = lhs[i] op rhs[i];                                    \
+        }
+
+DEFINE_SSE2_KERNEL(batch_add_sse2, _mm_add_pd, +)
+DEFINE_SSE2_KERNEL(batch_sub_sse2, _mm_sub_pd, -)
+DEFINE_SSE2_KERNEL(batch_mult_sse2, _mm_mul_pd, *)
+DEFINE_SSE2_KERNEL(batch_div_sse2, _mm_div_pd, /)
+
+    #if defined(__GNUC__) && defined(__x86_64__)
+        #define HAVE_AVX2_KERNELS 1
+
+        /* Defines `name` as a kernel running four lanes per instruction with
+           AVX2. It is compiled for AVX2 regardless of the build flags, so it
+           must only be called after checking the CPU supports it. */
+        #define DEFINE_AVX2_KERNEL(name, vec_op, op)                           \
+            __attribute__((target("avx2"))) static void name(                 \
+                double *restrict dst, const double *lhs, const double *rhs,   \
+                size_t n) {                                                   \
+                size_t i = 0;                                                 \
+                for (; i + 4 <= n; i += 4) {                                  \
+                    __m256d a = _mm256_loadu_pd(&lhs[i]);                     \
+                    __m256d b = _mm256_loadu_pd(&rhs[i]);                     \
+                    _mm256_storeu_pd(&dst[i], vec_op(a, b));                  \
+                }                                                             \
+                for (; i < n; i++)                                            \
+                    dst[i] = lhs[i] op rhs[i];                                \
+            }
+
+DEFINE_AVX2_KERNEL(batch_add_avx2, _mm256_add_pd, +)
+DEFINE_AVX2_KERNEL(batch_sub_avx2, _mm256_sub_pd, -)
+DEFINE_AVX2_KERNEL(batch_mult_avx2, _mm256_mul_pd, *)
+DEFINE_AVX2_KERNEL(batch_div_avx2, _mm256_div_pd, /)
+    #endif
+#endif
+
+/* the C library functions behind the vector kernels, shaped like pow */
+static double scalar_sin(double x, double y) { return (void)y, sin(x); }
+static double scalar_cos(double x, double y) { return (void)y, cos(x); }
+static double scalar_tan(double x, double y) { return (void)y, tan(x); }
+static double scalar_log(double x, double y) { return (void)y, log10(x); }
+static double scalar_ln(double x, double y) { return (void)y, log(x); }
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    #include "mvecmath.h"
+    #define HAVE_VECTOR_KERNELS 1
+
+    #define VEC_WIDTH 2
+    #define VEC_SUFFIX(name) name##_sse2
+    #include "mveckernels.h"
+
+    /* GCC compiles the wider kernels for their instruction sets regardless of
+       the build flags, so they must only be called after checking the CPU
+       supports them */
+    #if defined(HAVE_AVX2_KERNELS) && !defined(__clang__)
+        #define HAVE_WIDE_VECTOR_KERNELS 1
+
+        #pragma GCC push_options
+        #pragma GCC target("avx2")
+        #define VEC_WIDTH 4
+        #define VEC_SUFFIX(name) name##_avx2
+        #include "mveckernels.h"
+        #pragma GCC pop_options
+
+        #pragma GCC push_options
+        #pragma GCC target("avx512f")
+        #define VEC_WIDTH 8
+        #define VEC_SUFFIX(name) name##_avx512
+        #include "mveckernels.h"
+        #pragma GCC pop_options
+    #endif
+
+    /* Sets the function and power kernels of `kernels` to the vector kernels
+       of `width` for `precision`, leaving them for MC3_PRECISION_LIBM. */
+    #define SET_VECTOR_KERNELS(kernels, precision, width)                      \
+        do {                                                                  \
+            if ((precision) == MC3_PRECISION_HIGH) {                          \
+                kernels[OPC_EXP] = batch_pow_high_##width;                    \
+                kernels[OPC_SIN] = batch_sin_high_##width;                    \
+                kernels[OPC_COS] = batch_cos_high_##width;                    \
+                kernels[OPC_TAN] = batch_tan_high_##width;                    \
+                kernels[OPC_LOG] = batch_log_high_##width;                    \
+                kernels[OPC_LN] = batch_ln_high_##width;                      \
+            } else if ((precision) == MC3_PRECISION_FAST) {                   \
+                kernels[OPC_EXP] = batch_pow_fast_##width;                    \
+                kernels[OPC_SIN] = batch_sin_fast_##width;                    \
+                kernels[OPC_COS] = batch_cos_fast_##width;                    \
+                kernels[OPC_TAN] = batch_tan_fast_##width;                    \
+                kernels[OPC_LOG] = batch_log_fast_##width;                    \
+                kernels[OPC_LN] = batch_ln_fast_##width;                      \
+            }                                                                 \
+        } while (0)
+#endif
+
+/**
+ * @brief picks the widest kernel set the running CPU supports, with the
+ * function kernels for `precision`. The table is indexed by OpCode and has no
+ * entries for OPC_CONST and OPC_VAR.
+ */
+static void select_batch_kernels(BatchKernel kernels[],
+                                 MC3_Precision precision) {
+    kernels[OPC_ADD] = batch_add;
+    kernels[OPC_SUB] = batch_sub;
+    kernels[OPC_MULT] = batch_mult;
+    kernels[OPC_DIV] = batch_div;
+    kernels[OPC_EXP] = batch_exp;
+    kernels[OPC_SIN] = batch_sin;
+    kernels[OPC_COS] = batch_cos;
+    kernels[OPC_TAN] = batch_tan;
+    kernels[OPC_LOG] = batch_log;
+    kernels[OPC_LN] = batch_ln;
+
+#if defined(__SSE2__)
+    kernels[OPC_ADD] = batch_add_sse2;
+    kernels[OPC_SUB] = batch_sub_sse2;
+    kernels[OPC_MULT] = batch_mult_sse2;
+    kernels[OPC_DIV] = batch_div_sse2;
+#endif
+
+#if defined(HAVE_AVX2_KERNELS)
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[OPC_ADD] = batch_add_avx2;
+        kernels[OPC_SUB] = batch_sub_avx2;
+        kernels[OPC_MULT] = batch_mult_avx2;
+        kernels[OPC_DIV] = batch_div_avx2;
+    }
+#endif
+
+#if defined(HAVE_VECTOR_KERNELS)
+    SET_VECTOR_KERNELS(kernels, precision, sse2);
+#else
+    (void)precision;
+#endif
+
+#if defined(HAVE_WIDE_VECTOR_KERNELS)
+    if (__builtin_cpu_supports("avx512f")) {
+        SET_VECTOR_KERNELS(kernels, precision, avx512);
+    } else if (__builtin_cpu_supports("avx2")) {
+        SET_VECTOR_KERNELS(kernels, precision, avx2);
+    }
+#endif
+}
+
+/**
+ * @brief evaluates `prog` once per row of struct-of-arrays input. Rows are
+ * processed in blocks of BATCH_BLOCK_ROWS, running each instruction over the
+ * whole block before moving on to the next, so the dispatch cost is paid once
+ * per block instead of once per row. Functions and powers are computed by the
+ * C library, exactly like MC3_run.
+ *
+ * @param prog
+ * @param columns one array of `n` values per variable, indexed like
+ * MC3_var_name. May be NULL if the program has no variables.
+ * @param n number of rows
+ * @param out receives the `n` results
+ * @return MC3_ErrorCode
+ */
+MC3_ErrorCode MC3_eval_batch(const MC3_Program *prog,
+                             const double *const *columns, size_t n,
+                             double *out) {
+    return MC3_eval_batch_precision(prog, columns, n, out,
+                                    MC3_PRECISION_LIBM);
+}
+
+/**
+ * @brief same as MC3_eval_batch, computing functions and powers with
+ * `precision`. MC3_PRECISION_HIGH and MC3_PRECISION_FAST evaluate them with
+ * polynomial kernels on 2, 4 or 8 rows at once, as SSE2, AVX2 or AVX-512
+ * allow, within 1 and 4 units in the last place of the exact result. Every
+ * width returns the same bits.
+ * Arguments the kernels do not cover, such as sines of numbers over 2^20 or
+ * logarithms of subnormal numbers, are still computed by the C library, and
+ * so is everything where the vector kernels are not compiled. Sums and
+ * products are evaluated a row at a time, like MC3_run does.
+ */
+MC3_ErrorCode MC3_eval_batch_precision(const MC3_Program *prog,
+                                       const double *const *columns, size_t n,
+                                       double *out, MC3_Precision precision) {
+    if (columns == NULL && prog->var_count > 0) {
+        STATS(stats_error(MC3_UNBOUND_VARIABLE);)
+        return MC3_UNBOUND_VARIABLE;
+    }
+
+    if (n == 0)
+        return MC3_NO_ERROR;
+
+    STATS(const uint64_t start_time = stats_now();)
+    BatchKernel kernels[OPC_LN + 1];
+    select_batch_kernels(kernels, precision);
+
+    /* `regs[i]` is where the rows of register i are read from: a column of the
+       input for variables, and a block of `storage` for everything else */
+    const double **regs = malloc(prog->length * sizeof(double *));
+    double *storage =
+        malloc((size_t)prog->length * BATCH_BLOCK_ROWS * sizeof(double));
+    /* the variables of one row, for the bodies of sums and products */
+    const bool ranges = uses_ranges(prog);
+    double *row_vars =
+        ranges ? malloc((prog->var_count + 1) * sizeof(double)) : NULL;
+
+    if (regs == NULL || storage == NULL || (ranges && row_vars == NULL)) {
+        free(regs);
+        free(storage);
+        free(row_vars);
+        STATS(stats_error(MC3_OUT_OF_MEMORY);)
+        return MC3_OUT_OF_MEMORY;
+    }
+
+    /* constants are the same for every block, so they are only filled once */
+    for (unsigned int i = 0; i < prog->length; i++) {
+        double *block = &storage[(size_t)i * BATCH_BLOCK_ROWS];
+        regs[i] = block;
+
+        if (prog->code[i].op == OPC_CONST) {
+            for (size_t row = 0; row < BATCH_BLOCK_ROWS; row++)
+                block[row] = prog->code[i].value;
+        }
+    }
+
+    for (size_t start = 0; start < n; start += BATCH_BLOCK_ROWS) {
+        const size_t rows =
+            (n - start < BATCH_BLOCK_ROWS) ? n - start : BATCH_BLOCK_ROWS;
+
+        for (unsigned int i = 0; i < prog->length; i++) {
+            const struct Instr *instr = &prog->code[i];
+
+            if (instr->op == OPC_CONST)
+                continue;
+
+            if (instr->op == OPC_VAR) {
+                regs[i] = &columns[instr->lhs][start];
+                continue;
+            }
+
+            if (instr->op == OPC_SUM || instr->op == OPC_PROD) {
+                double *dst = &storage[(size_t)i * BATCH_BLOCK_ROWS];
+
+                for (size_t row = 0; row < rows; row++) {
+                    for (unsigned int var = 0; var < prog->var_count; var++)
+                        row_vars[var] = columns[var][start + row];
+
+                    dst[row] =
+                        evaluate_range(prog, instr, regs[instr->lhs][row],
+                                       regs[instr->rhs][row], row_vars);
+                }
+                continue;
+            }
+
+            kernels[instr->op](&storage[(size_t)i * BATCH_BLOCK_ROWS],
+                               regs[instr->lhs], regs[instr->rhs], rows);
+        }
+
+        memcpy(&out[start], regs[prog->result], rows * sizeof(double));
+    }
+
+    free(regs);
+    free(storage);
+    free(row_vars);
+    /* every row counts as one evaluation */
+    STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start_time, n);)
+    return MC3_NO_ERROR;
+}
+
+/* ===== Differentiation Functions =====*/
+
+/* Kernels for the derivatives of one register, one lane per variable: `scale`
+   writes a multiple of the derivatives of one operand, and `combine` the sum
+   of multiples of both. */
+typedef void (*ScaleKernel)(double *restrict dst, double a, const double *x,
+                            size_t n);
+typedef void (*CombineKernel)(double *restrict dst, double a, const double *x,
+                              double b, const double *y, size_t n);
+
+static void lanes_scale(double *restrict dst, double a, const double *x,
+                        size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = a * x[i];
+}
+
+static void lanes_combine(double *restrict dst, double a, const double *x,
+                          double b, const double *y, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = a * x[i] + b * y[i];
+}
+
+#if defined(__SSE2__)
+static void lanes_scale_sse2(double *restrict dst, double a, const double *x,
+                             size_t n) {
+    const __m128d va = _mm_set1_pd(a);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        _mm_storeu_pd(&dst[i], _mm_mul_pd(va, _mm_loadu_pd(&x[i])));
+    for (; i < n; i++)
+        dst[i] = a * x[i];
+}
+
+static void lanes_combine_sse2(double *restrict dst, double a,
+                               const double *x, double b, const double *y,
+                               size_t n) {
+    const __m128d va = _mm_set1_pd(a);
+    const __m128d vb = _mm_set1_pd(b);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        const __m128d ax = _mm_mul_pd(va, _mm_loadu_pd(&x[i]));
+        const __m128d by = _mm_mul_pd(vb, _mm_loadu_pd(&y[i]));
+        _mm_storeu_pd(&dst[i], _mm_add_pd(ax, by));
+    }
+    for (; i < n; i++)
+        dst[i] = a * x[i] + b * y[i];
+}
+
+    #if defined(HAVE_AVX2_KERNELS)
+__attribute__((target("avx2"))) static void
+lanes_scale_avx2(double *restrict dst, double a, const double *x, size_t n) {
+    const __m256d va = _mm256_set1_pd(a);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(&dst[i], _mm256_mul_pd(va, _mm256_loadu_pd(&x[i])));
+    for (; i < n; i++)
+        dst[i] = a * x[i];
+}
+
+__attribute__((target("avx2"))) static void
+lanes_combine_avx2(double *restrict dst, double a, const double *x, double b,
+                   const double *y, size_t n) {
+    const __m256d va = _mm256_set1_pd(a);
+    const __m256d vb = _mm256_set1_pd(b);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        const __m256d ax = _mm256_mul_pd(va, _mm256_loadu_pd(&x[i]));
+        const __m256d by = _mm256_mul_pd(vb, _mm256_loadu_pd(&y[i]));
+        _mm256_storeu_pd(&dst[i], _mm256_add_pd(ax, by));
+    }
+    for (; i < n; i++)
+        dst[i] = a * x[i] + b * y[i];
+}
+    #endif
+#endif
+
+/**
+ * @brief picks the widest lane kernels the running CPU supports.
+ */
+static void select_lane_kernels(ScaleKernel *scale, CombineKernel *combine) {
+    *scale = lanes_scale;
+    *combine = lanes_combine;
+
+#if defined(__SSE2__)
+    *scale = lanes_scale_sse2;
+    *combine = lanes_combine_sse2;
+#endif
+
+#if defined(HAVE_AVX2_KERNELS)
+    if (__builtin_cpu_supports("avx2")) {
+        *scale = lanes_scale_avx2;
+        *combine = lanes_combine_avx2;
+    }
+#endif
+}
+
+/**
+ * @brief the derivatives of `op` applied to `lhs` and `rhs`, which gave
+ * `value`, with respect to each operand.
+ */
+static void partial_derivatives(enum OpCode op, double lhs, double rhs,
+                                double value, double *d_lhs, double *d_rhs) {
+    switch (op) {
+    case OPC_ADD:
+        *d_lhs = 1.0;
+        *d_rhs = 1.0;
+        break;
+    case OPC_SUB:
+        *d_lhs = 1.0;
+        *d_rhs = -1.0;
+        break;
+    case OPC_MULT:
+        *d_lhs = rhs;
+        *d_rhs = lhs;
+        break;
+    case OPC_DIV:
+        *d_lhs = 1.0 / rhs;
+        *d_rhs = -value / rhs;
+        break;
+    case OPC_EXP:
+        *d_lhs = rhs * pow(lhs, rhs - 1.0);
+        *d_rhs = log(lhs) * value;
+        break;
+    case OPC_SIN:
+        *d_lhs = cos(lhs);
+        break;
+    case OPC_COS:
+        *d_lhs = -sin(lhs);
+        break;
+    case OPC_TAN:
+        *d_lhs = 1.0 + value * value;
+        break;
+    case OPC_LOG:
+        *d_lhs = 1.0 / (lhs * M_LN10);
+        break;
+    default:
+        *d_lhs = 1.0 / lhs;
+        break;
+    }
+}
+
+static bool differentiate(const MC3_Program *prog, const double *vars,
+                          size_t lanes, double *values, double *tangents,
+                          bool *varying);
+
+/**
+ * @brief the derivatives of the sum or product `instr` of `prog`, going from
+ * `from` to `to`, written to the `lanes` lanes of `dst`. Its bounds count as
+ * constants.
+ *
+ * @return false if out of memory.
+ */
+static bool range_tangents(const MC3_Program *prog, const struct Instr *instr,
+                           double from, double to, const double *vars,
+                           size_t lanes, double *dst) {
+    const struct Range *range = &prog->ranges[(unsigned int)instr->value];
+    const MC3_Program *body = &range->body;
+    const unsigned int slot = prog->var_count + range->depth;
+    const double terms = range_terms(from, to);
+
+    for (size_t lane = 0; lane < lanes; lane++)
+        dst[lane] = isnan(terms) ? NAN : 0.0;
+
+    if (isnan(terms) || terms == 0.0)
+        return true;
+
+    double *values = malloc((slot + 1 + body->length) * sizeof(double));
+    double *tangents = malloc((size_t)body->length * (lanes ? lanes : 1) *
+                              sizeof(double));
+    bool *varying = malloc(body->length * sizeof(bool));
+    bool done = values != NULL && tangents != NULL && varying != NULL;
+    double *index = done ? &values[slot] : NULL;
+    double *regs = done ? &values[slot + 1] : NULL;
+
+    if (done && slot > 0)
+        memcpy(values, vars, slot * sizeof(double));
+
+    if (done && range->degree >= 0) {
+        /* every coefficient is weighted by the sum of its power of the
+           index */
+        *index = from;
+        done = differentiate(body, values, lanes, regs, tangents, varying);
+
+        for (int p = 0; done && p <= range->degree; p++) {
+            const unsigned int reg = range->coefficients[p];
+            double weight;
+
+            if (reg == NO_COEFFICIENT || !varying[reg])
+                continue;
+
+            if (range->op == OPC_PROD) {
+                weight = terms * pow(regs[reg], terms - 1.0);
+            } else {
+                double unit[MAX_CLOSED_FORM_DEGREE + 1] = {0};
+                unit[p] = 1.0;
+                weight = closed_form(OPC_SUM, p, unit, from, to);
+            }
+
+            for (size_t lane = 0; lane < lanes; lane++)
+                dst[lane] += weight * tangents[lanes * reg + lane];
+        }
+    } else if (done) {
+        double product = 1.0;
+
+        for (uint64_t k = 0; done && k < (uint64_t)terms; k++) {
+            *index = from + (double)k;
+            done = differentiate(body, values, lanes, regs, tangents, varying);
+
+            const double term = regs[body->result];
+            const double *d_term = &tangents[lanes * body->result];
+            const bool term_varies = varying[body->result];
+
+            for (size_t lane = 0; done && lane < lanes; lane++) {
+                const double d = term_varies ? d_term[lane] : 0.0;
+                dst[lane] = (range->op == OPC_SUM)
+                                ? dst[lane] + d
+                                : dst[lane] * term + product * d;
+            }
+            product *= term;
+        }
+    }
+
+    free(values);
+    free(tangents);
+    free(varying);
+    return done;
+}
+
+/**
+ * @brief evaluates `prog` into `values`, with the lanes of every register
+ * which depends on a variable in `tangents`. Bodies of ranges find the
+ * indexes of their ranges after the `lanes` variables in `vars`.
+ *
+ * @return false if out of memory.
+ */
+static bool differentiate(const MC3_Program *prog, const double *vars,
+                          size_t lanes, double *values, double *tangents,
+                          bool *varying) {
+    ScaleKernel scale;
+    CombineKernel combine;
+    select_lane_kernels(&scale, &combine);
+
+    for (unsigned int i = 0; i < prog->length; i++) {
+        const struct Instr *instr = &prog->code[i];
+        double *dst = &tangents[lanes * i];
+
+        if (instr->op == OPC_CONST || instr->op == OPC_INDEX) {
+            values[i] = (instr->op == OPC_CONST)
+                            ? instr->value
+                            : vars[prog->var_count + instr->lhs];
+            varying[i] = false;
+            continue;
+        }
+
+        if (instr->op == OPC_VAR) {
+            values[i] = vars[instr->lhs];
+            varying[i] = true;
+            memset(dst, 0, lanes * sizeof(double));
+            dst[instr->lhs] = 1.0;
+            continue;
+        }
+
+        if (instr->op == OPC_SUM || instr->op == OPC_PROD) {
+            const double from = values[instr->lhs];
+            const double to = values[instr->rhs];
+
+            values[i] = evaluate_range(prog, instr, from, to, vars);
+            varying[i] = lanes > 0;
+            if (!range_tangents(prog, instr, from, to, vars, lanes, dst))
+                return false;
+            continue;
+        }
+
+        /* functions only have a left operand */
+        const bool binary = instr->op <= OPC_EXP;
+        const double lhs = values[instr->lhs];
+        const double rhs = binary ? values[instr->rhs] : 0.0;
+        const bool lhs_varies = varying[instr->lhs];
+        const bool rhs_varies = binary && varying[instr->rhs];
+
+        values[i] = apply_operator(instr->op, lhs, rhs);
+        varying[i] = lhs_varies || rhs_varies;
+        if (!varying[i])
+            continue;
+
+        double d_lhs = 0.0;
+        double d_rhs = 0.0;
+        partial_derivatives(instr->op, lhs, rhs, values[i], &d_lhs, &d_rhs);
+
+        /* the partial of an operand which does not vary is never used, so a
+           negative constant base does not poison the lanes with its log */
+        if (lhs_varies && rhs_varies) {
+            combine(dst, d_lhs, &tangents[lanes * instr->lhs], d_rhs,
+                    &tangents[lanes * instr->rhs], lanes);
+        } else if (lhs_varies) {
+            scale(dst, d_lhs, &tangents[lanes * instr->lhs], lanes);
+        } else {
+            scale(dst, d_rhs, &tangents[lanes * instr->rhs], lanes);
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief evaluates a program built by MC3_compile together with its gradient,
+ * in one pass instead of one evaluation per variable. Every register carries
+ * its value and its derivatives with respect to each variable, a dual number
+ * with one lane per variable; the lanes of an instruction are a combination of
+ * the lanes of its operands, run on vector instructions when the CPU has them.
+ * Registers which do not depend on any variable carry no lanes at all. The
+ * bounds of sums and products count as constants, and their bodies are
+ * differentiated term by term, or once when they are summed in closed form.
+ *
+ * @param prog
+ * @param vars values of the variables, indexed like MC3_var_name. May be NULL
+ * if the program has no variables.
+ * @param value receives the value of the program
+ * @param gradient receives MC3_var_count(prog) derivatives, indexed like
+ * MC3_var_name. May be NULL if the program has no variables.
+ * @return MC3_ErrorCode
+ */
+MC3_ErrorCode MC3_gradient(const MC3_Program *prog, const double *vars,
+                           double *value, double *gradient) {
+    const size_t lanes = prog->var_count;
+
+    if (vars == NULL && lanes > 0) {
+        STATS(stats_error(MC3_UNBOUND_VARIABLE);)
+        return MC3_UNBOUND_VARIABLE;
+    }
+
+    double *values = malloc(prog->length * sizeof(double));
+    /* lanes of register i, valid only if it depends on a variable */
+    double *tangents = malloc((size_t)prog->length * (lanes ? lanes : 1) *
+                              sizeof(double));
+    bool *varying = malloc(prog->length * sizeof(bool));
+
+    STATS(const uint64_t start = stats_now();)
+    if (values == NULL || tangents == NULL || varying == NULL ||
+        !differentiate(prog, vars, lanes, values, tangents, varying)) {
+        free(values);
+        free(tangents);
+        free(varying);
+        STATS(stats_error(MC3_OUT_OF_MEMORY);)
+        return MC3_OUT_OF_MEMORY;
+    }
+
+    *value = values[prog->result];
+    if (varying[prog->result]) {
+        memcpy(gradient, &tangents[lanes * prog->result],
+               lanes * sizeof(double));
+    } else if (lanes > 0) {
+        memset(gradient, 0, lanes * sizeof(double));
+    }
+
+    free(values);
+    free(tangents);
+    free(varying);
+    STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start, 1);)
+    return MC3_NO_ERROR;
+}
+
+/* ===== Matrix Functions =====*/
+
+/* Depth and width of the blocks a matrix product is computed in. A block of
+   the right operand, 64 rows of 256 columns, stays in the L2 cache while
+   every row of the left operand is run against it. */
+#define MATRIX_BLOCK_DEPTH 64
+#define MATRIX_BLOCK_COLUMNS 256
+
+/* Kernels of matrix products: `axpy` adds a multiple of `x` to `dst`, and
+   `dot` sums the products of the elements of `x` and `y`. */
+typedef void (*AxpyKernel)(double *restrict dst, double a, const double *x,
+                           size_t n);
+typedef double (*DotKernel)(const double *x, const double *y, size_t n);
+
+/*
+ * Every dot kernel keeps four partial sums, the one of lane i adding the
+ * products of elements i, i + 4, i + 8 and so on, and adds them as
+ * (s0 + s1) + (s2 + s3) before the products left over. Scalar, SSE2 and AVX2
+ * kernels then return the same bits.
+ */
+#define DOT_LANES 4
+
+static double sum_dot_lanes(const double lanes[DOT_LANES], const double *x,
+                            const double *y, size_t i, size_t n) {
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    for (; i < n; i++)
+        sum += x[i] * y[i];
+
+    return sum;
+}
+
+static void matrix_axpy(double *restrict dst, double a, const double *x,
+                        size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] += a * x[i];
+}
+
+static double matrix_dot(const double *x, const double *y, size_t n) {
+    double lanes[DOT_LANES] = {0.0, 0.0, 0.0, 0.0};
+    size_t i = 0;
+
+    for (; i + DOT_LANES <= n; i += DOT_LANES) {
+        for (int lane = 0; lane < DOT_LANES; lane++)
+            lanes[lane] += x[i + lane] * y[i + lane];
+    }
+
+    return sum_dot_lanes(lanes, x, y, i, n);
+}
+
+#if defined(__SSE2__)
+static void matrix_axpy_sse2(double *restrict dst, double a, const double *x,
+                             size_t n) {
+    const __m128d va = _mm_set1_pd(a);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        const __m128d ax = _mm_mul_pd(va, _mm_loadu_pd(&x[i]));
+        _mm_storeu_pd(&dst[i], _mm_add_pd(_mm_loadu_pd(&dst[i]), ax));
+    }
+    for (; i < n; i++)
+        dst[i] += a * x[i];
+}
+
+static double matrix_dot_sse2(const double *x, const double *y, size_t n) {
+    __m128d low = _mm_setzero_pd();
+    __m128d high = _mm_setzero_pd();
+    double lanes[DOT_LANES];
+    size_t i = 0;
+
+    for (; i + DOT_LANES <= n; i += DOT_LANES) {
+        low = _mm_add_pd(low, _mm_mul_pd(_mm_loadu_pd(&x[i]),
+                                         _mm_loadu_pd(&y[i])));
+        high = _mm_add_pd(high, _mm_mul_pd(_mm_loadu_pd(&x[i + 2]),
+                                           _mm_loadu_pd(&y[i + 2])));
+    }
+
+    _mm_storeu_pd(&lanes[0], low);
+    _mm_storeu_pd(&lanes[2], high);
+    return sum_dot_lanes(lanes, x, y, i, n);
+}
+
+    #if defined(HAVE_AVX2_KERNELS)
+__attribute__((target("avx2"))) static void
+matrix_axpy_avx2(double *restrict dst, double a, const double *x, size_t n) {
+    const __m256d va = _mm256_set1_pd(a);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        const __m256d ax = _mm256_mul_pd(va, _mm256_loadu_pd(&x[i]));
+        _mm256_storeu_pd(&dst[i], _mm256_add_pd(_mm256_loadu_pd(&dst[i]), ax));
+    }
+    for (; i < n; i++)
+        dst[i] += a * x[i];
+}
+
+__attribute__((target("avx2"))) static double
+matrix_dot_avx2(const double *x, const double *y, size_t n) {
+    __m256d sums = _mm256_setzero_pd();
+    double lanes[DOT_LANES];
+    size_t i = 0;
+
+    for (; i + DOT_LANES <= n; i += DOT_LANES)
+        sums = _mm256_add_pd(sums, _mm256_mul_pd(_mm256_loadu_pd(&x[i]),
+                                                 _mm256_loadu_pd(&y[i])));
+
+    _mm256_storeu_pd(lanes, sums);
+    return sum_dot_lanes(lanes, x, y, i, n);
+}
+    #endif
+#endif
+
+/**
+ * @brief picks the widest matrix kernels the running CPU supports.
+ */
+static void select_matrix_kernels(AxpyKernel *axpy, DotKernel *dot) {
+    *axpy = matrix_axpy;
+    *dot = matrix_dot;
+
+#if defined(__SSE2__)
+    *axpy = matrix_axpy_sse2;
+    *dot = matrix_dot_sse2;
+#endif
+
+#if defined(HAVE_AVX2_KERNELS)
+    if (__builtin_cpu_supports("avx2")) {
+        *axpy = matrix_axpy_avx2;
+        *dot = matrix_dot_avx2;
+    }
+#endif
+}
+
+/**
+ * @brief writes the product of the `m` by `k` matrix `a` and the `k` by `n`
+ * matrix `b` to `c`, a block of `b` at a time. Every element still adds its
+ * products in order of `k`, so the result does not depend on the blocks or
+ * on the kernel.
+ */
+static void matrix_multiply(double *restrict c, const double *a,
+                            const double *b, size_t m, size_t k, size_t n,
+                            AxpyKernel axpy) {
+    memset(c, 0, m * n * sizeof(double));
+
+    for (size_t kk = 0; kk < k; kk += MATRIX_BLOCK_DEPTH) {
+        const size_t depth =
+            (k - kk < MATRIX_BLOCK_DEPTH) ? k - kk : MATRIX_BLOCK_DEPTH;
+
+        for (size_t jj = 0; jj < n; jj += MATRIX_BLOCK_COLUMNS) {
+            const size_t width =
+                (n - jj < MATRIX_BLOCK_COLUMNS) ? n - jj : MATRIX_BLOCK_COLUMNS;
+
+            for (size_t i = 0; i < m; i++) {
+                for (size_t p = kk; p < kk + depth; p++)
+                    axpy(&c[i * n + jj], a[i * k + p], &b[p * n + jj], width);
+            }
+        }
+    }
+}
+
+/* What the instructions of one MC3_evaluate_matrix share. */
+struct MatrixEvaluation {
+    const struct MC3_Program *prog;
+    /* registers of the elements of the literals, see struct Parser */
+    const unsigned int *elements;
+    const MC3_Matrix *vars;
+    /* the value of every register, allocated from `arena` like every other
+       temporary of the evaluation */
+    MC3_Matrix *values;
+    struct Arena *arena;
+    BatchKernel kernels[OPC_LN + 1];
+    AxpyKernel axpy;
+    DotKernel dot;
+    /* where the bodies of the ranges are and the variables they read, see
+       struct Parser */
+    const struct BodySpan *body_spans;
+    const struct VarRead *var_reads;
+    unsigned int var_read_count;
+    /* set by an instruction which fails at another token than its own */
+    bool has_error_offset;
+    size_t error_offset;
+};
+
+static size_t matrix_size(const MC3_Matrix *matrix) {
+    return (size_t)matrix->rows * matrix->columns;
+}
+
+static bool new_matrix(struct Arena *arena, unsigned int rows,
+                       unsigned int columns, MC3_Matrix *matrix) {
+    matrix->rows = rows;
+    matrix->columns = columns;
+    matrix->elements = arena_alloc(arena, matrix_size(matrix) * sizeof(double));
+    return matrix->elements != NULL;
+}
+
+/**
+ * @brief applies `op` to every element of `lhs` and `rhs`, which have the
+ * same size unless one of them is a number. Functions read `lhs` alone.
+ */
+static MC3_ErrorCode elementwise(struct MatrixEvaluation *eval,
+                                 enum OpCode op, const MC3_Matrix *lhs,
+                                 const MC3_Matrix *rhs, MC3_Matrix *dst) {
+    const bool lhs_number = matrix_size(lhs) == 1;
+    const bool rhs_number = matrix_size(rhs) == 1;
+    const MC3_Matrix *shape = lhs_number ? rhs : lhs;
+
+    if (!lhs_number && !rhs_number &&
+        (lhs->rows != rhs->rows || lhs->columns != rhs->columns))
+        return MC3_DIMENSION_MISMATCH;
+
+    const size_t n = matrix_size(shape);
+    if (!new_matrix(eval->arena, shape->rows, shape->columns, dst))
+        return MC3_OUT_OF_MEMORY;
+
+    /* a number is spread over the size of the other operand, so the kernels
+       only see operands of the same size */
+    const double *operands[2] = {lhs->elements, rhs->elements};
+    for (int i = 0; i < 2; i++) {
+        if (matrix_size(i ? rhs : lhs) == 1 && n != 1) {
+            double *spread = arena_alloc(eval->arena, n * sizeof(double));
+            if (spread == NULL)
+                return MC3_OUT_OF_MEMORY;
+
+            for (size_t j = 0; j < n; j++)
+                spread[j] = operands[i][0];
+            operands[i] = spread;
+        }
+    }
+
+    eval->kernels[op](dst->elements, operands[0], operands[1], n);
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief whether the body of `range`, or of a range nested in it, reads
+ * variable `var`.
+ */
+static bool reads_var(const struct Range *ranges, const struct Range *range,
+                      unsigned int var) {
+    const MC3_Program *body = &range->body;
+
+    for (unsigned int i = 0; i < body->length; i++) {
+        const struct Instr *instr = &body->code[i];
+
+        if (instr->op == OPC_VAR && instr->lhs == var)
+            return true;
+        if ((instr->op == OPC_SUM || instr->op == OPC_PROD) &&
+            reads_var(ranges, &ranges[(unsigned int)instr->value], var))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief evaluates a sum or product, whose bounds and the variables its body
+ * reads must be numbers.
+ */
+static MC3_ErrorCode matrix_range(struct MatrixEvaluation *eval,
+                                  const struct Instr *instr,
+                                  MC3_Matrix *dst) {
+    const MC3_Matrix *from = &eval->values[instr->lhs];
+    const MC3_Matrix *to = &eval->values[instr->rhs];
+    const unsigned int var_count = eval->prog->var_count;
+    double *vars = arena_alloc(eval->arena, (var_count + 1) * sizeof(double));
+
+    if (vars == NULL || !new_matrix(eval->arena, 1, 1, dst))
+        return MC3_OUT_OF_MEMORY;
+
+    if (matrix_size(from) != 1 || matrix_size(to) != 1)
+        return MC3_DIMENSION_MISMATCH;
+
+    const struct Range *ranges = eval->prog->ranges;
+    const struct Range *range = &ranges[(unsigned int)instr->value];
+
+    for (unsigned int i = 0; i < var_count; i++) {
+        if (matrix_size(&eval->vars[i]) == 1) {
+            vars[i] = eval->vars[i].elements[0];
+        } else if (reads_var(ranges, range, i)) {
+            /* the first read of the matrix in the body, or a range in it */
+            const struct BodySpan *span =
+                &eval->body_spans[(unsigned int)instr->value];
+            for (unsigned int j = 0; j < eval->var_read_count; j++) {
+                const struct VarRead *read = &eval->var_reads[j];
+
+                if (read->var == i && read->offset > span->first &&
+                    read->offset < span->last) {
+                    eval->has_error_offset = true;
+                    eval->error_offset = read->offset;
+                    break;
+                }
+            }
+            return MC3_DIMENSION_MISMATCH;
+        } else {
+            /* the body never reads it */
+            vars[i] = NAN;
+        }
+    }
+
+    dst->elements[0] = evaluate_range(eval->prog, instr, from->elements[0],
+                                      to->elements[0], vars);
+    return MC3_NO_ERROR;
+}
+
+/**
+ * @brief evaluates instruction `index` into its register.
+ */
+static MC3_ErrorCode evaluate_matrix_instr(struct MatrixEvaluation *eval,
+                                           unsigned int index) {
+    const struct Instr *instr = &eval->prog->code[index];
+    const MC3_Matrix *lhs = &eval->values[instr->lhs];
+    const MC3_Matrix *rhs = &eval->values[instr->rhs];
+    MC3_Matrix *dst = &eval->values[index];
+
+    switch (instr->op) {
+    case OPC_CONST:
+        if (!new_matrix(eval->arena, 1, 1, dst))
+            return MC3_OUT_OF_MEMORY;
+        dst->elements[0] = instr->value;
+        return MC3_NO_ERROR;
+    case OPC_VAR:
+        *dst = eval->vars[instr->lhs];
+        return MC3_NO_ERROR;
+    case OPC_MATRIX: {
+        const unsigned int *elements =
+            &eval->elements[(unsigned int)instr->value];
+
+        if (!new_matrix(eval->arena, instr->lhs, instr->rhs, dst))
+            return MC3_OUT_OF_MEMORY;
+
+        for (size_t i = 0; i < matrix_size(dst); i++) {
+            const MC3_Matrix *element = &eval->values[elements[i]];
+
+            if (matrix_size(element) != 1)
+                return MC3_DIMENSION_MISMATCH;
+            dst->elements[i] = element->elements[0];
+        }
+        return MC3_NO_ERROR;
+    }
+    case OPC_SUM:
+    case OPC_PROD:
+        return matrix_range(eval, instr, dst);
+    case OPC_MATMUL:
+        if (lhs->columns != rhs->rows)
+            return MC3_DIMENSION_MISMATCH;
+        if (!new_matrix(eval->arena, lhs->rows, rhs->columns, dst))
+            return MC3_OUT_OF_MEMORY;
+
+        matrix_multiply(dst->elements, lhs->elements, rhs->elements,
+                        lhs->rows, lhs->columns, rhs->columns, eval->axpy);
+        return MC3_NO_ERROR;
+    case OPC_DOT:
+        if (matrix_size(lhs) != matrix_size(rhs))
+            return MC3_DIMENSION_MISMATCH;
+        if (!new_matrix(eval->arena, 1, 1, dst))
+            return MC3_OUT_OF_MEMORY;
+
+        dst->elements[0] =
+            eval->dot(lhs->elements, rhs->elements, matrix_size(lhs));
+        return MC3_NO_ERROR;
+    default:
+        return elementwise(eval, instr->op, lhs, rhs, dst);
+    }
+}
+
+/**
+ * @brief Evaluates the first `length` characters of `equ` with matrices as
+ * values. Matrices are written `[1, 2; 3, 4]`, commas separating the elements
+ * of a row and semicolons the rows, and a number is a matrix of one element.
+ * `+`, `-`, `*`, `/`, `^` and functions apply to every element, a number
+ * taking part with every element of the other operand. `a @ b` is the matrix
+ * product, and `dot(a, b)` the sum of the products of the elements of two
+ * matrices of as many elements. Matrix products are computed a cache sized
+ * block at a time with SSE2 or AVX2 where available, and give the same
+ * result whichever is used. Every temporary matrix lives in one arena, freed
+ * at once when the evaluation ends.
+ *
+ * @param vars the value of each variable, indexed like MC3_var_name. May be
+ * NULL if the expression has no variables. The body of a sum or product can
+ * only read variables which are numbers.
+ * @param result receives the matrix. Release its elements with free.
+ * @param err if parameter is NULL, then the error will not be set. Otherwise
+ * the error code, and the byte offset of the token it was found at, are
+ * written. Operands of incompatible sizes and rows of different lengths are
+ * MC3_DIMENSION_MISMATCH.
+ * @return MC3_NO_ERROR, or the error.
+ */
+MC3_ErrorCode MC3_evaluate_matrix(const char *equ, size_t length,
+                                  const MC3_Matrix *vars, MC3_Matrix *result,
+                                  MC3_Error *err) {
+    struct Arena arena = new_arena();
+    struct MC3_Program prog = {0};
+    struct Parser parser = new_parser(equ, length, &prog, &arena);
+    struct MatrixEvaluation eval = {
+        .prog = &prog,
+        .vars = vars,
+        .arena = &arena,
+    };
+    MC3_Error error = {MC3_NO_ERROR, 0};
+
+    parser.keep_offsets = true;
+    parser.matrices = true;
+    error.code = parse(&parser);
+    error.offset = parser.error_offset;
+
+    if (error.code == MC3_NO_ERROR && prog.var_count > 0 && vars == NULL) {
+        error.code = MC3_UNBOUND_VARIABLE;
+        error.offset = parser.var_offset;
+    }
+
+    if (error.code == MC3_NO_ERROR) {
+        error.code = optimize_ranges(&prog, &arena);
+        eval.elements = parser.elements;
+        eval.body_spans = parser.body_spans;
+        eval.var_reads = parser.var_reads;
+        eval.var_read_count = parser.var_read_count;
+        eval.values = arena_alloc(&arena, prog.length * sizeof(MC3_Matrix));
+        if (eval.values == NULL)
+            error.code = MC3_OUT_OF_MEMORY;
+    }
+
+    STATS(const uint64_t start = stats_now();)
+    select_batch_kernels(eval.kernels, MC3_PRECISION_LIBM);
+    select_matrix_kernels(&eval.axpy, &eval.dot);
+
+    for (unsigned int i = 0; i < prog.length && error.code == MC3_NO_ERROR;
+         i++) {
+        error.code = evaluate_matrix_instr(&eval, i);
+        if (error.code != MC3_NO_ERROR)
+            error.offset = eval.has_error_offset ? eval.error_offset
+                                                 : parser.offsets[i];
+    }
+    STATS(stats_phase(MC3_PHASE_EVALUATE, stats_now() - start, 1);)
+
+    *result = (MC3_Matrix){0, 0, NULL};
+    if (error.code == MC3_NO_ERROR) {
+        const MC3_Matrix *value = &eval.values[prog.result];
+        const size_t size = matrix_size(value) * sizeof(double);
+
+        result->elements = malloc(size ? size : 1);
+        if (result->elements == NULL) {
+            error.code = MC3_OUT_OF_MEMORY;
+        } else {
+            result->rows = value->rows;
+            result->columns = value->columns;
+            if (size > 0)
+                memcpy(result->elements, value->elements, size);
+        }
+    }
+
+    STATS(stats_error(error.code);)
+    write_context_error(err, error.code, error.offset);
+    free_arena(&arena);
+    return error.code;
+}
+
+/* ===== Formatting Functions =====*/
+
+/*
+ * Doubles are printed with the Schubfach algorithm (R. Giulietti, "The
+ * Schubfach way to render doubles", 2020): the interval of reals which round
+ * to the double is scaled by a 126-bit approximation of a power of ten, and
+ * the shortest decimal inside it is read off the scaled bounds. The
+ * approximations are the powers of ten of the literal parser, shifted down
+ * two bits and rounded up.
+ */
+
+/* floor(e * log10(2)) */
+static int floor_log10_pow2(int e) {
+    return (int)(((int64_t)e * 661971961083LL) >> 41);
+}
+
+/* floor(e * log10(3/4 * 2)) */
+static int floor_log10_three_quarters_pow2(int e) {
+    return (int)(((int64_t)e * 661971961083LL - 274743187321LL) >> 41);
+}
+
+/* floor(e * log2(10)) */
+static int floor_log2_pow10(int e) {
+    return (int)(((int64_t)e * 913124641741LL) >> 38);
+}
+
+/* rounds cp * g / 2^127 to odd, with g = g1 * 2^63 + g0 */
+static uint64_t round_to_odd(uint64_t g1, uint64_t g0, uint64_t cp) {
+    uint64_t low;
+    const uint64_t x1 = mul_high(g0, cp, &low);
+    const uint64_t y1 = mul_high(g1, cp, &low);
+    const uint64_t z = (low >> 1) + x1;
+    const uint64_t vbp = y1 + (z >> 63);
+
+    return vbp | (((z & INT64_MAX) + INT64_MAX) >> 63);
+}
+
+/**
+ * @brief finds the shortest decimal `*digits` * 10^`*exponent` which rounds to
+ * c * 2^q, preferring the one closest to it. `dk` is added to the exponent.
+ */
+static void shortest_decimal(int q, uint64_t c, int dk, uint64_t *digits,
+                             int *exponent) {
+    const uint64_t out = c & 1;
+    const uint64_t cb = c << 2;
+    const uint64_t cbr = cb + 2;
+    uint64_t cbl;
+    int k;
+
+    /* the interval is asymmetric below powers of two */
+    if (c != (1ULL << 52) || q == -1074) {
+        cbl = cb - 2;
+        k = floor_log10_pow2(q);
+    } else {
+        cbl = cb - 1;
+        k = floor_log10_three_quarters_pow2(q);
+    }
+
+    const int h = q + floor_log2_pow10(-k) + 2;
+    const uint64_t *power = POWERS_OF_TEN[-k - POWERS_OF_TEN_MIN_EXP];
+    /* g = floor(10^-k * 2^r) + 1 with 2^125 <= g < 2^126 */
+    uint64_t g_high = power[1] >> 2;
+    uint64_t g_low = (power[0] >> 2 | power[1] << 62) + 1;
+    g_high += (g_low == 0);
+    const uint64_t g1 = g_high << 1 | g_low >> 63;
+    const uint64_t g0 = g_low & INT64_MAX;
+
+    const uint64_t vb = round_to_odd(g1, g0, cb << h);
+    const uint64_t vbl = round_to_odd(g1, g0, cbl << h);
+    const uint64_t vbr = round_to_odd(g1, g0, cbr << h);
+    const uint64_t s = vb >> 2;
+
+    if (s >= 10) {
+        /* one digit fewer, if a multiple of ten is inside the interval */
+        const uint64_t sp10 = s / 10 * 10;
+        const uint64_t tp10 = sp10 + 10;
+        const bool upin = vbl + out <= sp10 << 2;
+        const bool wpin = (tp10 << 2) + out <= vbr;
+
+        if (upin != wpin) {
+            *digits = upin ? sp10 : tp10;
+            *exponent = k;
+            return;
+        }
+    }
+
+    const uint64_t t = s + 1;
+    const bool uin = vbl + out <= s << 2;
+    const bool win = (t << 2) + out <= vbr;
+
+    *exponent = k + dk;
+    if (uin != win) {
+        *digits = uin ? s : t;
+        return;
+    }
+
+    /* both are inside, take the closer one or the even one on a tie */
+    const int64_t cmp = (int64_t)(vb - ((s + t) << 1));
+    *digits = (cmp < 0 || (cmp == 0 && (s & 1) == 0)) ? s : t;
+}
+
+static const char DIGIT_PAIRS[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+/**
+ * @brief writes the `count` decimal digits of `value` to `dest`.
+ */
+static void write_digits(char *dest, uint64_t value, int count) {
+    while (count >= 2) {
+        count -= 2;
+        memcpy(&dest[count], &DIGIT_PAIRS[(value % 100) * 2], 2);
+        value /= 100;
+    }
+
+    if (count == 1)
+        dest[0] = (char)('0' + value);
+}
+
+static int count_digits(uint64_t value) {
+    static const uint64_t POWERS[] = {
+        10ULL,
+        100ULL,
+        1000ULL,
+        10000ULL,
+        100000ULL,
+        1000000ULL,
+        10000000ULL,
+        100000000ULL,
+        1000000000ULL,
+        10000000000ULL,
+        100000000000ULL,
+        1000000000000ULL,
+        10000000000000ULL,
+        100000000000000ULL,
+        1000000000000000ULL,
+        10000000000000000ULL,
+        100000000000000000ULL,
+        1000000000000000000ULL,
+        10000000000000000000ULL,
+    };
+    /* floor(log10(value)) is floor(log2(value) * 1233 / 4096) or one more */
+    const int guess = ((63 - __builtin_clzll(value | 1)) * 1233) >> 12;
+
+    return guess + 1 + (value >= POWERS[guess]);
+}
+
+/**
+ * @brief writes the shortest decimal which reads back as exactly `value`,
+ * terminated, to `buffer`, which holds at least MC3_DOUBLE_BUFFER_SIZE bytes.
+ * Numbers from 1e-6 up to 1e21 are written without an exponent ("0.1",
+ * "1234.5", "100"), others as "1.5e-7" or "1e+21", and non-finite ones as
+ * "nan", "inf" and "-inf".
+ *
+ * @return the length of the text.
+ */
+size_t MC3_format_double(double value, char *buffer) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    char *dest = buffer;
+    const int biased = (int)(bits >> 52) & 0x7ff;
+    const uint64_t fraction = bits & 0x000fffffffffffffULL;
+
+    if (biased == 0x7ff) {
+        const char *text = fraction ? "nan" : (bits >> 63) ? "-inf" : "inf";
+        strcpy(buffer, text);
+        return strlen(text);
+    }
+
+    if (bits >> 63)
+        *dest++ = '-';
+
+    uint64_t digits;
+    int exponent;
+
+    if (biased == 0 && fraction == 0) {
+        digits = 0;
+        exponent = 0;
+    } else if (fraction < 3 && biased == 0) {
+        /* too few bits for the scaled bounds to tell the candidates apart */
+        digits = (fraction == 1) ? 5 : 1;
+        exponent = (fraction == 1) ? -324 : -323;
+    } else if (biased == 0) {
+        shortest_decimal(-1074, fraction, 0, &digits, &exponent);
+    } else {
+        const int shift = 1075 - biased;
+        const uint64_t c = (1ULL << 52) | fraction;
+
+        /* integers are exact already */
+        if (shift > 0 && shift < 53 && (c >> shift) << shift == c) {
+            digits = c >> shift;
+            exponent = 0;
+        } else {
+            shortest_decimal(-shift, c, 0, &digits, &exponent);
+        }
+    }
+
+    while (digits != 0 && digits % 10 == 0) {
+        digits /= 10;
+        exponent++;
+    }
+
+    const int count = count_digits(digits);
+    /* position of the decimal point relative to the first digit */
+    const int point = count + exponent;
+
+    if (point > 21 || point < -5) {
+        /* d.ddde+x */
+        write_digits(&dest[1], digits, count);
+        dest[0] = dest[1];
+        if (count > 1) {
+            dest[1] = '.';
+            dest += count + 1;
+        } else {
+            dest += 1;
+        }
+
+        int power = point - 1;
+        *dest++ = 'e';
+        *dest++ = (power < 0) ? '-' : '+';
+        power = (power < 0) ? -power : power;
+        const int power_digits = count_digits((uint64_t)power);
+        write_digits(dest, (uint64_t)power, power_digits);
+        dest += power_digits;
+    } else if (point <= 0) {
+        /* 0.000ddd */
+        dest[0] = '0';
+        dest[1] = '.';
+        memset(&dest[2], '0', (size_t)-point);
+        dest += 2 - point;
+        write_digits(dest, digits, count);
+        dest += count;
+    } else if (point >= count) {
+        /* ddd000 */
+        write_digits(dest, digits, count);
+        memset(&dest[count], '0', (size_t)(point - count));
+        dest += point;
+    } else {
+        /* ddd.ddd */
+        write_digits(&dest[1], digits, count);
+        memmove(dest, &dest[1], (size_t)point);
+        dest[point] = '.';
+        dest += count + 1;
+    }
+
+    *dest = '\0';
+    return (size_t)(dest - buffer);
+}
+
+/**
+ * @brief writes the row for one expression in `format` to `buffer`, which
+ * holds at least MC3_RESULT_BUFFER_SIZE bytes. The row is `result`, or the
+ * error in `err` if one occured. If `err` is NULL there was no expression
+ * (an empty line), and an empty row is written. Text rows end with a newline
+ * and are not terminated.
+ *
+ * @return the length of the row.
+ */
+size_t MC3_format_result(MC3_Format format, double result,
+                         const MC3_Error *err, char *buffer) {
+    const bool failed = (err != NULL && err->code != MC3_NO_ERROR);
+    size_t length = 0;
+
+    if (format == MC3_FORMAT_BINARY) {
+        if (err == NULL || failed)
+            result = NAN;
+        memcpy(buffer, &result, sizeof(result));
+        return sizeof(result);
+    }
+
+    if (err == NULL) {
+        static const char *const empty[] = {"", ",,", "{}"};
+        length = strlen(empty[format]);
+        memcpy(buffer, empty[format], length);
+    } else if (failed) {
+        static const char *const errors[] = {
+            "error: %s (at %zu)",
+            ",\"%s\",%zu",
+            "{\"error\":\"%s\",\"offset\":%zu}",
+        };
+        const int written =
+            snprintf(buffer, MC3_RESULT_BUFFER_SIZE - 1, errors[format],
+                     get_error_str(err->code), err->offset);
+
+        /* snprintf returns the length the row would have had, which callers
+           must never step past the buffer by */
+        length = (written < 0) ? 0 : (size_t)written;
+        if (length > MC3_RESULT_BUFFER_SIZE - 2)
+            length = MC3_RESULT_BUFFER_SIZE - 2;
+    } else if (format == MC3_FORMAT_JSON) {
+        memcpy(buffer, "{\"result\":", 10);
+        length = 10;
+
+        if (isfinite(result)) {
+            length += MC3_format_double(result, &buffer[length]);
+        } else {
+            memcpy(&buffer[length], "null", 4);
+            length += 4;
+        }
+
+        buffer[length++] = '}';
+    } else {
+        length = MC3_format_double(result, buffer);
+        if (format == MC3_FORMAT_CSV) {
+            memcpy(&buffer[length], ",,", 2);
+            length += 2;
+        }
+    }
+
+    buffer[length++] = '\n';
+    return length;
+}
+
+// /* ===== Main Function =====*/
+
+// /**
+//  * @brief evaluates a mathematical expression from a string, returning the
+//  * result as a double. Calculator supports all basic arithmetic operators:
+//  * +, -, *, /, and ^. Also supports basic scientific functions such as ln,
+//  * sin and constants such as e and pi. The calculator follows  standard
+//  PEMDAS
+//  * order of operations.
+//  *
+//  * @param equ
+//  * @param err if parameter is NULL, then the error will not be set.
+//  Otherwise,
+//  * the value of any error that occurs is written to `err`.
+//  * @return double
+//  */
+double MC3_evaluate(const char *equ, MC3_ErrorCode *err) {
+    return MC3_evaluate_n(equ, strlen(equ), err);
+}
+
+/**
+ * @brief Same as MC3_evaluate, for the first `length` characters of `equ`,
+ * which does not need to be terminated.
+ */
+double MC3_evaluate_n(const char *equ, size_t length, MC3_ErrorCode *err) {
+    struct Arena arena = new_arena();
+    MC3_Error error;
+
+    double result = evaluate_in_arena(&arena, equ, length, &error);
+    free_arena(&arena);
+
+    write_error(err, error.code);
+    return result;
+}
+
+/* ==== Benchmarks ==== */
+
+/**
+ * @brief runs the lexer over `equ` without parsing, so its cost can be
+ * measured on its own.
+ *
+ * @return the number of tokens.
+ */
+unsigned int bench_tokenize(const char *equ, size_t length,
+                            MC3_ErrorCode *err) {
+    struct Lexer lexer = new_lexer(equ, length);
+    struct Token token;
+    unsigned int count = 0;
+
+    for (;;) {
+        MC3_ErrorCode error = next_token(&lexer, &token);
+
+        if (error != MC3_NO_ERROR || token.type == TYPE_EMPTY) {
+            write_error(err, error);
+            return count;
+        }
+
+        count++;
+    }
+}
+
+/* ==== Tests ==== */
+
+void print_token(struct Token *token) {
+    if (token->type == TYPE_INTEGER) {
+        printf("INTEGER(%lld)", token->ivalue);
+    } else if (token->type == TYPE_DECIMAL) {
+        printf("DECIMAL(%lf)", token->fvalue);
+    } else {
+        printf("%s", type_to_str(token->type));
+    }
+}
+
+void test_tokenization(void) {
+    struct TokensList list = new_list();
+
+    MLOG_log("Testing Suite: Tokenization");
+
+    clear_list(&list);
+    tokenize("2 + 4", &list, NULL);
+    MLOG_test("2 + 4",
               tokens_arr_equal(
                   list.tokens,
                   (enum TokenType[]){TYPE_INTEGER, OP_ADD, TYPE_INTEGER}, 3));
     // MLOG_array_custom(list.tokens, list.tkns_pos, print_token);
 
-    // tokenize("2 + 4 - 6 * 8 / 10 ^ 12", &list, NULL);
-    // MLOG_test(tokens_arr_equal(list.tokens,
-    //                            (enum TokenType[]){
-    //                                TYPE_INTEGER, OP_ADD, TYPE_INTEGER,
-    //                                OP_SUB, TYPE_INTEGER, OP_MULT,
-    //                                TYPE_INTEGER, OP_DIV, TYPE_INTEGER,
-    //                                OP_EXP, TYPE_INTEGER},
-    //                            11),
-    //           "2 + 4 - 6 * 8 / 10 ^ 12")
-    // tokenize("2 + 4 - 6 * 8 / 10 ^ 12", , &error_code);
-    // MLOG_test(error_code == MC3_NO_ERROR, "2 + 4 - 6 * 8 / 10 ^ 12");
-    // tokenize("8 * (2 + 4)", &error_code);
-    // MLOG_test(error_code == MC3_NO_ERROR, "8 * (2 + 4)");
-    // tokenize("sin(pi / 2)", &error_code);
-    // MLOG_test(error_code == MC3_NO_ERROR, "sin(pi / 2)");
-    // tokenize("ln(e ^ 5)", &error_code);
-    // MLOG_test(error_code == MC3_NO_ERROR, "ln(e ^ 5)");
-    // tokenize("2x * 5", &error_code);
-    // MLOG_test(error_code == MC3_INVALID_CHARACTER_FOUND, "2x * 5");
-    // tokenize("5 Ω 2", &error_code);
-    // MLOG_test(error_code == MC3_INVALID_CHARACTER_FOUND, "5 Ω 2");
+    clear_list(&list);
+    tokenize("sin(pi / 2) + sine * e", &list, NULL);
+    MLOG_test("sin(pi / 2) + sine * e",
+              tokens_arr_equal(list.tokens,
+                               (enum TokenType[]){
+                                   TYPE_FUNCTION, PAR_LEFT, TYPE_CONSTANT,
+                                   OP_DIV, TYPE_INTEGER, PAR_RIGHT, OP_ADD,
+                                   TYPE_IDENTIFIER, OP_MULT, TYPE_CONSTANT},
+                               10) &&
+                  list.tokens[0].keyword == KW_SIN &&
+                  list.tokens[9].keyword == KW_E);
+
+    clear_list(&list);
+    tokenize("9223372036854775807 + 1e-9 * 12345678901.5E3", &list, NULL);
+    MLOG_test("64-bit integers and exponents",
+              list.tkns_pos == 5 && list.tokens[0].type == TYPE_INTEGER &&
+                  list.tokens[0].ivalue == 9223372036854775807LL &&
+                  list.tokens[2].type == TYPE_DECIMAL &&
+                  list.tokens[2].fvalue == 1e-9 &&
+                  list.tokens[4].fvalue == 12345678901.5E3);
+
+    clear_list(&list);
+    tokenize("0.1000000000000000055511151231257827021181583404541015625 "
+             "+ 123456789012345678901234567890",
+             &list, NULL);
+    MLOG_test("long literals round correctly",
+              list.tkns_pos == 3 && list.tokens[0].fvalue == 0.1 &&
+                  list.tokens[2].type == TYPE_DECIMAL &&
+                  list.tokens[2].fvalue == 123456789012345678901234567890.0);
+
+    MLOG_test("is_func and is_constant",
+              is_func("2 * log(x)", 4) && !is_func("logs", 0) &&
+                  is_constant("pi", 0) && !is_constant("pin", 0));
+
+    // tokenize("2 + 4 - 6 * 8 / 10 ^ 12", &list, NULL);
+    // MLOG_test(tokens_arr_equal(list.tokens,
+    //                            (enum TokenType[]){
+    //                                TYPE_INTEGER, OP_ADD, TYPE_INTEGER,
+    //                                OP_SUB, TYPE_INTEGER, OP_MULT,
+    //                                TYPE_INTEGER, OP_DIV, TYPE_INTEGER,
+    //                                OP_EXP, TYPE_INTEGER},
+    //                            11),
+    //           "2 + 4 - 6 * 8 / 10 ^ 12")
+    // tokenize("2 + 4 - 6 * 8 / 10 ^ 12", , &error_code);
+    // MLOG_test(error_code == MC3_NO_ERROR, "2 + 4 - 6 * 8 / 10 ^ 12");
+    // tokenize("8 * (2 + 4)", &error_code);
+    // MLOG_test(error_code == MC3_NO_ERROR, "8 * (2 + 4)");
+    // tokenize("sin(pi / 2)", &error_code);
+    // MLOG_test(error_code == MC3_NO_ERROR, "sin(pi / 2)");
+    // tokenize("ln(e ^ 5)", &error_code);
+    // MLOG_test(error_code == MC3_NO_ERROR, "ln(e ^ 5)");
+    // tokenize("2x * 5", &error_code);
+    // MLOG_test(error_code == MC3_INVALID_CHARACTER_FOUND, "2x * 5");
+    // tokenize("5 Ω 2", &error_code);
+    // MLOG_test(error_code == MC3_INVALID_CHARACTER_FOUND, "5 Ω 2");
+
+    free_list(&list);
+}
+
+void test_compilation(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    MC3_Program *prog = NULL;
+
+    MLOG_log("Testing Suite: Compilation");
+
+    prog = MC3_compile("2 + 3 * 4", &error);
+    MLOG_test("2 + 3 * 4", prog != NULL && MC3_run(prog, NULL, NULL) == 14.0);
+    MLOG_test("2 + 3 * 4 (rerun)",
+              prog != NULL && MC3_run(prog, NULL, NULL) == 14.0);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("(2 + 4) / (6 + 8) - 2 ^ 3 ^ 2", &error);
+    MLOG_test("(2 + 4) / (6 + 8) - 2 ^ 3 ^ 2",
+              prog != NULL && MC3_run(prog, NULL, NULL) == (6.0 / 14) - 64.0);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("2 # 4", &error);
+    MLOG_test("2 # 4", prog == NULL && error == MC3_INVALID_CHARACTER_FOUND);
+
+    prog = MC3_compile("2 * (3 + 4", &error);
+    MLOG_test("2 * (3 + 4",
+              prog == NULL && error == MC3_UNBALANCED_PARENTHESES);
+
+    prog = MC3_compile("2 3", &error);
+    MLOG_test("2 3", prog == NULL && error == MC3_UNEXPECTED_TOKEN);
+
+    prog = MC3_compile("sin(pi / 2) + ln(e ^ 2) * log(100) - cos(0)", &error);
+    MLOG_test("sin(pi / 2) + ln(e ^ 2) * log(100) - cos(0)",
+              prog != NULL && fabs(MC3_run(prog, NULL, NULL) - 4.0) < 1e-12);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("tan(x) * (1 + cos(x / 2))", &error);
+    MLOG_test("functions of variables",
+              prog != NULL && MC3_var_count(prog) == 1 &&
+                  MC3_run(prog, (double[]){0.5}, NULL) ==
+                      tan(0.5) * (1 + cos(0.25)));
+    MC3_free_program(prog);
+
+    prog = MC3_compile("sin 2", &error);
+    MLOG_test("sin 2", prog == NULL && error == MC3_UNEXPECTED_TOKEN);
+
+    /* nesting far deeper than a recursive parser could handle */
+    enum { DEPTH = 200000 };
+    char *nested = malloc(2 * DEPTH + 2);
+    memset(nested, '(', DEPTH);
+    nested[DEPTH] = '7';
+    memset(&nested[DEPTH + 1], ')', DEPTH);
+    nested[2 * DEPTH + 1] = '\0';
+    prog = MC3_compile(nested, &error);
+    MLOG_test("deep nesting", prog != NULL && MC3_run(prog, NULL, NULL) == 7.0);
+    MC3_free_program(prog);
+    free(nested);
+
+    /* far more tokens than the old fixed token list could hold */
+    enum { TERMS = 100000 };
+    char *long_sum = malloc(2 * TERMS);
+    for (int i = 0; i < TERMS; i++) {
+        long_sum[2 * i] = '1';
+        long_sum[2 * i + 1] = '+';
+    }
+    long_sum[2 * TERMS - 1] = '\0';
+    prog = MC3_compile(long_sum, &error);
+    MLOG_test("long expression",
+              prog != NULL && MC3_run(prog, NULL, NULL) == TERMS);
+    MC3_free_program(prog);
+    free(long_sum);
+}
+
+void test_variables(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    MC3_Program *prog = NULL;
+
+    MLOG_log("Testing Suite: Variables");
+
+    prog = MC3_compile("price * (1 + rate) ^ years - price", &error);
+    MLOG_test("variables are numbered in order",
+              prog != NULL && MC3_var_count(prog) == 3 &&
+                  MC3_var_index(prog, "price") == 0 &&
+                  MC3_var_index(prog, "years") == 2 &&
+                  MC3_var_index(prog, "fee") == -1);
+    MLOG_test("price * (1 + rate) ^ years - price",
+              MC3_run(prog, (double[]){100, 0.5, 2}, NULL) == 125.0);
+
+    MC3_run(prog, NULL, &error);
+    MLOG_test("missing values", error == MC3_UNBOUND_VARIABLE);
+
+    /* enough rows to cover a full block, a partial block and odd lanes */
+    enum { ROWS = 517 };
+    double price[ROWS], rate[ROWS], years[ROWS], out[ROWS];
+    for (int i = 0; i < ROWS; i++) {
+        price[i] = i;
+        rate[i] = (i % 7) / 8.0;
+        years[i] = i % 3;
+    }
+
+    const double *columns[] = {price, rate, years};
+    error = MC3_eval_batch(prog, columns, ROWS, out);
+
+    bool batch_matches = (error == MC3_NO_ERROR);
+    for (int i = 0; i < ROWS; i++) {
+        double row[] = {price[i], rate[i], years[i]};
+        batch_matches = batch_matches && (out[i] == MC3_run(prog, row, NULL));
+    }
+    MLOG_test("batch matches MC3_run", batch_matches);
+
+    MC3_free_program(prog);
+}
+
+void test_optimization(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    MC3_Program *prog = NULL;
+
+    MLOG_log("Testing Suite: Optimization");
+
+    prog = MC3_compile("(2 + 4) * 8 - 2 ^ 3", &error);
+    MLOG_test("constants fold into one instruction",
+              prog != NULL && prog->length == 1 &&
+                  MC3_run(prog, NULL, NULL) == 40.0);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("x ^ 2", &error);
+    MLOG_test("x ^ 2 becomes x * x",
+              prog != NULL && prog->length == 2 &&
+                  prog->code[1].op == OPC_MULT &&
+                  MC3_run(prog, (double[]){1.5}, NULL) == 2.25);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("x ^ (0 - 3)", &error);
+    MLOG_test("x ^ (0 - 3)",
+              prog != NULL && MC3_run(prog, (double[]){2}, NULL) == 0.125);
+    MC3_free_program(prog);
+
+    /* a chain of multiplications would round 8 times on its way to x ^ 13 */
+    prog = MC3_compile("x ^ 13", &error);
+    MLOG_test("x ^ 13 stays a power",
+              prog != NULL && prog->code[prog->result].op == OPC_EXP &&
+                  MC3_run(prog, (double[]){1.1}, NULL) == pow(1.1, 13));
+    MC3_free_program(prog);
+
+    prog = MC3_compile("x ^ 2.5 + x / 4 + x / 3", &error);
+    bool divides = false;
+    for (unsigned int i = 0; prog != NULL && i < prog->length; i++)
+        divides = divides || (prog->code[i].op == OPC_DIV);
+    MLOG_test("x / 4 becomes a multiplication, x / 3 does not",
+              prog != NULL && divides &&
+                  MC3_run(prog, (double[]){3}, NULL) ==
+                      pow(3, 2.5) + 3 / 4.0 + 3 / 3.0);
+    MC3_free_program(prog);
+
+    /* a, b and a + b are computed once */
+    prog = MC3_compile("(a + b) ^ 2 * (a + b) ^ 3 / (a + b)", &error);
+    MLOG_test("a repeated subexpression is computed once",
+              prog != NULL && prog->length == 8 &&
+                  MC3_dedup_count(prog) == 6 &&
+                  MC3_run(prog, (double[]){1, 2}, NULL) ==
+                      (3.0 * 3.0) * pow(3.0, 3.0) / 3.0);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("x - 0 * 1 + y", &error);
+    MLOG_test("nothing to deduplicate",
+              prog != NULL && MC3_dedup_count(prog) == 0);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("sin(x) * 0 - sin(x) * 0 + (0 - 0)", &error);
+    bool distinct = true;
+    for (unsigned int i = 0; prog != NULL && i < prog->length; i++) {
+        for (unsigned int j = 0; j < i; j++)
+            distinct = distinct && (prog->code[i].op != prog->code[j].op ||
+                                    prog->code[i].lhs != prog->code[j].lhs ||
+                                    prog->code[i].rhs != prog->code[j].rhs ||
+                                    prog->code[i].value != prog->code[j].value);
+    }
+    MLOG_test("no two instructions are the same",
+              prog != NULL && distinct && MC3_dedup_count(prog) == 3);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("sum(i, 1, n, sin(i) * sin(i)) + sin(1) * sin(1)",
+                       &error);
+    MLOG_test("bodies of sums are deduplicated on their own",
+              prog != NULL && prog->range_count == 1 &&
+                  prog->ranges[0].body.length == 3 &&
+                  MC3_dedup_count(prog) == 2);
+    MC3_free_program(prog);
+}
+
+/**
+ * @brief compiles `equ`, evaluates it at `vars` with the interpreter and then
+ * with native code.
+ *
+ * @return true if both results have the same bits, or there is no JIT.
+ */
+static bool jit_matches(const char *equ, const double *vars) {
+    MC3_Program *prog = MC3_compile(equ, NULL);
+    double interpreted, native;
+
+    if (prog == NULL)
+        return false;
+
+    interpreted = MC3_run(prog, vars, NULL);
+    MC3_JitFunction function = MC3_jit_compile(prog);
+    native = function ? function(vars) : interpreted;
+    bool same = memcmp(&interpreted, &native, sizeof(double)) == 0;
+
+    /* MC3_run now runs the native code */
+    native = MC3_run(prog, vars, NULL);
+    same = same && memcmp(&interpreted, &native, sizeof(double)) == 0;
+
+    MC3_free_program(prog);
+    return same;
+}
+
+void test_jit(void) {
+    const double vars[] = {1.1, -3.7, 0.3};
+    char equ[4096];
+    size_t length = 0;
+
+    MLOG_log("Testing Suite: JIT");
+
+    MLOG_test("constant", jit_matches("2 + 4", NULL));
+    MLOG_test("variable", jit_matches("x", vars));
+    MLOG_test("x * x / y", jit_matches("x * x / y", vars));
+    MLOG_test("(x - y) ^ z", jit_matches("(x - y) ^ z", vars));
+    MLOG_test("x ^ 2.5 - y / 3 + 0.1",
+              jit_matches("x ^ 2.5 - y / 3 + 0.1", vars));
+    MLOG_test("z / (x - x)", jit_matches("z / (x - x)", vars));
+    MLOG_test("functions",
+              jit_matches("sin(x) + cos(y) * tan(z) - ln(z) / log(x)", vars));
+
+    /* more registers than MC3_run keeps on the stack */
+    length += sprintf(equ, "x");
+    for (unsigned int i = 1; i < 300; i++)
+        length += sprintf(&equ[length], " %c %c", "+*-/"[i % 4],
+                          "xyz"[i % 3]);
+    MLOG_test("300 terms", jit_matches(equ, vars));
+}
+
+void test_context(void) {
+    MC3_Context *ctx = MC3_context_new();
+    MC3_Error error;
+    double result = 0.0;
+
+    MLOG_log("Testing Suite: Context");
+
+    result = MC3_context_evaluate(ctx, "(2 + 4) * 8", 11, &error);
+    MLOG_test("(2 + 4) * 8", error.code == MC3_NO_ERROR && result == 48.0);
+
+    result = MC3_context_evaluate(ctx, "10 / 4", 6, &error);
+    MLOG_test("reused context", error.code == MC3_NO_ERROR && result == 2.5);
+
+    MC3_context_evaluate(ctx, "2 * (3 + 4))", 12, &error);
+    MLOG_test("2 * (3 + 4))", error.code == MC3_UNBALANCED_PARENTHESES &&
+                                  error.offset == 11);
+
+    MC3_context_evaluate(ctx, "()", 2, &error);
+    MLOG_test("()", error.code == MC3_UNEXPECTED_TOKEN && error.offset == 1);
+
+    MC3_context_evaluate(ctx, "2 * ()", 6, &error);
+    MLOG_test("2 * ()", error.code == MC3_UNEXPECTED_TOKEN &&
+                            error.offset == 5);
+
+    MC3_context_evaluate(ctx, "sin(1 + )", 9, &error);
+    MLOG_test("sin(1 + )", error.code == MC3_UNEXPECTED_TOKEN &&
+                               error.offset == 8);
+
+    MC3_context_evaluate(ctx, ")", 1, &error);
+    MLOG_test(")", error.code == MC3_UNBALANCED_PARENTHESES &&
+                       error.offset == 0);
+
+    MC3_context_evaluate(ctx, "2 * * 3", 7, &error);
+    MLOG_test("2 * * 3", error.code == MC3_UNEXPECTED_TOKEN &&
+                             error.offset == 4);
+
+    MC3_context_evaluate(ctx, "1 + $", 5, &error);
+    MLOG_test("1 + $", error.code == MC3_INVALID_CHARACTER_FOUND &&
+                           error.offset == 4);
+
+    /* a negative char, which isalpha must not be given */
+    MC3_context_evaluate(ctx, "1 + \xe9t\xe9", 6, &error);
+    MLOG_test("1 + \\xe9t\\xe9", error.code == MC3_INVALID_CHARACTER_FOUND &&
+                                   error.offset == 4);
+
+    MC3_context_evaluate(ctx, "1 + rate", 8, &error);
+    MLOG_test("1 + rate", error.code == MC3_UNBOUND_VARIABLE &&
+                              error.offset == 4);
+
+    MC3_context_evaluate(ctx, "", 0, &error);
+    MLOG_test("empty expression", error.code == MC3_UNEXPECTED_TOKEN &&
+                                      error.offset == 0);
+
+    MC3_context_free(ctx);
+}
+
+/**
+ * @brief applies a random edit to `text`: inserting, replacing or deleting up
+ * to three characters.
+ */
+static size_t random_edit(char *text, size_t length, size_t capacity) {
+    static const char ALPHABET[] = "0123456789. +-*/^()e$asnpi#";
+    const size_t at = (length > 0) ? (size_t)rand() % (length + 1) : 0;
+    const size_t count = 1 + rand() % 3;
+
+    switch (rand() % 3) {
+    case 0:
+        if (length + count > capacity)
+            return length;
+        memmove(&text[at + count], &text[at], length - at);
+        length += count;
+        break;
+    case 1:
+        if (at + count > length)
+            return length;
+        break;
+    default:
+        if (at + count > length)
+            return length;
+        memmove(&text[at], &text[at + count], length - at - count);
+        return length - count;
+    }
+
+    for (size_t i = at; i < at + count; i++)
+        text[i] = ALPHABET[rand() % (sizeof(ALPHABET) - 1)];
+
+    return length;
+}
+
+void test_session(void) {
+    MC3_Session *session = MC3_session_new();
+    MC3_Context *ctx = MC3_context_new();
+    MC3_Error error;
+    double result = 0.0;
+
+    MLOG_log("Testing Suite: Session");
+
+    result = MC3_session_update(session, "(2 + 4) * 8", 11, &error);
+    MLOG_test("(2 + 4) * 8", error.code == MC3_NO_ERROR && result == 48.0 &&
+                                 MC3_session_commit(session) == 1);
+
+    result = MC3_session_update(session, "ans / 2", 7, &error);
+    MLOG_test("ans / 2", error.code == MC3_NO_ERROR && result == 24.0 &&
+                             MC3_session_commit(session) == 2);
+
+    result = MC3_session_update(session, "$1 + $2 * ans", 13, &error);
+    MLOG_test("$1 + $2 * ans",
+              error.code == MC3_NO_ERROR && result == 48.0 + 24.0 * 24.0);
+
+    MC3_session_update(session, "$1 + $3", 7, &error);
+    MLOG_test("$3 before it exists", error.code == MC3_UNBOUND_VARIABLE &&
+                                         error.offset == 5 &&
+                                         MC3_session_commit(session) == 0);
+
+    MC3_session_update(session, "2 * (ans", 8, &error);
+    MLOG_test("2 * (ans", error.code == MC3_UNBALANCED_PARENTHESES);
+    MLOG_test("results", MC3_session_result_count(session) == 2 &&
+                             MC3_session_result(session, 2) == 24.0 &&
+                             isnan(MC3_session_result(session, 3)));
+
+    /* a long sum of products, edited near its end */
+    char text[16384];
+    size_t length = 0;
+    for (int i = 1; i <= 500; i++)
+        length += sprintf(&text[length], "%s(%d * sin(%d))",
+                          (i > 1) ? " + " : "", i, i);
+
+    MC3_session_update(session, text, length, &error);
+    MC3_SessionStats stats = MC3_session_stats(session);
+    MLOG_test("first update", error.code == MC3_NO_ERROR &&
+                                  stats.relexed == stats.tokens &&
+                                  stats.evaluated == stats.operators);
+
+    text[length - 3] = '7';
+    result = MC3_session_update(session, text, length, &error);
+    stats = MC3_session_stats(session);
+    MLOG_test("edit of one number", error.code == MC3_NO_ERROR &&
+                                        stats.relexed <= 3 &&
+                                        stats.evaluated == 3 &&
+                                        result == MC3_context_evaluate(
+                                                      ctx, text, length, NULL));
+
+    memmove(&text[13], &text[0], length);
+    memcpy(text, "2 * sin(1) + ", 13);
+    length += 13;
+    MC3_session_update(session, text, length, &error);
+    stats = MC3_session_stats(session);
+    MLOG_test("insertion at the start", error.code == MC3_NO_ERROR &&
+                                            stats.relexed <= 8);
+
+    /* random edits, checked against evaluating the whole text */
+    bool matches = true;
+    length = 0;
+    srand(17);
+    for (int i = 0; i < 20000 && matches; i++) {
+        length = random_edit(text, length, 64);
+
+        MC3_Error expected;
+        MC3_ErrorCode lex_error;
+        struct TokensList list = new_list();
+        const double value = MC3_context_evaluate(ctx, text, length, &expected);
+        result = MC3_session_update(session, text, length, &error);
+
+        tokenize_n(text, length, &list, &lex_error);
+        matches = error.code == expected.code &&
+                  error.offset == expected.offset &&
+                  memcmp(&result, &value, sizeof(double)) == 0 &&
+                  MC3_session_stats(session).tokens == list.tkns_pos;
+        free_list(&list);
+    }
+    MLOG_test("random edits", matches);
+
+    /* subexpressions whose hashes collide do not share a value */
+    MC3_Session *memo = MC3_session_new();
+    bool separate = memo != NULL && reserve_memo(memo, 3);
+    if (separate) {
+        struct MemoSlot *slot = find_memo(memo, 42, OPC_ADD, 1.0, 2.0, NULL, 0);
+        *slot = (struct MemoSlot){
+            .hash = 42, .op = OPC_ADD, .lhs = 1.0, .rhs = 2.0, .value = 3.0};
+        separate =
+            find_memo(memo, 42, OPC_ADD, 1.0, 2.0, NULL, 0) == slot &&
+            find_memo(memo, 42, OPC_ADD, 5.0, 2.0, NULL, 0)->hash == 0 &&
+            find_memo(memo, 42, OPC_SUB, 1.0, 2.0, NULL, 0)->hash == 0;
+    }
+    MLOG_test("colliding hashes", separate);
+    MC3_session_free(memo);
+
+    MC3_context_free(ctx);
+    MC3_session_free(session);
+}
+
+/**
+ * @brief sets cell `name` to the terminated expression `equ`.
+ */
+static MC3_ErrorCode set_cell(MC3_Sheet *sheet, const char *name,
+                              const char *equ, MC3_Error *err) {
+    return MC3_sheet_set(sheet, name, equ, strlen(equ), err);
+}
+
+/**
+ * @brief compares every cell `c0` to `c{count - 1}` of two sheets.
+ */
+static bool same_cells(const MC3_Sheet *first, const MC3_Sheet *second,
+                       unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        char name[16];
+        MC3_Error first_error;
+        MC3_Error second_error;
+
+        sprintf(name, "c%u", i);
+        const double first_value = MC3_sheet_get(first, name, &first_error);
+        const double second_value = MC3_sheet_get(second, name, &second_error);
+
+        if (first_error.code != second_error.code ||
+            memcmp(&first_value, &second_value, sizeof(double)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+void test_sheet(void) {
+    MC3_Sheet *sheet = MC3_sheet_new(1);
+    MC3_Error error;
+
+    MLOG_log("Testing Suite: Sheet");
+
+    set_cell(sheet, "a", "2 * b + c", &error);
+    set_cell(sheet, "d", "c ^ 2", NULL);
+    MC3_sheet_set_value(sheet, "b", 3.0);
+    MC3_sheet_set_value(sheet, "c", 4.0);
+    MLOG_test("first recalculation", error.code == MC3_NO_ERROR &&
+                                         MC3_sheet_recalc(sheet) == 4 &&
+                                         MC3_sheet_get(sheet, "a", NULL) ==
+                                             10.0 &&
+                                         MC3_sheet_get(sheet, "d", NULL) ==
+                                             16.0);
+
+    /* only `b` and `a` depend on `b` */
+    MC3_sheet_set_value(sheet, "b", 5.0);
+    MLOG_test("downstream of b", MC3_sheet_recalc(sheet) == 2 &&
+                                     MC3_sheet_get(sheet, "a", NULL) == 14.0);
+    MLOG_test("nothing changed", MC3_sheet_recalc(sheet) == 0);
+
+    set_cell(sheet, "a", "b * 10", NULL);
+    MC3_sheet_set_value(sheet, "c", 1.0);
+    MLOG_test("redefinition drops c", MC3_sheet_recalc(sheet) == 3 &&
+                                          MC3_sheet_get(sheet, "a", NULL) ==
+                                              50.0 &&
+                                          MC3_sheet_get(sheet, "d", NULL) ==
+                                              1.0);
+
+    MLOG_test("b = 1 + a", set_cell(sheet, "b", "1 + a", &error) ==
+                                   MC3_CIRCULAR_REFERENCE &&
+                               error.offset == 4);
+    MLOG_test("k = k", set_cell(sheet, "k", "k", &error) ==
+                               MC3_CIRCULAR_REFERENCE &&
+                           error.offset == 0);
+    MLOG_test("rejected cells are unchanged", MC3_sheet_recalc(sheet) == 0 &&
+                                                  MC3_sheet_get(sheet, "b",
+                                                                NULL) == 5.0);
+    MLOG_test("invalid names",
+              set_cell(sheet, "2x", "1", NULL) == MC3_UNEXPECTED_TOKEN &&
+                  set_cell(sheet, "pi", "1", NULL) == MC3_UNEXPECTED_TOKEN &&
+                  set_cell(sheet, "f", "(1", &error) ==
+                      MC3_UNBALANCED_PARENTHESES);
+
+    /* errors pass on to the cells referring to a cell in error */
+    set_cell(sheet, "f", "g + 1", NULL);
+    set_cell(sheet, "h", "f * 2", NULL);
+    MC3_sheet_recalc(sheet);
+    MC3_sheet_get(sheet, "h", &error);
+    MLOG_test("unset precedent", error.code == MC3_UNBOUND_VARIABLE);
+    MC3_sheet_get(sheet, "nowhere", &error);
+    MLOG_test("unknown cell", error.code == MC3_UNBOUND_VARIABLE);
+
+    MC3_sheet_set_value(sheet, "g", 2.0);
+    MLOG_test("set precedent", MC3_sheet_recalc(sheet) == 3 &&
+                                   MC3_sheet_get(sheet, "h", &error) == 6.0 &&
+                                   error.code == MC3_NO_ERROR);
+
+    /* a random DAG evaluated on four threads, checked against one thread */
+    enum { CELLS = 6000, INPUTS = 64 };
+    MC3_Sheet *parallel = MC3_sheet_new(4);
+    MC3_Sheet *serial = MC3_sheet_new(1);
+    char name[16];
+    char equ[128];
+
+    srand(18);
+    for (unsigned int i = 0; i < CELLS; i++) {
+        sprintf(name, "c%u", i);
+
+        if (i < INPUTS) {
+            MC3_sheet_set_value(parallel, name, i);
+            MC3_sheet_set_value(serial, name, i);
+            continue;
+        }
+
+        sprintf(equ, "c%u * 0.5 + sin(c%u) - c%u / 3", rand() % i,
+                rand() % i, rand() % i);
+        set_cell(parallel, name, equ, NULL);
+        set_cell(serial, name, equ, NULL);
+    }
+
+    MLOG_test("random DAG", MC3_sheet_recalc(parallel) == CELLS &&
+                                MC3_sheet_recalc(serial) == CELLS &&
+                                same_cells(parallel, serial, CELLS));
+
+    bool matches = true;
+    for (int i = 0; i < 20 && matches; i++) {
+        sprintf(name, "c%u", (unsigned int)rand() % INPUTS);
+        MC3_sheet_set_value(parallel, name, i * 1.5);
+        MC3_sheet_set_value(serial, name, i * 1.5);
+
+        const unsigned int count = MC3_sheet_recalc(parallel);
+        matches = count < CELLS && MC3_sheet_recalc(serial) == count &&
+                  same_cells(parallel, serial, CELLS);
+    }
+    MLOG_test("random DAG after input changes", matches);
+
+    MC3_sheet_free(parallel);
+    MC3_sheet_free(serial);
+    MC3_sheet_free(sheet);
+}
+
+/**
+ * @brief evaluates the terminated expression `equ` exactly and compares the
+ * text of the result to `expected`.
+ */
+static bool exact_is(const char *equ, const char *expected) {
+    char *text = MC3_evaluate_exact(equ, strlen(equ), NULL);
+    const bool same = text != NULL && strcmp(text, expected) == 0;
+
+    free(text);
+    return same;
+}
+
+static bool exact_fails(const char *equ, MC3_ErrorCode code, size_t offset) {
+    MC3_Error error;
+    char *text = MC3_evaluate_exact(equ, strlen(equ), &error);
+    const bool failed =
+        text == NULL && error.code == code && error.offset == offset;
+
+    free(text);
+    return failed;
+}
+
+static void random_limbs(uint32_t *a, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        a[i] = ((uint32_t)rand() * 7919u + (uint32_t)rand()) % LIMB_BASE;
+
+    /* a nonzero top limb, so the lengths are what they say */
+    if (length > 0 && a[length - 1] == 0)
+        a[length - 1] = 1;
+}
+
+/**
+ * @brief multiplies random numbers of `an` and `bn` limbs with limbs_mul and
+ * by schoolbook multiplication, then divides the product by the second one.
+ */
+static bool check_multiplication(size_t an, size_t bn) {
+    uint32_t *a = malloc(an * sizeof(uint32_t));
+    uint32_t *b = malloc(bn * sizeof(uint32_t));
+    uint32_t *fast = malloc((an + bn) * sizeof(uint32_t));
+    uint32_t *slow = malloc((an + bn) * sizeof(uint32_t));
+    uint32_t *quotient = malloc((an + 1) * sizeof(uint32_t));
+    bool same = false;
+
+    if (a != NULL && b != NULL && fast != NULL && slow != NULL &&
+        quotient != NULL) {
+        random_limbs(a, an);
+        random_limbs(b, bn);
+        mul_schoolbook(slow, a, an, b, bn);
+
+        same = limbs_mul(fast, a, an, b, bn) &&
+               memcmp(fast, slow, (an + bn) * sizeof(uint32_t)) == 0 &&
+               limbs_divide(quotient, fast, limbs_trim(fast, an + bn), b,
+                            bn) == 0 &&
+               limbs_compare(quotient, limbs_trim(quotient, an), a, an) == 0;
+    }
+
+    free(a);
+    free(b);
+    free(fast);
+    free(slow);
+    free(quotient);
+    return same;
+}
+
+/**
+ * @brief divides a random number of `an` limbs by one of `bn` limbs with
+ * limbs_divide and with Knuth's algorithm D alone, which must agree on the
+ * quotient and on whether there is a remainder.
+ */
+static bool check_division(size_t an, size_t bn) {
+    uint32_t *a = malloc(an * sizeof(uint32_t));
+    uint32_t *b = malloc(bn * sizeof(uint32_t));
+    uint32_t *u = malloc((an + 1) * sizeof(uint32_t));
+    uint32_t *v = malloc(bn * sizeof(uint32_t));
+    uint32_t *fast = malloc((an + 1) * sizeof(uint32_t));
+    uint32_t *slow = malloc((an + 1) * sizeof(uint32_t));
+    bool same = false;
+
+    if (a != NULL && b != NULL && u != NULL && v != NULL && fast != NULL &&
+        slow != NULL) {
+        random_limbs(a, an);
+        random_limbs(b, bn);
+
+        const uint32_t scale = LIMB_BASE / (b[bn - 1] + 1);
+        u[an] = limbs_mul_small(u, a, an, scale);
+        limbs_mul_small(v, b, bn, scale);
+        divide_schoolbook(slow, u, an + 1, v, bn);
+
+        same = limbs_divide(fast, a, an, b, bn) ==
+                   (limbs_trim(u, bn) != 0) &&
+               memcmp(fast, slow, (an - bn + 1) * sizeof(uint32_t)) == 0;
+    }
+
+    free(a);
+    free(b);
+    free(u);
+    free(v);
+    free(fast);
+    free(slow);
+    return same;
+}
+
+void test_exact(void) {
+    MLOG_log("Testing Suite: Exact Arithmetic");
+
+    MLOG_test("0.1 + 0.2", exact_is("0.1 + 0.2", "0.3"));
+    MLOG_test("2 ^ 100",
+              exact_is("2 ^ 100", "1267650600228229401496703205376"));
+    MLOG_test("1 / 8", exact_is("1 / 8", "0.125"));
+    MLOG_test("1e20 / 1e-3",
+              exact_is("1e20 / 1e-3", "100000000000000000000000"));
+    MLOG_test("(0 - 1.5) ^ 3", exact_is("(0 - 1.5) ^ 3", "-3.375"));
+    MLOG_test("2 ^ (0 - 3)", exact_is("2 ^ (0 - 3)", "0.125"));
+    MLOG_test("0 ^ 0", exact_is("0 ^ 0", "1"));
+    MLOG_test("123456789 * 987654321 - 121932631112635269",
+              exact_is("123456789 * 987654321 - 121932631112635269", "0"));
+
+    MLOG_test("1 / 3", exact_fails("1 / 3", MC3_INEXACT_RESULT, 2));
+    MLOG_test("3 / 0", exact_fails("3 / 0", MC3_DIVISION_BY_ZERO, 2));
+    MLOG_test("2 ^ 0.5", exact_fails("2 ^ 0.5", MC3_INEXACT_RESULT, 2));
+    MLOG_test("sin(1)", exact_fails("sin(1)", MC3_INEXACT_RESULT, 0));
+    MLOG_test("1 + pi", exact_fails("1 + pi", MC3_INEXACT_RESULT, 4));
+    MLOG_test("x + 1", exact_fails("x + 1", MC3_UNBOUND_VARIABLE, 0));
+
+    /* one pair of lengths for each multiplication algorithm, and unbalanced
+       ones */
+    static const size_t lengths[][2] = {
+        {7, 5},      {31, 31},    {48, 40},     {200, 90},   {159, 150},
+        {400, 300},  {1400, 1200}, {2000, 1600}, {5000, 1500}, {3000, 40}};
+    bool matches = true;
+
+    srand(19);
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]) && matches;
+         i++)
+        matches = check_multiplication(lengths[i][0], lengths[i][1]);
+    MLOG_test("multiplication against schoolbook", matches);
+
+    /* quotients shorter than, as long as and longer than the divisor */
+    static const size_t divisions[][2] = {
+        {300, 200}, {4000, 2000}, {3001, 1000}, {10000, 700}, {900, 64}};
+    matches = true;
+    for (size_t i = 0; i < sizeof(divisions) / sizeof(divisions[0]) && matches;
+         i++)
+        matches = check_division(divisions[i][0], divisions[i][1]);
+    MLOG_test("recursive division against long division", matches);
+}
+
+/**
+ * @brief compares the gradient of `prog` at `vars` to central differences.
+ */
+static bool matches_differences(const MC3_Program *prog, double *vars) {
+    enum { MAX_VARS = 8 };
+    const unsigned int count = MC3_var_count(prog);
+    double gradient[MAX_VARS];
+    double value;
+
+    if (count > MAX_VARS ||
+        MC3_gradient(prog, vars, &value, gradient) != MC3_NO_ERROR ||
+        value != MC3_run(prog, vars, NULL))
+        return false;
+
+    for (unsigned int i = 0; i < count; i++) {
+        const double saved = vars[i];
+        const double step = 1e-6 * fmax(1.0, fabs(saved));
+
+        vars[i] = saved + step;
+        const double above = MC3_run(prog, vars, NULL);
+        vars[i] = saved - step;
+        const double below = MC3_run(prog, vars, NULL);
+        vars[i] = saved;
+
+        const double difference = (above - below) / (2 * step);
+        if (fabs(difference - gradient[i]) >
+            1e-6 * fmax(1.0, fabs(gradient[i])))
+            return false;
+    }
+
+    return true;
+}
+
+void test_gradient(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    double value = 0.0;
+    double gradient[3];
+
+    MLOG_log("Testing Suite: Gradient");
+
+    MC3_Program *prog = MC3_compile("price * (1 + rate) ^ years - price", NULL);
+    error = MC3_gradient(prog, (double[]){100, 0.5, 2}, &value, gradient);
+    MLOG_test("price * (1 + rate) ^ years - price",
+              error == MC3_NO_ERROR && value == 125.0 &&
+                  gradient[0] == 1.25 && gradient[1] == 300.0 &&
+                  fabs(gradient[2] - 225 * log(1.5)) < 1e-12);
+    MLOG_test("missing values",
+              MC3_gradient(prog, NULL, &value, gradient) ==
+                  MC3_UNBOUND_VARIABLE);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("x - x + 2 ^ 3", NULL);
+    error = MC3_gradient(prog, (double[]){5}, &value, gradient);
+    MLOG_test("x - x + 2 ^ 3", error == MC3_NO_ERROR && value == 8.0 &&
+                                   gradient[0] == 0.0);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("sin(1) * 2", NULL);
+    MLOG_test("no variables",
+              MC3_gradient(prog, NULL, &value, NULL) == MC3_NO_ERROR &&
+                  value == sin(1) * 2);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("x ^ 3 * sin(y) / (z + 2) - ln(x) + 2 ^ y * "
+                       "cos(z) - tan(x / y) + log(x * z) * 0.1 ^ z",
+                       NULL);
+    MLOG_test("every operator",
+              matches_differences(prog, (double[]){2, 3, 4}) &&
+                  matches_differences(prog, (double[]){0.5, 1.5, 0.25}));
+    MC3_free_program(prog);
+
+    /* enough variables for full vector lanes and an odd one */
+    enum { VARS = 37 };
+    char equ[VARS * 16];
+    double vars[VARS];
+    double lanes[VARS];
+    size_t length = 0;
+
+    for (int i = 0; i < VARS; i++) {
+        length += sprintf(&equ[length], "%sv%d * v%d", i ? " + " : "", i, i);
+        vars[i] = i * 0.5 - 3;
+    }
+
+    prog = MC3_compile(equ, NULL);
+    error = MC3_gradient(prog, vars, &value, lanes);
+
+    bool all_lanes = prog != NULL && MC3_var_count(prog) == VARS &&
+                     error == MC3_NO_ERROR;
+    for (int i = 0; i < VARS && all_lanes; i++)
+        all_lanes = lanes[i] == 2 * vars[i];
+    MLOG_test("37 variables", all_lanes);
+    MC3_free_program(prog);
+}
+
+/* the environment test programs are started with */
+extern char **environ;
+
+/**
+ * @brief runs `argv`, reading its standard input from the file `input` and
+ * writing its standard output to the file `output` when they are not NULL.
+ *
+ * @return the exit status of the program, or -1 if it could not be started.
+ */
+static int run_command(char *const argv[], const char *input,
+                       const char *output) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status = -1;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    if (input != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, input,
+                                         O_RDONLY, 0);
+    if (output != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, output,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    const bool started =
+        posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (!started || waitpid(pid, &status, 0) != pid)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * @brief writes `equ` to `out` with every variable of `prog` replaced by its
+ * value in `vars`, in parentheses and with enough digits to read back the
+ * same double.
+ */
+static void substitute_vars(const char *equ, const MC3_Program *prog,
+                            const double *vars, char *out, size_t size) {
+    size_t written = 0;
+
+    for (size_t i = 0; equ[i] != '\0' && written + 32 < size;) {
+        size_t length = 0;
+        char name[64];
+
+        if (!is_identifier_start(equ[i])) {
+            out[written++] = equ[i++];
+            continue;
+        }
+
+        while (is_identifier_char(equ[i + length]) &&
+               length + 1 < sizeof(name)) {
+            name[length] = equ[i + length];
+            length++;
+        }
+        name[length] = '\0';
+
+        const int var = MC3_var_index(prog, name);
+        if (var >= 0)
+            written += sprintf(out + written, "(%.17g)", vars[var]);
+        else
+            written += sprintf(out + written, "%s", name);
+        i += length;
+    }
+
+    out[written] = '\0';
+}
+
+void test_emit_c(void) {
+    /* every operator, constants which are not finite, sums and products, and
+       more variables than some of the expressions use */
+    static const char *const equations[] = {
+        "price * (1 + rate) ^ years - price",
+        "sin(x) / cos(y) + tan(x * y) - log(x) * ln(y) + 2 ^ 0.5",
+        "1 / 0 + x",
+        "0 / 0 * x",
+        "pi * e * x ^ 3 - 0.1",
+        "x ^ 13 + 1 / 3",
+        "42",
+        "sum(i, 1, 20000, x / i) + prod(j, 1, 5, y + j) - "
+        "sum(k, 1, z * 10, k ^ 2 * x + sum(l, 1, k, sin(l)))",
+    };
+    enum { EQUATIONS = sizeof(equations) / sizeof(equations[0]), ROWS = 200 };
+    /* next to the test binary rather than in a shared directory */
+    char dir[] = "mcalc3-emit-XXXXXX";
+    char source_path[64], binary_path[64], input_path[64], output_path[64];
+    const char *compiler = getenv("CC") ? getenv("CC") : "cc";
+    MC3_Program *progs[EQUATIONS] = {0};
+    bool matches = mkdtemp(dir) != NULL;
+
+    MLOG_log("Testing Suite: Emit C");
+
+    sprintf(source_path, "%s/emitted.c", dir);
+    sprintf(binary_path, "%s/emitted", dir);
+    sprintf(input_path, "%s/input", dir);
+    sprintf(output_path, "%s/output", dir);
+
+    /* the generated functions, and a driver printing their results for the
+       rows of three variables on its input */
+    FILE *source = matches ? fopen(source_path, "w") : NULL;
+    matches = source != NULL;
+
+    for (unsigned int i = 0; i < EQUATIONS && matches; i++) {
+        char name[16];
+
+        progs[i] = MC3_compile(equations[i], NULL);
+        matches = progs[i] != NULL && MC3_var_count(progs[i]) <= 3;
+        if (matches) {
+            sprintf(name, "f%u", i);
+            MC3_emit_c(progs[i], name, source);
+        }
+    }
+
+    if (source != NULL) {
+        fputs("#include <stdio.h>\n"
+              "int main(void) {\n"
+              "    double vars[3];\n"
+              "    while (scanf(\"%la %la %la\", &vars[0], &vars[1], &vars[2])"
+              " == 3) {\n",
+              source);
+        for (unsigned int i = 0; i < EQUATIONS; i++)
+            fprintf(source, "        printf(\"%%a\\n\", f%u(vars));\n", i);
+        fputs("    }\n    return 0;\n}\n", source);
+        matches = fclose(source) == 0 && matches;
+    }
+
+    char *const compile[] = {(char *)compiler, "-std=c99", "-o",
+                             binary_path,      source_path, "-lm",
+                             NULL};
+    const int compiled = matches ? run_command(compile, NULL, NULL) : 0;
+
+    if (matches && compiled < 0) {
+        MLOG_log("no C compiler found, skipping");
+        matches = false;
+    } else {
+        matches = matches && compiled == 0;
+        MLOG_test("generated code compiles", matches);
+    }
+
+    double vars[ROWS][3];
+    FILE *input = matches ? fopen(input_path, "w") : NULL;
+    matches = input != NULL;
+
+    srand(21);
+    for (int row = 0; row < ROWS && matches; row++) {
+        for (int i = 0; i < 3; i++) {
+            vars[row][i] = 0.1 + 3.0 * rand() / RAND_MAX;
+            fprintf(input, "%a ", vars[row][i]);
+        }
+        fputc('\n', input);
+    }
+    if (input != NULL)
+        matches = fclose(input) == 0 && matches;
+
+    char *const run[] = {binary_path, NULL};
+    matches = matches && run_command(run, input_path, output_path) == 0;
+    FILE *output = matches ? fopen(output_path, "r") : NULL;
+    matches = output != NULL;
+
+    /* the variables of each program are numbered in order of appearance, and
+       so are the columns of the input. MC3_evaluate gets their values
+       written into the expression. */
+    for (int row = 0; row < ROWS && matches; row++) {
+        for (unsigned int i = 0; i < EQUATIONS && matches; i++) {
+            char equ[512], text[64];
+
+            substitute_vars(equations[i], progs[i], vars[row], equ,
+                            sizeof(equ));
+            const double expected = MC3_evaluate(equ, NULL);
+
+            matches = fscanf(output, "%63s", text) == 1;
+            const double value = strtod(text, NULL);
+            matches = matches && (isnan(expected)
+                                      ? isnan(value)
+                                      : memcmp(&value, &expected,
+                                               sizeof(double)) == 0);
+        }
+    }
+    if (output != NULL) {
+        fclose(output);
+        MLOG_test("generated code matches MC3_evaluate", matches);
+    }
+
+    /* only the files written above can be in the directory */
+    const char *const paths[] = {source_path, binary_path, input_path,
+                                 output_path};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+        remove(paths[i]);
+    MLOG_test("generated files are removed", rmdir(dir) == 0);
+
+    for (unsigned int i = 0; i < EQUATIONS; i++)
+        MC3_free_program(progs[i]);
+}
+
+#if defined(HAVE_VECTOR_KERNELS)
+static long double reference_value(enum OpCode op, long double x,
+                                   long double y) {
+    switch (op) {
+    case OPC_EXP:
+        return powl(x, y);
+    case OPC_SIN:
+        return sinl(x);
+    case OPC_COS:
+        return cosl(x);
+    case OPC_TAN:
+        return tanl(x);
+    case OPC_LOG:
+        return log10l(x);
+    default:
+        return logl(x);
+    }
+}
+
+/**
+ * @brief the largest error of `out` against the long double value of `op`,
+ * in units in the last place of a double.
+ */
+static double max_ulp_error(enum OpCode op, const double *lhs,
+                            const double *rhs, const double *out, size_t n) {
+    double worst = 0.0;
+
+    for (size_t i = 0; i < n; i++) {
+        const long double exact = reference_value(op, lhs[i], rhs[i]);
+        const long double ulp = ldexpl(1.0L, ilogbl(exact) - 52);
+        worst = fmax(worst, (double)(fabsl(out[i] - exact) / ulp));
+    }
+
+    return worst;
+}
+#endif
+
+void test_vector_math(void) {
+    MLOG_log("Testing Suite: Vector Math");
+
+#if defined(HAVE_VECTOR_KERNELS)
+    /* not a multiple of any width, so the last vector is padded */
+    enum { ROWS = 4099, SPECIAL_ROWS = 12 };
+    static double lhs[ROWS], rhs[ROWS], out[ROWS], first[ROWS];
+    struct {
+        bool supported;
+        BatchKernel high[OPC_LN + 1];
+        BatchKernel fast[OPC_LN + 1];
+    } widths[3] = {{.supported = true}};
+    const unsigned int width_count = sizeof(widths) / sizeof(widths[0]);
+
+    SET_VECTOR_KERNELS(widths[0].high, MC3_PRECISION_HIGH, sse2);
+    SET_VECTOR_KERNELS(widths[0].fast, MC3_PRECISION_FAST, sse2);
+    #if defined(HAVE_WIDE_VECTOR_KERNELS)
+    widths[1].supported = __builtin_cpu_supports("avx2");
+    SET_VECTOR_KERNELS(widths[1].high, MC3_PRECISION_HIGH, avx2);
+    SET_VECTOR_KERNELS(widths[1].fast, MC3_PRECISION_FAST, avx2);
+    widths[2].supported = __builtin_cpu_supports("avx512f");
+    SET_VECTOR_KERNELS(widths[2].high, MC3_PRECISION_HIGH, avx512);
+    SET_VECTOR_KERNELS(widths[2].fast, MC3_PRECISION_FAST, avx512);
+    #endif
+
+    /* arguments are spread over [low, high], evenly or, for `logarithmic`,
+       evenly in their logarithm. Exponents are spread over [-100, 100] */
+    static const struct {
+        enum OpCode op;
+        double low, high;
+        bool logarithmic;
+    } ranges[] = {
+        {OPC_SIN, -10, 10, false},       {OPC_SIN, -1e6, 1e6, false},
+        {OPC_COS, -10, 10, false},       {OPC_COS, -1e6, 1e6, false},
+        {OPC_TAN, -10, 10, false},       {OPC_TAN, -1e6, 1e6, false},
+        {OPC_LN, 1e-300, 1e300, true},   {OPC_LN, 0.9, 1.1, false},
+        {OPC_LOG, 1e-300, 1e300, true},  {OPC_LOG, 0.9, 1.1, false},
+        {OPC_EXP, 1e-3, 1e3, true},      {OPC_EXP, 0.99, 1.01, false},
+    };
+    bool high_bound = true;
+    bool fast_bound = true;
+    bool same_bits = true;
+
+    srand(22);
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        for (int i = 0; i < ROWS; i++) {
+            const double u = (double)rand() / RAND_MAX;
+
+            lhs[i] = ranges[r].logarithmic
+                         ? exp(log(ranges[r].low) +
+                               u * (log(ranges[r].high) - log(ranges[r].low)))
+                         : ranges[r].low + u * (ranges[r].high - ranges[r].low);
+            rhs[i] = 200.0 * rand() / RAND_MAX - 100.0;
+        }
+
+        for (unsigned int w = 0; w < width_count; w++) {
+            if (!widths[w].supported)
+                continue;
+
+            widths[w].high[ranges[r].op](out, lhs, rhs, ROWS);
+            high_bound = high_bound &&
+                         max_ulp_error(ranges[r].op, lhs, rhs, out, ROWS) <= 1;
+            if (w == 0)
+                memcpy(first, out, sizeof(out));
+            same_bits = same_bits && memcmp(first, out, sizeof(out)) == 0;
+
+            widths[w].fast[ranges[r].op](out, lhs, rhs, ROWS);
+            fast_bound = fast_bound &&
+                         max_ulp_error(ranges[r].op, lhs, rhs, out, ROWS) <= 4;
+        }
+    }
+
+    MLOG_test("high precision within 1 ulp", high_bound);
+    MLOG_test("fast precision within 4 ulp", fast_bound);
+    MLOG_test("every width returns the same bits", same_bits);
+
+    /* arguments the kernels leave to the C library, and signed zeros */
+    static const double special_lhs[SPECIAL_ROWS] = {
+        NAN,  INFINITY, -INFINITY, 0.0,      -0.0,          -1.0,
+        1e300, 0x1p20 + 1, DBL_MAX, 0x1p-1070, 1e-310, 1e5,
+    };
+    static const double special_rhs[SPECIAL_ROWS] = {
+        2.0, 0.5, 3.0, -1.0, 3.0, 0.5, 2.0, NAN, 0.5, 0.5, -2.0, 100.0,
+    };
+    bool matches = true;
+
+    for (unsigned int w = 0; w < width_count; w++) {
+        if (!widths[w].supported)
+            continue;
+
+        for (enum OpCode op = OPC_EXP; op <= OPC_LN; op++) {
+            widths[w].high[op](out, special_lhs, special_rhs, SPECIAL_ROWS);
+
+            for (int i = 0; i < SPECIAL_ROWS; i++) {
+                const double expected =
+                    apply_operator(op, special_lhs[i], special_rhs[i]);
+                matches = matches &&
+                          (isnan(expected) ? isnan(out[i])
+                                           : memcmp(&out[i], &expected,
+                                                    sizeof(double)) == 0);
+            }
+        }
+    }
+    MLOG_test("special arguments match the C library", matches);
+
+    /* exponents large enough to overflow splitting them in two_prod */
+    static const double huge_lhs[] = {1.0, 1.0, 1.0, 1.0, 0.5, 2.0};
+    static const double huge_rhs[] = {1e308, -1e308, DBL_MAX, -DBL_MAX,
+                                      0x1p997, -0x1p997};
+    const size_t huge_rows = sizeof(huge_lhs) / sizeof(huge_lhs[0]);
+    bool huge_matches = true;
+
+    for (unsigned int w = 0; w < width_count; w++) {
+        if (!widths[w].supported)
+            continue;
+
+        for (int high = 0; high <= 1; high++) {
+            (high ? widths[w].high : widths[w].fast)[OPC_EXP](
+                out, huge_lhs, huge_rhs, huge_rows);
+
+            for (size_t i = 0; i < huge_rows; i++)
+                huge_matches = huge_matches &&
+                               out[i] == pow(huge_lhs[i], huge_rhs[i]);
+        }
+    }
+    MLOG_test("pow with huge exponents", huge_matches);
+#endif
+
+    /* whole programs, against MC3_run */
+    enum { PROGRAM_ROWS = 1000 };
+    double xs[PROGRAM_ROWS], ys[PROGRAM_ROWS], results[PROGRAM_ROWS];
+    const double *columns[] = {xs, ys};
+    MC3_Program *prog =
+        MC3_compile("sin(x) * ln(y) + x ^ y - tan(x / y) + log(x)", NULL);
+    bool close = prog != NULL;
+
+    for (int i = 0; i < PROGRAM_ROWS; i++) {
+        xs[i] = 0.01 + i * 0.01;
+        ys[i] = 0.5 + i * 0.003;
+    }
+
+    for (MC3_Precision precision = MC3_PRECISION_LIBM;
+         precision <= MC3_PRECISION_FAST && close; precision++) {
+        close = MC3_eval_batch_precision(prog, columns, PROGRAM_ROWS, results,
+                                         precision) == MC3_NO_ERROR;
+
+        for (int i = 0; i < PROGRAM_ROWS && close; i++) {
+            const double expected =
+                MC3_run(prog, (double[]){xs[i], ys[i]}, NULL);
+            close = (precision == MC3_PRECISION_LIBM)
+                        ? results[i] == expected
+                        : fabs(results[i] - expected) <=
+                              1e-12 * fmax(1.0, fabs(expected));
+        }
+    }
+    MLOG_test("MC3_eval_batch_precision", close);
+    MC3_free_program(prog);
+}
+
+/**
+ * @brief checks that `equ` fails with `code` at byte `offset`.
+ */
+static bool range_fails(MC3_Context *ctx, const char *equ, MC3_ErrorCode code,
+                        size_t offset) {
+    MC3_Error error;
+
+    MC3_context_evaluate(ctx, equ, strlen(equ), &error);
+    return error.code == code && error.offset == offset;
+}
+
+/**
+ * @brief evaluates the compiled `prog` with the chunks of its ranges shared
+ * by `threads` threads.
+ */
+static double run_on_threads(const MC3_Program *prog, unsigned int threads) {
+    range_threads = threads;
+    const double value = MC3_run(prog, NULL, NULL);
+    range_threads = 0;
+    return value;
+}
+
+struct RangeCaller {
+    const MC3_Program *prog;
+    double *result;
+};
+
+static void *run_from_thread(void *arg) {
+    const struct RangeCaller *caller = arg;
+    *caller->result = run_on_threads(caller->prog, 8);
+    return NULL;
+}
+
+void test_ranges(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    MC3_Context *ctx = MC3_context_new();
+    MC3_Program *prog = NULL;
+
+    MLOG_log("Testing Suite: Ranges");
+
+    MLOG_test("sum(i, 1, 10, i)",
+              MC3_evaluate("sum(i, 1, 10, i)", &error) == 55.0 &&
+                  error == MC3_NO_ERROR);
+    MLOG_test("prod(i, 1, 5, i)",
+              MC3_evaluate("prod(i, 1, 5, i)", &error) == 120.0 &&
+                  error == MC3_NO_ERROR);
+    MLOG_test("sum(i, 1, 3, sum(j, 1, i, i * j))",
+              MC3_evaluate("sum(i, 1, 3, sum(j, 1, i, i * j))", &error) ==
+                      25.0 &&
+                  error == MC3_NO_ERROR);
+    MLOG_test("sum(i, 0.5, 3, i)",
+              MC3_evaluate("sum(i, 0.5, 3, i)", &error) == 4.5);
+    MLOG_test("empty ranges",
+              MC3_evaluate("sum(i, 5, 1, i) + prod(i, 5, 1, i)", &error) ==
+                  1.0);
+    MLOG_test("bound which is not a number",
+              isnan(MC3_evaluate("sum(i, 1, 0 / 0, i)", &error)) &&
+                  isnan(MC3_evaluate("prod(i, 1 / 0, 2, i)", &error)));
+
+    /* the index hides a variable of the same name inside the body only */
+    prog = MC3_compile("sum(x, 1, 3, x) + x", &error);
+    MLOG_test("index named like a variable",
+              prog != NULL && MC3_var_count(prog) == 1 &&
+                  MC3_run(prog, (double[]){10}, NULL) == 16.0);
+    MC3_free_program(prog);
+
+    MLOG_test("too few arguments",
+              range_fails(ctx, "sum(i, 1, 2)", MC3_UNEXPECTED_TOKEN, 11));
+    MLOG_test("too many arguments",
+              range_fails(ctx, "sum(i, 1, 2, i, 3)", MC3_UNEXPECTED_TOKEN,
+                          14));
+    MLOG_test("index which is not a name",
+              range_fails(ctx, "sum(1, 2, 3, 4)", MC3_UNEXPECTED_TOKEN, 4) &&
+                  range_fails(ctx, "sum(i + 1, 1, 2, i)",
+                              MC3_UNEXPECTED_TOKEN, 6));
+    MLOG_test("comma outside of a range",
+              range_fails(ctx, "1, 2", MC3_UNEXPECTED_TOKEN, 1) &&
+                  range_fails(ctx, "sum(i, 1, 2, (i, 3))",
+                              MC3_UNEXPECTED_TOKEN, 15));
+    MLOG_test("unclosed range",
+              range_fails(ctx, "sum(i, 1, 2, i", MC3_UNBALANCED_PARENTHESES,
+                          14));
+    MLOG_test("index used in its bounds",
+              range_fails(ctx, "sum(i, i, 2, 1)", MC3_UNBOUND_VARIABLE, 7));
+
+    /* a polynomial body is summed in closed form, folded into a constant
+       when it has no variables */
+    prog = MC3_compile("sum(i, 1, 100, i ^ 2)", &error);
+    MLOG_test("closed form of a constant sum",
+              prog != NULL && prog->length == 1 &&
+                  MC3_run(prog, NULL, NULL) == 338350.0);
+    MC3_free_program(prog);
+
+    const char *polynomial = "sum(i, 0 - 50, 1000, 1.5 * i ^ 3 - 2 * i + 0.25)";
+    const double looped = MC3_evaluate(polynomial, NULL);
+    prog = MC3_compile(polynomial, &error);
+    MLOG_test("closed form matches the loop",
+              prog != NULL &&
+                  fabs(MC3_run(prog, NULL, NULL) - looped) <=
+                      1e-15 * fabs(looped));
+    MC3_free_program(prog);
+
+    const double quintic =
+        MC3_evaluate("sum(i, 0 - 3, 2e5, 0.5 * i ^ 5 - i * i / 4)", NULL);
+    prog = MC3_compile("sum(i, a, b, x * i ^ 5 - i * i / y)", &error);
+    MLOG_test("closed form with variables",
+              prog != NULL && prog->range_count == 1 &&
+                  prog->ranges[0].degree == 5 &&
+                  fabs(MC3_run(prog, (double[]){-3, 2e5, 0.5, 4}, NULL) -
+                       quintic) <= 1e-14 * fabs(quintic));
+    MC3_free_program(prog);
+
+    prog = MC3_compile("prod(i, 1, n, x + 1)", &error);
+    MLOG_test("closed form of a product",
+              prog != NULL && prog->ranges[0].degree == 0 &&
+                  MC3_run(prog, (double[]){10, 0.5}, NULL) ==
+                      pow(1.5, 10));
+    MC3_free_program(prog);
+
+    /* compensated summation keeps the harmonic sum to the last bit or so */
+    long double harmonic = 0.0L;
+    for (int i = 1000000; i >= 1; i--)
+        harmonic += 1.0L / i;
+    MLOG_test("sum(i, 1, 1000000, 1 / i)",
+              fabsl(MC3_evaluate("sum(i, 1, 1000000, 1 / i)", NULL) -
+                    harmonic) <= 0x1p-52L * harmonic);
+
+    /* large enough to be split across threads, nested ranges included */
+    prog = MC3_compile("sum(i, 1, 300000, sin(i) / i) + "
+                       "prod(j, 1, 200000, 1 + 1e-6 * cos(j)) + "
+                       "sum(k, 1, 140000, sum(l, 1, 2, sin(k * l)))",
+                       &error);
+    const double serial = (prog != NULL) ? run_on_threads(prog, 1) : 0.0;
+    bool same_bits = prog != NULL && !isnan(serial);
+    for (unsigned int threads = 2; threads <= 8 && same_bits; threads *= 2) {
+        const double parallel = run_on_threads(prog, threads);
+        same_bits = memcmp(&parallel, &serial, sizeof(double)) == 0;
+    }
+    MLOG_test("same bits on any number of threads", same_bits);
+
+    /* evaluations reuse the threads of the pool instead of starting their
+       own, and ranges evaluated while it is busy are added alone */
+    const unsigned int pool_threads = range_pool.threads;
+    pthread_t ids[4];
+    double results[4];
+    struct RangeCaller callers[4];
+    unsigned int started = 0;
+    for (; prog != NULL && started < 4; started++) {
+        callers[started] = (struct RangeCaller){prog, &results[started]};
+        if (pthread_create(&ids[started], NULL, run_from_thread,
+                           &callers[started]) != 0)
+            break;
+    }
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    for (unsigned int i = 0; i < started; i++)
+        same_bits = same_bits &&
+                    memcmp(&results[i], &serial, sizeof(double)) == 0;
+    MLOG_test("concurrent ranges", same_bits && started == 4);
+    MLOG_test("pool threads are reused",
+              pool_threads == 7 && range_pool.threads == pool_threads);
+    MC3_free_program(prog);
+
+    MC3_Session *session = MC3_session_new();
+    MC3_Error session_error;
+    const double doubled =
+        MC3_session_update(session, "sum(i, 1, 100, i * 2)", 21,
+                           &session_error);
+    const double tripled =
+        MC3_session_update(session, "sum(i, 1, 100, i * 3)", 21,
+                           &session_error);
+    MLOG_test("session edits a body",
+              doubled == 10100.0 && tripled == 15150.0 &&
+                  MC3_session_update(session, "sum(i, 1, 100, i * 3) + 1",
+                                     25, &session_error) == 15151.0);
+    MC3_session_free(session);
+
+    enum { ROWS = 300 };
+    double xs[ROWS];
+    double ys[ROWS];
+    double out[ROWS];
+    prog = MC3_compile("sum(i, 1, 50, x ^ i / i) * y", &error);
+    for (int row = 0; row < ROWS; row++) {
+        xs[row] = row * 0.003;
+        ys[row] = row - 100.0;
+    }
+    bool batch_matches =
+        prog != NULL &&
+        MC3_eval_batch(prog, (const double *const[]){xs, ys}, ROWS, out) ==
+            MC3_NO_ERROR;
+    for (int row = 0; row < ROWS && batch_matches; row++)
+        batch_matches = out[row] == MC3_run(prog, (double[]){xs[row], ys[row]},
+                                            NULL);
+    MLOG_test("batch evaluation", batch_matches);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("sum(i, 1, 20, x * sin(y * i)) + "
+                       "prod(j, 1, 4, x + j / y)",
+                       &error);
+    MLOG_test("gradient of a loop",
+              prog != NULL &&
+                  matches_differences(prog, (double[]){0.7, 1.3}) &&
+                  MC3_jit_compile(prog) == NULL);
+    MC3_free_program(prog);
+
+    prog = MC3_compile("sum(i, 1, 30, x * i ^ 2 + y * i) * prod(j, 2, 5, y)",
+                       &error);
+    MLOG_test("gradient of a closed form",
+              prog != NULL && prog->ranges[0].degree == 2 &&
+                  matches_differences(prog, (double[]){0.7, 1.3}));
+    MC3_free_program(prog);
+
+    MC3_Error exact_error;
+    MLOG_test("exact sums", MC3_evaluate_exact("1 + sum(i, 1, 2, i)", 19,
+                                               &exact_error) == NULL &&
+                                exact_error.code == MC3_INEXACT_RESULT &&
+                                exact_error.offset == 4);
+
+    MC3_context_free(ctx);
+}
+
+/**
+ * @brief evaluates `equ` with matrices and compares the result with the
+ * `rows` by `columns` elements of `expected`, bit for bit.
+ */
+static bool matrix_equals(const char *equ, const MC3_Matrix *vars,
+                          unsigned int rows, unsigned int columns,
+                          const double *expected) {
+    MC3_Matrix result;
+    const bool same =
+        MC3_evaluate_matrix(equ, strlen(equ), vars, &result, NULL) ==
+            MC3_NO_ERROR &&
+        result.rows == rows && result.columns == columns &&
+        memcmp(result.elements, expected, rows * columns * sizeof(double)) ==
+            0;
+
+    free(result.elements);
+    return same;
+}
+
+static bool matrix_fails(const char *equ, const MC3_Matrix *vars,
+                         MC3_ErrorCode code, size_t offset) {
+    MC3_Matrix result;
+    MC3_Error error;
+
+    return MC3_evaluate_matrix(equ, strlen(equ), vars, &result, &error) ==
+               code &&
+           error.code == code && error.offset == offset &&
+           result.elements == NULL;
+}
+
+void test_matrices(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+
+    MLOG_log("Testing Suite: Matrices");
+
+    MLOG_test("[1, 2; 3, 4] @ [5; 6]",
+              matrix_equals("[1, 2; 3, 4] @ [5; 6]", NULL, 2, 1,
+                            (double[]){17, 39}));
+    MLOG_test("[1, 2; 3, 4] * 2 + [10, 20; 30, 40]",
+              matrix_equals("[1, 2; 3, 4] * 2 + [10, 20; 30, 40]", NULL, 2, 2,
+                            (double[]){12, 24, 36, 48}));
+    MLOG_test("2 ^ [1, 2, 3] / [4, 1, 2]",
+              matrix_equals("2 ^ [1, 2, 3] / [4, 1, 2]", NULL, 1, 3,
+                            (double[]){0.5, 4, 4}));
+    MLOG_test("sin([0.5; 1 + 1]) like MC3_evaluate",
+              matrix_equals("sin([0.5; 1 + 1])", NULL, 2, 1,
+                            (double[]){sin(0.5), sin(2)}));
+    MLOG_test("dot([1, 2, 3], [4; 5; 6])",
+              matrix_equals("dot([1, 2, 3], [4; 5; 6])", NULL, 1, 1,
+                            (double[]){32}));
+    MLOG_test("[1, 2] @ [3; 4] @ [5, 6]",
+              matrix_equals("[1, 2] @ [3; 4] @ [5, 6]", NULL, 1, 2,
+                            (double[]){55, 66}));
+    MLOG_test("sum(i, 1, 4, i) * [1, 2]",
+              matrix_equals("sum(i, 1, 4, i) * [1, 2]", NULL, 1, 2,
+                            (double[]){10, 20}));
+
+    const MC3_Matrix vars[] = {
+        {2, 2, (double[]){2, 0, 1, 3}},
+        {2, 1, (double[]){1, 2}},
+        {1, 1, (double[]){10}},
+    };
+    MLOG_test("a @ v - v * k",
+              matrix_equals("a @ v - v * k", vars, 2, 1,
+                            (double[]){2 - 10, 7 - 20}));
+    /* only the variables a sum reads must be numbers */
+    MLOG_test("a + sum(i, 1, 3, i)",
+              matrix_equals("a + sum(i, 1, 3, i)", vars, 2, 2,
+                            (double[]){8, 6, 7, 9}));
+    MLOG_test("a @ v + sum(i, 1, 3, i * k)",
+              matrix_equals("a @ v + sum(i, 1, 3, i * k)", vars, 2, 1,
+                            (double[]){62, 67}));
+
+    /* crosses the edges of the blocks in both directions */
+    enum { M = 70, K = 150, N = 300 };
+    MC3_Matrix operands[2] = {{M, K, malloc(M * K * sizeof(double))},
+                              {K, N, malloc(K * N * sizeof(double))}};
+    double *expected = malloc(M * N * sizeof(double));
+    MC3_Matrix product = {0, 0, NULL};
+    bool blocked = operands[0].elements && operands[1].elements && expected;
+
+    for (size_t i = 0; blocked && i < M * K; i++)
+        operands[0].elements[i] = sin((double)i) * 3.0;
+    for (size_t i = 0; blocked && i < K * N; i++)
+        operands[1].elements[i] = 1.0 / (i + 0.5);
+    for (size_t i = 0; blocked && i < M; i++) {
+        for (size_t j = 0; j < N; j++) {
+            double sum = 0.0;
+            for (size_t p = 0; p < K; p++)
+                sum += operands[0].elements[i * K + p] *
+                       operands[1].elements[p * N + j];
+            expected[i * N + j] = sum;
+        }
+    }
+    blocked = blocked &&
+              MC3_evaluate_matrix("a @ b", 5, operands, &product, NULL) ==
+                  MC3_NO_ERROR &&
+              product.rows == M && product.columns == N &&
+              memcmp(product.elements, expected, M * N * sizeof(double)) == 0;
+    MLOG_test("blocked product matches the plain loop", blocked);
+    free(product.elements);
+
+    /* every kernel returns what the scalar one does */
+    const MC3_Matrix rows[] = {{1, 1003, operands[1].elements},
+                               {1003, 1, &operands[1].elements[7]}};
+    const double dot = matrix_dot(rows[0].elements, rows[1].elements, 1003);
+    MLOG_test("dot of 1003 elements",
+              blocked && matrix_equals("dot(x, y)", rows, 1, 1, &dot));
+    free(operands[0].elements);
+    free(operands[1].elements);
+    free(expected);
+
+    MLOG_test("[1, 2; 3]",
+              matrix_fails("[1, 2; 3]", NULL, MC3_DIMENSION_MISMATCH, 8));
+    MLOG_test("[1, 2] + [1, 2, 3]",
+              matrix_fails("[1, 2] + [1, 2, 3]", NULL, MC3_DIMENSION_MISMATCH,
+                           7));
+    MLOG_test("[1, 2] @ [1, 2]",
+              matrix_fails("[1, 2] @ [1, 2]", NULL, MC3_DIMENSION_MISMATCH,
+                           7));
+    MLOG_test("dot([1, 2], 3)",
+              matrix_fails("dot([1, 2], 3)", NULL, MC3_DIMENSION_MISMATCH, 0));
+    MLOG_test("[[1, 2], 3]",
+              matrix_fails("[[1, 2], 3]", NULL, MC3_DIMENSION_MISMATCH, 0));
+    MLOG_test("sum(i, 1, 3, [i, 1])",
+              matrix_fails("sum(i, 1, 3, [i, 1])", NULL,
+                           MC3_DIMENSION_MISMATCH, 13));
+    MLOG_test("sum(i, 1, 3, i * a)",
+              matrix_fails("sum(i, 1, 3, i * a)", vars, MC3_DIMENSION_MISMATCH,
+                           17));
+    MLOG_test("sum(i, 1, 2, sum(j, 1, i, a))",
+              matrix_fails("sum(i, 1, 2, sum(j, 1, i, a))", vars,
+                           MC3_DIMENSION_MISMATCH, 26));
+    MLOG_test("a + sum(i, 1, 3, i) + sum(j, 1, 2, j * a)",
+              matrix_fails("a + sum(i, 1, 3, i) + sum(j, 1, 2, j * a)", vars,
+                           MC3_DIMENSION_MISMATCH, 39));
+    MLOG_test("[1, 2)",
+              matrix_fails("[1, 2)", NULL, MC3_UNBALANCED_PARENTHESES, 5));
+    MLOG_test("(1, 2]",
+              matrix_fails("(1, 2]", NULL, MC3_UNEXPECTED_TOKEN, 2));
+    MLOG_test("[1, 2",
+              matrix_fails("[1, 2", NULL, MC3_UNBALANCED_PARENTHESES, 5));
+    MLOG_test("[1, ]", matrix_fails("[1, ]", NULL, MC3_UNEXPECTED_TOKEN, 4));
+    MLOG_test("dot(1, 2, 3)",
+              matrix_fails("dot(1, 2, 3)", NULL, MC3_UNEXPECTED_TOKEN, 8));
+    MLOG_test("dot(1)", matrix_fails("dot(1)", NULL, MC3_UNEXPECTED_TOKEN, 5));
+    MLOG_test("1; 2", matrix_fails("1; 2", NULL, MC3_UNEXPECTED_TOKEN, 1));
+    MLOG_test("x @ [1]",
+              matrix_fails("x @ [1]", NULL, MC3_UNBOUND_VARIABLE, 0));
+
+    /* everywhere else numbers are matrices of one element */
+    MLOG_test("[2] * 3 @ 4 + dot(1, 2)",
+              MC3_evaluate("[2] * 3 @ 4 + dot(1, 2)", &error) == 26 &&
+                  error == MC3_NO_ERROR);
+    MC3_evaluate("1 + [1, 2]", &error);
+    MLOG_test("1 + [1, 2]", error == MC3_DIMENSION_MISMATCH);
+}
+
+void test_cache(void) {
+    MC3_Cache *cache = MC3_cache_new(2, 1);
+    MC3_Context *ctx = MC3_context_new();
+    MC3_CacheStats stats;
+    MC3_Error error;
+    double result = 0.0;
+
+    MLOG_log("Testing Suite: Cache");
+
+    MC3_Program *first = MC3_cache_compile(cache, "2 * x", 5, &error);
+    MC3_Program *second = MC3_cache_compile(cache, " 2*x ", 5, &error);
+    MLOG_test("spacing is ignored", first != NULL && first == second);
+    MC3_free_program(second);
+
+    /* "12" and "1 2" must not share an entry */
+    MC3_cache_compile(cache, "1 2", 3, &error);
+    MLOG_test("1 2", error.code == MC3_UNEXPECTED_TOKEN && error.offset == 2);
+
+    stats = MC3_cache_stats(cache);
+    MLOG_test("hits and misses", stats.hits == 1 && stats.misses == 2 &&
+                                     stats.size == 1);
+
+    MC3_context_set_cache(ctx, cache);
+    result = MC3_context_evaluate(ctx, "1 + 2", 5, &error);
+    MLOG_test("1 + 2", error.code == MC3_NO_ERROR && result == 3.0);
+    result = MC3_context_evaluate(ctx, "3 * 4", 5, &error);
+    MLOG_test("3 * 4", error.code == MC3_NO_ERROR && result == 12.0);
+
+    /* "2 * x" was the least recently used, the evicted program stays valid
+       while referenced */
+    stats = MC3_cache_stats(cache);
+    MLOG_test("eviction", stats.evictions == 1 && stats.size == 2);
+    const double x = 4.0;
+    MLOG_test("evicted program", MC3_run(first, &x, NULL) == 8.0);
+    MC3_free_program(first);
+
+    result = MC3_context_evaluate(ctx, "1+2", 3, &error);
+    stats = MC3_cache_stats(cache);
+    MLOG_test("1+2", error.code == MC3_NO_ERROR && result == 3.0 &&
+                         stats.hits == 2);
+
+    MC3_context_evaluate(ctx, "1 + rate", 8, &error);
+    MLOG_test("1 + rate", error.code == MC3_UNBOUND_VARIABLE &&
+                              error.offset == 4);
+
+    MC3_context_free(ctx);
+    MC3_cache_free(cache);
+
+    /* spaces around an exponent split the literal, so they are kept */
+    cache = MC3_cache_new(4, 1);
+    MC3_free_program(MC3_cache_compile(cache, "1e-5", 4, &error));
+    MC3_free_program(MC3_cache_compile(cache, "2E+3", 4, &error));
+    MLOG_test("1e -5", MC3_cache_compile(cache, "1e -5", 5, &error) == NULL &&
+                           error.code == MC3_UNEXPECTED_TOKEN);
+    MLOG_test("1e- 5", MC3_cache_compile(cache, "1e- 5", 5, &error) == NULL &&
+                           error.code == MC3_UNEXPECTED_TOKEN);
+    MLOG_test("2E +3", MC3_cache_compile(cache, "2E +3", 5, &error) == NULL &&
+                           error.code == MC3_UNEXPECTED_TOKEN);
+
+    /* a `$` only names a result when a digit follows it */
+    MC3_free_program(MC3_cache_compile(cache, "$1+1", 4, &error));
+    MLOG_test("$ 1+1", MC3_cache_compile(cache, "$ 1+1", 5, &error) == NULL &&
+                           error.code == MC3_INVALID_CHARACTER_FOUND &&
+                           error.offset == 0);
+    MC3_cache_free(cache);
+
+    /* the cache only saves work, every path computes the same bits */
+    static const char *const powers[] = {
+        "sum(i, 1, 1000, sin(i) ^ 11)", "sum(i, 1, 1000, (i / 7 + 0.3) ^ 3)",
+        "1.1 ^ 13", "2.5 ^ 0.5 * 3 ^ 7", "prod(k, 1, 20, 1 + 1 / k ^ 2)"};
+    cache = MC3_cache_new(8, 1);
+    ctx = MC3_context_new();
+    MC3_Context *cached = MC3_context_new();
+    MC3_context_set_cache(cached, cache);
+    MC3_Session *session = MC3_session_new();
+    for (size_t i = 0; i < sizeof(powers) / sizeof(*powers); i++) {
+        const size_t length = strlen(powers[i]);
+        MC3_ErrorCode code = MC3_NO_ERROR;
+        MC3_Program *prog = MC3_compile(powers[i], &code);
+        const double results[] = {
+            MC3_evaluate(powers[i], NULL),
+            MC3_context_evaluate(ctx, powers[i], length, &error),
+            MC3_context_evaluate(cached, powers[i], length, &error),
+            MC3_context_evaluate(cached, powers[i], length, &error),
+            prog != NULL ? MC3_run(prog, NULL, NULL) : 0.0,
+            MC3_session_update(session, powers[i], length, &error)};
+        bool same = true;
+        for (size_t j = 1; j < sizeof(results) / sizeof(*results); j++)
+            same = same &&
+                   memcmp(&results[0], &results[j], sizeof(double)) == 0;
+        MLOG_test(powers[i], same);
+        MC3_free_program(prog);
+    }
+    MC3_session_free(session);
+    MC3_context_free(cached);
+    MC3_context_free(ctx);
+    MC3_cache_free(cache);
+}
+
+void test_stats(void) {
+    MC3_ErrorCode error = MC3_NO_ERROR;
+    MC3_Stats stats;
+
+    MLOG_log("Testing Suite: Statistics");
+
+    MC3_reset_stats();
+    MC3_evaluate("(1 + (2 * 3)) - 4", &error);
+    MC3_evaluate("1 + x", &error);
+    MC3_evaluate("2 $ 3", &error);
+    stats = MC3_get_stats();
+
+#if defined(MC3_STATS)
+    MLOG_test("phases",
+              stats.enabled && stats.calls[MC3_PHASE_TOKENIZE] == 0 &&
+                  stats.calls[MC3_PHASE_PARSE] == 3 &&
+                  stats.calls[MC3_PHASE_EVALUATE] == 1);
+    /* 9 tokens fall in bucket 4 (8-15), 3 tokens in bucket 2 (2-3) */
+    MLOG_test("token counts", stats.token_counts[4] == 1 &&
+                                  stats.token_counts[2] == 1 &&
+                                  stats.token_counts[1] == 1);
+    MLOG_test("nesting depths", stats.nesting_depths[2] == 1 &&
+                                    stats.nesting_depths[0] == 2);
+    MLOG_test("errors", stats.errors[MC3_UNBOUND_VARIABLE] == 1 &&
+                            stats.errors[MC3_INVALID_CHARACTER_FOUND] == 1 &&
+                            stats.errors[MC3_NO_ERROR] == 0);
+
+    MC3_reset_stats();
+    stats = MC3_get_stats();
+    MLOG_test("reset", stats.calls[MC3_PHASE_PARSE] == 0 &&
+                           stats.errors[MC3_UNBOUND_VARIABLE] == 0);
+#else
+    MLOG_test("compiled out", !stats.enabled &&
+                                  stats.calls[MC3_PHASE_PARSE] == 0);
+#endif
+}
+
+static void *log_from_thread(void *arg) {
+    MLOG_logf("logging from thread %d", *(int *)arg);
+    return NULL;
+}
+
+void test_logging(void) {
+    int evaluated = 0;
+
+    MLOG_log("Testing Suite: Logging");
+
+    MLOG_debugf("%d", evaluated++);
+    MLOG_test("disabled level", evaluated == 0);
+
+    pthread_t threads[4];
+    int ids[4];
+
+    for (int i = 0; i < 4; i++) {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, log_from_thread, &ids[i]);
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+#ifndef MLOG_SYNC
+    mlog_flush();
+
+    int drained = 1;
+    for (struct mlog_ring *ring = atomic_load(&mlog_rings); ring != NULL;
+         ring = ring->next) {
+        drained &= atomic_load(&ring->tail) == atomic_load(&ring->head);
+    }
+    MLOG_test("flush", drained);
+#endif
+}
+
+void test_formatting(void) {
+    static const struct {
+        double value;
+        const char *text;
+    } cases[] = {
+        {0.0, "0"},
+        {-0.0, "-0"},
+        {6.0, "6"},
+        {-2.5, "-2.5"},
+        {0.1, "0.1"},
+        {0.1 + 0.2, "0.30000000000000004"},
+        {1.0 / 3.0, "0.3333333333333333"},
+        {1e21, "1e+21"},
+        {1e20, "100000000000000000000"},
+        {1e-6, "0.000001"},
+        {1.5e-7, "1.5e-7"},
+        {5e-324, "5e-324"},
+        {1.7976931348623157e308, "1.7976931348623157e+308"},
+        {9007199254740993.0, "9007199254740992"},
+    };
+    char text[MC3_DOUBLE_BUFFER_SIZE];
+    char row[MC3_RESULT_BUFFER_SIZE];
+    const MC3_Error ok = {MC3_NO_ERROR, 0};
+    const MC3_Error failed = {MC3_INVALID_CHARACTER_FOUND, 4};
+
+    MLOG_log("Testing Suite: Formatting");
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        MC3_format_double(cases[i].value, text);
+        MLOG_test(cases[i].text, strcmp(text, cases[i].text) == 0);
+    }
+
+    /* random bit patterns must read back exactly, in at most 17 digits */
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    bool round_trips = true;
+
+    for (int i = 0; i < 20000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        double value, back;
+        memcpy(&value, &state, sizeof(value));
+        if (!isfinite(value))
+            continue;
+
+        const size_t length = MC3_format_double(value, text);
+        back = strtod(text, NULL);
+        round_trips &= (memcmp(&back, &value, sizeof(value)) == 0) &&
+                       length < MC3_DOUBLE_BUFFER_SIZE;
+    }
+    MLOG_test("round trip", round_trips);
+
+    size_t length = MC3_format_result(MC3_FORMAT_CSV, 2.5, &ok, row);
+    MLOG_test("csv", length == 6 && memcmp(row, "2.5,,\n", 6) == 0);
+    length = MC3_format_result(MC3_FORMAT_CSV, 0.0, &failed, row);
+    MLOG_test("csv error",
+              memcmp(row, ",\"Invalid character was found.\",4\n", length) ==
+                  0);
+    length = MC3_format_result(MC3_FORMAT_JSON, INFINITY, &ok, row);
+    MLOG_test("json", memcmp(row, "{\"result\":null}\n", length) == 0);
+    length = MC3_format_result(MC3_FORMAT_JSON, 0.0, NULL, row);
+    MLOG_test("json empty", length == 3 && memcmp(row, "{}\n", 3) == 0);
+    length = MC3_format_result(MC3_FORMAT_BINARY, 0.0, &failed, row);
+    double binary;
+    memcpy(&binary, row, sizeof(binary));
+    MLOG_test("binary", length == sizeof(binary) && isnan(binary));
+
+    /* the widest rows still fit, and end with their newline */
+    const MC3_Error widest = {MC3_UNBOUND_VARIABLE, SIZE_MAX};
+    bool bounded = true;
+    for (int format = MC3_FORMAT_PLAIN; format < MC3_FORMAT_BINARY;
+         format++) {
+        memset(row, 0, sizeof(row));
+        length = MC3_format_result(format, -1.7976931348623157e308, &ok, row);
+        bounded &= length < MC3_RESULT_BUFFER_SIZE && row[length - 1] == '\n';
+        length = MC3_format_result(format, 0.0, &widest, row);
+        bounded &= length < MC3_RESULT_BUFFER_SIZE && row[length - 1] == '\n';
+    }
+    MLOG_test("rows are bounded", bounded);
 }
 
 void test_evaulation(void) {
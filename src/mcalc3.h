@@ -1,22 +1,252 @@
 #ifndef MCALCULATOR_VER3_H_
 #define MCALCULATOR_VER3_H_
 
+#include <stddef.h>
+#include <stdio.h>
+
 
     typedef enum {
         MC3_NO_ERROR,
         MC3_TOKENS_LIMIT_REACHED,
-        MC3_INVALID_CHARACTER_FOUND
+        MC3_INVALID_CHARACTER_FOUND,
+        MC3_OUT_OF_MEMORY,
+        MC3_UNBOUND_VARIABLE,
+        MC3_UNEXPECTED_TOKEN,
+        MC3_UNBALANCED_PARENTHESES,
+        MC3_CIRCULAR_REFERENCE,
+        MC3_DIVISION_BY_ZERO,
+        MC3_INEXACT_RESULT,
+        MC3_DIMENSION_MISMATCH
     } MC3_ErrorCode;
 
+    /* An error code, and the byte offset in the expression it was found at. */
+    typedef struct {
+        MC3_ErrorCode code;
+        size_t offset;
+    } MC3_Error;
+
+    /* number of error codes, for tables indexed by MC3_ErrorCode */
+    #define MC3_ERROR_CODES (MC3_DIMENSION_MISMATCH + 1)
+
+    typedef enum {
+        /* lexing ahead of parsing, as sessions do */
+        MC3_PHASE_TOKENIZE,
+        /* parsing, with the lexing done along the way, and optimizing */
+        MC3_PHASE_PARSE,
+        MC3_PHASE_EVALUATE,
+        MC3_PHASE_COUNT
+    } MC3_Phase;
+
+    /* number of buckets of the histograms in MC3_Stats */
+    #define MC3_STATS_BUCKETS 16
+
+    /* Counters kept when the library is built with MC3_STATS, see
+       MC3_get_stats. */
+    typedef struct {
+        /* 0 if the library was built without MC3_STATS */
+        int enabled;
+        /* number of expressions each phase ran on (rows for MC3_eval_batch),
+           and the time spent, in cycles on x86-64 and nanoseconds elsewhere */
+        unsigned long long calls[MC3_PHASE_COUNT];
+        unsigned long long cycles[MC3_PHASE_COUNT];
+        /* parsed expressions by number of tokens, and by deepest nesting of
+           parenthesis. Bucket 0 counts zero, bucket i values from 2^(i-1) to
+           2^i - 1, and the last bucket everything above. */
+        unsigned long long token_counts[MC3_STATS_BUCKETS];
+        unsigned long long nesting_depths[MC3_STATS_BUCKETS];
+        /* failed compilations and evaluations, by error code */
+        unsigned long long errors[MC3_ERROR_CODES];
+    } MC3_Stats;
+
+    /* Memory reused across evaluations. A context must only be used by one
+       thread at a time. */
+    typedef struct MC3_Context MC3_Context;
+
+    /* An expression lowered once by MC3_compile, which can then be evaluated
+       any number of times by MC3_run. */
+    typedef struct MC3_Program MC3_Program;
+
+    /* Native code of a program, see MC3_jit_compile. */
+    typedef double (*MC3_JitFunction)(const double* vars);
+
+    /* A bounded cache of compiled programs keyed by expression text, which
+       can be shared by any number of threads and contexts. */
+    typedef struct MC3_Cache MC3_Cache;
+
+    /* An expression being edited, and the results committed so far. Every
+       update reuses the tokens and subexpression values of the previous ones,
+       see MC3_session_update. A session must only be used by one thread at a
+       time. */
+    typedef struct MC3_Session MC3_Session;
+
+    /* what the last update of a session had to redo */
+    typedef struct {
+        /* tokens of the text, and how many of them were lexed again */
+        unsigned int tokens;
+        unsigned int relexed;
+        /* operators in the expression, and how many of them were evaluated
+           instead of taking a value remembered from an earlier update */
+        unsigned int operators;
+        unsigned int evaluated;
+    } MC3_SessionStats;
+
+    /* Named cells holding expressions which use other cells as variables,
+       recalculated together. See MC3_sheet_set. A sheet must only be used by
+       one thread at a time; it runs its own threads during MC3_sheet_recalc.
+     */
+    typedef struct MC3_Sheet MC3_Sheet;
+
+    typedef struct {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+        /* number of programs currently cached */
+        size_t size;
+    } MC3_CacheStats;
+
+    /* how MC3_eval_batch_precision computes functions and powers */
+    typedef enum {
+        /* with the C library, exactly like MC3_run */
+        MC3_PRECISION_LIBM,
+        /* with vector kernels, within 1 ulp of the exact result */
+        MC3_PRECISION_HIGH,
+        /* with faster vector kernels, within 4 ulp of the exact
+           result */
+        MC3_PRECISION_FAST
+    } MC3_Precision;
+
+    /* A matrix of doubles, see MC3_evaluate_matrix. A vector is a matrix of
+       one row or one column, and a number a matrix of one element. */
+    typedef struct {
+        unsigned int rows;
+        unsigned int columns;
+        /* rows * columns elements, one row after the other */
+        double* elements;
+    } MC3_Matrix;
+
     extern double MC3_evaluate(const char* equ, MC3_ErrorCode* err);
+    extern double MC3_evaluate_n(const char* equ, size_t length,
+                                 MC3_ErrorCode* err);
+    extern char* MC3_evaluate_exact(const char* equ, size_t length,
+                                    MC3_Error* err);
+    extern MC3_ErrorCode MC3_evaluate_matrix(const char* equ, size_t length,
+                                             const MC3_Matrix* vars,
+                                             MC3_Matrix* result,
+                                             MC3_Error* err);
+    extern MC3_Program* MC3_compile(const char* equ, MC3_ErrorCode* err);
+    extern MC3_Program* MC3_compile_n(const char* equ, size_t length,
+                                      MC3_ErrorCode* err);
+    extern double MC3_run(const MC3_Program* prog, const double* vars,
+                          MC3_ErrorCode* err);
+    extern MC3_ErrorCode MC3_eval_batch(const MC3_Program* prog,
+                                        const double* const* columns,
+                                        size_t n, double* out);
+    extern MC3_ErrorCode MC3_eval_batch_precision(
+        const MC3_Program* prog, const double* const* columns, size_t n,
+        double* out, MC3_Precision precision);
+    extern MC3_ErrorCode MC3_gradient(const MC3_Program* prog,
+                                      const double* vars, double* value,
+                                      double* gradient);
+    extern void MC3_free_program(MC3_Program* prog);
+    extern MC3_JitFunction MC3_jit_compile(MC3_Program* prog);
+    extern unsigned int MC3_dedup_count(const MC3_Program* prog);
+    extern void MC3_dump_program(const MC3_Program* prog, FILE* file);
+    extern void MC3_emit_c(const MC3_Program* prog, const char* name,
+                           FILE* file);
+    extern void MC3_set_range_threads(unsigned int threads);
+
+    /* Variables are numbered in order of their first appearance in the
+       expression. `vars` and `columns` are indexed by these numbers. */
+    extern unsigned int MC3_var_count(const MC3_Program* prog);
+    extern const char* MC3_var_name(const MC3_Program* prog,
+                                    unsigned int index);
+    extern int MC3_var_index(const MC3_Program* prog, const char* name);
+    extern MC3_Context* MC3_context_new(void);
+    extern void MC3_context_free(MC3_Context* ctx);
+    extern double MC3_context_evaluate(MC3_Context* ctx, const char* equ,
+                                       size_t length, MC3_Error* err);
+    extern void MC3_context_set_cache(MC3_Context* ctx, MC3_Cache* cache);
+
+    extern MC3_Session* MC3_session_new(void);
+    extern void MC3_session_free(MC3_Session* session);
+    extern double MC3_session_update(MC3_Session* session, const char* equ,
+                                     size_t length, MC3_Error* err);
+    extern unsigned int MC3_session_commit(MC3_Session* session);
+    extern unsigned int MC3_session_result_count(const MC3_Session* session);
+    extern double MC3_session_result(const MC3_Session* session,
+                                     unsigned int number);
+    extern MC3_SessionStats MC3_session_stats(const MC3_Session* session);
+
+    extern MC3_Sheet* MC3_sheet_new(unsigned int threads);
+    extern void MC3_sheet_free(MC3_Sheet* sheet);
+    extern MC3_ErrorCode MC3_sheet_set(MC3_Sheet* sheet, const char* name,
+                                       const char* equ, size_t length,
+                                       MC3_Error* err);
+    extern MC3_ErrorCode MC3_sheet_set_value(MC3_Sheet* sheet,
+                                             const char* name, double value);
+    extern unsigned int MC3_sheet_recalc(MC3_Sheet* sheet);
+    extern double MC3_sheet_get(const MC3_Sheet* sheet, const char* name,
+                                MC3_Error* err);
+
+    extern MC3_Cache* MC3_cache_new(size_t capacity, unsigned int shards);
+    extern void MC3_cache_free(MC3_Cache* cache);
+    extern MC3_Program* MC3_cache_compile(MC3_Cache* cache, const char* equ,
+                                          size_t length, MC3_Error* err);
+    extern MC3_CacheStats MC3_cache_stats(MC3_Cache* cache);
+
+    /* shortest round-tripping text of a double, see MC3_format_double */
+    #define MC3_DOUBLE_BUFFER_SIZE 32
+    /* longest row MC3_format_result writes */
+    #define MC3_RESULT_BUFFER_SIZE 128
+
+    typedef enum {
+        /* the result, or `error: {message} (at {offset})` */
+        MC3_FORMAT_PLAIN,
+        /* `{result},,` or `,"{message}",{offset}` */
+        MC3_FORMAT_CSV,
+        /* `{"result":...}` or `{"error":"...","offset":...}`, one per line.
+           Results which are not finite are null. */
+        MC3_FORMAT_JSON,
+        /* 8 bytes per result in native byte order, NaN for errors */
+        MC3_FORMAT_BINARY
+    } MC3_Format;
+
+    extern size_t MC3_format_double(double value, char* buffer);
+    extern size_t MC3_format_result(MC3_Format format, double result,
+                                    const MC3_Error* err, char* buffer);
+
+    extern MC3_Stats MC3_get_stats(void);
+    extern void MC3_reset_stats(void);
+
     extern const char* getErrorString(const MC3_ErrorCode err);
 
     static inline int error_occured(MC3_ErrorCode* err) {
         return (*err != MC3_NO_ERROR);
     }
 
+    /* ==== Benchmarks ==== */
+    unsigned int bench_tokenize(const char* equ, size_t length,
+                                MC3_ErrorCode* err);
+
     /* ==== Tests ==== */
     void test_tokenization(void);
+    void test_compilation(void);
+    void test_variables(void);
+    void test_optimization(void);
+    void test_jit(void);
+    void test_context(void);
+    void test_cache(void);
+    void test_session(void);
+    void test_sheet(void);
+    void test_exact(void);
+    void test_gradient(void);
+    void test_emit_c(void);
+    void test_vector_math(void);
+    void test_ranges(void);
+    void test_matrices(void);
+    void test_stats(void);
+    void test_logging(void);
+    void test_formatting(void);
     void test_evaulation(void);
 
 #endif /* MCALCULATOR_VER3_H_ */
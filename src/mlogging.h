@@ -16,78 +16,474 @@
     #define TC_CYAN   "\033[0;36m"
     #define TC_WHITE  "\033[0;37m"
 
-    /* Logging Functions */
+    /** Log Levels */
+
+    /* Macros of levels below MLOG_LEVEL expand to nothing, so neither the call
+       nor its arguments are evaluated. Define MLOG_LEVEL before including this
+       file to change it. MLOGOFF is the same as MLOG_LEVEL_OFF. */
+    #define MLOG_LEVEL_DEBUG 0
+    #define MLOG_LEVEL_LOG   1
+    #define MLOG_LEVEL_ERROR 2
+    #define MLOG_LEVEL_OFF   3
+
+    #if defined(MLOGOFF)
+        #undef MLOG_LEVEL
+        #define MLOG_LEVEL MLOG_LEVEL_OFF
+    #elif !defined(MLOG_LEVEL)
+        #define MLOG_LEVEL MLOG_LEVEL_LOG
+    #endif
+
+    /* Output */
+
+    /* Unless MLOG_SYNC is defined, a message is formatted by the calling thread
+       into a ring buffer only that thread writes to, and a background thread
+       writes the rings out in batches. Logging threads never wait on each other
+       or on the stdio lock. When a ring is full the message is dropped and
+       counted. Messages of one thread keep their order, messages of different
+       threads do not. What is left is written when the process exits, or by
+       mlog_flush().
+
+       The state is static, so every translation unit including this file has
+       its own rings and background thread. */
 
-    #include <stdio.h>
     #include <stdarg.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+
+    /* longest message including its newline, longer ones are truncated */
+    #ifndef MLOG_MESSAGE_SIZE
+        #define MLOG_MESSAGE_SIZE 480
+    #endif
+
+    /* number of messages one thread can have waiting to be written */
+    #ifndef MLOG_RING_SIZE
+        #define MLOG_RING_SIZE 128
+    #endif
+
+    #if defined(__GNUC__)
+        #define MLOG_PRINTF(fmt, args) __attribute__((format(printf, fmt, args)))
+    #else
+        #define MLOG_PRINTF(fmt, args)
+    #endif
+
+    enum mlog_stream { MLOG_STDOUT, MLOG_STDERR };
+
+    struct mlog_record {
+        enum mlog_stream stream;
+        size_t length;
+        /* not terminated */
+        char text[MLOG_MESSAGE_SIZE];
+    };
+
+    static void mlog_write_now(const struct mlog_record* record) {
+        FILE* file = (record->stream == MLOG_STDERR) ? stderr : stdout;
+        fwrite(record->text, 1, record->length, file);
+    }
+
+    #ifndef MLOG_SYNC
+        #include <pthread.h>
+        #include <semaphore.h>
+        #include <stdatomic.h>
+        #include <time.h>
+
+        enum { MLOG_RING_FREE, MLOG_RING_ACTIVE, MLOG_RING_RETIRED };
+
+        struct mlog_ring {
+            /* set once, before the ring is added to mlog_rings */
+            struct mlog_ring* next;
+            /* MLOG_RING_ACTIVE while a thread owns the ring, MLOG_RING_RETIRED
+               once it exited, MLOG_RING_FREE when written out and reusable */
+            atomic_int state;
+            /* records added, only stored by the owning thread */
+            _Alignas(64) atomic_size_t head;
+            atomic_size_t dropped;
+            /* records written, only stored by the background thread */
+            _Alignas(64) atomic_size_t tail;
+            struct mlog_record records[MLOG_RING_SIZE];
+        };
+
+        static _Atomic(struct mlog_ring*) mlog_rings;
+        static _Thread_local struct mlog_ring* mlog_own_ring;
+        static pthread_once_t mlog_once = PTHREAD_ONCE_INIT;
+        /* retires the ring of an exiting thread */
+        static pthread_key_t mlog_key;
+        static pthread_t mlog_thread;
+        static sem_t mlog_wakeup;
+        /* set when the background thread has been woken up */
+        static atomic_int mlog_pending;
+        /* set while the background thread writes messages */
+        static atomic_int mlog_running;
+        static atomic_int mlog_stopping;
+
+        static void mlog_wake(void) {
+            if (!atomic_exchange(&mlog_pending, 1))
+                sem_post(&mlog_wakeup);
+        }
+
+        static void mlog_retire(void* ring) {
+            atomic_store_explicit(&((struct mlog_ring*)ring)->state,
+                                  MLOG_RING_RETIRED, memory_order_release);
+            mlog_wake();
+        }
+
+        static void mlog_drain_ring(struct mlog_ring* ring) {
+            const int state =
+                atomic_load_explicit(&ring->state, memory_order_acquire);
+            const size_t head =
+                atomic_load_explicit(&ring->head, memory_order_acquire);
+            const size_t dropped = atomic_exchange_explicit(
+                &ring->dropped, 0, memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+            for (; tail != head; tail++)
+                mlog_write_now(&ring->records[tail % MLOG_RING_SIZE]);
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+            if (dropped != 0)
+                fprintf(stderr, "[ERROR]: %zu log messages dropped\n", dropped);
+
+            /* a retired thread adds nothing after its last message */
+            if (state == MLOG_RING_RETIRED)
+                atomic_store(&ring->state, MLOG_RING_FREE);
+        }
+
+        /* writes every waiting message, taking the stdio locks once */
+        static void mlog_drain(void) {
+            flockfile(stdout);
+            flockfile(stderr);
+            for (struct mlog_ring* ring =
+                     atomic_load_explicit(&mlog_rings, memory_order_acquire);
+                 ring != NULL; ring = ring->next) {
+                mlog_drain_ring(ring);
+            }
+            funlockfile(stderr);
+            funlockfile(stdout);
+
+            fflush(stdout);
+            fflush(stderr);
+        }
+
+        static void* mlog_main(void* arg) {
+            (void)arg;
+
+            for (;;) {
+                atomic_store(&mlog_pending, 0);
+                mlog_drain();
+
+                if (atomic_load(&mlog_stopping)) {
+                    /* messages added before mlog_stopping was set */
+                    mlog_drain();
+                    return NULL;
+                }
+
+                if (!atomic_load(&mlog_pending))
+                    sem_wait(&mlog_wakeup);
+            }
+        }
+
+        static void mlog_stop(void) {
+            atomic_store(&mlog_stopping, 1);
+            sem_post(&mlog_wakeup);
+            pthread_join(mlog_thread, NULL);
+            atomic_store(&mlog_running, 0);
+        }
+
+        static void mlog_start(void) {
+            if (pthread_key_create(&mlog_key, mlog_retire) != 0 ||
+                sem_init(&mlog_wakeup, 0, 0) != 0 ||
+                pthread_create(&mlog_thread, NULL, mlog_main, NULL) != 0)
+                return;
+
+            atomic_store(&mlog_running, 1);
+            atexit(mlog_stop);
+        }
+
+        /* the ring of the calling thread, NULL to write synchronously */
+        static struct mlog_ring* mlog_get_ring(void) {
+            if (mlog_own_ring != NULL)
+                return mlog_own_ring;
+
+            pthread_once(&mlog_once, mlog_start);
+            if (!atomic_load(&mlog_running))
+                return NULL;
+
+            struct mlog_ring* ring =
+                atomic_load_explicit(&mlog_rings, memory_order_acquire);
+            for (; ring != NULL; ring = ring->next) {
+                int state = MLOG_RING_FREE;
+                if (atomic_compare_exchange_strong(&ring->state, &state,
+                                                   MLOG_RING_ACTIVE))
+                    break;
+            }
+
+            if (ring == NULL) {
+                ring = aligned_alloc(_Alignof(struct mlog_ring),
+                                     sizeof(struct mlog_ring));
+                if (ring == NULL)
+                    return NULL;
+
+                atomic_init(&ring->state, MLOG_RING_ACTIVE);
+                atomic_init(&ring->head, 0);
+                atomic_init(&ring->dropped, 0);
+                atomic_init(&ring->tail, 0);
+
+                ring->next = atomic_load(&mlog_rings);
+                while (!atomic_compare_exchange_weak(&mlog_rings, &ring->next,
+                                                     ring))
+                    ;
+            }
+
+            pthread_setspecific(mlog_key, ring);
+            mlog_own_ring = ring;
+            return ring;
+        }
+
+        /**
+         * @brief waits until every message logged so far is written.
+         */
+        static void mlog_flush(void) {
+            if (!atomic_load(&mlog_running))
+                return;
+
+            mlog_wake();
+            for (struct mlog_ring* ring = atomic_load(&mlog_rings);
+                 ring != NULL; ring = ring->next) {
+                const size_t head = atomic_load(&ring->head);
+
+                while (atomic_load(&ring->tail) < head &&
+                       atomic_load(&mlog_running)) {
+                    nanosleep(&(struct timespec){.tv_nsec = 100000}, NULL);
+                    mlog_wake();
+                }
+            }
+        }
+    #else
+        static void mlog_flush(void) { fflush(stdout); }
+    #endif
+
+    /* a message being formatted */
+    struct mlog_writer {
+    #ifndef MLOG_SYNC
+        /* NULL when writing synchronously */
+        struct mlog_ring* ring;
+    #endif
+        struct mlog_record* record;
+        struct mlog_record local;
+    };
+
+    // ! WARNING: every message starts with mlog_begin and, if it returned 1,
+    // ! ends with mlog_end.
+    static int mlog_begin(struct mlog_writer* writer, enum mlog_stream stream) {
+        writer->record = &writer->local;
+
+    #ifndef MLOG_SYNC
+        struct mlog_ring* ring = mlog_get_ring();
+
+        /* after exit started nothing writes the rings out anymore */
+        if (ring != NULL &&
+            !atomic_load_explicit(&mlog_running, memory_order_relaxed))
+            ring = NULL;
+
+        if (ring != NULL) {
+            const size_t head =
+                atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+            if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+                MLOG_RING_SIZE) {
+                atomic_fetch_add_explicit(&ring->dropped, 1,
+                                          memory_order_relaxed);
+                mlog_wake();
+                return 0;
+            }
+
+            writer->record = &ring->records[head % MLOG_RING_SIZE];
+        }
+        writer->ring = ring;
+    #endif
+
+        writer->record->stream = stream;
+        writer->record->length = 0;
+        return 1;
+    }
+
+    static void mlog_vprintf(struct mlog_writer* writer, const char* fmt,
+                             va_list args) {
+        struct mlog_record* record = writer->record;
+        /* one byte is kept for the newline */
+        const size_t space = MLOG_MESSAGE_SIZE - 1 - record->length;
+
+        if (space == 0)
+            return;
+
+        int count = vsnprintf(&record->text[record->length], space + 1, fmt, args);
+        if (count > 0)
+            record->length += ((size_t)count < space) ? (size_t)count : space;
+    }
+
+    MLOG_PRINTF(2, 3)
+    static void mlog_printf(struct mlog_writer* writer, const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        mlog_vprintf(writer, fmt, args);
+        va_end(args);
+    }
+
+    static void mlog_end(struct mlog_writer* writer) {
+        struct mlog_record* record = writer->record;
+        record->text[record->length++] = '\n';
+
+    #ifndef MLOG_SYNC
+        if (writer->ring != NULL) {
+            atomic_store_explicit(
+                &writer->ring->head,
+                atomic_load_explicit(&writer->ring->head, memory_order_relaxed) + 1,
+                memory_order_release);
+            mlog_wake();
+            return;
+        }
+    #endif
+
+        mlog_write_now(record);
+    }
+
+    /* Logging Functions */
 
     /* basic logging */
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro
     // * Newline is included as part of function.
     static void mlog_log(const char* msg) {
-        printf("[LOG]: %s\n", msg);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "[LOG]: %s", msg);
+            mlog_end(&writer);
+        }
     }
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
+    MLOG_PRINTF(1, 2)
     static void mlog_logf(const char* msg, ...) {
-        va_list args;
-        va_start(args, msg);
-        printf("[LOG]: ");
-        vprintf(msg, args);
-        puts("");
-        va_end(args);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            va_list args;
+            va_start(args, msg);
+            mlog_printf(&writer, "[LOG]: ");
+            mlog_vprintf(&writer, msg, args);
+            va_end(args);
+            mlog_end(&writer);
+        }
     }
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
     static void mlog_logc(const char* color, const char* msg) {
-        printf("%s[LOG]: %s%s\n", color, msg, NO_COLOR);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "%s[LOG]: %s%s", color, msg, NO_COLOR);
+            mlog_end(&writer);
+        }
     }
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
+    MLOG_PRINTF(2, 3)
     static void mlog_logfc(const char* color, const char* msg, ...) {
-        va_list args;
-        va_start(args, msg);
-        printf("%s[LOG]: ", color);
-        vprintf(msg, args);
-        puts(NO_COLOR);
-        va_end(args);
+        struct mlog_writer writer;
 
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            va_list args;
+            va_start(args, msg);
+            mlog_printf(&writer, "%s[LOG]: ", color);
+            mlog_vprintf(&writer, msg, args);
+            mlog_printf(&writer, "%s", NO_COLOR);
+            va_end(args);
+            mlog_end(&writer);
+        }
     }
 
     static void mlog_array_int(int arr[], size_t size) {
-        printf("[LOG]: [");
-        for (size_t i = 0; i < size; i++) {
-            printf("%d%s", arr[i], (i == (size - 1) ? "" : ", "));
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "[LOG]: [");
+            for (size_t i = 0; i < size; i++) {
+                mlog_printf(&writer, "%d%s", arr[i], (i == (size - 1) ? "" : ", "));
+            }
+            mlog_printf(&writer, "]");
+            mlog_end(&writer);
         }
-        puts("]");
     }
 
     static void mlog_array_char(char arr[], size_t size) {
-        printf("[LOG]: [");
-        for (size_t i = 0; i < size; i++) {
-            printf("%c%s", arr[i], (i == (size - 1) ? "" : ", "));
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "[LOG]: [");
+            for (size_t i = 0; i < size; i++) {
+                mlog_printf(&writer, "%c%s", arr[i], (i == (size - 1) ? "" : ", "));
+            }
+            mlog_printf(&writer, "]");
+            mlog_end(&writer);
         }
-        puts("]");
     }
 
     static void mlog_array_double(double arr[], size_t size) {
-        printf("[LOG]: [");
-        for (size_t i = 0; i < size; i++) {
-            printf("%lf%s", arr[i], (i == (size - 1) ? "" : ", "));
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "[LOG]: [");
+            for (size_t i = 0; i < size; i++) {
+                mlog_printf(&writer, "%lf%s", arr[i], (i == (size - 1) ? "" : ", "));
+            }
+            mlog_printf(&writer, "]");
+            mlog_end(&writer);
         }
-        puts("]");
     }
 
     static void mlog_array_str(char* arr[], size_t size) {
-        printf("[LOG]: [");
-        for (size_t i = 0; i < size; i++) {
-            printf("%s%s", arr[i], (i == (size - 1) ? "" : ", "));
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "[LOG]: [");
+            for (size_t i = 0; i < size; i++) {
+                mlog_printf(&writer, "%s%s", arr[i], (i == (size - 1) ? "" : ", "));
+            }
+            mlog_printf(&writer, "]");
+            mlog_end(&writer);
+        }
+    }
+
+    /* debug logging */
+
+    // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
+    // * Newline is included as part of function.
+    static void mlog_debug(const char* msg) {
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDERR)) {
+            mlog_printf(&writer, "[DEBUG]: %s", msg);
+            mlog_end(&writer);
+        }
+    }
+
+    // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
+    // * Newline is included as part of function.
+    MLOG_PRINTF(1, 2)
+    static void mlog_debugf(const char* msg, ...) {
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDERR)) {
+            va_list args;
+            va_start(args, msg);
+            mlog_printf(&writer, "[DEBUG]: ");
+            mlog_vprintf(&writer, msg, args);
+            va_end(args);
+            mlog_end(&writer);
         }
-        puts("]");
     }
 
     /* error logging */
@@ -95,62 +491,94 @@
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
     static void mlog_error(const char* msg) {
-        fprintf(stderr, "[ERROR]: %s\n", msg);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDERR)) {
+            mlog_printf(&writer, "[ERROR]: %s", msg);
+            mlog_end(&writer);
+        }
     }
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
+    MLOG_PRINTF(1, 2)
     static void mlog_errorf(const char* msg, ...) {
-        va_list args;
-        va_start(args, msg);
-        fprintf(stderr, "[ERROR]: ");
-        vfprintf(stderr, msg, args);
-        puts("");
-        va_end(args);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDERR)) {
+            va_list args;
+            va_start(args, msg);
+            mlog_printf(&writer, "[ERROR]: ");
+            mlog_vprintf(&writer, msg, args);
+            va_end(args);
+            mlog_end(&writer);
+        }
     }
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
     static void mlog_errorc(const char* color, const char* msg) {
-        fprintf(stderr, "%s[ERROR]: %s%s\n", color, msg, NO_COLOR);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDERR)) {
+            mlog_printf(&writer, "%s[ERROR]: %s%s", color, msg, NO_COLOR);
+            mlog_end(&writer);
+        }
     }
 
     // ! WARNING: this function should not be called directly. Instead, use corresponding macro.
     // * Newline is included as part of function.
+    MLOG_PRINTF(2, 3)
     static void mlog_errorfc(const char* color, const char* msg, ...) {
-        va_list args;
-        va_start(args, msg);
-        fprintf(stderr, "%s[ERROR]: ", color);
-        vfprintf(stderr, msg, args);
-        puts(NO_COLOR);
-        va_end(args);
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDERR)) {
+            va_list args;
+            va_start(args, msg);
+            mlog_printf(&writer, "%s[ERROR]: ", color);
+            mlog_vprintf(&writer, msg, args);
+            mlog_printf(&writer, "%s", NO_COLOR);
+            va_end(args);
+            mlog_end(&writer);
+        }
     }
 
     /* testing */
     static int mlog_test(int cond, const char* tag) {
-        if (cond) {
-            printf("[TEST] %s: %s[PASSED]%s\n", tag, TC_GREEN, NO_COLOR);
-            return 0;
-        } else {
-            printf("[TEST] %s: %s[FAILED]%s\n", tag, TC_RED, NO_COLOR);
-            return 1;
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "[TEST] %s: %s%s%s", tag,
+                        cond ? TC_GREEN : TC_RED, cond ? "[PASSED]" : "[FAILED]",
+                        NO_COLOR);
+            mlog_end(&writer);
         }
+        return cond ? 0 : 1;
     }
 
     static int mlog_testc(const char* color, int cond, const char* tag) {
-        if (cond) {
-            printf("%s[TEST] %s: %s[PASSED]%s\n", color, tag, TC_GREEN, NO_COLOR);
-            return 0;
-        } else {
-            printf("%s[TEST] %s: %s[FAILED]%s\n", color, tag, TC_RED, NO_COLOR);
-            return 1;
+        struct mlog_writer writer;
+
+        if (mlog_begin(&writer, MLOG_STDOUT)) {
+            mlog_printf(&writer, "%s[TEST] %s: %s%s%s", color, tag,
+                        cond ? TC_GREEN : TC_RED, cond ? "[PASSED]" : "[FAILED]",
+                        NO_COLOR);
+            mlog_end(&writer);
         }
+        return cond ? 0 : 1;
     }
 
-    #ifndef MLOGOFF
+    #if MLOG_LEVEL <= MLOG_LEVEL_DEBUG
+        #define MLOG_debug(msg) mlog_debug(msg);
+        #define MLOG_debugf(msg, ...) mlog_debugf(msg, __VA_ARGS__);
+    #else
+        #define MLOG_debug(msg) ((void) 0);
+        #define MLOG_debugf(msg, ...) ((void) 0);
+    #endif
+
+    #if MLOG_LEVEL <= MLOG_LEVEL_LOG
         /* standard */
         #define MLOG_log(msg) mlog_log(msg);
-        #define MLOG_error(msg) mlog_error(msg);
         #define MLOG_test(tag, cond) mlog_test(cond, tag);
 
         /* arrays */
@@ -158,7 +586,9 @@
         #define MLOG_array_char(arr, size) mlog_array_char(arr, size);
         #define MLOG_array_double(arr, size) mlog_array_double(arr, size);
         #define MLOG_array_str(arr, size) mlog_array_str(arr, size);
+        /* fmt_fn prints to stdout itself, so this one is written synchronously */
         #define MLOG_array_custom(arr, size, fmt_fn) {\
+                    mlog_flush();\
                     printf("[LOG]: [");\
                     for (size_t i = 0; i < size; i++) {\
                         fmt_fn(&arr[i]);\
@@ -170,20 +600,16 @@
 
         /* format */
         #define MLOG_logf(msg, ...) mlog_logf(msg, __VA_ARGS__);
-        #define MLOG_errorf(msg, ...) mlog_errorf(msg, __VA_ARGS__);
 
         /* color */
         #define MLOG_logc(color, msg) mlog_logc(color, msg);
-        #define MLOG_errorc(color, msg) mlog_errorc(color, msg);
         #define MLOG_testc(tag, color, cond) mlog_testc(color, cond, tag);
 
         /* color and format */
         #define MLOG_logfc(color, msg, ...) mlog_logfc(color, msg, __VA_ARGS__);
-        #define MLOG_errorfc(color, msg, ...) mlog_errorfc(color, msg, __VA_ARGS__);
     #else
         /* standard */
         #define MLOG_log(msg) ((void) 0);
-        #define MLOG_error(msg) ((void) 0);
         #define MLOG_test(tag, cond) ((void) 0);
 
         /* arrays */
@@ -195,15 +621,24 @@
 
         /* format */
         #define MLOG_logf(msg, ...) ((void) 0);
-        #define MLOG_errorf(msg, ...) ((void) 0);
 
         /* color */
         #define MLOG_logc(color, msg) ((void) 0);
-        #define MLOG_errorc(color, msg) ((void) 0);
-        #define MLOG_testc(color, cond, tag) ((void) 0);
+        #define MLOG_testc(tag, color, cond) ((void) 0);
 
         /* color and format */
         #define MLOG_logfc(color, msg, ...) ((void) 0);
+    #endif
+
+    #if MLOG_LEVEL <= MLOG_LEVEL_ERROR
+        #define MLOG_error(msg) mlog_error(msg);
+        #define MLOG_errorf(msg, ...) mlog_errorf(msg, __VA_ARGS__);
+        #define MLOG_errorc(color, msg) mlog_errorc(color, msg);
+        #define MLOG_errorfc(color, msg, ...) mlog_errorfc(color, msg, __VA_ARGS__);
+    #else
+        #define MLOG_error(msg) ((void) 0);
+        #define MLOG_errorf(msg, ...) ((void) 0);
+        #define MLOG_errorc(color, msg) ((void) 0);
         #define MLOG_errorfc(color, msg, ...) ((void) 0);
     #endif
 #endif
@@ -0,0 +1,403 @@
+/*
+ * Batch kernels for the functions and powers of mcalc3.c, computing several
+ * rows at once with the vector extensions of GCC and Clang.
+ *
+ * This file has no include guard: mcalc3.c includes it once per vector width,
+ * defining VEC_WIDTH as the number of doubles per vector and VEC_SUFFIX(name)
+ * as the name of `name` for that width, so the same code is compiled for
+ * SSE2, AVX2 and AVX-512. Every width runs the same operations in the same
+ * order without fused multiply-adds (GCC only contracts a * b + c outside
+ * the ISO C modes), so they all return the same bits.
+ *
+ * Arguments are reduced to a short interval, and the function evaluated there
+ * as a polynomial with double-double arithmetic where a double would lose
+ * precision. Lanes outside the range a kernel handles (large arguments of
+ * trigonometric functions, logarithms of subnormals or non-positive numbers,
+ * powers which overflow, NaN and infinities) are flagged as special and
+ * computed by the C library instead, so they behave exactly like MC3_run.
+ */
+
+#define V(name) VEC_SUFFIX(name)
+#define vdouble V(vdouble)
+#define vlong V(vlong)
+
+typedef double vdouble __attribute__((vector_size(VEC_WIDTH * 8)));
+typedef int64_t vlong __attribute__((vector_size(VEC_WIDTH * 8)));
+
+static inline vdouble V(splat)(double value) {
+    return (vdouble){0} + value;
+}
+
+static inline vdouble V(abs)(vdouble value) {
+    return (vdouble)((vlong)value & INT64_MAX);
+}
+
+/**
+ * @brief the lanes of `yes` where `mask` is set, and of `no` elsewhere.
+ */
+static inline vdouble V(select)(vlong mask, vdouble yes, vdouble no) {
+    return (vdouble)(((vlong)yes & mask) | ((vlong)no & ~mask));
+}
+
+/**
+ * @brief `value` with its sign flipped in the lanes where `mask` is set.
+ */
+static inline vdouble V(negate_if)(vlong mask, vdouble value) {
+    return (vdouble)((vlong)value ^ (mask & INT64_MIN));
+}
+
+/**
+ * @brief rounds `value`, below 2^51 in magnitude, to the nearest integer,
+ * writing it as an integer to `integer`.
+ */
+static inline vdouble V(round)(vdouble value, vlong *integer) {
+    const vdouble shifter = V(splat)(0x1.8p52);
+    const vdouble shifted = value + shifter;
+
+    *integer = (vlong)shifted - (vlong)shifter;
+    return shifted - shifter;
+}
+
+/* Error-free transformations: the sum or product of two doubles as the
+   rounded result plus the rounding error, written to `error`. */
+
+static inline vdouble V(two_sum)(vdouble a, vdouble b, vdouble *error) {
+    const vdouble sum = a + b;
+    const vdouble b_part = sum - a;
+
+    *error = (a - (sum - b_part)) + (b - b_part);
+    return sum;
+}
+
+/* requires |a| >= |b| */
+static inline vdouble V(fast_two_sum)(vdouble a, vdouble b, vdouble *error) {
+    const vdouble sum = a + b;
+
+    *error = b - (sum - a);
+    return sum;
+}
+
+static inline vdouble V(two_prod)(vdouble a, vdouble b, vdouble *error) {
+    /* Dekker's product, splitting each factor into halves of 26 bits */
+    const vdouble split_a = a * 134217729.0;
+    const vdouble split_b = b * 134217729.0;
+    const vdouble a_high = split_a - (split_a - a);
+    const vdouble b_high = split_b - (split_b - b);
+    const vdouble a_low = a - a_high;
+    const vdouble b_low = b - b_high;
+    const vdouble product = a * b;
+
+    *error = ((a_high * b_high - product) + a_high * b_low + a_low * b_high) +
+             a_low * b_low;
+    return product;
+}
+
+/**
+ * @brief ln(x) as a double-double, its high part returned and its low part
+ * written to `low`, for positive normal x. x is 2^k * z with z in
+ * [0.6875, 1.375) and z close to c from LOG_TABLE, so
+ * ln(x) = k ln(2) + ln(c) + ln(1 + r) with r = z / c - 1 below 2^-7.
+ */
+static inline __attribute__((always_inline)) vdouble
+V(log_dd)(vdouble x, vdouble *low, bool high) {
+    const vlong bits = (vlong)x;
+    const vlong offset = bits - 0x3fe6000000000000;
+    const vlong index = (offset >> 45) & 127;
+    /* the exponent as a double, through 2^52 + 2^51 as V(round) does */
+    const vdouble k = (vdouble)((offset >> 52) + (vlong)V(splat)(0x1.8p52)) -
+                      0x1.8p52;
+    const vdouble z = (vdouble)(bits - (offset & ~((INT64_C(1) << 52) - 1)));
+    vdouble inverse, log_c_high, log_c_low;
+
+    for (int i = 0; i < VEC_WIDTH; i++) {
+        inverse[i] = LOG_TABLE[index[i]][0];
+        log_c_high[i] = LOG_TABLE[index[i]][1];
+        log_c_low[i] = LOG_TABLE[index[i]][2];
+    }
+
+    /* r exactly, as z * (1 / c) rounds too much to subtract 1 from */
+    vdouble product_error, r_low;
+    const vdouble product = V(two_prod)(z, inverse, &product_error);
+    const vdouble r = V(two_sum)(product - 1.0, product_error, &r_low);
+
+    /* ln(1 + r) = r - r^2 / 2 + r^3 * tail(r), with r^2 exact */
+    vdouble square_low;
+    const vdouble square = V(two_prod)(r, r, &square_low);
+    square_low += 2.0 * r * r_low;
+
+    vdouble tail = high ? V(splat)(1.0 / 9) + r * (-1.0 / 10)
+                        : V(splat)(1.0 / 9);
+    tail = -1.0 / 6 + r * (1.0 / 7 + r * (-1.0 / 8 + r * tail));
+    tail = 1.0 / 3 + r * (-1.0 / 4 + r * (1.0 / 5 + r * tail));
+    tail *= r * square;
+
+    vdouble error_1, error_2, error_3;
+    const vdouble sum_1 = V(two_sum)(k * LN2_HI, log_c_high, &error_1);
+    const vdouble sum_2 = V(two_sum)(sum_1, r, &error_2);
+    const vdouble sum_3 = V(two_sum)(sum_2, -0.5 * square, &error_3);
+    const vdouble rest = error_1 + error_2 + error_3 + k * LN2_LO +
+                         log_c_low + r_low - 0.5 * square_low + tail;
+
+    return V(fast_two_sum)(sum_3, rest, low);
+}
+
+/**
+ * @brief e^(x + x_low) for |x| <= 708, so the result is normal. x is
+ * (64m + j) ln(2) / 64 + r with |r| <= ln(2) / 128, so
+ * e^x = 2^m * 2^(j / 64) * e^r with 2^(j / 64) from EXP2_TABLE.
+ */
+static inline __attribute__((always_inline)) vdouble
+V(exp_dd)(vdouble x, vdouble x_low, bool high) {
+    vlong n;
+    const vdouble rounded = V(round)(x * INV_LN2_64, &n);
+    const vdouble r =
+        (x - rounded * LN2_64_HI) - rounded * LN2_64_LO + x_low;
+    const vlong j = n & 63;
+    const vlong m = n >> 6;
+    vdouble power_high, power_low;
+
+    for (int i = 0; i < VEC_WIDTH; i++) {
+        power_high[i] = EXP2_TABLE[j[i]][0];
+        power_low[i] = EXP2_TABLE[j[i]][1];
+    }
+
+    /* e^r - 1 */
+    vdouble series = high ? V(splat)(1.0 / 120) + r * (1.0 / 720)
+                          : V(splat)(1.0 / 120);
+    series = r + r * r * (0.5 + r * (1.0 / 6 + r * (1.0 / 24 + r * series)));
+
+    const vdouble scale = (vdouble)((m + 1023) << 52);
+    return (power_high + (power_high * series + power_low)) * scale;
+}
+
+/**
+ * @brief x reduced by the multiple n of pi / 2 nearest to it, as a
+ * double-double, for |x| <= 2^20 so n * PIO2_1 to n * PIO2_3 are exact. Writes
+ * n modulo 4 to `quadrant`.
+ */
+static inline vdouble V(reduce_pio2)(vdouble x, vdouble *low, vlong *quadrant) {
+    vlong n;
+    const vdouble rounded = V(round)(x * INV_PIO2, &n);
+    vdouble error_1, error_2;
+    const vdouble first = x - rounded * PIO2_1;
+    const vdouble second = V(two_sum)(first, -(rounded * PIO2_2), &error_1);
+    const vdouble third = V(two_sum)(second, -(rounded * PIO2_3), &error_2);
+
+    *quadrant = n & 3;
+    return V(fast_two_sum)(third, error_1 + error_2 - rounded * PIO2_4, low);
+}
+
+/**
+ * @brief sin(x + x_low) for |x| <= pi / 4 as a double-double, following
+ * fdlibm's __kernel_sin.
+ */
+static inline vdouble V(sin_kernel)(vdouble x, vdouble x_low, vdouble *low) {
+    const vdouble z = x * x;
+    const vdouble v = z * x;
+    const vdouble r =
+        SIN_S2 + z * (SIN_S3 + z * (SIN_S4 + z * (SIN_S5 + z * SIN_S6)));
+
+    return V(fast_two_sum)(
+        x, -((z * (0.5 * x_low - v * r) - x_low) - v * SIN_S1), low);
+}
+
+/**
+ * @brief cos(x + x_low) for |x| <= pi / 4 as a double-double, following
+ * fdlibm's __kernel_cos.
+ */
+static inline vdouble V(cos_kernel)(vdouble x, vdouble x_low, vdouble *low) {
+    const vdouble z = x * x;
+    const vdouble w = z * z;
+    const vdouble r = z * (COS_C1 + z * (COS_C2 + z * COS_C3)) +
+                      w * w * (COS_C4 + z * (COS_C5 + z * COS_C6));
+    const vdouble half = 0.5 * z;
+    const vdouble one_minus = 1.0 - half;
+
+    return V(fast_two_sum)(
+        one_minus, ((1.0 - one_minus) - half) + (z * r - x * x_low), low);
+}
+
+/* Vector versions of the operators, writing the lanes the C library must
+   compute to `special`. `y` is only used by pow. */
+
+static inline vdouble V(vector_sin)(vdouble x, vdouble y, vlong *special,
+                                    bool high) {
+    vdouble r_low, sin_low, cos_low;
+    vlong quadrant;
+    (void)y;
+
+    *special = ~(V(abs)(x) <= 0x1p20);
+    const vdouble r = V(reduce_pio2)(x, &r_low, &quadrant);
+    if (!high)
+        r_low = V(splat)(0.0);
+
+    const vdouble sin_r = V(sin_kernel)(r, r_low, &sin_low);
+    const vdouble cos_r = V(cos_kernel)(r, r_low, &cos_low);
+    const vdouble value =
+        V(select)((quadrant & 1) != 0, cos_r + cos_low, sin_r + sin_low);
+
+    /* sin(-0) is -0, which the kernel rounds to 0 */
+    return V(select)(x == 0.0, x, V(negate_if)((quadrant & 2) != 0, value));
+}
+
+static inline vdouble V(vector_cos)(vdouble x, vdouble y, vlong *special,
+                                    bool high) {
+    vdouble r_low, sin_low, cos_low;
+    vlong quadrant;
+    (void)y;
+
+    *special = ~(V(abs)(x) <= 0x1p20);
+    const vdouble r = V(reduce_pio2)(x, &r_low, &quadrant);
+    if (!high)
+        r_low = V(splat)(0.0);
+
+    const vdouble sin_r = V(sin_kernel)(r, r_low, &sin_low);
+    const vdouble cos_r = V(cos_kernel)(r, r_low, &cos_low);
+    const vdouble value =
+        V(select)((quadrant & 1) != 0, sin_r + sin_low, cos_r + cos_low);
+
+    return V(negate_if)(((quadrant + 1) & 2) != 0, value);
+}
+
+static inline vdouble V(vector_tan)(vdouble x, vdouble y, vlong *special,
+                                    bool high) {
+    vdouble r_low, sin_low, cos_low;
+    vlong quadrant;
+    (void)y;
+
+    *special = ~(V(abs)(x) <= 0x1p20);
+    const vdouble r = V(reduce_pio2)(x, &r_low, &quadrant);
+    if (!high)
+        r_low = V(splat)(0.0);
+
+    const vdouble sin_r = V(sin_kernel)(r, r_low, &sin_low);
+    const vdouble cos_r = V(cos_kernel)(r, r_low, &cos_low);
+
+    /* tan(x) is sin(r) / cos(r) in even quadrants and -cos(r) / sin(r) in
+       odd ones */
+    const vlong odd = (quadrant & 1) != 0;
+    const vdouble numerator = V(select)(odd, cos_r, sin_r);
+    const vdouble numerator_low = V(select)(odd, cos_low, sin_low);
+    const vdouble denominator = V(select)(odd, sin_r, cos_r);
+    const vdouble denominator_low = V(select)(odd, sin_low, cos_low);
+    vdouble quotient = numerator / denominator;
+
+    if (high) {
+        /* one correction step of the double-double division */
+        vdouble product_error;
+        const vdouble product =
+            V(two_prod)(quotient, denominator, &product_error);
+        const vdouble remainder = ((numerator - product) - product_error) +
+                                  numerator_low - quotient * denominator_low;
+        quotient += remainder / denominator;
+    }
+
+    return V(select)(x == 0.0, x, V(negate_if)(odd, quotient));
+}
+
+static inline vdouble V(vector_ln)(vdouble x, vdouble y, vlong *special,
+                                   bool high) {
+    vdouble low;
+    (void)y;
+
+    *special = ~((x >= DBL_MIN) & (x <= DBL_MAX));
+    const vdouble value = V(log_dd)(x, &low, high);
+    return value + low;
+}
+
+static inline vdouble V(vector_log)(vdouble x, vdouble y, vlong *special,
+                                    bool high) {
+    vdouble low;
+    (void)y;
+
+    *special = ~((x >= DBL_MIN) & (x <= DBL_MAX));
+    const vdouble value = V(log_dd)(x, &low, high);
+
+    if (!high)
+        return (value + low) * (INV_LN10_HI + INV_LN10_LO);
+
+    vdouble product_error;
+    const vdouble product =
+        V(two_prod)(value, V(splat)(INV_LN10_HI), &product_error);
+    return product +
+           (product_error + value * INV_LN10_LO + low * INV_LN10_HI);
+}
+
+static inline vdouble V(vector_pow)(vdouble x, vdouble y, vlong *special,
+                                    bool high) {
+    vdouble log_low, product_error;
+    const vdouble log = V(log_dd)(x, &log_low, high);
+
+    /* y ln(x) must be a double-double too, as e^(y ln(x)) magnifies its
+       error by up to 708 */
+    const vdouble product = V(two_prod)(y, log, &product_error);
+    const vdouble exponent_low = product_error + y * log_low;
+
+    /* past 2^996 the split of y in two_prod overflows, which makes the
+       error NaN even where the product itself is fine, as for 1 ^ 1e308 */
+    *special = ~((x >= DBL_MIN) & (x <= DBL_MAX) &
+                 (V(abs)(product) <= 708.0) &
+                 (V(abs)(y) <= 0x1p996));
+    return V(exp_dd)(product, exponent_low, high);
+}
+
+/* Defines `name` as a batch kernel running `vector` on VEC_WIDTH rows at a
+   time. The last vector is padded with ones, so every row is computed the same
+   way wherever it is. Special lanes are computed by `scalar`, and `rhs` is
+   only read by `binary` kernels. */
+#define DEFINE_VECTOR_KERNEL(name, vector, scalar, binary, high)               \
+    static void V(name)(double *restrict dst, const double *lhs,              \
+                        const double *rhs, size_t n) {                        \
+        for (size_t i = 0; i < n; i += VEC_WIDTH) {                           \
+            const size_t rows = (n - i < VEC_WIDTH) ? n - i : VEC_WIDTH;      \
+            vdouble x = V(splat)(1.0);                                        \
+            vdouble y = V(splat)(1.0);                                        \
+            vlong special;                                                    \
+                                                                              \
+            if (rows == VEC_WIDTH) {                                          \
+                memcpy(&x, &lhs[i], sizeof(x));                               \
+                if (binary)                                                   \
+                    memcpy(&y, &rhs[i], sizeof(y));                           \
+            } else {                                                          \
+                memcpy(&x, &lhs[i], rows * sizeof(double));                   \
+                if (binary)                                                   \
+                    memcpy(&y, &rhs[i], rows * sizeof(double));               \
+            }                                                                 \
+                                                                              \
+            const vdouble result = V(vector)(x, y, &special, high);           \
+            int64_t any_special = 0;                                          \
+            for (size_t j = 0; j < VEC_WIDTH; j++)                            \
+                any_special |= special[j];                                    \
+                                                                              \
+            if (rows == VEC_WIDTH && !any_special) {                          \
+                memcpy(&dst[i], &result, sizeof(result));                     \
+                continue;                                                     \
+            }                                                                 \
+            for (size_t j = 0; j < rows; j++) {                               \
+                dst[i + j] = special[j]                                       \
+                                 ? scalar(lhs[i + j],                         \
+                                          binary ? rhs[i + j] : 0.0)          \
+                                 : result[j];                                 \
+            }                                                                 \
+        }                                                                     \
+    }
+
+DEFINE_VECTOR_KERNEL(batch_sin_high, vector_sin, scalar_sin, false, true)
+DEFINE_VECTOR_KERNEL(batch_cos_high, vector_cos, scalar_cos, false, true)
+DEFINE_VECTOR_KERNEL(batch_tan_high, vector_tan, scalar_tan, false, true)
+DEFINE_VECTOR_KERNEL(batch_log_high, vector_log, scalar_log, false, true)
+DEFINE_VECTOR_KERNEL(batch_ln_high, vector_ln, scalar_ln, false, true)
+DEFINE_VECTOR_KERNEL(batch_pow_high, vector_pow, pow, true, true)
+DEFINE_VECTOR_KERNEL(batch_sin_fast, vector_sin, scalar_sin, false, false)
+DEFINE_VECTOR_KERNEL(batch_cos_fast, vector_cos, scalar_cos, false, false)
+DEFINE_VECTOR_KERNEL(batch_tan_fast, vector_tan, scalar_tan, false, false)
+DEFINE_VECTOR_KERNEL(batch_log_fast, vector_log, scalar_log, false, false)
+DEFINE_VECTOR_KERNEL(batch_ln_fast, vector_ln, scalar_ln, false, false)
+DEFINE_VECTOR_KERNEL(batch_pow_fast, vector_pow, pow, true, false)
+
+#undef DEFINE_VECTOR_KERNEL
+#undef vlong
+#undef vdouble
+#undef V
+#undef VEC_SUFFIX
+#undef VEC_WIDTH
@@ -0,0 +1,401 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "parallel.h"
+#include "mcalc3.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* nominal size of the piece of input one task evaluates. Chunks are moved
+   forward to the next line so no line is split between two of them. */
+#define CHUNK_SIZE (1 << 20)
+
+/* number of chunks handed to each worker per round. Output of a round is kept
+   in memory until it is written, so this bounds memory use. */
+#define CHUNKS_PER_WORKER 4
+
+struct Chunk {
+    /* lines to evaluate, not terminated */
+    const char *begin;
+    const char *end;
+    /* formatted results, in order */
+    char *output;
+    size_t length;
+    size_t capacity;
+    /* set if the output could not grow */
+    int failed;
+    /* set once the results are complete, guarded by Pool.lock */
+    int done;
+};
+
+/* chunks waiting to be evaluated by one worker. The owner takes chunks from the
+   front and idle workers steal them from the back. */
+struct Deque {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+};
+
+struct Pool {
+    struct Chunk *chunks;
+    struct Deque *deques;
+    unsigned int threads;
+    MC3_Format format;
+
+    pthread_mutex_t lock;
+    /* signalled when a new round is handed out or the pool stops */
+    pthread_cond_t work_ready;
+    /* signalled whenever a chunk is done */
+    pthread_cond_t chunk_done;
+    /* incremented for every round handed out */
+    unsigned long round;
+    int stop;
+};
+
+struct Worker {
+    struct Pool *pool;
+    unsigned int id;
+    /* memory reused by every evaluation on this worker */
+    MC3_Context *ctx;
+};
+
+/**
+ * @brief appends the result of evaluating one line to the chunk output.
+ *
+ * @return 0, or -1 if the output could not grow.
+ */
+static int append_result(struct Chunk *chunk, MC3_Context *ctx,
+                         MC3_Format format, const char *line, size_t length) {
+    if (chunk->capacity - chunk->length < MC3_RESULT_BUFFER_SIZE) {
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : 4096;
+        char *output = realloc(chunk->output, capacity);
+
+        if (output == NULL)
+            return -1;
+
+        chunk->output = output;
+        chunk->capacity = capacity;
+    }
+
+    char *dest = &chunk->output[chunk->length];
+
+    if (length > 0 && line[length - 1] == '\r')
+        length--;
+
+    if (length == 0) {
+        chunk->length += MC3_format_result(format, 0.0, NULL, dest);
+        return 0;
+    }
+
+    MC3_Error error;
+    double result = MC3_context_evaluate(ctx, line, length, &error);
+
+    chunk->length += MC3_format_result(format, result, &error, dest);
+    return 0;
+}
+
+static void evaluate_chunk(struct Chunk *chunk, MC3_Context *ctx,
+                           MC3_Format format) {
+    const char *line = chunk->begin;
+
+    while (line < chunk->end) {
+        const char *newline = memchr(line, '\n', chunk->end - line);
+        const char *line_end = newline ? newline : chunk->end;
+
+        if (append_result(chunk, ctx, format, line, line_end - line) != 0) {
+            chunk->failed = 1;
+            break;
+        }
+
+        line = line_end + 1;
+    }
+}
+
+/**
+ * @brief takes the next chunk for worker `id`: its own front chunk if it has
+ * one, otherwise the back chunk of another worker.
+ *
+ * @return 0 if a chunk was written to `index`, -1 if no work is left.
+ */
+static int take_chunk(struct Pool *pool, unsigned int id, size_t *index) {
+    struct Deque *own = &pool->deques[id];
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        *index = own->head++;
+        pthread_mutex_unlock(&own->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (unsigned int i = 1; i < pool->threads; i++) {
+        struct Deque *victim = &pool->deques[(id + i) % pool->threads];
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            *index = --victim->tail;
+            pthread_mutex_unlock(&victim->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return -1;
+}
+
+static void *worker_main(void *arg) {
+    struct Worker *worker = arg;
+    struct Pool *pool = worker->pool;
+    unsigned long seen_round = 0;
+
+    /* with other workers busy, a large sum stays on the worker evaluating it */
+    if (pool->threads > 1)
+        MC3_set_range_threads(1);
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->round == seen_round)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen_round = pool->round;
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t index;
+        while (take_chunk(pool, worker->id, &index) == 0) {
+            evaluate_chunk(&pool->chunks[index], worker->ctx, pool->format);
+
+            pthread_mutex_lock(&pool->lock);
+            pool->chunks[index].done = 1;
+            pthread_cond_broadcast(&pool->chunk_done);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t count = write(fd, data, length);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        data += count;
+        length -= count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief splits `length` bytes at `data` into chunks of about CHUNK_SIZE
+ * bytes, each ending after a newline (or at the end of the input).
+ *
+ * @return the number of chunks, or 0 if out of memory.
+ */
+static size_t split_chunks(const char *data, size_t length,
+                           struct Chunk **chunks) {
+    size_t count = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    *chunks = calloc(count, sizeof(struct Chunk));
+
+    if (*chunks == NULL)
+        return 0;
+
+    const char *begin = data;
+    const char *end = data + length;
+
+    for (size_t i = 0; i < count; i++) {
+        const char *chunk_end = end;
+
+        if (i + 1 < count) {
+            const char *nominal = data + (i + 1) * CHUNK_SIZE;
+
+            if (nominal <= begin) {
+                /* a long line already carried the previous chunk past this
+                   one, which is left empty */
+                chunk_end = begin;
+            } else {
+                const char *newline = memchr(nominal, '\n', end - nominal);
+                chunk_end = newline ? newline + 1 : end;
+            }
+        }
+
+        (*chunks)[i].begin = begin;
+        (*chunks)[i].end = chunk_end;
+        begin = chunk_end;
+    }
+
+    return count;
+}
+
+/**
+ * @brief hands chunks out round by round and writes their output in input
+ * order as soon as each one is done.
+ */
+static int run_rounds(struct Pool *pool, size_t count) {
+    const size_t round_size = (size_t)pool->threads * CHUNKS_PER_WORKER;
+    int status = EXIT_SUCCESS;
+
+    for (size_t first = 0; first < count; first += round_size) {
+        const size_t last =
+            (count - first < round_size) ? count : first + round_size;
+        const size_t per_worker =
+            (last - first + pool->threads - 1) / pool->threads;
+
+        /* contiguous ranges keep each worker's output close to the writer */
+        for (unsigned int i = 0; i < pool->threads; i++) {
+            struct Deque *deque = &pool->deques[i];
+            size_t head = first + i * per_worker;
+
+            pthread_mutex_lock(&deque->lock);
+            deque->head = (head < last) ? head : last;
+            deque->tail = (head + per_worker < last) ? head + per_worker : last;
+            pthread_mutex_unlock(&deque->lock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->round++;
+        pthread_cond_broadcast(&pool->work_ready);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (size_t i = first; i < last; i++) {
+            struct Chunk *chunk = &pool->chunks[i];
+
+            pthread_mutex_lock(&pool->lock);
+            while (!chunk->done)
+                pthread_cond_wait(&pool->chunk_done, &pool->lock);
+            pthread_mutex_unlock(&pool->lock);
+
+            if (status == EXIT_SUCCESS && chunk->failed) {
+                fprintf(stderr, "mcalc3: out of memory\n");
+                status = EXIT_FAILURE;
+            } else if (status == EXIT_SUCCESS &&
+                       write_all(STDOUT_FILENO, chunk->output,
+                                 chunk->length) != 0) {
+                perror("mcalc3: write");
+                status = EXIT_FAILURE;
+            }
+
+            free(chunk->output);
+            chunk->output = NULL;
+        }
+
+        if (status != EXIT_SUCCESS)
+            break;
+    }
+
+    return status;
+}
+
+int evaluate_parallel(const char *path, unsigned int threads,
+                      MC3_Cache *cache, MC3_Format format) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "mcalc3: cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return EXIT_FAILURE;
+    }
+
+    if (info.st_size == 0) {
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+    const size_t length = info.st_size;
+    const char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "mcalc3: cannot map %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    posix_madvise((void *)data, length, POSIX_MADV_SEQUENTIAL);
+
+    struct Pool pool = {.threads = threads ? threads : 1, .format = format};
+    struct Worker *workers = calloc(pool.threads, sizeof(struct Worker));
+    pthread_t *ids = calloc(pool.threads, sizeof(pthread_t));
+    pool.deques = calloc(pool.threads, sizeof(struct Deque));
+    size_t count = split_chunks(data, length, &pool.chunks);
+
+    if (workers == NULL || ids == NULL || pool.deques == NULL || count == 0) {
+        fprintf(stderr, "mcalc3: out of memory\n");
+        free(workers);
+        free(ids);
+        free(pool.deques);
+        free(pool.chunks);
+        munmap((void *)data, length);
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.chunk_done, NULL);
+
+    unsigned int started = 0;
+    for (; started < pool.threads; started++) {
+        pthread_mutex_init(&pool.deques[started].lock, NULL);
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        workers[started].ctx = MC3_context_new();
+
+        if (workers[started].ctx == NULL)
+            break;
+
+        MC3_context_set_cache(workers[started].ctx, cache);
+        if (pthread_create(&ids[started], NULL, worker_main,
+                           &workers[started]) != 0) {
+            MC3_context_free(workers[started].ctx);
+            break;
+        }
+    }
+
+    int status = EXIT_FAILURE;
+    if (started == pool.threads) {
+        status = run_rounds(&pool, count);
+    } else {
+        fprintf(stderr, "mcalc3: cannot start worker threads\n");
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+        MC3_context_free(workers[i].ctx);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(pool.chunks[i].output);
+
+    for (unsigned int i = 0; i < pool.threads; i++)
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_cond_destroy(&pool.chunk_done);
+
+    free(workers);
+    free(ids);
+    free(pool.deques);
+    free(pool.chunks);
+    munmap((void *)data, length);
+
+    return status;
+}
@@ -0,0 +1,18 @@
+#ifndef MCALCULATOR_PARALLEL_H_
+#define MCALCULATOR_PARALLEL_H_
+
+#include "mcalc3.h"
+
+    /**
+     * @brief evaluates every line of the file at `path` on `threads` worker
+     * threads, writing one line of output per line of input, in input order.
+     * If `cache` is not NULL, every worker takes its programs from it.
+     * Results are written in `format`.
+     *
+     * @return EXIT_SUCCESS, or EXIT_FAILURE if the file could not be read or
+     * the output could not be written.
+     */
+    int evaluate_parallel(const char* path, unsigned int threads,
+                          MC3_Cache* cache, MC3_Format format);
+
+#endif /* MCALCULATOR_PARALLEL_H_ */
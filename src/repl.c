@@ -0,0 +1,402 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "repl.h"
+#include "mcalc3.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define PROMPT "> "
+
+/* longest line the editor accepts, further keys are ignored */
+#define MAX_LINE_LENGTH 65536
+
+/* number of lines kept for the up and down keys */
+#define HISTORY_SIZE 256
+
+/* width assumed when the terminal does not report one */
+#define DEFAULT_COLUMNS 80
+
+#define KEY_CTRL(key) ((key) & 0x1f)
+#define KEY_BACKSPACE 127
+
+struct Editor {
+    /* evaluates the line after every key, reusing the previous evaluation */
+    MC3_Session *session;
+
+    char line[MAX_LINE_LENGTH];
+    size_t length;
+    size_t cursor;
+    /* first character of the line shown, when it is wider than the terminal */
+    size_t scroll;
+
+    /* lines entered, oldest first */
+    char *history[HISTORY_SIZE];
+    unsigned int history_count;
+    /* entry shown by the up and down keys, history_count for a new line */
+    unsigned int browsing;
+    /* the new line, kept while older ones are browsed */
+    char *draft;
+
+    /* set by the last update of `session` */
+    MC3_Error error;
+    double value;
+};
+
+/**
+ * @brief prints the outcome of the expression just entered: `$n = value`
+ * once it is committed, or the error.
+ */
+static void print_outcome(MC3_Session *session, const MC3_Error *error,
+                          double value) {
+    char text[MC3_RESULT_BUFFER_SIZE];
+
+    if (error->code != MC3_NO_ERROR) {
+        fwrite(text, 1, MC3_format_result(MC3_FORMAT_PLAIN, 0.0, error, text),
+               stdout);
+        return;
+    }
+
+    const unsigned int number = MC3_session_commit(session);
+    if (number == 0) {
+        printf("error: %s\n", getErrorString(MC3_OUT_OF_MEMORY));
+        return;
+    }
+
+    MC3_format_double(value, text);
+    printf("$%u = %s\n", number, text);
+}
+
+/**
+ * @brief evaluates every line of standard input, for input which is not a
+ * terminal.
+ */
+static int run_lines(MC3_Session *session) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    while ((length = getline(&line, &capacity, stdin)) >= 0) {
+        while (length > 0 &&
+               (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            length--;
+
+        if (length == 0)
+            continue;
+
+        MC3_Error error;
+        const double value =
+            MC3_session_update(session, line, length, &error);
+        print_outcome(session, &error, value);
+    }
+
+    free(line);
+    return EXIT_SUCCESS;
+}
+
+static unsigned int terminal_columns(void) {
+    struct winsize size;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_col == 0)
+        return DEFAULT_COLUMNS;
+
+    return size.ws_col;
+}
+
+/**
+ * @brief evaluates the line again and redraws it, with its value after it if
+ * it has one and there is room.
+ */
+static void refresh(struct Editor *editor) {
+    editor->value = MC3_session_update(editor->session, editor->line,
+                                       editor->length, &editor->error);
+
+    const size_t prompt = strlen(PROMPT);
+    const unsigned int columns = terminal_columns();
+    const size_t width = (columns > prompt + 1) ? columns - prompt - 1 : 1;
+
+    if (editor->cursor < editor->scroll)
+        editor->scroll = editor->cursor;
+    if (editor->cursor - editor->scroll >= width)
+        editor->scroll = editor->cursor - width + 1;
+
+    size_t shown = editor->length - editor->scroll;
+    if (shown > width)
+        shown = width;
+
+    fputs("\r" PROMPT, stdout);
+    fwrite(&editor->line[editor->scroll], 1, shown, stdout);
+
+    if (editor->error.code == MC3_NO_ERROR) {
+        char text[MC3_DOUBLE_BUFFER_SIZE];
+        const size_t length = MC3_format_double(editor->value, text);
+
+        /* dimmed, so it is not taken for part of the line */
+        if (shown + length + 4 <= width)
+            printf("  \x1b[2m= %.*s\x1b[0m", (int)length, text);
+    }
+
+    printf("\x1b[K\r\x1b[%zuC", prompt + editor->cursor - editor->scroll);
+    fflush(stdout);
+}
+
+static void set_line(struct Editor *editor, const char *text) {
+    editor->length = text ? strlen(text) : 0;
+    if (editor->length > 0)
+        memcpy(editor->line, text, editor->length);
+    editor->cursor = editor->length;
+}
+
+/**
+ * @brief shows history entry `entry`, or the new line for history_count.
+ */
+static void browse(struct Editor *editor, unsigned int entry) {
+    if (entry > editor->history_count || entry == editor->browsing)
+        return;
+
+    if (editor->browsing == editor->history_count) {
+        free(editor->draft);
+        editor->draft = strndup(editor->line, editor->length);
+    }
+
+    editor->browsing = entry;
+    set_line(editor, (entry < editor->history_count) ? editor->history[entry]
+                                                     : editor->draft);
+}
+
+static void add_history(struct Editor *editor) {
+    char *entry = strndup(editor->line, editor->length);
+    if (entry == NULL)
+        return;
+
+    if (editor->history_count == HISTORY_SIZE) {
+        free(editor->history[0]);
+        memmove(&editor->history[0], &editor->history[1],
+                (HISTORY_SIZE - 1) * sizeof(char *));
+        editor->history_count--;
+    }
+
+    editor->history[editor->history_count++] = entry;
+}
+
+/**
+ * @brief evaluates the line for good and starts a new one.
+ */
+static void enter_line(struct Editor *editor) {
+    fputs("\r\n", stdout);
+
+    if (editor->length > 0) {
+        print_outcome(editor->session, &editor->error, editor->value);
+        add_history(editor);
+    }
+
+    free(editor->draft);
+    editor->draft = NULL;
+    editor->browsing = editor->history_count;
+    editor->length = 0;
+    editor->cursor = 0;
+    editor->scroll = 0;
+}
+
+static void insert_char(struct Editor *editor, char ch) {
+    if (editor->length == MAX_LINE_LENGTH)
+        return;
+
+    memmove(&editor->line[editor->cursor + 1], &editor->line[editor->cursor],
+            editor->length - editor->cursor);
+    editor->line[editor->cursor++] = ch;
+    editor->length++;
+}
+
+static void delete_range(struct Editor *editor, size_t from, size_t to) {
+    memmove(&editor->line[from], &editor->line[to], editor->length - to);
+    editor->length -= to - from;
+    editor->cursor = from;
+}
+
+static int read_key(void) {
+    unsigned char key;
+    ssize_t count;
+
+    while ((count = read(STDIN_FILENO, &key, 1)) < 0 && errno == EINTR)
+        ;
+
+    return (count == 1) ? key : -1;
+}
+
+/**
+ * @brief handles the rest of an escape sequence, for the arrow, home, end and
+ * delete keys.
+ */
+static void escape_sequence(struct Editor *editor) {
+    const int kind = read_key();
+    if (kind != '[' && kind != 'O')
+        return;
+
+    switch (read_key()) {
+    case 'A':
+        if (editor->browsing > 0)
+            browse(editor, editor->browsing - 1);
+        break;
+    case 'B':
+        browse(editor, editor->browsing + 1);
+        break;
+    case 'C':
+        if (editor->cursor < editor->length)
+            editor->cursor++;
+        break;
+    case 'D':
+        if (editor->cursor > 0)
+            editor->cursor--;
+        break;
+    case 'H':
+        editor->cursor = 0;
+        break;
+    case 'F':
+        editor->cursor = editor->length;
+        break;
+    case '3':
+        if (read_key() == '~' && editor->cursor < editor->length)
+            delete_range(editor, editor->cursor, editor->cursor + 1);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief applies one key to the line.
+ *
+ * @return false once the editor should stop.
+ */
+static bool handle_key(struct Editor *editor, int key) {
+    switch (key) {
+    case -1:
+        return false;
+    case KEY_CTRL('D'):
+        if (editor->length == 0)
+            return false;
+        if (editor->cursor < editor->length)
+            delete_range(editor, editor->cursor, editor->cursor + 1);
+        break;
+    case KEY_CTRL('C'):
+        /* abandons the line */
+        fputs("^C\r\n", stdout);
+        editor->length = 0;
+        editor->cursor = 0;
+        editor->browsing = editor->history_count;
+        break;
+    case '\r':
+    case '\n':
+        enter_line(editor);
+        break;
+    case KEY_BACKSPACE:
+    case KEY_CTRL('H'):
+        if (editor->cursor > 0)
+            delete_range(editor, editor->cursor - 1, editor->cursor);
+        break;
+    case KEY_CTRL('A'):
+        editor->cursor = 0;
+        break;
+    case KEY_CTRL('E'):
+        editor->cursor = editor->length;
+        break;
+    case KEY_CTRL('B'):
+        if (editor->cursor > 0)
+            editor->cursor--;
+        break;
+    case KEY_CTRL('F'):
+        if (editor->cursor < editor->length)
+            editor->cursor++;
+        break;
+    case KEY_CTRL('U'):
+        delete_range(editor, 0, editor->cursor);
+        break;
+    case KEY_CTRL('K'):
+        editor->length = editor->cursor;
+        break;
+    case KEY_CTRL('P'):
+        if (editor->browsing > 0)
+            browse(editor, editor->browsing - 1);
+        break;
+    case KEY_CTRL('N'):
+        browse(editor, editor->browsing + 1);
+        break;
+    case KEY_CTRL('L'):
+        fputs("\x1b[H\x1b[2J", stdout);
+        break;
+    case KEY_CTRL('['):
+        escape_sequence(editor);
+        break;
+    default:
+        if (key >= ' ' && key < KEY_BACKSPACE)
+            insert_char(editor, key);
+        break;
+    }
+
+    return true;
+}
+
+/**
+ * @brief edits lines on the terminal, with the terminal switched to reading
+ * key by key without echo.
+ */
+static int run_editor(MC3_Session *session) {
+    struct termios saved;
+    struct termios raw;
+
+    if (tcgetattr(STDIN_FILENO, &saved) != 0)
+        return run_lines(session);
+
+    raw = saved;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0)
+        return run_lines(session);
+
+    struct Editor *editor = calloc(1, sizeof(struct Editor));
+    if (editor == NULL) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        fprintf(stderr, "mcalc3: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    editor->session = session;
+
+    do {
+        refresh(editor);
+    } while (handle_key(editor, read_key()));
+
+    fputs("\r\n", stdout);
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+    for (unsigned int i = 0; i < editor->history_count; i++)
+        free(editor->history[i]);
+    free(editor->draft);
+    free(editor);
+    return EXIT_SUCCESS;
+}
+
+int run_repl(void) {
+    MC3_Session *session = MC3_session_new();
+
+    if (session == NULL) {
+        fprintf(stderr, "mcalc3: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    const int status = (isatty(STDIN_FILENO) && isatty(STDOUT_FILENO))
+                           ? run_editor(session)
+                           : run_lines(session);
+
+    MC3_session_free(session);
+    return status;
+}
@@ -0,0 +1,15 @@
+#ifndef MCALCULATOR_REPL_H_
+#define MCALCULATOR_REPL_H_
+
+    /**
+     * @brief reads expressions from standard input until it ends, printing
+     * the value of each as `$n = value`. Later expressions can use the value
+     * of the last one as `ans`, and of the nth one as `$n`. On a terminal
+     * the line is edited in place, and the value of the expression is shown
+     * next to it as it is typed.
+     *
+     * @return EXIT_SUCCESS, or EXIT_FAILURE if out of memory.
+     */
+    int run_repl(void);
+
+#endif /* MCALCULATOR_REPL_H_ */
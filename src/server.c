@@ -0,0 +1,1146 @@
+/* accept4, signalfd and the Linux socket extensions */
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "mcalc3.h"
+
+/* the other tests log from another translation unit, so messages are written
+   at once to keep them in order */
+#define MLOG_SYNC
+#include "mlogging.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* size of the length in front of every request and response */
+#define HEADER_SIZE 4
+
+/* received bytes a connection may have waiting for a worker. Reading from it
+   stops beyond this until its current batch is evaluated. */
+#define MAX_PENDING_INPUT (4 << 20)
+
+/* unsent bytes a connection may have. No new batch is started for it beyond
+   this until the client reads its responses. */
+#define MAX_PENDING_OUTPUT (4 << 20)
+
+/* size of each read from a socket or standard input */
+#define READ_SIZE (64 << 10)
+
+/* events handled per epoll_wait */
+#define MAX_EVENTS 64
+
+/* ===== Buffers ===== */
+
+/* bytes `start` to `length` of `data` are waiting to be consumed */
+struct Buffer {
+    char *data;
+    size_t start;
+    size_t length;
+    size_t capacity;
+};
+
+static size_t buffer_pending(const struct Buffer *buffer) {
+    return buffer->length - buffer->start;
+}
+
+/**
+ * @brief makes room for `extra` more bytes after the end of `buffer`, moving
+ * its pending bytes to the front first.
+ *
+ * @return 0, or -1 if out of memory.
+ */
+static int buffer_reserve(struct Buffer *buffer, size_t extra) {
+    if (buffer->start > 0) {
+        memmove(buffer->data, &buffer->data[buffer->start],
+                buffer_pending(buffer));
+        buffer->length -= buffer->start;
+        buffer->start = 0;
+    }
+
+    if (buffer->capacity - buffer->length >= extra)
+        return 0;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity - buffer->length < extra)
+        capacity *= 2;
+
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+        return -1;
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int buffer_append(struct Buffer *buffer, const char *data,
+                         size_t length) {
+    if (buffer_reserve(buffer, length) != 0)
+        return -1;
+
+    memcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+    return 0;
+}
+
+static void put_length(char *dest, uint32_t length) {
+    dest[0] = (char)(length >> 24);
+    dest[1] = (char)(length >> 16);
+    dest[2] = (char)(length >> 8);
+    dest[3] = (char)length;
+}
+
+static uint32_t get_length(const char *src) {
+    const unsigned char *bytes = (const unsigned char *)src;
+
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+           ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+/**
+ * @brief finds the end of the complete requests at the front of `buffer`.
+ *
+ * @return the offset after the last complete request, or -1 if a request is
+ * longer than MC3_MAX_REQUEST_LENGTH.
+ */
+static long complete_requests(const struct Buffer *buffer) {
+    size_t pos = buffer->start;
+
+    while (buffer->length - pos >= HEADER_SIZE) {
+        const uint32_t length = get_length(&buffer->data[pos]);
+
+        if (length > MC3_MAX_REQUEST_LENGTH)
+            return -1;
+        if (buffer->length - pos - HEADER_SIZE < length)
+            break;
+
+        pos += HEADER_SIZE + length;
+    }
+
+    return (long)pos;
+}
+
+/* ===== Server ===== */
+
+/* what an epoll event belongs to */
+enum SourceKind { SOURCE_LISTENER, SOURCE_DONE, SOURCE_SIGNAL, SOURCE_CLIENT };
+
+struct Connection {
+    /* first, so events of every source can be told apart */
+    enum SourceKind kind;
+    int fd;
+    /* requests not yet handed to a worker */
+    struct Buffer in;
+    /* responses not yet sent */
+    struct Buffer out;
+    /* events the connection is registered for, 0 if it is not registered */
+    uint32_t events;
+    /* set while a worker evaluates a batch of the connection */
+    bool busy;
+    /* set once the client stopped sending */
+    bool eof;
+    /* set once the connection is closed. It is freed when no worker uses it
+       anymore. */
+    bool closed;
+    struct Connection *prev;
+    struct Connection *next;
+};
+
+/* requests of one connection, evaluated in order by one worker */
+struct Batch {
+    struct Connection *conn;
+    /* complete requests, back to back */
+    char *requests;
+    size_t length;
+    struct Buffer output;
+    /* set if the output could not grow */
+    bool failed;
+    struct Batch *next;
+};
+
+struct Server {
+    int epoll_fd;
+    int listen_fd;
+    /* an eventfd written by workers whenever they finish a batch */
+    int done_fd;
+    int signal_fd;
+    MC3_Cache *cache;
+
+    /* open connections */
+    struct Connection *connections;
+    /* connections closed during this round of events, freed after it */
+    struct Connection *closed;
+
+    pthread_mutex_t lock;
+    /* signalled when a batch is queued or the server stops */
+    pthread_cond_t work_ready;
+    /* batches waiting for a worker, oldest first */
+    struct Batch *queue_head;
+    struct Batch *queue_tail;
+    /* evaluated batches waiting for the event loop */
+    struct Batch *done;
+    bool stop;
+};
+
+struct Worker {
+    struct Server *server;
+    pthread_t id;
+    /* memory reused by every evaluation on this worker */
+    MC3_Context *ctx;
+};
+
+static struct Connection listener_source = {.kind = SOURCE_LISTENER};
+static struct Connection done_source = {.kind = SOURCE_DONE};
+static struct Connection signal_source = {.kind = SOURCE_SIGNAL};
+
+static void free_batch(struct Batch *batch) {
+    free(batch->requests);
+    free(batch->output.data);
+    free(batch);
+}
+
+/**
+ * @brief evaluates every request of `batch`, appending one response per
+ * request to its output.
+ */
+static void evaluate_batch(struct Batch *batch, MC3_Context *ctx) {
+    size_t pos = 0;
+
+    while (pos < batch->length) {
+        const uint32_t length = get_length(&batch->requests[pos]);
+        const char *equ = &batch->requests[pos + HEADER_SIZE];
+        pos += HEADER_SIZE + length;
+
+        if (buffer_reserve(&batch->output,
+                           HEADER_SIZE + MC3_RESULT_BUFFER_SIZE)) {
+            batch->failed = true;
+            return;
+        }
+
+        char *dest = &batch->output.data[batch->output.length];
+        MC3_Error error;
+        double result = 0.0;
+
+        if (length > 0)
+            result = MC3_context_evaluate(ctx, equ, length, &error);
+
+        /* the row without its newline */
+        const size_t count =
+            MC3_format_result(MC3_FORMAT_PLAIN, result,
+                              (length > 0) ? &error : NULL,
+                              &dest[HEADER_SIZE]) -
+            1;
+
+        put_length(dest, count);
+        batch->output.length += HEADER_SIZE + count;
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct Worker *worker = arg;
+    struct Server *server = worker->server;
+    const uint64_t one = 1;
+
+    /* requests are already evaluated in parallel, a large sum stays on the
+       worker evaluating it */
+    MC3_set_range_threads(1);
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->stop && server->queue_head == NULL)
+            pthread_cond_wait(&server->work_ready, &server->lock);
+
+        struct Batch *batch = server->queue_head;
+        if (batch == NULL) {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+
+        server->queue_head = batch->next;
+        if (server->queue_head == NULL)
+            server->queue_tail = NULL;
+        pthread_mutex_unlock(&server->lock);
+
+        evaluate_batch(batch, worker->ctx);
+
+        pthread_mutex_lock(&server->lock);
+        batch->next = server->done;
+        server->done = batch;
+        pthread_mutex_unlock(&server->lock);
+
+        while (write(server->done_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/**
+ * @brief registers `conn` for `events`, or unregisters it if `events` is 0.
+ * Hang-ups are reported even without any event asked for, so a connection
+ * which waits for a worker is not left registered.
+ */
+static void set_events(struct Server *server, struct Connection *conn,
+                       uint32_t events) {
+    if (events == conn->events)
+        return;
+
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    int op = (conn->events == 0) ? EPOLL_CTL_ADD
+             : (events == 0)     ? EPOLL_CTL_DEL
+                                 : EPOLL_CTL_MOD;
+
+    epoll_ctl(server->epoll_fd, op, conn->fd, &event);
+    conn->events = events;
+}
+
+static void close_connection(struct Server *server, struct Connection *conn) {
+    set_events(server, conn, 0);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->closed = true;
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        server->connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    /* a busy connection is freed once its batch comes back */
+    if (!conn->busy) {
+        conn->next = server->closed;
+        server->closed = conn;
+    }
+}
+
+static void free_connection(struct Connection *conn) {
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+/**
+ * @brief hands the complete requests of `conn` to the workers as one batch.
+ *
+ * @return 0, or -1 on a malformed request or if out of memory.
+ */
+static int dispatch(struct Server *server, struct Connection *conn) {
+    const long end = complete_requests(&conn->in);
+
+    if (end < 0)
+        return -1;
+    if ((size_t)end == conn->in.start)
+        return 0;
+
+    struct Batch *batch = calloc(1, sizeof(struct Batch));
+    const size_t length = end - conn->in.start;
+
+    if (batch == NULL || (batch->requests = malloc(length)) == NULL) {
+        free(batch);
+        return -1;
+    }
+
+    memcpy(batch->requests, &conn->in.data[conn->in.start], length);
+    batch->length = length;
+    batch->conn = conn;
+    conn->in.start = end;
+    conn->busy = true;
+
+    pthread_mutex_lock(&server->lock);
+    if (server->queue_tail != NULL)
+        server->queue_tail->next = batch;
+    else
+        server->queue_head = batch;
+    server->queue_tail = batch;
+    pthread_cond_signal(&server->work_ready);
+    pthread_mutex_unlock(&server->lock);
+
+    return 0;
+}
+
+/**
+ * @brief sends as much of the pending output of `conn` as the socket takes.
+ *
+ * @return 0, or -1 if the connection failed.
+ */
+static int flush_connection(struct Connection *conn) {
+    while (buffer_pending(&conn->out) > 0) {
+        ssize_t count = send(conn->fd, &conn->out.data[conn->out.start],
+                             buffer_pending(&conn->out), MSG_NOSIGNAL);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        conn->out.start += count;
+    }
+
+    conn->out.start = conn->out.length = 0;
+    return 0;
+}
+
+/**
+ * @brief reads what the client sent, up to MAX_PENDING_INPUT bytes.
+ *
+ * @return 0, or -1 if the connection failed.
+ */
+static int receive(struct Connection *conn) {
+    while (buffer_pending(&conn->in) < MAX_PENDING_INPUT) {
+        if (buffer_reserve(&conn->in, READ_SIZE) != 0)
+            return -1;
+
+        ssize_t count =
+            recv(conn->fd, &conn->in.data[conn->in.length], READ_SIZE, 0);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        if (count == 0) {
+            conn->eof = true;
+            return 0;
+        }
+
+        conn->in.length += count;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief starts the next batch of `conn` if it can, then closes it or updates
+ * the events it waits for.
+ */
+static void settle(struct Server *server, struct Connection *conn,
+                   bool failed) {
+    if (!failed && !conn->busy &&
+        buffer_pending(&conn->out) < MAX_PENDING_OUTPUT)
+        failed = dispatch(server, conn) != 0;
+
+    /* a client which stopped sending is done once everything is answered */
+    if (failed ||
+        (conn->eof && !conn->busy && buffer_pending(&conn->out) == 0)) {
+        close_connection(server, conn);
+        return;
+    }
+
+    uint32_t events = 0;
+    if (!conn->eof && buffer_pending(&conn->in) < MAX_PENDING_INPUT)
+        events |= EPOLLIN;
+    if (buffer_pending(&conn->out) > 0)
+        events |= EPOLLOUT;
+
+    set_events(server, conn, events);
+}
+
+static void accept_connections(struct Server *server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("mcalc3: accept");
+            return;
+        }
+
+        struct Connection *conn = calloc(1, sizeof(struct Connection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+
+        conn->kind = SOURCE_CLIENT;
+        conn->fd = fd;
+        conn->next = server->connections;
+        if (conn->next != NULL)
+            conn->next->prev = conn;
+        server->connections = conn;
+
+        set_events(server, conn, EPOLLIN);
+    }
+}
+
+/**
+ * @brief queues the output of every evaluated batch on its connection.
+ */
+static void collect_batches(struct Server *server) {
+    uint64_t count;
+    while (read(server->done_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&server->lock);
+    struct Batch *batch = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    while (batch != NULL) {
+        struct Batch *next = batch->next;
+        struct Connection *conn = batch->conn;
+        conn->busy = false;
+
+        if (conn->closed) {
+            conn->next = server->closed;
+            server->closed = conn;
+        } else if (batch->failed) {
+            settle(server, conn, true);
+        } else if (buffer_pending(&conn->out) == 0) {
+            /* take the output as it is instead of copying it */
+            free(conn->out.data);
+            conn->out = batch->output;
+            batch->output = (struct Buffer){0};
+            settle(server, conn, flush_connection(conn) != 0);
+        } else {
+            bool failed = buffer_append(&conn->out,
+                                        batch->output.data,
+                                        batch->output.length) != 0;
+            settle(server, conn, failed || flush_connection(conn) != 0);
+        }
+
+        free_batch(batch);
+        batch = next;
+    }
+}
+
+/**
+ * @brief runs the event loop until a signal to stop arrives.
+ */
+static void run_loop(struct Server *server) {
+    struct epoll_event events[MAX_EVENTS];
+    bool stopping = false;
+
+    while (!stopping) {
+        int count = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("mcalc3: epoll_wait");
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct Connection *conn = events[i].data.ptr;
+
+            switch (conn->kind) {
+            case SOURCE_LISTENER:
+                accept_connections(server);
+                break;
+            case SOURCE_DONE:
+                collect_batches(server);
+                break;
+            case SOURCE_SIGNAL: {
+                /* taken, so it is not delivered once it is unblocked again */
+                struct signalfd_siginfo info;
+                while (read(server->signal_fd, &info, sizeof(info)) > 0)
+                    ;
+                stopping = true;
+                break;
+            }
+            case SOURCE_CLIENT: {
+                /* closed earlier in this round */
+                if (conn->closed)
+                    break;
+
+                bool failed = false;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    failed = receive(conn) != 0;
+                if (!failed && (events[i].events & EPOLLOUT))
+                    failed = flush_connection(conn) != 0;
+                settle(server, conn, failed);
+                break;
+            }
+            }
+        }
+
+        while (server->closed != NULL) {
+            struct Connection *next = server->closed->next;
+            free_connection(server->closed);
+            server->closed = next;
+        }
+    }
+}
+
+/**
+ * @brief binds a listening socket to `path`. A socket file left behind by a
+ * server which is gone is replaced, one in use is not.
+ *
+ * @return the socket, or -1.
+ */
+static int listen_on(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mcalc3: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("mcalc3: socket");
+        return -1;
+    }
+
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+    if (bound != 0 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (probe >= 0 &&
+            connect(probe, (struct sockaddr *)&addr, sizeof(addr)) != 0 &&
+            errno == ECONNREFUSED) {
+            unlink(path);
+            bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+        } else {
+            errno = EADDRINUSE;
+        }
+
+        if (probe >= 0)
+            close(probe);
+    }
+
+    if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "mcalc3: cannot listen on %s: %s\n", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int serve(const char *path, unsigned int threads, MC3_Cache *cache) {
+    struct Server server = {
+        .listen_fd = -1, .done_fd = -1, .signal_fd = -1, .cache = cache};
+    sigset_t signals, old_signals;
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (online > 0) ? online : 1;
+    }
+
+    /* blocked before the workers start, so only signal_fd receives them */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (server.epoll_fd < 0 || server.done_fd < 0 || server.signal_fd < 0) {
+        perror("mcalc3: cannot start server");
+    } else {
+        server.listen_fd = listen_on(path);
+    }
+
+    struct Worker *workers = calloc(threads, sizeof(struct Worker));
+    unsigned int started = 0;
+    int status = EXIT_FAILURE;
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.work_ready, NULL);
+
+    if (server.listen_fd >= 0 && workers != NULL) {
+        for (; started < threads; started++) {
+            workers[started].server = &server;
+            workers[started].ctx = MC3_context_new();
+
+            if (workers[started].ctx == NULL)
+                break;
+
+            MC3_context_set_cache(workers[started].ctx, cache);
+            if (pthread_create(&workers[started].id, NULL, worker_main,
+                               &workers[started]) != 0) {
+                MC3_context_free(workers[started].ctx);
+                break;
+            }
+        }
+    }
+
+    if (server.listen_fd >= 0 && started == threads) {
+        struct epoll_event event = {.events = EPOLLIN};
+
+        event.data.ptr = &listener_source;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+        event.data.ptr = &done_source;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.done_fd, &event);
+        event.data.ptr = &signal_source;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &event);
+
+        fprintf(stderr, "mcalc3: serving on %s with %u workers\n", path,
+                threads);
+        run_loop(&server);
+        status = EXIT_SUCCESS;
+    } else if (server.listen_fd >= 0) {
+        fprintf(stderr, "mcalc3: cannot start worker threads\n");
+    }
+
+    pthread_mutex_lock(&server.lock);
+    server.stop = true;
+    pthread_cond_broadcast(&server.work_ready);
+    pthread_mutex_unlock(&server.lock);
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i].id, NULL);
+        MC3_context_free(workers[i].ctx);
+    }
+
+    /* workers empty the queue before they stop */
+    for (struct Batch *batch = server.done, *next; batch; batch = next) {
+        next = batch->next;
+        if (batch->conn->closed)
+            free_connection(batch->conn);
+        free_batch(batch);
+    }
+    for (struct Connection *conn = server.connections, *next; conn;
+         conn = next) {
+        next = conn->next;
+        close(conn->fd);
+        free_connection(conn);
+    }
+
+    if (server.listen_fd >= 0) {
+        close(server.listen_fd);
+        unlink(path);
+    }
+    if (server.signal_fd >= 0)
+        close(server.signal_fd);
+    if (server.done_fd >= 0)
+        close(server.done_fd);
+    if (server.epoll_fd >= 0)
+        close(server.epoll_fd);
+
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.work_ready);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    free(workers);
+
+    return status;
+}
+
+/* ===== Client ===== */
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "mcalc3: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "mcalc3: cannot connect to %s: %s\n", path,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief frames every complete line of `lines` as a request, and the rest too
+ * if `last` is set.
+ *
+ * @return the number of requests, or -1 if a line is too long or out of
+ * memory.
+ */
+static long frame_lines(struct Buffer *lines, struct Buffer *requests,
+                        bool last) {
+    long count = 0;
+
+    while (buffer_pending(lines) > 0) {
+        const char *line = &lines->data[lines->start];
+        const char *newline = memchr(line, '\n', buffer_pending(lines));
+
+        if (newline == NULL && !last)
+            break;
+
+        size_t length = newline ? (size_t)(newline - line)
+                                : buffer_pending(lines);
+        lines->start += length + (newline != NULL);
+
+        if (length > 0 && line[length - 1] == '\r')
+            length--;
+
+        if (length > MC3_MAX_REQUEST_LENGTH) {
+            fprintf(stderr, "mcalc3: line too long\n");
+            return -1;
+        }
+
+        char header[HEADER_SIZE];
+        put_length(header, length);
+
+        if (buffer_append(requests, header, HEADER_SIZE) != 0 ||
+            buffer_append(requests, line, length) != 0)
+            return -1;
+        count++;
+    }
+
+    if (buffer_pending(lines) > MC3_MAX_REQUEST_LENGTH) {
+        fprintf(stderr, "mcalc3: line too long\n");
+        return -1;
+    }
+
+    return count;
+}
+
+/**
+ * @brief prints every complete response at the front of `responses`.
+ *
+ * @return the number of responses printed.
+ */
+static long print_responses(struct Buffer *responses) {
+    long count = 0;
+
+    while (buffer_pending(responses) >= HEADER_SIZE) {
+        const char *response = &responses->data[responses->start];
+        const uint32_t length = get_length(response);
+
+        if (buffer_pending(responses) - HEADER_SIZE < length)
+            break;
+
+        fwrite(&response[HEADER_SIZE], 1, length, stdout);
+        putchar('\n');
+        responses->start += HEADER_SIZE + length;
+        count++;
+    }
+
+    return count;
+}
+
+int run_client(const char *path) {
+    int fd = connect_to(path);
+
+    if (fd < 0)
+        return EXIT_FAILURE;
+
+    struct Buffer lines = {0}, requests = {0}, responses = {0};
+    /* requests sent or queued which were not answered yet */
+    long outstanding = 0;
+    bool input_done = false, shut = false;
+    int status = EXIT_SUCCESS;
+
+    while (!input_done || outstanding > 0) {
+        struct pollfd fds[2] = {
+            {.fd = -1, .events = POLLIN},
+            {.fd = fd, .events = POLLIN},
+        };
+
+        /* stop reading input while the server is behind */
+        if (!input_done && buffer_pending(&requests) < MAX_PENDING_OUTPUT)
+            fds[0].fd = STDIN_FILENO;
+        if (buffer_pending(&requests) > 0)
+            fds[1].events |= POLLOUT;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("mcalc3: poll");
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (fds[0].revents) {
+            if (buffer_reserve(&lines, READ_SIZE) != 0) {
+                fprintf(stderr, "mcalc3: out of memory\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            ssize_t count =
+                read(STDIN_FILENO, &lines.data[lines.length], READ_SIZE);
+
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("mcalc3: read");
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            input_done = (count == 0);
+            lines.length += count;
+
+            long framed = frame_lines(&lines, &requests, input_done);
+            if (framed < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            outstanding += framed;
+        }
+
+        if (fds[1].revents & POLLOUT) {
+            ssize_t count = send(fd, &requests.data[requests.start],
+                                 buffer_pending(&requests),
+                                 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (count < 0 && errno != EINTR && errno != EAGAIN) {
+                perror("mcalc3: send");
+                status = EXIT_FAILURE;
+                break;
+            }
+            requests.start += (count > 0) ? count : 0;
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (buffer_reserve(&responses, READ_SIZE) != 0) {
+                fprintf(stderr, "mcalc3: out of memory\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            ssize_t count = recv(fd, &responses.data[responses.length],
+                                 READ_SIZE, MSG_DONTWAIT);
+            if (count < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            if (count <= 0) {
+                fprintf(stderr, "mcalc3: server closed the connection\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+
+            responses.length += count;
+            outstanding -= print_responses(&responses);
+        }
+
+        /* tells the server no more requests are coming */
+        if (input_done && !shut && buffer_pending(&requests) == 0) {
+            shutdown(fd, SHUT_WR);
+            shut = true;
+        }
+    }
+
+    close(fd);
+    free(lines.data);
+    free(requests.data);
+    free(responses.data);
+
+    if (fflush(stdout) != 0)
+        status = EXIT_FAILURE;
+    return status;
+}
+
+/* ===== Tests ===== */
+
+struct TestServer {
+    const char *path;
+    int status;
+};
+
+static void *run_test_server(void *arg) {
+    struct TestServer *test = arg;
+    test->status = serve(test->path, 2, NULL);
+    return NULL;
+}
+
+/**
+ * @brief connects to `path`, waiting for the server to listen on it. Reads
+ * time out, so a broken server fails the tests instead of hanging them.
+ *
+ * @return the socket, or -1.
+ */
+static int connect_test(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    const struct timeval timeout = {.tv_sec = 10};
+
+    strcpy(addr.sun_path, path);
+
+    for (int attempt = 0; attempt < 500; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return fd;
+        }
+
+        close(fd);
+        nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+    }
+
+    return -1;
+}
+
+static void frame_request(struct Buffer *requests, const char *equ) {
+    char header[HEADER_SIZE];
+
+    put_length(header, strlen(equ));
+    buffer_append(requests, header, HEADER_SIZE);
+    buffer_append(requests, equ, strlen(equ));
+}
+
+/**
+ * @brief sends the pending bytes of `requests` and empties it.
+ */
+static bool send_requests(int fd, struct Buffer *requests) {
+    while (buffer_pending(requests) > 0) {
+        ssize_t count = send(fd, &requests->data[requests->start],
+                             buffer_pending(requests), MSG_NOSIGNAL);
+
+        if (count < 0 && errno != EINTR)
+            return false;
+        requests->start += (count > 0) ? count : 0;
+    }
+
+    requests->start = requests->length = 0;
+    return true;
+}
+
+/**
+ * @brief reads one response into `text`, terminated.
+ *
+ * @return its length, or -1 if the connection ended or the response does not
+ * fit.
+ */
+static long read_response(int fd, char *text, size_t capacity) {
+    char header[HEADER_SIZE];
+
+    if (recv(fd, header, HEADER_SIZE, MSG_WAITALL) != HEADER_SIZE)
+        return -1;
+
+    const uint32_t length = get_length(header);
+
+    if (length >= capacity ||
+        (length > 0 && recv(fd, text, length, MSG_WAITALL) != length))
+        return -1;
+
+    text[length] = '\0';
+    return length;
+}
+
+/**
+ * @brief whether the server closed `fd` without sending anything more.
+ */
+static bool is_closed(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, 0) == 0;
+}
+
+void test_server(void) {
+    char dir[] = "/tmp/mcalc3-test-XXXXXX";
+    char path[sizeof(dir) + 8];
+    char text[MC3_RESULT_BUFFER_SIZE];
+    char equ[32], expected[32];
+    struct TestServer server = {.path = path, .status = EXIT_FAILURE};
+    struct Buffer requests = {0};
+    pthread_t thread;
+
+    MLOG_log("Testing Suite: Server");
+
+    if (mkdtemp(dir) == NULL) {
+        MLOG_test("temporary directory", false);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/socket", dir);
+
+    pthread_create(&thread, NULL, run_test_server, &server);
+    const int fd = connect_test(path);
+    MLOG_test("connect", fd >= 0);
+
+    frame_request(&requests, "1 + 2");
+    frame_request(&requests, "");
+    frame_request(&requests, "1 +");
+    send_requests(fd, &requests);
+    MLOG_test("1 + 2", read_response(fd, text, sizeof(text)) == 1 &&
+                           strcmp(text, "3") == 0);
+    MLOG_test("empty request", read_response(fd, text, sizeof(text)) == 0);
+    MLOG_test("1 +", read_response(fd, text, sizeof(text)) > 0 &&
+                         strncmp(text, "error: ", 7) == 0);
+
+    /* sent at once, answered in order */
+    enum { PIPELINED = 2000 };
+    bool in_order = true;
+
+    for (int i = 0; i < PIPELINED; i++) {
+        snprintf(equ, sizeof(equ), "%d * 2", i);
+        frame_request(&requests, equ);
+    }
+    send_requests(fd, &requests);
+    for (int i = 0; i < PIPELINED && in_order; i++) {
+        snprintf(expected, sizeof(expected), "%d", i * 2);
+        in_order = read_response(fd, text, sizeof(text)) >= 0 &&
+                   strcmp(text, expected) == 0;
+    }
+    MLOG_test("pipelined requests", in_order);
+
+    /* a request over the limit closes the connection */
+    const int oversized = connect_test(path);
+    char header[HEADER_SIZE];
+    put_length(header, MC3_MAX_REQUEST_LENGTH + 1);
+    buffer_append(&requests, header, HEADER_SIZE);
+    send_requests(oversized, &requests);
+    MLOG_test("oversized request", is_closed(oversized));
+    close(oversized);
+
+    /* complete requests are answered, the rest of a request is dropped once
+       the client stops sending */
+    const int truncated = connect_test(path);
+    frame_request(&requests, "2 * 3");
+    put_length(header, 10);
+    buffer_append(&requests, header, HEADER_SIZE);
+    buffer_append(&requests, "1 +", 3);
+    send_requests(truncated, &requests);
+    shutdown(truncated, SHUT_WR);
+    MLOG_test("truncated request",
+              read_response(truncated, text, sizeof(text)) == 1 &&
+                  strcmp(text, "6") == 0 && is_closed(truncated));
+    close(truncated);
+
+    /* clients leaving in the middle of a request, or before reading their
+       responses, do not disturb the others */
+    const int partial = connect_test(path);
+    buffer_append(&requests, header, HEADER_SIZE);
+    buffer_append(&requests, "1 +", 3);
+    send_requests(partial, &requests);
+    close(partial);
+
+    const int unread = connect_test(path);
+    for (int i = 0; i < PIPELINED; i++)
+        frame_request(&requests, "sin(1) ^ 2 + cos(1) ^ 2");
+    send_requests(unread, &requests);
+    close(unread);
+
+    frame_request(&requests, "7 - 2");
+    send_requests(fd, &requests);
+    MLOG_test("disconnected clients",
+              read_response(fd, text, sizeof(text)) == 1 &&
+                  strcmp(text, "5") == 0);
+    close(fd);
+
+    pthread_kill(thread, SIGTERM);
+    pthread_join(thread, NULL);
+    MLOG_test("stops on SIGTERM",
+              server.status == EXIT_SUCCESS && access(path, F_OK) != 0);
+
+    free(requests.data);
+    rmdir(dir);
+}
@@ -0,0 +1,39 @@
+#ifndef MCALCULATOR_SERVER_H_
+#define MCALCULATOR_SERVER_H_
+
+#include "mcalc3.h"
+
+    /*
+     * Protocol: a request is a 4 byte big-endian length followed by that many
+     * bytes of expression (at most MC3_MAX_REQUEST_LENGTH). Each request is
+     * answered by a response framed the same way: the result as text, an
+     * `error: ...` message, or nothing for an empty request. A client may send
+     * any number of requests without waiting, and the responses of one
+     * connection come back in request order.
+     */
+    #define MC3_MAX_REQUEST_LENGTH (1 << 20)
+
+    /**
+     * @brief serves requests on the Unix domain socket `path` until SIGINT or
+     * SIGTERM, evaluating them on `threads` worker threads (0 for one per
+     * processor). Every worker takes its programs from `cache`, which may be
+     * NULL.
+     *
+     * @return EXIT_SUCCESS, or EXIT_FAILURE if the server could not start.
+     */
+    int serve(const char* path, unsigned int threads, MC3_Cache* cache);
+
+    /**
+     * @brief sends every line of standard input as a request to the server at
+     * `path` and prints one line per response, in input order. Requests are
+     * pipelined, the client does not wait for a response before sending the
+     * next request.
+     *
+     * @return EXIT_SUCCESS, or EXIT_FAILURE if the connection failed.
+     */
+    int run_client(const char* path);
+
+    /* ==== Tests ==== */
+    void test_server(void);
+
+#endif /* MCALCULATOR_SERVER_H_ */
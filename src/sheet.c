@@ -0,0 +1,133 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sheet.h"
+#include "mcalc3.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Definition {
+    /* terminated name of the cell */
+    char *name;
+    /* error of the expression, with its offset in the line */
+    MC3_Error error;
+};
+
+/**
+ * @brief splits `line` into the name and expression of a definition. The name
+ * is terminated in place.
+ *
+ * @return the offset of the expression in the line, or 0 if the line is not a
+ * definition.
+ */
+static size_t split_definition(char *line, size_t length, char **name) {
+    char *equals = memchr(line, '=', length);
+    if (equals == NULL)
+        return 0;
+
+    char *begin = line + strspn(line, " ");
+    char *end = equals;
+    while (end > begin && end[-1] == ' ')
+        end--;
+
+    if (begin == end)
+        return 0;
+
+    *end = '\0';
+    *name = begin;
+    return equals + 1 - line;
+}
+
+static void print_cell(const MC3_Sheet *sheet,
+                       const struct Definition *definition) {
+    char text[MC3_RESULT_BUFFER_SIZE];
+    MC3_Error error = definition->error;
+    double value = 0.0;
+
+    if (error.code == MC3_NO_ERROR)
+        value = MC3_sheet_get(sheet, definition->name, &error);
+
+    printf("%s = ", definition->name);
+    fwrite(text, 1, MC3_format_result(MC3_FORMAT_PLAIN, value, &error, text),
+           stdout);
+}
+
+int evaluate_sheet(const char *path, unsigned int threads) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "mcalc3: cannot open %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    MC3_Sheet *sheet = MC3_sheet_new(threads);
+    struct Definition *definitions = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    unsigned long number = 0;
+    int status = (sheet != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    while (status == EXIT_SUCCESS &&
+           (length = getline(&line, &line_capacity, file)) >= 0) {
+        number++;
+        while (length > 0 &&
+               (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            length--;
+
+        if (strspn(line, " ") == (size_t)length)
+            continue;
+
+        char *name;
+        const size_t start = split_definition(line, length, &name);
+        if (start == 0) {
+            fprintf(stderr, "mcalc3: %s:%lu: expected name = expression\n",
+                    path, number);
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct Definition *grown =
+                realloc(definitions, capacity * sizeof(struct Definition));
+            if (grown == NULL)
+                break;
+            definitions = grown;
+        }
+
+        struct Definition *definition = &definitions[count];
+        definition->name = strdup(name);
+        if (definition->name == NULL)
+            break;
+        count++;
+
+        /* errors are reported at their offset in the line */
+        MC3_sheet_set(sheet, name, &line[start], length - start,
+                      &definition->error);
+        definition->error.offset += start;
+    }
+
+    if (sheet == NULL || (status == EXIT_SUCCESS && !feof(file))) {
+        fprintf(stderr, "mcalc3: out of memory\n");
+        status = EXIT_FAILURE;
+    }
+
+    if (status == EXIT_SUCCESS) {
+        MC3_sheet_recalc(sheet);
+        for (size_t i = 0; i < count; i++)
+            print_cell(sheet, &definitions[i]);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(definitions[i].name);
+    free(definitions);
+    free(line);
+    MC3_sheet_free(sheet);
+    fclose(file);
+    return status;
+}
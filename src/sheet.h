@@ -0,0 +1,16 @@
+#ifndef MCALCULATOR_SHEET_H_
+#define MCALCULATOR_SHEET_H_
+
+    /**
+     * @brief reads cells from the file at `path`, one `name = expression`
+     * per line, and prints `name = value` for each in file order once they
+     * are all evaluated. Expressions may refer to any cell of the file.
+     * Cells not depending on each other are evaluated on `threads` threads
+     * (0 for one per processor).
+     *
+     * @return EXIT_SUCCESS, or EXIT_FAILURE if the file could not be read, a
+     * line is not a definition or memory ran out.
+     */
+    int evaluate_sheet(const char* path, unsigned int threads);
+
+#endif /* MCALCULATOR_SHEET_H_ */
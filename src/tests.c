@@ -1,7 +1,27 @@
 #include "mcalc3.h"
+#include "server.h"
 
 
 int main(void) {
+    /* first, as it logs separately from the tests of the library */
+    test_server();
     test_tokenization();
+    test_compilation();
+    test_variables();
+    test_optimization();
+    test_jit();
+    test_context();
+    test_cache();
+    test_session();
+    test_sheet();
+    test_exact();
+    test_gradient();
+    test_emit_c();
+    test_vector_math();
+    test_ranges();
+    test_matrices();
+    test_stats();
+    test_logging();
+    test_formatting();
     test_evaulation();
 }